@@ -1,20 +1,24 @@
 // client.c
 // TCP client that uses fork(): child copies stdin->socket; parent copies socket->stdout.
-// Usage: ./client <server_ip> <port>
+// Usage: ./client [-s count] <server_ip> <port>
 // Example: ./client 127.0.0.1 5000
 // Type lines and press Enter; server will echo them back in uppercase.
 // Ctrl+D (EOF) to close the write side; client exits when server closes.
+// With -s, the client instead has the server sort `count` random ints and
+// reports the end-to-end throughput, transfers included.
 
 #define _POSIX_C_SOURCE 200809L
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFSZ 4096
@@ -25,6 +29,12 @@ static void die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s count] <server_ip> <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 static void copy_stream(int in_fd, int out_fd)
 {
     char buf[BUFSZ];
@@ -54,15 +64,151 @@ static void copy_stream(int in_fd, int out_fd)
     }
 }
 
-int main(int argc, char **argv)
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
 {
-    if (argc != 3)
+    const char *p = buf;
+    while (len > 0)
     {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Read one reply line, without the newline. Returns -1 on EOF or error.
+static int read_line(int fd, char *buf, size_t bufsz)
+{
+    size_t i = 0;
+    while (i + 1 < bufsz)
+    {
+        char c;
+        if (read_all(fd, &c, 1) != 0)
+            return -1;
+        if (c == '\n')
+            break;
+        buf[i++] = c;
+    }
+    buf[i] = '\0';
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Send n random ints with SORT, read them back, check them and report the
+// throughput. Returns the exit status.
+static int run_sort(int sock, size_t n)
+{
+    size_t bytes = n * sizeof(int32_t);
+    int32_t *a = malloc(bytes ? bytes : 1);
+    if (!a)
+        die("malloc");
+    uint64_t x = 88172645463325252ull, sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int32_t v = (int32_t)(uint32_t)x;
+        sum += (uint32_t)v;
+        a[i] = (int32_t)htonl((uint32_t)v);
+    }
+
+    char line[BUFSZ];
+    double t0 = now();
+    snprintf(line, sizeof(line), "SORT %zu\n", n);
+    if (write_all(sock, line, strlen(line)) != 0 || read_line(sock, line, sizeof(line)) != 0)
+        die("sort request");
+    if (strcmp(line, "READY") != 0)
+    {
+        fprintf(stderr, "Server refused the sort: %s\n", line);
+        free(a);
         return EXIT_FAILURE;
     }
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
+    if (write_all(sock, a, bytes) != 0)
+        die("send");
+    double t1 = now();
+    // The reply header comes once the server has sorted.
+    if (read_line(sock, line, sizeof(line)) != 0 || strncmp(line, "OK ", 3) != 0)
+    {
+        fprintf(stderr, "Sort failed: %s\n", line);
+        free(a);
+        return EXIT_FAILURE;
+    }
+    double t2 = now();
+    if (read_all(sock, a, bytes) != 0)
+        die("receive");
+    double t3 = now();
+
+    int ok = 1;
+    uint64_t back = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        a[i] = (int32_t)ntohl((uint32_t)a[i]);
+        back += (uint32_t)a[i];
+        if (i > 0 && a[i - 1] > a[i])
+            ok = 0;
+    }
+    free(a);
+    if (!ok || back != sum)
+    {
+        fprintf(stderr, "Server returned a wrong result.\n");
+        return EXIT_FAILURE;
+    }
+    double secs = t3 - t0;
+    fprintf(stderr,
+            "sorted %zu ints in %.3f s end to end (%.1f M ints/s, %.1f MB/s each way)\n"
+            "  admission and send %.3f s, sort %.3f s, receive %.3f s\n",
+            n, secs, n / secs / 1e6, bytes / secs / 1e6, t1 - t0, t2 - t1, t3 - t2);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    long long sortCount = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        if (opt == 's' && atoll(optarg) >= 0)
+            sortCount = atoll(optarg);
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
     if (port <= 0 || port > 65535)
     {
         fprintf(stderr, "Invalid port.\n");
@@ -91,6 +237,13 @@ int main(int argc, char **argv)
 
     fprintf(stderr, "Connected to %s:%d\n", ip, port);
 
+    if (sortCount >= 0)
+    {
+        int rc = run_sort(sock, (size_t)sortCount);
+        close(sock);
+        return rc;
+    }
+
     pid_t pid = fork();
     if (pid < 0)
         die("fork");
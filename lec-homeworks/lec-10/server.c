@@ -1,24 +1,38 @@
 // server.c
-// Concurrent TCP echo server using forked child processes (no threads).
-// Usage: ./server <port>
+// Concurrent TCP echo server using forked child processes. Lines are echoed
+// back in uppercase, except the SORT command, which sorts a block of ints
+// with the parallel merge sort engine from lec-15 (see handle_sort).
+// Usage: ./server [-t sort_threads] [-m sort_mem_MB] <port>
 // Example: ./server 5000
+// Build: make -C ../lec-15 libpsort.a
+//        gcc -Wall -O2 -I../lec-15 server.c ../lec-15/libpsort.a -o server -pthread
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "psort.h"
+
 #define BACKLOG 128
 #define BUFSZ 4096
+// How long a SORT waits for memory and threads before the server says BUSY.
+#define SORT_WAIT_SECONDS 10
 
 static void die(const char *msg)
 {
@@ -26,6 +40,12 @@ static void die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t sort_threads] [-m sort_mem_MB] <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 // Reap all dead children to avoid zombies.
 static void sigchld_handler(int signo)
 {
@@ -65,6 +85,183 @@ static ssize_t readline(int fd, char *buf, size_t bufsz)
     return (ssize_t)i;
 }
 
+// Read or write exactly len bytes. Return 0, or -1 on error or early EOF.
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---------------------------------------------------------------------------
+// Sort admission. Every child sorts in its own process, so the budget of
+// sort threads and buffer memory lives in an anonymous shared mapping made
+// before the first fork, guarded by a process-shared mutex. A sort takes
+// its memory and as many free threads as there are, or waits for another
+// sort to finish. A child killed mid-sort leaks its grant until restart.
+
+struct sortPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    int threadsTotal, threadsFree;
+    size_t memTotal, memFree;
+};
+
+static struct sortPool *pool;
+
+static void pool_init(int threads, size_t mem)
+{
+    pool = mmap(NULL, sizeof(*pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+        die("mmap");
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&pool->lock, &ma) != 0 || pthread_cond_init(&pool->freed, &ca) != 0)
+        die("pthread_mutex_init");
+    pthread_mutexattr_destroy(&ma);
+    pthread_condattr_destroy(&ca);
+    pool->threadsTotal = pool->threadsFree = threads;
+    pool->memTotal = pool->memFree = mem;
+}
+
+// Reserve mem bytes and at least one thread. Returns the number of threads
+// granted, 0 if the wait timed out, or -1 if mem exceeds the whole budget.
+static int pool_acquire(size_t mem)
+{
+    if (mem > pool->memTotal)
+        return -1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SORT_WAIT_SECONDS;
+
+    int threads = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->memFree < mem || pool->threadsFree == 0)
+        if (pthread_cond_timedwait(&pool->freed, &pool->lock, &deadline) == ETIMEDOUT)
+            break;
+    if (pool->memFree >= mem && pool->threadsFree > 0)
+    {
+        threads = pool->threadsFree;
+        pool->threadsFree = 0;
+        pool->memFree -= mem;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return threads;
+}
+
+static void pool_release(size_t mem, int threads)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->memFree += mem;
+    pool->threadsFree += threads;
+    pthread_cond_broadcast(&pool->freed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int reply(int fd, const char *msg)
+{
+    return write_all(fd, msg, strlen(msg));
+}
+
+// SORT <n>: the server answers READY once the sort is admitted (BUSY or
+// ERR otherwise), the client sends n 32-bit ints in network byte order,
+// and the server answers "OK <n>" followed by the same ints sorted.
+// Returns -1 if the connection broke.
+static int handle_sort(int connfd, const char *arg)
+{
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || (*end && !isspace((unsigned char)*end)) || n > SIZE_MAX / 8)
+        return reply(connfd, "ERR bad count\n");
+    size_t bytes = (size_t)n * sizeof(int32_t);
+    size_t mem = 2 * bytes; // the data plus the engine's scratch buffer
+    int threads = pool_acquire(mem);
+    if (threads <= 0)
+        return reply(connfd, threads < 0 ? "ERR too large\n" : "BUSY\n");
+
+    // The header and the data go out as separate writes; don't let Nagle
+    // hold the data back until the header is acked.
+    int yes = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    int rc = 0;
+    int32_t *a = malloc(bytes ? bytes : 1);
+    if (!a)
+        rc = reply(connfd, "ERR out of memory\n");
+    else if (reply(connfd, "READY\n") != 0 || read_all(connfd, a, bytes) != 0)
+        rc = -1;
+    else
+    {
+        double t0 = now();
+        for (size_t i = 0; i < n; i++)
+            a[i] = (int32_t)ntohl((uint32_t)a[i]);
+        struct sortPolicy policy;
+        sort_policy_init(&policy);
+        policy.threads = threads;
+        policy.strategy = SORT_AUTO;
+        if (parallel_merge_sort(a, (size_t)n, sizeof(int32_t), psort_cmp_int, NULL, &policy) != 0)
+            rc = reply(connfd, "ERR sort failed\n");
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+                a[i] = (int32_t)htonl((uint32_t)a[i]);
+            double secs = now() - t0;
+            fprintf(stderr, "[child %ld] SORT %llu on %d threads: %.3f s\n", (long)getpid(), n,
+                    threads, secs);
+            char head[64];
+            snprintf(head, sizeof(head), "OK %llu\n", n);
+            if (reply(connfd, head) != 0 || write_all(connfd, a, bytes) != 0)
+                rc = -1;
+        }
+    }
+    free(a);
+    pool_release(mem, threads);
+    return rc;
+}
+
 static void to_upper(char *s)
 {
     for (; *s; ++s)
@@ -93,43 +290,54 @@ static void handle_client(int connfd, struct sockaddr_in *peer)
             perror("readline");
             break;
         }
-        // Transform to uppercase and echo back.
-        to_upper(line);
-        size_t to_write = strlen(line);
-        size_t off = 0;
-        while (off < to_write)
+        if (strncmp(line, "SORT ", 5) == 0)
         {
-            ssize_t m = write(connfd, line + off, to_write - off);
-            if (m < 0)
+            if (handle_sort(connfd, line + 5) != 0)
             {
-                if (errno == EINTR)
-                    continue;
-                perror("write");
-                goto done;
+                fprintf(stderr, "[child %ld] SORT transfer failed\n", (long)getpid());
+                break;
             }
-            off += (size_t)m;
+            continue;
+        }
+        // Transform to uppercase and echo back.
+        to_upper(line);
+        if (write_all(connfd, line, strlen(line)) != 0)
+        {
+            perror("write");
+            break;
         }
     }
 
-done:
     fprintf(stderr, "[child %ld] disconnected: %s:%d\n", (long)getpid(), addr, p);
     close(connfd);
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    // Sort budget: all CPUs and a quarter of RAM unless told otherwise.
+    int sortThreads = sort_policy_threads(NULL);
+    size_t sortMem = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE) / 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return EXIT_FAILURE;
+        if (opt == 't' && atoi(optarg) > 0)
+            sortThreads = atoi(optarg);
+        else if (opt == 'm' && atol(optarg) > 0)
+            sortMem = (size_t)atol(optarg) << 20;
+        else
+            usage(argv[0]);
     }
-    int port = atoi(argv[1]);
+    if (optind != argc - 1)
+        usage(argv[0]);
+    int port = atoi(argv[optind]);
     if (port <= 0 || port > 65535)
     {
         fprintf(stderr, "Invalid port.\n");
         return EXIT_FAILURE;
     }
 
+    pool_init(sortThreads, sortMem);
+
     // Ignore SIGPIPE so unexpected client closes don't kill us.
     signal(SIGPIPE, SIG_IGN);
 
@@ -161,7 +369,8 @@ int main(int argc, char **argv)
     if (listen(listenfd, BACKLOG) < 0)
         die("listen");
 
-    fprintf(stderr, "Server listening on port %d ...\n", port);
+    fprintf(stderr, "Server listening on port %d (sorts: %d threads, %zu MB) ...\n", port,
+            sortThreads, sortMem >> 20);
 
     // Accept loop: fork a child per connection.
     for (;;)
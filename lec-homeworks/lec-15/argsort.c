@@ -0,0 +1,160 @@
+// argsort.c
+// Key-index sorting. Keys are pulled out of the records into compact
+// pairs, normalised to unsigned order with radix_key_bits. When keys are
+// 32-bit and n fits in 32 bits, a pair packs into one uint64_t
+// (key << 32 | index) and goes through the radix sort; otherwise 16-byte
+// (key, index) pairs go through the stable merge engine. Either way, equal
+// keys keep their index order.
+//
+// The gather reads records in permutation order, which is random, so
+// each worker prefetches a few records ahead of the one it copies.
+
+#include "argsort.h"
+#include "team.h"
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How far ahead of the current record the gather prefetches.
+#define GATHER_PREFETCH 8
+
+struct keyIndex
+{
+    uint64_t key;
+    uint64_t index;
+};
+
+static int cmp_key_index(const void *a, const void *b, void *ctx)
+{
+    (void)ctx;
+    uint64_t x = ((const struct keyIndex *)a)->key;
+    uint64_t y = ((const struct keyIndex *)b)->key;
+    return (x > y) - (x < y);
+}
+
+struct argShared
+{
+    const char *records;
+    size_t n, recordSize, keyOffset;
+    enum radixKey keyType;
+    void *pairs;
+    size_t *perm;
+    int packed;
+};
+
+static void extract_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct argShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+    const char *rec = sh->records + lo * sh->recordSize + sh->keyOffset;
+    for (size_t i = lo; i < hi; i++, rec += sh->recordSize)
+    {
+        uint64_t key = radix_key_bits(rec, sh->keyType);
+        if (sh->packed)
+            ((uint64_t *)sh->pairs)[i] = key << 32 | i;
+        else
+            ((struct keyIndex *)sh->pairs)[i] = (struct keyIndex){key, i};
+    }
+}
+
+static void perm_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct argShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+    for (size_t i = lo; i < hi; i++)
+    {
+        if (sh->packed)
+            sh->perm[i] = (size_t)(((uint64_t *)sh->pairs)[i] & 0xffffffffu);
+        else
+            sh->perm[i] = (size_t)((struct keyIndex *)sh->pairs)[i].index;
+    }
+}
+
+int argsort(const void *records, size_t n, size_t recordSize,
+            size_t keyOffset, enum radixKey keyType, size_t *perm,
+            const struct sortPolicy *policy)
+{
+    int packed = radix_key_size(keyType) == 4 && n <= UINT32_MAX;
+    size_t pairSize = packed ? sizeof(uint64_t) : sizeof(struct keyIndex);
+    struct sortBuf pairs;
+    if (sort_buf_alloc(&pairs, n * pairSize + 1, policy) != 0)
+        return -1;
+    struct argShared sh = {records, n, recordSize, keyOffset, keyType,
+                           pairs.data, perm, packed};
+    int threads = sort_policy_threads(policy);
+
+    team_run(threads, extract_worker, &sh);
+    // Pairs are made in index order, so the radix sort need not look at
+    // the index half.
+    int rc = packed ? radix_sort_prefix(sh.pairs, n, RADIX_U64, 4, policy)
+                    : parallel_merge_sort(sh.pairs, n, pairSize, cmp_key_index, NULL, policy);
+    if (rc == 0)
+        team_run(threads, perm_worker, &sh);
+    sort_buf_free(&pairs);
+    return rc;
+}
+
+struct gatherShared
+{
+    const char *src;
+    char *dst;
+    size_t n, recordSize;
+    const size_t *perm;
+};
+
+static void gather_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct gatherShared *sh = arg;
+    size_t lo, hi, rs = sh->recordSize;
+    team_slice(team, id, sh->n, &lo, &hi);
+    for (size_t i = lo; i < hi; i++)
+    {
+        if (i + GATHER_PREFETCH < hi)
+            __builtin_prefetch(sh->src + sh->perm[i + GATHER_PREFETCH] * rs);
+        memcpy(sh->dst + i * rs, sh->src + sh->perm[i] * rs, rs);
+    }
+}
+
+void gather_records(const void *src, void *dst, size_t n, size_t recordSize,
+                    const size_t *perm, const struct sortPolicy *policy)
+{
+    struct gatherShared sh = {src, dst, n, recordSize, perm};
+    team_run(sort_policy_threads(policy), gather_worker, &sh);
+}
+
+int key_index_sort(void *records, size_t n, size_t recordSize,
+                   size_t keyOffset, enum radixKey keyType,
+                   const struct sortPolicy *policy)
+{
+    if (n < 2)
+        return 0;
+    if (n > SIZE_MAX / recordSize)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    size_t *perm = malloc(n * sizeof(*perm));
+    if (!perm)
+        return -1;
+    if (argsort(records, n, recordSize, keyOffset, keyType, perm, policy) != 0)
+    {
+        free(perm);
+        return -1;
+    }
+    struct sortBuf copy;
+    if (sort_buf_alloc(&copy, n * recordSize, policy) != 0)
+    {
+        free(perm);
+        return -1;
+    }
+    gather_records(records, copy.data, n, recordSize, perm, policy);
+    memcpy(records, copy.data, n * recordSize);
+    sort_buf_free(&copy);
+    free(perm);
+    return 0;
+}
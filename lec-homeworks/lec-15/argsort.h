@@ -0,0 +1,43 @@
+// argsort.h
+// Index sorts for large records: sort compact (key, index) pairs instead of
+// moving whole records at every merge level, then gather once.
+
+#ifndef ARGSORT_H
+#define ARGSORT_H
+
+#include <stddef.h>
+
+#include "psort.h"
+#include "radix.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compute the stable sorting permutation of n records of recordSize bytes,
+// keyed by a value of keyType at byte offset keyOffset in each record.
+// On return perm[i] is the index of the record that belongs at position i;
+// records with equal keys keep their input order.
+// Returns 0 on success, -1 (errno set) on allocation failure.
+int argsort(const void *records, size_t n, size_t recordSize,
+            size_t keyOffset, enum radixKey keyType, size_t *perm,
+            const struct sortPolicy *policy);
+
+// dst[i] = src[perm[i]] for n records, in parallel. src and dst must not
+// overlap.
+void gather_records(const void *src, void *dst, size_t n, size_t recordSize,
+                    const size_t *perm, const struct sortPolicy *policy);
+
+// Sort records in place by key: argsort, then one gather pass into a
+// temporary copy, which is copied back sequentially. Extra memory is the
+// copy plus the permutation (recordSize + 8 bytes per record), or 24 to 40
+// bytes per record while the pairs are sorted, whichever is larger.
+int key_index_sort(void *records, size_t n, size_t recordSize,
+                   size_t keyOffset, enum radixKey keyType,
+                   const struct sortPolicy *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARGSORT_H
@@ -0,0 +1,508 @@
+// autotune.c
+// Tuning profiles.
+//
+// The profile file is plain text, one section per host type:
+//
+//   [Intel(R) Xeon(R) Gold 6130 CPU @ 2.10GHz, 32 CPUs]
+//   threads = 32
+//   cutoff = 32
+//   min_parallel = 8192
+//   strategy = binary
+//   block_bytes = 262144
+//   fanout = 256
+//   radix_min_n = 4096
+//
+// radix_min_n may be "never". Keys left out keep the sort_policy_init
+// defaults.
+//
+// The tuner sorts one generated array, copied afresh before every timed
+// sort. Each setting is timed reps times and the fastest run counts,
+// which filters out most of the noise from other processes. Small arrays
+// are sorted over and over until enough time has passed to measure.
+
+#define _GNU_SOURCE
+#include "autotune.h"
+#include "radix.h"
+#include "hugemem.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Longest line the profile reader accepts.
+#define PROFILE_LINE 256
+// Least time spent sorting per timing of a small array.
+#define TUNE_MIN_SECONDS 0.02
+// Array lengths tried for the radix crossover, doubling between these.
+#define TUNE_RADIX_FROM 1024
+#define TUNE_RADIX_TO ((size_t)1 << 20)
+
+static const char *const strategyNames[] = {
+    [SORT_BINARY] = "binary",
+    [SORT_MULTIWAY] = "multiway",
+    [SORT_NATURAL] = "natural",
+    [SORT_SAMPLE] = "sample",
+    [SORT_INPLACE] = "inplace",
+    [SORT_AUTO] = "auto"};
+
+void sort_profile_cpu(char *buf, size_t len)
+{
+    char model[PROFILE_LINE] = "unknown CPU";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f)
+    {
+        char line[PROFILE_LINE];
+        while (fgets(line, sizeof(line), f))
+        {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) || !colon)
+                continue;
+            colon += strspn(colon + 1, " \t") + 1;
+            colon[strcspn(colon, "\n")] = '\0';
+            if (*colon)
+                snprintf(model, sizeof(model), "%s", colon);
+            break;
+        }
+        fclose(f);
+    }
+    // The brackets delimit the section name, so none may appear inside it.
+    for (char *p = model; *p; p++)
+        if (*p == '[' || *p == ']')
+            *p = ' ';
+    snprintf(buf, len, "%s, %ld CPUs", model, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+const char *sort_profile_path(char *buf, size_t len)
+{
+    const char *env = getenv("PSORT_PROFILE");
+    if (env && *env)
+    {
+        snprintf(buf, len, "%s", env);
+        return buf;
+    }
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+        return NULL;
+    snprintf(buf, len, "%s/.psort_profile", home);
+    return buf;
+}
+
+// If line is a section header, copy its name to name and return 1.
+static int section_name(const char *line, char *name, size_t len)
+{
+    if (line[0] != '[')
+        return 0;
+    const char *end = strchr(line, ']');
+    if (!end)
+        return 0;
+    size_t n = (size_t)(end - line - 1);
+    if (n >= len)
+        n = len - 1;
+    memcpy(name, line + 1, n);
+    name[n] = '\0';
+    return 1;
+}
+
+static int parse_count(const char *s, size_t *v)
+{
+    char *end;
+    errno = 0;
+    unsigned long long x = strtoull(s, &end, 10);
+    if (end == s || *end || errno || *s == '-')
+        return -1;
+    *v = (size_t)x;
+    return 0;
+}
+
+// Set the field named key from value. Returns 0, or -1 if either is bad.
+static int profile_set(struct sortProfile *p, const char *key, const char *value)
+{
+    size_t v;
+    if (!strcmp(key, "strategy"))
+    {
+        for (int s = SORT_BINARY; s <= SORT_AUTO; s++)
+            if (!strcmp(value, strategyNames[s]))
+            {
+                p->strategy = (enum sortStrategy)s;
+                return 0;
+            }
+        return -1;
+    }
+    if (!strcmp(key, "radix_min_n") && !strcmp(value, "never"))
+    {
+        p->radixMinN = SIZE_MAX;
+        return 0;
+    }
+    if (parse_count(value, &v) != 0)
+        return -1;
+    if (!strcmp(key, "threads") && v <= INT32_MAX)
+        p->threads = (int)v;
+    else if (!strcmp(key, "cutoff") && v > 0)
+        p->cutoff = v;
+    else if (!strcmp(key, "min_parallel"))
+        p->minParallel = v;
+    else if (!strcmp(key, "block_bytes") && v > 0)
+        p->blockBytes = v;
+    else if (!strcmp(key, "fanout") && v >= 2 && v <= INT32_MAX)
+        p->fanout = (int)v;
+    else if (!strcmp(key, "radix_min_n"))
+        p->radixMinN = v;
+    else
+        return -1;
+    return 0;
+}
+
+static void profile_defaults(struct sortProfile *p)
+{
+    struct sortPolicy d;
+    sort_policy_init(&d);
+    sort_profile_cpu(p->cpu, sizeof(p->cpu));
+    p->threads = d.threads;
+    p->cutoff = d.cutoff;
+    p->minParallel = d.minParallel;
+    p->strategy = SORT_AUTO;
+    p->blockBytes = d.blockBytes;
+    p->fanout = d.fanout;
+    p->radixMinN = d.radixMinN;
+}
+
+int sort_profile_load(const char *path, struct sortProfile *p)
+{
+    profile_defaults(p);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char line[PROFILE_LINE], name[sizeof(p->cpu)];
+    int inSection = 0, found = 0, bad = 0;
+    while (!bad && fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (section_name(line, name, sizeof(name)))
+        {
+            inSection = !strcmp(name, p->cpu);
+            found |= inSection;
+            continue;
+        }
+        char *s = line + strspn(line, " \t");
+        if (!inSection || !*s || *s == '#')
+            continue;
+        char *eq = strchr(s, '=');
+        if (!eq)
+        {
+            bad = 1;
+            break;
+        }
+        char *key = s, *value = eq + 1;
+        for (*eq = '\0'; eq > key && (eq[-1] == ' ' || eq[-1] == '\t');)
+            *--eq = '\0';
+        value += strspn(value, " \t");
+        for (char *e = value + strlen(value); e > value && (e[-1] == ' ' || e[-1] == '\t');)
+            *--e = '\0';
+        bad = profile_set(p, key, value) != 0;
+    }
+    int readErr = ferror(f) ? errno : 0;
+    fclose(f);
+    if (readErr)
+    {
+        errno = readErr;
+        return -1;
+    }
+    if (bad)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!found)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    return 0;
+}
+
+void sort_profile_print(FILE *f, const struct sortProfile *p)
+{
+    fprintf(f,
+            "[%s]\n"
+            "threads = %d\n"
+            "cutoff = %zu\n"
+            "min_parallel = %zu\n"
+            "strategy = %s\n"
+            "block_bytes = %zu\n"
+            "fanout = %d\n",
+            p->cpu, p->threads, p->cutoff, p->minParallel, strategyNames[p->strategy],
+            p->blockBytes, p->fanout);
+    if (p->radixMinN == SIZE_MAX)
+        fprintf(f, "radix_min_n = never\n");
+    else
+        fprintf(f, "radix_min_n = %zu\n", p->radixMinN);
+}
+
+int sort_profile_save(const char *path, const struct sortProfile *p)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+        return -1;
+
+    // Keep every other host's section as it was.
+    FILE *in = fopen(path, "r");
+    if (in)
+    {
+        char line[PROFILE_LINE], name[sizeof(p->cpu)];
+        int skip = 0;
+        while (fgets(line, sizeof(line), in))
+        {
+            if (section_name(line, name, sizeof(name)))
+                skip = !strcmp(name, p->cpu);
+            if (!skip)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    else if (errno != ENOENT)
+    {
+        fclose(out);
+        unlink(tmp);
+        return -1;
+    }
+    sort_profile_print(out, p);
+    if (ferror(out) | fclose(out))
+    {
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) != 0)
+    {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+void sort_profile_apply(const struct sortProfile *p, struct sortPolicy *policy,
+                        unsigned keep)
+{
+    if (!(keep & SORT_PROFILE_KEEP_THREADS))
+        policy->threads = p->threads;
+    if (!(keep & SORT_PROFILE_KEEP_STRATEGY))
+        policy->strategy = p->strategy;
+    policy->cutoff = p->cutoff;
+    policy->minParallel = p->minParallel;
+    policy->blockBytes = p->blockBytes;
+    policy->fanout = p->fanout;
+    policy->radixMinN = p->radixMinN;
+}
+
+// ---------------------------------------------------------------------------
+// Tuner.
+
+struct tuneState
+{
+    const struct autotuneOptions *opt;
+    const int *src; // the generated input
+    int *work;      // sorted in place, refilled from src
+};
+
+// Best time over opt->reps timings to sort the first n elements of src,
+// with the merge engine under policy or with radix sort. Returns a
+// negative time if a sort fails.
+static double time_sort(const struct tuneState *ts, size_t n, const struct sortPolicy *policy,
+                        int radix)
+{
+    double best = 0;
+    for (int r = 0; r < ts->opt->reps; r++)
+    {
+        double spent = 0;
+        size_t sorts = 0;
+        do
+        {
+            memcpy(ts->work, ts->src, n * sizeof(int));
+            double t0 = now();
+            int rc = radix ? radix_sort(ts->work, n, RADIX_I32, policy)
+                           : parallel_merge_sort(ts->work, n, sizeof(int), psort_cmp_int, NULL,
+                                                 policy);
+            spent += now() - t0;
+            sorts++;
+            if (rc != 0)
+                return -1;
+        } while (spent < TUNE_MIN_SECONDS);
+        double t = spent / sorts;
+        if (r == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+// Time the sort with *field set to each candidate in turn, leave the
+// fastest in *field and return its time (negative on failure).
+static double tune_size(const struct tuneState *ts, struct sortPolicy *policy, size_t *field,
+                        const char *name, const size_t *cand, int nCand)
+{
+    double best = -1;
+    size_t bestV = *field;
+    for (int i = 0; i < nCand; i++)
+    {
+        *field = cand[i];
+        double t = time_sort(ts, ts->opt->n, policy, 0);
+        if (t < 0)
+            return t;
+        if (ts->opt->log)
+            fprintf(ts->opt->log, "  %s %zu: %.4f s\n", name, cand[i], t);
+        if (best < 0 || t < best)
+        {
+            best = t;
+            bestV = cand[i];
+        }
+    }
+    *field = bestV;
+    return best;
+}
+
+// The coordinate search, on ts's data, starting from *policy.
+static int tune(const struct tuneState *ts, struct sortPolicy *policy, int ncpu)
+{
+    FILE *log = ts->opt->log;
+    size_t n = ts->opt->n;
+    double t;
+
+    if (log)
+        fprintf(log, "tuning on %zu elements, best of %d\nthreads\n", n, ts->opt->reps);
+    double best = -1;
+    int bestThreads = ncpu;
+    for (int th = 1;; th = th * 2 < ncpu ? th * 2 : ncpu)
+    {
+        policy->threads = th;
+        t = time_sort(ts, n, policy, 0);
+        if (t < 0)
+            return -1;
+        if (log)
+            fprintf(log, "  threads %d: %.4f s\n", th, t);
+        if (best < 0 || t < best)
+        {
+            best = t;
+            bestThreads = th;
+        }
+        if (th == ncpu)
+            break;
+    }
+    policy->threads = bestThreads;
+
+    static const size_t cutoffs[] = {8, 16, 24, 32, 48, 64, 96};
+    if (log)
+        fprintf(log, "cutoff\n");
+    if (tune_size(ts, policy, &policy->cutoff, "cutoff", cutoffs,
+                  (int)(sizeof(cutoffs) / sizeof(cutoffs[0]))) < 0)
+        return -1;
+
+    // With one thread nothing is ever split, so there is nothing to tune.
+    if (policy->threads > 1)
+    {
+        static const size_t splits[] = {2048, 4096, 8192, 16384, 65536};
+        if (log)
+            fprintf(log, "smallest parallel split\n");
+        if (tune_size(ts, policy, &policy->minParallel, "min_parallel", splits,
+                      (int)(sizeof(splits) / sizeof(splits[0]))) < 0)
+            return -1;
+    }
+
+    static const enum sortStrategy strategies[] = {SORT_BINARY, SORT_MULTIWAY, SORT_NATURAL,
+                                                   SORT_SAMPLE};
+    if (log)
+        fprintf(log, "strategy\n");
+    best = -1;
+    enum sortStrategy bestStrategy = SORT_BINARY;
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+    {
+        policy->strategy = strategies[i];
+        t = time_sort(ts, n, policy, 0);
+        if (t < 0)
+            return -1;
+        if (log)
+            fprintf(log, "  %s: %.4f s\n", strategyNames[strategies[i]], t);
+        if (best < 0 || t < best)
+        {
+            best = t;
+            bestStrategy = strategies[i];
+        }
+    }
+    policy->strategy = bestStrategy;
+    if (bestStrategy == SORT_MULTIWAY)
+    {
+        static const size_t blocks[] = {64 << 10, 128 << 10, 256 << 10, 512 << 10, 1 << 20,
+                                        2 << 20};
+        if (log)
+            fprintf(log, "multiway block size\n");
+        if (tune_size(ts, policy, &policy->blockBytes, "block_bytes", blocks,
+                      (int)(sizeof(blocks) / sizeof(blocks[0]))) < 0)
+            return -1;
+    }
+
+    // The crossover is the shortest length from which radix sort wins at
+    // every length tried; "never" if it loses even at the longest.
+    if (log)
+        fprintf(log, "radix sort against merge sort\n");
+    policy->radixMinN = SIZE_MAX;
+    for (size_t m = TUNE_RADIX_TO; m >= TUNE_RADIX_FROM; m /= 2)
+    {
+        double tm = time_sort(ts, m, policy, 0);
+        double tr = time_sort(ts, m, policy, 1);
+        if (tm < 0 || tr < 0)
+            return -1;
+        if (log)
+            fprintf(log, "  n %zu: merge %.2f us, radix %.2f us\n", m, tm * 1e6, tr * 1e6);
+        if (tr >= tm)
+            break;
+        policy->radixMinN = m;
+    }
+    return 0;
+}
+
+int sort_autotune(const struct autotuneOptions *opt, struct sortProfile *p)
+{
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    struct autotuneOptions o = *opt;
+    if (o.n < TUNE_RADIX_TO)
+        o.n = TUNE_RADIX_TO;
+    if (o.reps < 1)
+        o.reps = 1;
+
+    struct sortPolicy policy;
+    sort_policy_init(&policy);
+    policy.threads = ncpu;
+    struct sortBuf src = {NULL, 0, 0, BUF_HEAP}, work = {NULL, 0, 0, BUF_HEAP};
+    int rc = -1;
+    if (sort_buf_alloc(&src, o.n * sizeof(int), &policy) == 0 &&
+        sort_buf_alloc(&work, o.n * sizeof(int), &policy) == 0 &&
+        gen_fill_int(src.data, o.n, &o.data, &policy) == 0)
+    {
+        struct tuneState ts = {&o, src.data, work.data};
+        rc = tune(&ts, &policy, ncpu);
+    }
+    sort_buf_free(&src);
+    sort_buf_free(&work);
+    if (rc != 0)
+        return -1;
+
+    sort_profile_cpu(p->cpu, sizeof(p->cpu));
+    p->threads = policy.threads;
+    p->cutoff = policy.cutoff;
+    p->minParallel = policy.minParallel;
+    p->strategy = policy.strategy;
+    p->blockBytes = policy.blockBytes;
+    p->fanout = policy.fanout;
+    p->radixMinN = policy.radixMinN;
+    return 0;
+}
@@ -0,0 +1,83 @@
+// autotune.h
+// Per-host tuning profiles. The tuner times the int sort on this machine
+// over the policy's parameters and records the fastest settings; the
+// profile file keeps one section per CPU model, so one file in a shared
+// home directory serves every machine type the sort runs on.
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "psort.h"
+#include "gen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sortProfile
+{
+    char cpu[160];              // section name: CPU model and count
+    int threads;                // 0: all CPUs
+    size_t cutoff;
+    size_t minParallel;
+    enum sortStrategy strategy; // merge strategy for large arrays
+    size_t blockBytes;          // SORT_MULTIWAY
+    int fanout;                 // SORT_MULTIWAY
+    size_t radixMinN;           // radix sort from this many ints on; SIZE_MAX: never
+};
+
+// Name of the section this host's profile lives in.
+void sort_profile_cpu(char *buf, size_t len);
+
+// $PSORT_PROFILE if set, else $HOME/.psort_profile. Returns buf, or NULL
+// if neither is set.
+const char *sort_profile_path(char *buf, size_t len);
+
+// Load this host's section of the profile file at path. Returns 0, or -1
+// with errno set: from fopen or fgets if the file can't be read, ENODATA if it
+// has no section for this host, EINVAL if the section is malformed.
+int sort_profile_load(const char *path, struct sortProfile *p);
+
+// Replace p->cpu's section of the file at path with p, keeping the other
+// sections. Returns 0 or -1 (errno set).
+int sort_profile_save(const char *path, const struct sortProfile *p);
+
+// Settings sort_profile_apply leaves alone, typically because the user
+// gave them explicitly.
+enum
+{
+    SORT_PROFILE_KEEP_THREADS = 1,
+    SORT_PROFILE_KEEP_STRATEGY = 2,
+};
+
+// Copy the profile's settings into policy, except those named in keep
+// (SORT_PROFILE_KEEP_* flags).
+void sort_profile_apply(const struct sortProfile *p, struct sortPolicy *policy,
+                        unsigned keep);
+
+// Print p as a profile section.
+void sort_profile_print(FILE *f, const struct sortProfile *p);
+
+struct autotuneOptions
+{
+    size_t n;                   // elements per timed sort
+    struct genSpec data;        // what to sort
+    int reps;                   // timings per setting; the best one counts
+    FILE *log;                  // progress, or NULL
+};
+
+// Tune on this host. Each parameter is searched in turn with the best
+// values found so far for the others: threads, cutoff, the smallest
+// subarray worth splitting, strategy (and block size if multiway wins),
+// then the array length from which radix sort beats the tuned merge
+// sort. Returns 0, or -1 (errno set) if memory runs out.
+int sort_autotune(const struct autotuneOptions *opt, struct sortProfile *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // AUTOTUNE_H
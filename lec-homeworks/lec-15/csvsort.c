@@ -0,0 +1,1052 @@
+// csvsort.c
+// CSV record sort.
+//
+// Parsing cuts the buffer into one chunk per worker at line ends. A first
+// pass counts the rows in each chunk with a 16-byte SSE2 newline mask,
+// so every worker knows the row number its chunk starts at. The second
+// pass finds the field delimiters with a ',' / '\n' mask, 16 bytes at a
+// time, and stores each field's offset and length in its column.
+//
+// Keys are encoded per row into big-endian byte strings: ints with the
+// sign bit flipped (in 4 bytes if the whole column fits, else 8), floats
+// as radix_key_bits, strings as their first `width` bytes padded with
+// zeros, and descending keys with every byte inverted. A key of up to 8
+// bytes is then one unsigned integer, and the sort is argsort's (radix
+// for 4 bytes); a wider key is sorted with its row number appended by
+// the merge engine under memcmp. Both are stable.
+//
+// A string longer than its key width can tie with a different string.
+// Runs of equal keys are sorted again on the whole fields afterwards, if
+// any field was cut.
+
+#define _GNU_SOURCE
+#include "csvsort.h"
+#include "argsort.h"
+#include "radix.h"
+#include "team.h"
+#include "hugemem.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Widest encoded key: keys beyond it are rejected by csv_parse_keys.
+#define CSV_MAX_KEY_BYTES 256
+#define CSV_DEFAULT_WIDTH 16
+// Rows formatted per worker per round of csv_write.
+#define CSV_WRITE_ROWS (1u << 16)
+// How far ahead of the current row the column gather prefetches.
+#define CSV_GATHER_PREFETCH 8
+
+// Bit i set if p[i] is c, for i in [0, 16).
+#ifdef __SSE2__
+static inline unsigned byte_mask16(const char *p, char c)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(c)));
+}
+#endif
+
+// Length of the run before the first ',' or '\n' in p[0..end).
+static inline size_t find_delim(const char *p, const char *end)
+{
+    const char *q = p;
+#ifdef __SSE2__
+    while (q + 16 <= end)
+    {
+        unsigned m = byte_mask16(q, ',') | byte_mask16(q, '\n');
+        if (m)
+            return (size_t)(q - p) + (size_t)__builtin_ctz(m);
+        q += 16;
+    }
+#endif
+    while (q < end && *q != ',' && *q != '\n')
+        q++;
+    return (size_t)(q - p);
+}
+
+// Non-empty lines in p[0..end), which starts at a line start.
+static size_t count_rows(const char *p, const char *end)
+{
+    size_t rows = 0;
+    unsigned carry = 1; // previous byte was a line end
+    const char *q = p;
+#ifdef __SSE2__
+    while (q + 16 <= end)
+    {
+        unsigned m = byte_mask16(q, '\n');
+        rows += (size_t)__builtin_popcount(m & ~((m << 1) | carry));
+        carry = m >> 15;
+        q += 16;
+    }
+#endif
+    for (; q < end; q++)
+    {
+        unsigned nl = *q == '\n';
+        rows += nl & !carry;
+        carry = nl;
+    }
+    if (end > p && end[-1] != '\n')
+        rows++;
+    return rows;
+}
+
+// Read the field at *pp: sets *f and *flen (quotes kept, '\r' before a
+// line end dropped) and *last if it ends the line, and moves *pp past its
+// delimiter. Returns 0, or -1 if a quoted field isn't closed properly.
+static int next_field(const char **pp, const char *end, const char **f, size_t *flen,
+                      int *last)
+{
+    const char *p = *pp;
+    *f = p;
+    if (p < end && *p == '"')
+    {
+        p++;
+        for (;;)
+        {
+            const char *q = memchr(p, '"', (size_t)(end - p));
+            if (!q || memchr(p, '\n', (size_t)(q - p)))
+                return -1;
+            p = q + 1;
+            if (p < end && *p == '"')
+                p++;
+            else
+                break;
+        }
+        // Only a '\r' may sit between the closing quote and the delimiter.
+        size_t gap = find_delim(p, end);
+        if (gap > 1 || (gap == 1 && *p != '\r'))
+            return -1;
+        p += gap;
+    }
+    else
+        p += find_delim(p, end);
+    *last = p == end || *p == '\n';
+    *flen = (size_t)(p - *f);
+    if (*last && *flen > 0 && p[-1] == '\r')
+        (*flen)--;
+    *pp = p < end ? p + 1 : p;
+    return 0;
+}
+
+// Fields in the line at p, or 0 if it is malformed.
+static size_t count_fields(const char *p, const char *end)
+{
+    size_t cols = 0;
+    const char *f;
+    size_t flen;
+    int last = 0;
+    while (!last)
+    {
+        if (next_field(&p, end, &f, &flen, &last) != 0)
+            return 0;
+        cols++;
+    }
+    return cols;
+}
+
+struct parseShared
+{
+    struct csvTable *t;
+    size_t *cut;   // worker w parses text[cut[w]..cut[w+1])
+    size_t *first; // rows per chunk, then the row each chunk starts at
+    size_t badRow;
+    int err;
+};
+
+static void count_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    struct parseShared *sh = arg;
+    sh->first[id] = count_rows(sh->t->text + sh->cut[id], sh->t->text + sh->cut[id + 1]);
+}
+
+static void parse_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct parseShared *sh = arg;
+    struct csvTable *t = sh->t;
+    const char *p = t->text + sh->cut[id], *end = t->text + sh->cut[id + 1];
+    size_t r = sh->first[id];
+    while (p < end)
+    {
+        if (*p == '\n')
+        {
+            p++;
+            continue;
+        }
+        size_t c = 0;
+        int last = 0, bad = 0;
+        while (!last && !bad)
+        {
+            const char *f;
+            size_t flen;
+            if (next_field(&p, end, &f, &flen, &last) != 0 || c == t->cols ||
+                flen > UINT32_MAX)
+                bad = 1;
+            else
+            {
+                t->start[c][r] = (uint64_t)(f - t->text);
+                t->len[c][r] = (uint32_t)flen;
+                c++;
+            }
+        }
+        if (bad || c != t->cols)
+        {
+            // Report the first bad row of the file, not of whoever got
+            // here first.
+            pthread_mutex_lock(&team->gate);
+            if (!sh->err || r < sh->badRow)
+                sh->badRow = r;
+            sh->err = EINVAL;
+            pthread_mutex_unlock(&team->gate);
+            return;
+        }
+        r++;
+    }
+}
+
+static int alloc_columns(struct csvTable *t)
+{
+    t->start = calloc(t->cols ? t->cols : 1, sizeof(*t->start));
+    t->len = calloc(t->cols ? t->cols : 1, sizeof(*t->len));
+    if (!t->start || !t->len)
+        return -1;
+    for (size_t c = 0; c < t->cols; c++)
+    {
+        t->start[c] = malloc(t->rows * sizeof(uint64_t) + 1);
+        t->len[c] = malloc(t->rows * sizeof(uint32_t) + 1);
+        if (!t->start[c] || !t->len[c])
+            return -1;
+    }
+    return 0;
+}
+
+int csv_parse(const char *buf, size_t len, int header, struct csvTable *t,
+              const struct sortPolicy *policy)
+{
+    memset(t, 0, sizeof(*t));
+    t->text = buf;
+    const char *end = buf + len, *p = buf;
+    if (header && len > 0)
+    {
+        const char *nl = memchr(buf, '\n', len);
+        p = nl ? nl + 1 : end;
+        t->header = buf;
+        t->headerLen = (size_t)((nl ? nl : end) - buf);
+        if (t->headerLen > 0 && buf[t->headerLen - 1] == '\r')
+            t->headerLen--;
+    }
+    size_t base = (size_t)(p - buf);
+
+    // The header, or else the first row, says how many columns there are.
+    const char *line = t->header;
+    if (!line)
+    {
+        line = p;
+        while (line < end && *line == '\n')
+            line++;
+    }
+    if (line < end)
+    {
+        t->cols = count_fields(line, end);
+        if (t->cols == 0)
+        {
+            t->badRow = 0;
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    int threads = sort_policy_threads(policy);
+    if ((size_t)threads > (len - base) / (1u << 16) + 1)
+        threads = (int)((len - base) / (1u << 16) + 1);
+    struct parseShared sh = {t, malloc(((size_t)threads + 1) * sizeof(size_t)),
+                             malloc(((size_t)threads + 1) * sizeof(size_t)), 0, 0};
+    if (!sh.cut || !sh.first)
+        goto nomem;
+    // Cut at even offsets, moved forward to the next line start.
+    for (int w = 0; w <= threads; w++)
+    {
+        size_t c = w == threads ? len : base + (len - base) / (size_t)threads * (size_t)w;
+        while (c > base && c < len && buf[c - 1] != '\n')
+            c++;
+        if (w > 0 && c < sh.cut[w - 1])
+            c = sh.cut[w - 1];
+        sh.cut[w] = c;
+    }
+    team_run_chunks(threads, count_worker, &sh);
+    for (int w = 0; w < threads; w++)
+    {
+        size_t rows = sh.first[w];
+        sh.first[w] = t->rows;
+        t->rows += rows;
+    }
+    if (alloc_columns(t) != 0)
+        goto nomem;
+    team_run_chunks(threads, parse_worker, &sh);
+    free(sh.cut);
+    free(sh.first);
+    if (sh.err)
+    {
+        csv_free(t);
+        t->badRow = sh.badRow;
+        errno = sh.err;
+        return -1;
+    }
+    return 0;
+
+nomem:
+    free(sh.cut);
+    free(sh.first);
+    csv_free(t);
+    errno = ENOMEM;
+    return -1;
+}
+
+void csv_free(struct csvTable *t)
+{
+    for (size_t c = 0; c < t->cols; c++)
+    {
+        if (t->start)
+            free(t->start[c]);
+        if (t->len)
+            free(t->len[c]);
+    }
+    free(t->start);
+    free(t->len);
+    t->start = NULL;
+    t->len = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Keys.
+
+// Copy the text of field f[0..len) without its quotes to out, at most max
+// bytes. Returns the full unquoted length.
+static size_t unquote(const char *f, size_t len, char *out, size_t max)
+{
+    if (len < 2 || f[0] != '"')
+    {
+        memcpy(out, f, len < max ? len : max);
+        return len;
+    }
+    size_t n = 0;
+    for (size_t i = 1; i + 1 < len; i++)
+    {
+        if (f[i] == '"')
+            i++; // "" is one quote
+        if (n < max)
+            out[n] = f[i];
+        n++;
+    }
+    return n;
+}
+
+// Column of the header field called name[0..len), or -1.
+static long header_column(const struct csvTable *t, const char *name, size_t len)
+{
+    if (!t->header)
+        return -1;
+    const char *p = t->header, *end = t->header + t->headerLen;
+    char buf[CSV_MAX_KEY_BYTES];
+    for (long c = 0; p <= end; c++)
+    {
+        const char *f;
+        size_t flen;
+        int last;
+        if (next_field(&p, end, &f, &flen, &last) != 0)
+            return -1;
+        size_t n = unquote(f, flen, buf, sizeof(buf));
+        if (n == len && n <= sizeof(buf) && !memcmp(buf, name, len))
+            return c;
+        if (last)
+            break;
+    }
+    return -1;
+}
+
+int csv_parse_keys(const char *spec, const struct csvTable *t, struct csvKey *keys, int max)
+{
+    int nKeys = 0;
+    size_t total = 0;
+    const char *p = spec;
+    while (*p)
+    {
+        const char *end = p + strcspn(p, ","), *colon = memchr(p, ':', (size_t)(end - p));
+        const char *nameEnd = colon ? colon : end;
+        if (nKeys == max || nKeys == CSV_MAX_KEYS || nameEnd == p)
+            goto bad;
+        struct csvKey *k = &keys[nKeys++];
+        *k = (struct csvKey){0, CSV_STRING, CSV_DEFAULT_WIDTH, 0};
+
+        long col = header_column(t, p, (size_t)(nameEnd - p));
+        if (col < 0)
+        {
+            char *num;
+            col = strtol(p, &num, 10) - 1;
+            if (num != nameEnd || col < 0)
+                goto bad;
+        }
+        if ((size_t)col >= t->cols)
+            goto bad;
+        k->column = (size_t)col;
+
+        // Flags after the column: a type, and/or desc.
+        for (const char *q = colon; q && q < end;)
+        {
+            q++;
+            const char *qe = memchr(q, ':', (size_t)(end - q));
+            if (!qe)
+                qe = end;
+            size_t n = (size_t)(qe - q);
+            if (n == 4 && !memcmp(q, "desc", 4))
+                k->descending = 1;
+            else if (n == 1 && *q == 'i')
+                k->type = CSV_INT;
+            else if (n == 1 && *q == 'f')
+                k->type = CSV_FLOAT;
+            else if (n >= 1 && *q == 's')
+            {
+                k->type = CSV_STRING;
+                if (n > 1)
+                {
+                    char *num;
+                    unsigned long w = strtoul(q + 1, &num, 10);
+                    if (num != qe || w == 0 || w > CSV_MAX_KEY_BYTES)
+                        goto bad;
+                    k->width = w;
+                }
+            }
+            else
+                goto bad;
+            q = qe;
+        }
+        total += k->type == CSV_STRING ? k->width : 8;
+        if (total > CSV_MAX_KEY_BYTES)
+            goto bad;
+        p = *end ? end + 1 : end;
+    }
+    if (nKeys == 0)
+        goto bad;
+    return nKeys;
+
+bad:
+    errno = EINVAL;
+    return -1;
+}
+
+// An int field; empty is INT64_MIN. Returns 0, or -1 if it isn't one.
+static int parse_int64(const char *f, size_t len, int64_t *v)
+{
+    char buf[24];
+    const char *s = f;
+    size_t n = len;
+    if (len >= 2 && f[0] == '"')
+    {
+        n = unquote(f, len, buf, sizeof(buf));
+        if (n > sizeof(buf))
+            return -1;
+        s = buf;
+    }
+    if (n == 0)
+    {
+        *v = INT64_MIN;
+        return 0;
+    }
+    // 19 digits can't overflow a uint64_t; check the range once at the end.
+    int neg = s[0] == '-';
+    size_t i = neg || s[0] == '+';
+    if (i == n || n - i > 19)
+        return -1;
+    uint64_t u = 0;
+    for (; i < n; i++)
+    {
+        unsigned d = (unsigned)(s[i] - '0');
+        if (d > 9)
+            return -1;
+        u = u * 10 + d;
+    }
+    if (u > (uint64_t)INT64_MAX + (uint64_t)neg)
+        return -1;
+    *v = neg ? (int64_t)(0 - u) : (int64_t)u;
+    return 0;
+}
+
+// A float field; empty is -inf. Returns 0, or -1 if it isn't one.
+static int parse_double(const char *f, size_t len, double *v)
+{
+    char buf[64];
+    size_t n = unquote(f, len, buf, sizeof(buf) - 1);
+    if (n == 0)
+    {
+        *v = -INFINITY;
+        return 0;
+    }
+    if (n >= sizeof(buf))
+        return -1;
+    buf[n] = 0;
+    char *end;
+    *v = strtod(buf, &end);
+    return end == buf + n ? 0 : -1;
+}
+
+struct keyPlan
+{
+    const struct csvKey *key;
+    size_t offset, width; // bytes of the encoded key
+    void *value;          // parsed column: int64_t or double per row
+    int64_t min, max;     // CSV_INT: over the non-empty fields
+    int truncated;        // CSV_STRING: some field was longer than width
+};
+
+struct encodeShared
+{
+    const struct csvTable *t;
+    struct keyPlan *plan;
+    int nKeys;
+    size_t keyBytes, recordSize; // recordSize 4 or 8: packed keys
+    char *out;
+    size_t badRow;
+    int err;
+};
+
+static void fail_row(struct sortTeam *team, struct encodeShared *sh, size_t r)
+{
+    pthread_mutex_lock(&team->gate);
+    if (!sh->err || r < sh->badRow)
+        sh->badRow = r;
+    sh->err = EINVAL;
+    pthread_mutex_unlock(&team->gate);
+}
+
+// Parse the numeric key columns, and find the range of the int ones.
+static void value_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct encodeShared *sh = arg;
+    const struct csvTable *t = sh->t;
+    size_t lo, hi;
+    team_slice(team, id, t->rows, &lo, &hi);
+    for (int k = 0; k < sh->nKeys; k++)
+    {
+        struct keyPlan *kp = &sh->plan[k];
+        if (kp->key->type == CSV_STRING)
+            continue;
+        size_t c = kp->key->column;
+        int64_t min = INT64_MAX, max = INT64_MIN;
+        for (size_t r = lo; r < hi; r++)
+        {
+            const char *f = t->text + t->start[c][r];
+            int ok;
+            if (kp->key->type == CSV_INT)
+            {
+                int64_t v = INT64_MIN;
+                ok = parse_int64(f, t->len[c][r], &v) == 0;
+                ((int64_t *)kp->value)[r] = v;
+                if (v != INT64_MIN)
+                {
+                    min = v < min ? v : min;
+                    max = v > max ? v : max;
+                }
+            }
+            else
+                ok = parse_double(f, t->len[c][r], &((double *)kp->value)[r]) == 0;
+            if (!ok)
+            {
+                fail_row(team, sh, r);
+                return;
+            }
+        }
+        if (kp->key->type == CSV_INT)
+        {
+            pthread_mutex_lock(&team->gate);
+            kp->min = min < kp->min ? min : kp->min;
+            kp->max = max > kp->max ? max : kp->max;
+            pthread_mutex_unlock(&team->gate);
+        }
+    }
+}
+
+static inline void put_be(unsigned char *p, uint64_t v, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(v >> (8 * (bytes - 1 - i)));
+}
+
+static inline uint64_t get_be(const unsigned char *p, size_t bytes)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+// Key k of row r as a big-endian number of kp->width bytes, for any key
+// but a string wider than 8 bytes. Sets *cut if a string was cut.
+static inline uint64_t key_bits(const struct csvTable *t, const struct keyPlan *kp, size_t r,
+                                int *cut)
+{
+    uint64_t mask = kp->width == 8 ? ~0ull : (1ull << (8 * kp->width)) - 1, bits;
+    if (kp->key->type == CSV_INT)
+    {
+        int64_t v = ((const int64_t *)kp->value)[r];
+        // Empty fields encode as zero, below every value.
+        bits = v == INT64_MIN ? 0 : ((uint64_t)v ^ (1ull << (8 * kp->width - 1))) & mask;
+    }
+    else if (kp->key->type == CSV_FLOAT)
+        bits = radix_key_bits(&((const double *)kp->value)[r], RADIX_F64);
+    else
+    {
+        size_t c = kp->key->column;
+        unsigned char b[8] = {0};
+        *cut |= unquote(t->text + t->start[c][r], t->len[c][r], (char *)b, kp->width) >
+                kp->width;
+        bits = get_be(b, kp->width);
+    }
+    return kp->key->descending ? ~bits & mask : bits;
+}
+
+static void encode_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct encodeShared *sh = arg;
+    const struct csvTable *t = sh->t;
+    size_t lo, hi;
+    team_slice(team, id, t->rows, &lo, &hi);
+    int truncated[CSV_MAX_KEYS] = {0};
+    unsigned char kb[CSV_MAX_KEY_BYTES + 8];
+    for (size_t r = lo; r < hi; r++)
+    {
+        if (sh->recordSize <= sizeof(uint64_t))
+        {
+            // Packed: shift the keys into one integer, first key on top.
+            uint64_t key = 0;
+            for (int k = 0; k < sh->nKeys; k++)
+            {
+                const struct keyPlan *kp = &sh->plan[k];
+                uint64_t bits = key_bits(t, kp, r, &truncated[k]);
+                key = kp->width == 8 ? bits : key << (8 * kp->width) | bits;
+            }
+            if (sh->recordSize == sizeof(uint32_t))
+                ((uint32_t *)sh->out)[r] = (uint32_t)(key << (8 * (4 - sh->keyBytes)));
+            else
+                ((uint64_t *)sh->out)[r] = key << (8 * (8 - sh->keyBytes));
+            continue;
+        }
+        for (int k = 0; k < sh->nKeys; k++)
+        {
+            const struct keyPlan *kp = &sh->plan[k];
+            unsigned char *p = kb + kp->offset;
+            if (kp->key->type != CSV_STRING || kp->width <= 8)
+            {
+                put_be(p, key_bits(t, kp, r, &truncated[k]), kp->width);
+                continue;
+            }
+            size_t c = kp->key->column;
+            size_t n = unquote(t->text + t->start[c][r], t->len[c][r], (char *)p, kp->width);
+            if (n < kp->width)
+                memset(p + n, 0, kp->width - n);
+            truncated[k] |= n > kp->width;
+            if (kp->key->descending)
+                for (size_t i = 0; i < kp->width; i++)
+                    p[i] = (unsigned char)~p[i];
+        }
+        // Key bytes padded to 8, then the row, big-endian.
+        memset(kb + sh->keyBytes, 0, sh->recordSize - 8 - sh->keyBytes);
+        put_be(kb + sh->recordSize - 8, r, 8);
+        memcpy(sh->out + r * sh->recordSize, kb, sh->recordSize);
+    }
+    for (int k = 0; k < sh->nKeys; k++)
+        if (truncated[k])
+            __atomic_store_n(&sh->plan[k].truncated, 1, __ATOMIC_RELAXED);
+}
+
+static int cmp_bytes(const void *a, const void *b, void *ctx)
+{
+    return memcmp(a, b, *(const size_t *)ctx);
+}
+
+// Reads a field's unquoted bytes one at a time.
+struct fieldReader
+{
+    const char *p, *end;
+    int quoted;
+};
+
+static inline void field_reader_init(struct fieldReader *fr, const char *f, size_t len)
+{
+    fr->quoted = len >= 2 && f[0] == '"';
+    fr->p = f + fr->quoted;
+    fr->end = f + len - fr->quoted;
+}
+
+// Next byte, or -1 at the end.
+static inline int field_reader_next(struct fieldReader *fr)
+{
+    if (fr->p == fr->end)
+        return -1;
+    unsigned char c = (unsigned char)*fr->p++;
+    if (fr->quoted && c == '"')
+        fr->p++; // "" is one quote
+    return c;
+}
+
+// Fields in unquoted bytewise order, a prefix first.
+static int cmp_fields(const char *a, size_t la, const char *b, size_t lb)
+{
+    struct fieldReader x, y;
+    field_reader_init(&x, a, la);
+    field_reader_init(&y, b, lb);
+    for (;;)
+    {
+        int cx = field_reader_next(&x), cy = field_reader_next(&y);
+        if (cx != cy)
+            return cx < cy ? -1 : 1;
+        if (cx < 0)
+            return 0;
+    }
+}
+
+struct tieCtx
+{
+    const struct csvTable *t;
+    const struct keyPlan *plan;
+    int first, nKeys; // keys before first are known to be equal
+};
+
+// Rows whose encoded keys agree up to the end of a cut string: compare
+// the keys from that string on in full, then the row numbers to stay
+// stable.
+static int cmp_rows(const void *a, const void *b, void *ctx)
+{
+    const struct tieCtx *tc = ctx;
+    const struct csvTable *t = tc->t;
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    for (int k = tc->first; k < tc->nKeys; k++)
+    {
+        const struct keyPlan *kp = &tc->plan[k];
+        size_t c = kp->key->column;
+        int d;
+        if (kp->key->type == CSV_STRING)
+            d = cmp_fields(t->text + t->start[c][x], t->len[c][x], t->text + t->start[c][y],
+                           t->len[c][y]);
+        else
+        {
+            uint64_t vx, vy;
+            if (kp->key->type == CSV_INT)
+            {
+                vx = (uint64_t)((const int64_t *)kp->value)[x] ^ (1ull << 63);
+                vy = (uint64_t)((const int64_t *)kp->value)[y] ^ (1ull << 63);
+            }
+            else
+            {
+                vx = radix_key_bits(&((const double *)kp->value)[x], RADIX_F64);
+                vy = radix_key_bits(&((const double *)kp->value)[y], RADIX_F64);
+            }
+            d = (vx > vy) - (vx < vy);
+        }
+        if (d != 0)
+            return kp->key->descending ? -d : d;
+    }
+    return (x > y) - (x < y);
+}
+
+// Whether the rows at sorted positions i and j have the same first
+// `bytes` bytes of encoded key. Packed keys are found by row, wide ones
+// are in sorted order.
+static int same_prefix(const struct encodeShared *sh, const size_t *perm, size_t i, size_t j,
+                       size_t bytes)
+{
+    if (sh->recordSize == sizeof(uint32_t))
+    {
+        const uint32_t *k = (const uint32_t *)sh->out;
+        return (k[perm[i]] ^ k[perm[j]]) >> (8 * (4 - bytes)) == 0;
+    }
+    if (sh->recordSize == sizeof(uint64_t))
+    {
+        const uint64_t *k = (const uint64_t *)sh->out;
+        return bytes == 8 ? k[perm[i]] == k[perm[j]]
+                          : (k[perm[i]] ^ k[perm[j]]) >> (8 * (8 - bytes)) == 0;
+    }
+    return !memcmp(sh->out + i * sh->recordSize, sh->out + j * sh->recordSize, bytes);
+}
+
+int csv_sort(const struct csvTable *t, const struct csvKey *keys, int nKeys, size_t *perm,
+             const struct sortPolicy *policy, struct csvSortStats *st)
+{
+    struct csvSortStats local;
+    if (!st)
+        st = &local;
+    memset(st, 0, sizeof(*st));
+    size_t n = t->rows;
+    int threads = sort_policy_threads(policy);
+    struct keyPlan plan[CSV_MAX_KEYS];
+    if (nKeys <= 0 || nKeys > CSV_MAX_KEYS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    double t0 = now();
+
+    struct encodeShared sh = {t, plan, nKeys, 0, 0, NULL, 0, 0};
+    int rc = -1;
+    for (int k = 0; k < nKeys; k++)
+    {
+        plan[k] = (struct keyPlan){&keys[k], 0, 0, NULL, INT64_MAX, INT64_MIN, 0};
+        if (keys[k].type != CSV_STRING && !(plan[k].value = malloc(n * sizeof(int64_t) + 1)))
+            goto nomem;
+    }
+    team_run(threads, value_worker, &sh);
+    if (sh.err)
+    {
+        st->badRow = sh.badRow;
+        errno = sh.err;
+        goto done;
+    }
+    for (int k = 0; k < nKeys; k++)
+    {
+        struct keyPlan *kp = &plan[k];
+        if (keys[k].type == CSV_INT)
+            kp->width = kp->min >= INT32_MIN && kp->max <= INT32_MAX ? 4 : 8;
+        else
+            kp->width = keys[k].type == CSV_FLOAT ? 8 : keys[k].width;
+        kp->offset = sh.keyBytes;
+        sh.keyBytes += kp->width;
+    }
+    st->keyBytes = sh.keyBytes;
+
+    // Up to 8 bytes the key is one integer; else key, padding and row.
+    if (sh.keyBytes <= 4)
+        sh.recordSize = sizeof(uint32_t);
+    else if (sh.keyBytes <= 8)
+        sh.recordSize = sizeof(uint64_t);
+    else
+        sh.recordSize = ((sh.keyBytes + 7) & ~(size_t)7) + 8;
+    struct sortBuf keyBuf;
+    if (sort_buf_alloc(&keyBuf, n * sh.recordSize + 1, policy) != 0)
+        goto done;
+    sh.out = keyBuf.data;
+    team_run(threads, encode_worker, &sh);
+    double t1 = now();
+    st->encodeSeconds = t1 - t0;
+
+    if (sh.recordSize <= sizeof(uint64_t))
+    {
+        enum radixKey type = sh.recordSize == sizeof(uint32_t) ? RADIX_U32 : RADIX_U64;
+        st->radix = type == RADIX_U32 && n <= UINT32_MAX;
+        rc = argsort(sh.out, n, sh.recordSize, 0, type, perm, policy);
+    }
+    else
+    {
+        rc = parallel_merge_sort(sh.out, n, sh.recordSize, cmp_bytes, &sh.recordSize, policy);
+        for (size_t i = 0; rc == 0 && i < n; i++)
+            perm[i] = get_be((unsigned char *)sh.out + i * sh.recordSize + sh.recordSize - 8, 8);
+    }
+
+    // Cut strings: the order is only right up to the first cut string
+    // key. Sort each run that agrees that far again on the full keys.
+    int first = 0;
+    while (first < nKeys && !plan[first].truncated)
+        first++;
+    if (rc == 0 && first < nKeys)
+    {
+        struct sortPolicy serial;
+        sort_policy_init(&serial);
+        serial.threads = 1;
+        struct tieCtx tc = {t, plan, first, nKeys};
+        size_t bytes = plan[first].offset + plan[first].width;
+        for (size_t i = 0, j; rc == 0 && i < n; i = j)
+        {
+            for (j = i + 1; j < n && same_prefix(&sh, perm, i, j, bytes); j++)
+                ;
+            if (j - i > 1)
+            {
+                rc = parallel_merge_sort(perm + i, j - i, sizeof(size_t), cmp_rows, &tc,
+                                         &serial);
+                st->tieRuns++;
+            }
+        }
+    }
+    st->sortSeconds = now() - t1;
+    sort_buf_free(&keyBuf);
+    goto done;
+
+nomem:
+    errno = ENOMEM;
+done:
+    for (int k = 0; k < nKeys; k++)
+        free(plan[k].value);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Gather and write.
+
+struct gatherShared
+{
+    const void *src;
+    void *dst;
+    size_t n, size;
+    const size_t *perm;
+};
+
+static void gather_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct gatherShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+    if (sh->size == sizeof(uint64_t))
+    {
+        const uint64_t *src = sh->src;
+        uint64_t *dst = sh->dst;
+        for (size_t i = lo; i < hi; i++)
+        {
+            if (i + CSV_GATHER_PREFETCH < hi)
+                __builtin_prefetch(src + sh->perm[i + CSV_GATHER_PREFETCH]);
+            dst[i] = src[sh->perm[i]];
+        }
+    }
+    else
+    {
+        const uint32_t *src = sh->src;
+        uint32_t *dst = sh->dst;
+        for (size_t i = lo; i < hi; i++)
+        {
+            if (i + CSV_GATHER_PREFETCH < hi)
+                __builtin_prefetch(src + sh->perm[i + CSV_GATHER_PREFETCH]);
+            dst[i] = src[sh->perm[i]];
+        }
+    }
+}
+
+int csv_gather(struct csvTable *t, const size_t *perm, const struct sortPolicy *policy)
+{
+    int threads = sort_policy_threads(policy);
+    for (size_t c = 0; c < t->cols; c++)
+    {
+        uint64_t *start = malloc(t->rows * sizeof(uint64_t) + 1);
+        uint32_t *len = malloc(t->rows * sizeof(uint32_t) + 1);
+        if (!start || !len)
+        {
+            free(start);
+            free(len);
+            errno = ENOMEM;
+            return -1;
+        }
+        struct gatherShared s = {t->start[c], start, t->rows, sizeof(uint64_t), perm};
+        struct gatherShared l = {t->len[c], len, t->rows, sizeof(uint32_t), perm};
+        team_run(threads, gather_worker, &s);
+        team_run(threads, gather_worker, &l);
+        free(t->start[c]);
+        free(t->len[c]);
+        t->start[c] = start;
+        t->len[c] = len;
+    }
+    return 0;
+}
+
+struct writeShared
+{
+    const struct csvTable *t;
+    size_t first; // first row of this round
+    char **buf;   // per worker, grown as needed
+    size_t *cap, *len;
+    int err;
+};
+
+static void write_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    struct writeShared *sh = arg;
+    const struct csvTable *t = sh->t;
+    size_t lo = sh->first + (size_t)id * CSV_WRITE_ROWS;
+    if (lo >= t->rows)
+        return;
+    size_t hi = lo + CSV_WRITE_ROWS < t->rows ? lo + CSV_WRITE_ROWS : t->rows;
+    size_t need = (hi - lo) * t->cols;
+    for (size_t c = 0; c < t->cols; c++)
+        for (size_t r = lo; r < hi; r++)
+            need += t->len[c][r];
+    if (need > sh->cap[id])
+    {
+        char *p = realloc(sh->buf[id], need);
+        if (!p)
+        {
+            __atomic_store_n(&sh->err, ENOMEM, __ATOMIC_RELAXED);
+            return;
+        }
+        sh->buf[id] = p;
+        sh->cap[id] = need;
+    }
+    char *p = sh->buf[id];
+    for (size_t r = lo; r < hi; r++)
+        for (size_t c = 0; c < t->cols; c++)
+        {
+            memcpy(p, t->text + t->start[c][r], t->len[c][r]);
+            p += t->len[c][r];
+            *p++ = c + 1 < t->cols ? ',' : '\n';
+        }
+    sh->len[id] = (size_t)(p - sh->buf[id]);
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t m = write(fd, p, len);
+        if (m < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += m;
+        len -= (size_t)m;
+    }
+    return 0;
+}
+
+int csv_write(int fd, const struct csvTable *t, const struct sortPolicy *policy)
+{
+    if (t->header && (write_all(fd, t->header, t->headerLen) != 0 || write_all(fd, "\n", 1) != 0))
+        return -1;
+    int threads = sort_policy_threads(policy);
+    size_t blocks = (t->rows + CSV_WRITE_ROWS - 1) / CSV_WRITE_ROWS;
+    if ((size_t)threads > blocks)
+        threads = blocks ? (int)blocks : 1;
+    struct writeShared sh = {t, 0, calloc((size_t)threads, sizeof(char *)),
+                             calloc((size_t)threads, sizeof(size_t)),
+                             calloc((size_t)threads, sizeof(size_t)), 0};
+    int rc = 0;
+    if (!sh.buf || !sh.cap || !sh.len)
+    {
+        errno = ENOMEM;
+        rc = -1;
+    }
+    for (; rc == 0 && sh.first < t->rows; sh.first += (size_t)threads * CSV_WRITE_ROWS)
+    {
+        memset(sh.len, 0, (size_t)threads * sizeof(size_t));
+        team_run_chunks(threads, write_worker, &sh);
+        if (sh.err)
+        {
+            errno = sh.err;
+            rc = -1;
+        }
+        for (int w = 0; rc == 0 && w < threads; w++)
+            rc = write_all(fd, sh.buf[w], sh.len[w]);
+    }
+
+    int saved = errno;
+    for (int w = 0; sh.buf && w < threads; w++)
+        free(sh.buf[w]);
+    free(sh.buf);
+    free(sh.cap);
+    free(sh.len);
+    errno = saved;
+    return rc;
+}
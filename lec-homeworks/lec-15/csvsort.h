@@ -0,0 +1,97 @@
+// csvsort.h
+// Sort CSV records by composite keys (e.g. region, then timestamp).
+//
+// The file is parsed in parallel into columns: structure of arrays, one
+// start offset and one length per field, pointing into the text. Only the
+// key columns are turned into sort keys, encoded as fixed-width byte
+// strings that order like the composite key under memcmp; the other
+// columns are never touched until the columns are gathered into sorted
+// order for output.
+
+#ifndef CSVSORT_H
+#define CSVSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Most keys csv_sort takes.
+#define CSV_MAX_KEYS 16
+
+enum csvKeyType
+{
+    CSV_STRING, // bytewise, on the first `width` bytes, then the whole field
+    CSV_INT,    // decimal, 64-bit
+    CSV_FLOAT   // anything strtod reads
+};
+
+struct csvKey
+{
+    size_t column; // 0-based
+    enum csvKeyType type;
+    size_t width;  // CSV_STRING: bytes of the field kept in the encoded key
+    int descending;
+};
+
+// Fields are comma-separated and may be double-quoted, with "" for a
+// quote; a quoted field may not hold a newline. Empty lines are skipped
+// and "\r\n" line ends are accepted.
+struct csvTable
+{
+    const char *text;   // the parsed buffer; fields point into it
+    size_t rows, cols;  // rows does not count the header
+    const char *header; // header line without its line end, or NULL
+    size_t headerLen;
+    uint64_t **start;   // start[c][r]: offset of field (r, c) in text
+    uint32_t **len;     // len[c][r]: its length, quotes included
+    size_t badRow;      // after an EINVAL from csv_parse: the row at fault
+};
+
+// Parse buf[0..len) into t, the first line as a header if header != 0.
+// Every row must have as many fields as the first. Returns 0, or -1 with
+// errno set to EINVAL (t->badRow says where) or ENOMEM.
+int csv_parse(const char *buf, size_t len, int header, struct csvTable *t,
+              const struct sortPolicy *policy);
+
+void csv_free(struct csvTable *t);
+
+// Parse a key list like "region,ts:i:desc,3:s8". Each key is a column,
+// by header name or 1-based number, then optional ":i" (int), ":f"
+// (float), ":s" or ":sN" (string, N key bytes, default 16), and ":desc".
+// Returns the number of keys (at most max), or -1 (EINVAL). Encoded keys
+// are limited to 256 bytes.
+int csv_parse_keys(const char *spec, const struct csvTable *t, struct csvKey *keys, int max);
+
+struct csvSortStats
+{
+    size_t keyBytes;    // width of an encoded key
+    int radix;          // sorted by the radix engine, else by the merge engine
+    size_t tieRuns;     // runs of equal truncated string keys sorted again
+    size_t badRow;      // after an EINVAL: the row whose key didn't parse
+    double encodeSeconds, sortSeconds;
+};
+
+// Compute the stable sorting permutation of t's rows: perm[i] is the row
+// that belongs at position i. Empty numeric fields sort as the smallest
+// value. Returns 0, or -1 with errno set to EINVAL (st->badRow says
+// where) or ENOMEM. st may be NULL.
+int csv_sort(const struct csvTable *t, const struct csvKey *keys, int nKeys, size_t *perm,
+             const struct sortPolicy *policy, struct csvSortStats *st);
+
+// Put every column of t in perm order. Returns 0 or -1 (ENOMEM).
+int csv_gather(struct csvTable *t, const size_t *perm, const struct sortPolicy *policy);
+
+// Write t to fd as CSV, header first, rows in table order. Returns 0 or
+// -1 (errno set).
+int csv_write(int fd, const struct csvTable *t, const struct sortPolicy *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CSVSORT_H
@@ -0,0 +1,432 @@
+// extsort.c
+// External merge sort in two phases.
+//
+// Run formation: read as many records as the budget allows after setting
+// aside the sort's workspace, sort them in memory with the parallel engine,
+// and write them out as one run.
+//
+// Merging: merge up to `fanout` runs at a time through a heap, giving each
+// input run and the output an equal share of the budget as its buffer.
+// Buffers below EXT_MIN_BUFFER would turn the merge into small random reads,
+// so the fanout is capped to keep them large; if there are more runs than
+// that, the merge takes several passes.
+//
+// All the runs of a pass live in one temporary file as (offset, length)
+// spans, and each reader keeps its own offset into it with pread. The
+// number of open files is then the same however many runs there are.
+
+#define _GNU_SOURCE
+#include "extsort.h"
+#include "argsort.h"
+#include "radix.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXT_MIN_BUFFER (1u << 20)
+#define EXT_MAX_FANOUT 256
+#define EXT_KEY_INDEX_MIN 32
+
+struct extState
+{
+    const struct extsortConfig *cfg;
+    struct extsortStats *st;
+};
+
+// ---------------------------------------------------------------------------
+// Timed I/O helpers. Short reads only happen at end of file.
+
+static ssize_t read_full(struct extState *es, int fd, void *buf, size_t len)
+{
+    double t0 = now();
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = read(fd, (char *)buf + off, len - off);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    es->st->ioSeconds += now() - t0;
+    es->st->bytesRead += off;
+    return (ssize_t)off;
+}
+
+static ssize_t pread_full(struct extState *es, int fd, void *buf, size_t len, off_t at)
+{
+    double t0 = now();
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = pread(fd, (char *)buf + off, len - off, at + (off_t)off);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    es->st->ioSeconds += now() - t0;
+    es->st->bytesRead += off;
+    return (ssize_t)off;
+}
+
+static int write_full(struct extState *es, int fd, const void *buf, size_t len)
+{
+    double t0 = now();
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = write(fd, (const char *)buf + off, len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    es->st->ioSeconds += now() - t0;
+    es->st->bytesWritten += len;
+    return 0;
+}
+
+static int temp_file(const char *dir)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/extsort-XXXXXX", dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+// A sorted run: `len` bytes at `off` in the pass's run file.
+struct runSpan
+{
+    off_t off;
+    off_t len;
+};
+
+// ---------------------------------------------------------------------------
+// Phase 1: sorted runs.
+
+// Wide records keyed by a leading int are sorted through a key index
+// rather than moved at every merge level.
+static int use_key_index(const struct extsortConfig *cfg)
+{
+    return cfg->cmp == psort_cmp_int && cfg->recordSize >= EXT_KEY_INDEX_MIN;
+}
+
+// Bytes of sort workspace needed per record on top of the record itself.
+static size_t sort_overhead(const struct extsortConfig *cfg)
+{
+    return use_key_index(cfg) ? cfg->recordSize + sizeof(size_t) : cfg->recordSize;
+}
+
+static int sort_chunk(const struct extsortConfig *cfg, void *buf, size_t n)
+{
+    if (use_key_index(cfg))
+        return key_index_sort(buf, n, cfg->recordSize, 0, RADIX_I32, cfg->policy);
+    if (cfg->recordSize == sizeof(int) && cfg->cmp == psort_cmp_int &&
+        radix_policy_preferred(RADIX_I32, n, cfg->policy))
+        return radix_sort(buf, n, RADIX_I32, cfg->policy);
+    return parallel_merge_sort(buf, n, cfg->recordSize, cfg->cmp, cfg->ctx,
+                               cfg->policy);
+}
+
+// Write the sorted runs one after another to tmp. Returns the number of
+// runs described in *runsOut (malloc'd), or -1.
+static long make_runs(struct extState *es, int in, int tmp, struct runSpan **runsOut)
+{
+    const struct extsortConfig *cfg = es->cfg;
+    size_t rs = cfg->recordSize;
+    size_t chunk = cfg->memBudget / (rs + sort_overhead(cfg));
+    char *buf = malloc(chunk * rs);
+    struct runSpan *runs = NULL;
+    long count = 0;
+    off_t end = 0;
+    if (!buf)
+        return -1;
+
+    for (;;)
+    {
+        ssize_t got = read_full(es, in, buf, chunk * rs);
+        if (got < 0)
+            goto fail;
+        if (got == 0)
+            break;
+        if ((size_t)got % rs)
+        {
+            errno = EINVAL; // file isn't a whole number of records
+            goto fail;
+        }
+        size_t n = (size_t)got / rs;
+
+        double t0 = now();
+        if (sort_chunk(cfg, buf, n) != 0)
+            goto fail;
+        es->st->cpuSeconds += now() - t0;
+
+        struct runSpan *grown = realloc(runs, (size_t)(count + 1) * sizeof(*runs));
+        if (!grown)
+            goto fail;
+        runs = grown;
+        runs[count++] = (struct runSpan){end, (off_t)got};
+        if (write_full(es, tmp, buf, (size_t)got) != 0)
+            goto fail;
+        end += got;
+        es->st->records += n;
+        if ((size_t)got < chunk * rs)
+            break;
+    }
+    free(buf);
+    *runsOut = runs;
+    return count;
+
+fail:
+    free(buf);
+    free(runs);
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Phase 2: k-way merge.
+
+struct runReader
+{
+    int fd;
+    off_t next; // file offset of the next fill
+    off_t end;  // end of the run in the file
+    char *buf;
+    size_t len; // bytes in buf
+    size_t pos; // offset of the current record
+};
+
+static int reader_fill(struct extState *es, struct runReader *r, size_t cap)
+{
+    if ((off_t)cap > r->end - r->next)
+        cap = (size_t)(r->end - r->next);
+    ssize_t got = pread_full(es, r->fd, r->buf, cap, r->next);
+    if (got < 0)
+        return -1;
+    if ((size_t)got < cap)
+    {
+        errno = EIO; // the run file is shorter than what was written to it
+        return -1;
+    }
+    r->next += got;
+    r->len = (size_t)got;
+    r->pos = 0;
+    return 0;
+}
+
+// Heap order: smaller record first, lower run index on ties (stability).
+static int heap_less(const struct extsortConfig *cfg, struct runReader *rd,
+                     int x, int y)
+{
+    int c = cfg->cmp(rd[x].buf + rd[x].pos, rd[y].buf + rd[y].pos, cfg->ctx);
+    return c < 0 || (c == 0 && x < y);
+}
+
+static void sift_down(const struct extsortConfig *cfg, struct runReader *rd,
+                      int *heap, int size, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, m = i;
+        if (l < size && heap_less(cfg, rd, heap[l], heap[m]))
+            m = l;
+        if (l + 1 < size && heap_less(cfg, rd, heap[l + 1], heap[m]))
+            m = l + 1;
+        if (m == i)
+            return;
+        int t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+// Merge runs[0..k) of the file src into out.
+static int merge_runs(struct extState *es, int src, const struct runSpan *runs, int k,
+                      int out)
+{
+    const struct extsortConfig *cfg = es->cfg;
+    if (k == 0)
+        return 0;
+    size_t rs = cfg->recordSize;
+    size_t cap = cfg->memBudget / (size_t)(k + 1) / rs * rs;
+    if (cap < rs)
+        cap = rs;
+
+    struct runReader *rd = calloc((size_t)k, sizeof(*rd));
+    int *heap = malloc((size_t)k * sizeof(*heap));
+    char *obuf = malloc(cap);
+    int rc = -1, size = 0;
+    size_t olen = 0;
+    if (!rd || !heap || !obuf)
+        goto done;
+
+    for (int i = 0; i < k; i++)
+    {
+        rd[i].fd = src;
+        rd[i].next = runs[i].off;
+        rd[i].end = runs[i].off + runs[i].len;
+        rd[i].buf = malloc(cap);
+        if (!rd[i].buf || reader_fill(es, &rd[i], cap) != 0)
+            goto done;
+        if (rd[i].len)
+            heap[size++] = i;
+    }
+
+    double t0 = now();
+    for (int i = size / 2 - 1; i >= 0; i--)
+        sift_down(cfg, rd, heap, size, i);
+    while (size > 0)
+    {
+        struct runReader *r = &rd[heap[0]];
+        memcpy(obuf + olen, r->buf + r->pos, rs);
+        olen += rs;
+        if (olen == cap)
+        {
+            es->st->cpuSeconds += now() - t0;
+            if (write_full(es, out, obuf, olen) != 0)
+                goto done;
+            olen = 0;
+            t0 = now();
+        }
+        r->pos += rs;
+        if (r->pos == r->len)
+        {
+            es->st->cpuSeconds += now() - t0;
+            if (reader_fill(es, r, cap) != 0)
+                goto done;
+            t0 = now();
+            if (r->len == 0)
+                heap[0] = heap[--size];
+        }
+        sift_down(cfg, rd, heap, size, 0);
+    }
+    es->st->cpuSeconds += now() - t0;
+    rc = write_full(es, out, obuf, olen);
+
+done:
+    for (int i = 0; rd && i < k; i++)
+        free(rd[i].buf);
+    free(rd);
+    free(heap);
+    free(obuf);
+    return rc;
+}
+
+int external_sort(const char *inPath, const char *outPath,
+                  const struct extsortConfig *cfg, struct extsortStats *stats)
+{
+    struct extsortStats local;
+    if (!stats)
+        stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (cfg->recordSize == 0 || cfg->memBudget < 4 * cfg->recordSize)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct extState es = {cfg, stats};
+
+    int in = open(inPath, O_RDONLY);
+    if (in < 0)
+        return -1;
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int src = temp_file(cfg->tmpDir);
+    if (src < 0)
+    {
+        close(in);
+        return -1;
+    }
+    struct runSpan *runs = NULL;
+    long count = make_runs(&es, in, src, &runs);
+    close(in);
+    if (count < 0)
+    {
+        close(src);
+        return -1;
+    }
+    stats->runs = (size_t)count;
+
+    int fanout = (int)(cfg->memBudget / EXT_MIN_BUFFER) - 1;
+    if (fanout > EXT_MAX_FANOUT)
+        fanout = EXT_MAX_FANOUT;
+    if (fanout < 2)
+        fanout = 2;
+
+    // Intermediate passes: merge groups of runs into new, longer runs in a
+    // fresh file, which then replaces the old one.
+    while (count > fanout)
+    {
+        int dst = temp_file(cfg->tmpDir);
+        long next = 0;
+        off_t end = 0;
+        for (long i = 0; dst >= 0 && i < count; i += fanout)
+        {
+            int k = count - i < fanout ? (int)(count - i) : fanout;
+            off_t len = 0;
+            for (int j = 0; j < k; j++)
+                len += runs[i + j].len;
+            if (merge_runs(&es, src, runs + i, k, dst) != 0)
+            {
+                int saved = errno;
+                close(dst);
+                dst = -1;
+                errno = saved;
+                break;
+            }
+            runs[next++] = (struct runSpan){end, len};
+            end += len;
+        }
+        int saved = errno;
+        close(src);
+        if (dst < 0)
+        {
+            free(runs);
+            errno = saved;
+            return -1;
+        }
+        src = dst;
+        count = next;
+        stats->mergePasses++;
+    }
+
+    int out = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        int saved = errno;
+        close(src);
+        free(runs);
+        errno = saved;
+        return -1;
+    }
+    int rc = merge_runs(&es, src, runs, (int)count, out);
+    if (count > 1)
+        stats->mergePasses++;
+    close(src);
+    free(runs);
+    if (close(out) != 0)
+        rc = -1;
+    return rc;
+}
@@ -0,0 +1,49 @@
+// extsort.h
+// External merge sort for files of fixed-width binary records that don't
+// fit in memory.
+
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct extsortConfig
+{
+    size_t recordSize;                // bytes per record
+    psort_cmp_fn cmp;                 // record comparator
+    void *ctx;                        // passed to cmp
+    size_t memBudget;                 // cap on buffer memory, in bytes
+    const char *tmpDir;               // where run files go; NULL = /tmp
+    const struct sortPolicy *policy;  // threads for the in-memory sorts
+};
+
+struct extsortStats
+{
+    size_t records;
+    size_t runs;          // initial sorted runs
+    int mergePasses;      // k-way merge passes over the data
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    double ioSeconds;     // wall time spent in read/write calls
+    double cpuSeconds;    // wall time spent sorting and merging
+};
+
+// Sort the records of inPath into outPath, never holding more than
+// cfg->memBudget bytes of record buffers. Run files are unlinked as soon as
+// they are created, so nothing is left behind on failure.
+// stats may be NULL. Returns 0 on success, -1 (errno set) on failure.
+int external_sort(const char *inPath, const char *outPath,
+                  const struct extsortConfig *cfg, struct extsortStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EXTSORT_H
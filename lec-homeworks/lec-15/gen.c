@@ -0,0 +1,254 @@
+// gen.c
+// Parallel input generation with per-block xoshiro256++ streams.
+//
+// glibc's rand() takes a lock on every call and the old driver used
+// rand() % 1000, so filling a large array took longer than sorting it.
+// Each GEN_BLOCK of the output here is filled by an independent stream,
+// and workers take whole blocks, so the result depends only on the seed.
+
+#include "gen.h"
+#include "team.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Elements per independently seeded block.
+#define GEN_BLOCK (1u << 16)
+// Largest Zipf universe; its CDF table is 8 bytes per value.
+#define ZIPF_MAX_UNIVERSE (1u << 20)
+
+static const char *distNames[] = {"uniform", "sorted", "reverse", "nearly_sorted",
+                                  "few_unique", "zipf", "organ_pipe"};
+
+void gen_spec_init(struct genSpec *spec)
+{
+    spec->dist = GEN_UNIFORM;
+    spec->seed = 1;
+    spec->lo = 0;
+    spec->hi = 999;
+}
+
+int gen_dist_parse(const char *name, enum genDist *dist)
+{
+    for (size_t i = 0; i < sizeof(distNames) / sizeof(distNames[0]); i++)
+        if (!strcmp(name, distNames[i]))
+        {
+            *dist = (enum genDist)i;
+            return 0;
+        }
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// xoshiro256++, seeded through splitmix64 as its authors recommend.
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+void gen_rng_seed(struct genRng *rng, uint64_t seed, uint64_t stream)
+{
+    uint64_t x = seed;
+    x = splitmix64(&x) ^ stream * 0xd1b54a32d192ed03ull;
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&x);
+}
+
+uint64_t gen_rng_next(struct genRng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Uniform in [0, range) by multiply-shift; the bias is below 2^-32.
+static inline uint64_t below(uint64_t x, uint64_t range)
+{
+    return (uint64_t)(((unsigned __int128)x * range) >> 64);
+}
+
+// ---------------------------------------------------------------------------
+// Parallel fill.
+
+struct genShared
+{
+    void *a;
+    enum radixKey type;
+    size_t n;
+    const struct genSpec *spec;
+    uint64_t range;     // hi - lo + 1
+    size_t blocks;
+    int chunks;
+    const double *cdf;  // GEN_ZIPF: cumulative weights
+    size_t universe;
+};
+
+// Value at rank i of n when spread evenly over the range.
+static inline int64_t spread(const struct genShared *sh, size_t i)
+{
+    return (int64_t)sh->spec->lo +
+           (int64_t)(((unsigned __int128)i * sh->range) / sh->n);
+}
+
+static int64_t zipf_draw(const struct genShared *sh, uint64_t x)
+{
+    double u = (double)(x >> 11) * (1.0 / 9007199254740992.0) * sh->cdf[sh->universe - 1];
+    size_t lo = 0, hi = sh->universe - 1;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sh->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (int64_t)sh->spec->lo + (int64_t)lo;
+}
+
+// Store value v as element i. The switch is on a loop invariant, which
+// the compiler hoists out of the fill loops.
+static inline void put(const struct genShared *sh, size_t i, int64_t v)
+{
+    switch (sh->type)
+    {
+    case RADIX_I32:
+    case RADIX_U32:
+        ((int32_t *)sh->a)[i] = (int32_t)v;
+        break;
+    case RADIX_F32:
+        ((float *)sh->a)[i] = (float)v;
+        break;
+    case RADIX_I64:
+    case RADIX_U64:
+        ((int64_t *)sh->a)[i] = v;
+        break;
+    case RADIX_F64:
+        ((double *)sh->a)[i] = (double)v;
+        break;
+    }
+}
+
+static void fill_block(const struct genShared *sh, size_t b)
+{
+    size_t lo = b * GEN_BLOCK;
+    size_t hi = lo + GEN_BLOCK < sh->n ? lo + GEN_BLOCK : sh->n;
+    size_t size = radix_key_size(sh->type);
+    char *a = sh->a;
+    struct genRng rng;
+    gen_rng_seed(&rng, sh->spec->seed, b);
+
+    switch (sh->spec->dist)
+    {
+    case GEN_UNIFORM:
+        for (size_t i = lo; i < hi; i++)
+            put(sh, i, (int64_t)sh->spec->lo + (int64_t)below(gen_rng_next(&rng), sh->range));
+        break;
+    case GEN_SORTED:
+    case GEN_NEARLY_SORTED:
+        for (size_t i = lo; i < hi; i++)
+            put(sh, i, spread(sh, i));
+        // Swaps stay inside the block so blocks remain independent.
+        for (size_t k = 0; sh->spec->dist == GEN_NEARLY_SORTED && hi - lo > 1 && k < (hi - lo) / 100; k++)
+        {
+            size_t i = lo + below(gen_rng_next(&rng), hi - lo - 1);
+            size_t reach = hi - 1 - i < 16 ? hi - 1 - i : 16;
+            size_t j = i + 1 + below(gen_rng_next(&rng), reach);
+            char t[8];
+            memcpy(t, a + i * size, size);
+            memcpy(a + i * size, a + j * size, size);
+            memcpy(a + j * size, t, size);
+        }
+        break;
+    case GEN_REVERSE:
+        for (size_t i = lo; i < hi; i++)
+            put(sh, i, spread(sh, sh->n - 1 - i));
+        break;
+    case GEN_FEW_UNIQUE:
+        for (size_t i = lo; i < hi; i++)
+        {
+            uint64_t k = below(gen_rng_next(&rng), 16);
+            put(sh, i, (int64_t)sh->spec->lo + (int64_t)(k * sh->range / 16));
+        }
+        break;
+    case GEN_ZIPF:
+        for (size_t i = lo; i < hi; i++)
+            put(sh, i, zipf_draw(sh, gen_rng_next(&rng)));
+        break;
+    case GEN_ORGAN_PIPE:
+        for (size_t i = lo; i < hi; i++)
+            // Even ranks rise through the first half, odd ranks fall through
+            // the second; with n odd the first half takes the middle.
+            put(sh, i, spread(sh, i < (sh->n + 1) / 2 ? 2 * i : 2 * (sh->n - i) - 1));
+        break;
+    }
+}
+
+static void gen_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    const struct genShared *sh = arg;
+    size_t first = sh->blocks * (size_t)id / (size_t)sh->chunks;
+    size_t last = sh->blocks * (size_t)(id + 1) / (size_t)sh->chunks;
+    for (size_t b = first; b < last; b++)
+        fill_block(sh, b);
+}
+
+int gen_fill_int(int *a, size_t n, const struct genSpec *spec,
+                 const struct sortPolicy *policy)
+{
+    return gen_fill_key(a, n, RADIX_I32, spec, policy);
+}
+
+int gen_fill_key(void *a, size_t n, enum radixKey type, const struct genSpec *spec,
+                 const struct sortPolicy *policy)
+{
+    if (spec->lo > spec->hi || (unsigned)spec->dist > GEN_ORGAN_PIPE ||
+        (unsigned)type > RADIX_F64)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n == 0)
+        return 0;
+
+    struct genShared sh = {a, type, n, spec, (uint64_t)((int64_t)spec->hi - spec->lo + 1),
+                           (n + GEN_BLOCK - 1) / GEN_BLOCK, 1, NULL, 0};
+    double *cdf = NULL;
+    if (spec->dist == GEN_ZIPF)
+    {
+        sh.universe = sh.range < ZIPF_MAX_UNIVERSE ? (size_t)sh.range : ZIPF_MAX_UNIVERSE;
+        cdf = malloc(sh.universe * sizeof(double));
+        if (!cdf)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        double sum = 0;
+        for (size_t k = 0; k < sh.universe; k++)
+            cdf[k] = (sum += 1.0 / (double)(k + 1));
+        sh.cdf = cdf;
+    }
+
+    int threads = sort_policy_threads(policy);
+    sh.chunks = (size_t)threads < sh.blocks ? threads : (int)sh.blocks;
+    team_run_chunks(sh.chunks, gen_worker, &sh);
+    free(cdf);
+    return 0;
+}
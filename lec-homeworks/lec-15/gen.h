@@ -0,0 +1,72 @@
+// gen.h
+// Parallel generation of test input.
+//
+// Values come from xoshiro256++ streams. The array is cut into fixed
+// blocks, and each block has its own stream seeded from (seed, block
+// index), so a given seed gives the same array for any thread count.
+
+#ifndef GEN_H
+#define GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+#include "radix.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum genDist
+{
+    GEN_UNIFORM,       // independent uniform values in [lo, hi]
+    GEN_SORTED,        // ascending, spread evenly over [lo, hi]
+    GEN_REVERSE,       // descending
+    GEN_NEARLY_SORTED, // ascending with 1% of elements swapped nearby
+    GEN_FEW_UNIQUE,    // 16 distinct values spread over [lo, hi]
+    GEN_ZIPF,          // lo + k with P(k) ~ 1/(k+1), k < min(hi-lo+1, 2^20)
+    GEN_ORGAN_PIPE     // ascending to the middle, then descending
+};
+
+struct genSpec
+{
+    enum genDist dist;
+    uint64_t seed;
+    int lo, hi; // inclusive value range
+};
+
+// Defaults: uniform in [0, 999], seed 1.
+void gen_spec_init(struct genSpec *spec);
+
+// Distribution by name ("uniform", "sorted", "reverse", "nearly_sorted",
+// "few_unique", "zipf", "organ_pipe"). Returns 0, or -1 if unknown.
+int gen_dist_parse(const char *name, enum genDist *dist);
+
+// Fill a[0..n) as described by spec. Returns 0 on success, -1 (errno set)
+// if spec is invalid (EINVAL) or a table can't be allocated (ENOMEM).
+int gen_fill_int(int *a, size_t n, const struct genSpec *spec,
+                 const struct sortPolicy *policy);
+
+// gen_fill_int for keys of any radix type: the same values, converted.
+// RADIX_U32 and RADIX_U64 keys take them modulo 2^32 or 2^64.
+int gen_fill_key(void *a, size_t n, enum radixKey type, const struct genSpec *spec,
+                 const struct sortPolicy *policy);
+
+// One xoshiro256++ stream, for callers that want raw 64-bit values.
+struct genRng
+{
+    uint64_t s[4];
+};
+
+// Seed the stream for (seed, stream); different streams do not overlap in
+// practice.
+void gen_rng_seed(struct genRng *rng, uint64_t seed, uint64_t stream);
+
+uint64_t gen_rng_next(struct genRng *rng);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // GEN_H
@@ -0,0 +1,151 @@
+// hugemem.c
+// Huge-page backed buffers with a fallback chain.
+//
+// MAP_HUGETLB only succeeds when pages have been reserved in
+// /proc/sys/vm/nr_hugepages (or the 1 GiB pool), so most hosts end up on
+// transparent huge pages. For those, the mapping is aligned to 2 MiB by
+// over-allocating and trimming, so that every 2 MiB stretch can be one
+// page, and then marked MADV_HUGEPAGE. That is enough when THP is set to
+// "madvise" rather than "always".
+
+#define _GNU_SOURCE
+#include "hugemem.h"
+#include "team.h"
+#include "sorttrace.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define HUGE_2M ((size_t)2 << 20)
+#define HUGE_1G ((size_t)1 << 30)
+// Smallest share of a buffer worth its own pre-faulting thread.
+#define FAULT_MIN_SHARE ((size_t)64 << 20)
+
+static const char *kindNames[] = {"heap", "thp", "hugetlb-2M", "hugetlb-1G"};
+
+const char *sort_buf_kind(enum bufKind kind)
+{
+    return kindNames[kind];
+}
+
+static size_t round_up(size_t len, size_t page)
+{
+    return (len + page - 1) / page * page;
+}
+
+// len must be a multiple of the page size given by shift (log2 bytes).
+static void *map_hugetlb(size_t len, int shift)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE |
+                       (shift << MAP_HUGE_SHIFT),
+                   -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Anonymous mapping of len bytes starting on a 2 MiB boundary.
+static void *map_aligned(size_t len)
+{
+    size_t over = len + HUGE_2M;
+    char *p = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)p + HUGE_2M - 1) & ~(uintptr_t)(HUGE_2M - 1));
+    if (aligned > p)
+        munmap(p, (size_t)(aligned - p));
+    size_t tail = (size_t)(p + over - (aligned + len));
+    if (tail)
+        munmap(aligned + len, tail);
+    return aligned;
+}
+
+struct faultShared
+{
+    char *base;
+    size_t pages; // 2 MiB pages in the buffer
+    int parts;
+};
+
+// Touch one byte per 2 MiB of this worker's share. Under THP each touch
+// faults in a whole huge page; if the kernel falls back to small pages,
+// the rest of the share faults during the sort instead.
+static void fault_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    const struct faultShared *sh = arg;
+    size_t lo = sh->pages * (size_t)id / (size_t)sh->parts;
+    size_t hi = sh->pages * (size_t)(id + 1) / (size_t)sh->parts;
+    for (size_t pg = lo; pg < hi; pg++)
+        *(volatile char *)(sh->base + pg * HUGE_2M) = 0;
+}
+
+static int buf_alloc(struct sortBuf *buf, size_t len, const struct sortPolicy *policy)
+{
+    buf->len = len;
+    buf->mapped = 0;
+    buf->kind = BUF_HEAP;
+    if (!policy || !policy->hugePages || len < HUGE_2M)
+    {
+        buf->data = malloc(len ? len : 1);
+        if (!buf->data)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+    }
+
+    // hugetlbfs pages are faulted in by MAP_POPULATE.
+    if (len >= HUGE_1G && (buf->data = map_hugetlb(round_up(len, HUGE_1G), 30)))
+    {
+        buf->mapped = round_up(len, HUGE_1G);
+        buf->kind = BUF_HUGE_1G;
+        return 0;
+    }
+    if ((buf->data = map_hugetlb(round_up(len, HUGE_2M), 21)))
+    {
+        buf->mapped = round_up(len, HUGE_2M);
+        buf->kind = BUF_HUGE_2M;
+        return 0;
+    }
+
+    buf->mapped = round_up(len, HUGE_2M);
+    buf->data = map_aligned(buf->mapped);
+    if (!buf->data)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    buf->kind = BUF_THP;
+    madvise(buf->data, buf->mapped, MADV_HUGEPAGE);
+    struct faultShared sh = {buf->data, buf->mapped / HUGE_2M, sort_policy_threads(policy)};
+    if ((size_t)sh.parts > buf->mapped / FAULT_MIN_SHARE + 1)
+        sh.parts = (int)(buf->mapped / FAULT_MIN_SHARE + 1);
+    team_run_chunks(sh.parts, fault_worker, &sh);
+    return 0;
+}
+
+int sort_buf_alloc(struct sortBuf *buf, size_t len, const struct sortPolicy *policy)
+{
+    if (buf_alloc(buf, len, policy) != 0)
+        return -1;
+    TRACE_MEM((int64_t)len);
+    return 0;
+}
+
+void sort_buf_free(struct sortBuf *buf)
+{
+    if (buf->data)
+        TRACE_MEM(-(int64_t)buf->len);
+    if (buf->kind == BUF_HEAP)
+        free(buf->data);
+    else if (buf->data)
+        munmap(buf->data, buf->mapped);
+    buf->data = NULL;
+}
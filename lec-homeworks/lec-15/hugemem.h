@@ -0,0 +1,53 @@
+// hugemem.h
+// Large sort buffers, optionally backed by huge pages.
+//
+// A sort over n elements streams through the data and a scratch buffer of
+// the same size. With 4 KiB pages that is one TLB entry per 4 KiB, and
+// at large n much of the sort time goes to TLB misses. Buffers from
+// sort_buf_alloc use 1 GiB or 2 MiB hugetlbfs pages when the system has
+// some reserved, and otherwise transparent huge pages.
+
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum bufKind
+{
+    BUF_HEAP,    // plain malloc
+    BUF_THP,     // anonymous mapping with MADV_HUGEPAGE
+    BUF_HUGE_2M, // MAP_HUGETLB, 2 MiB pages
+    BUF_HUGE_1G  // MAP_HUGETLB, 1 GiB pages
+};
+
+struct sortBuf
+{
+    void *data;
+    size_t len;    // bytes asked for
+    size_t mapped; // bytes actually mapped (0 for BUF_HEAP)
+    enum bufKind kind;
+};
+
+// Allocate len bytes. If policy->hugePages is set and len is at least one
+// huge page, try 1 GiB pages, then 2 MiB pages, then transparent huge
+// pages. The memory is pre-faulted in parallel so page faults don't land
+// in the timed sort. Otherwise it is a plain malloc.
+// Returns 0, or -1 (errno set) if no memory is available.
+int sort_buf_alloc(struct sortBuf *buf, size_t len, const struct sortPolicy *policy);
+
+void sort_buf_free(struct sortBuf *buf);
+
+// "heap", "thp", "hugetlb-2M" or "hugetlb-1G".
+const char *sort_buf_kind(enum bufKind kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HUGEMEM_H
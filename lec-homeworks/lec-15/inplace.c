@@ -0,0 +1,477 @@
+// inplace.c
+// Low-memory stable merge sort strategy.
+//
+// The other strategies allocate a scratch buffer as large as the array,
+// which caps a sort at half of RAM. Here each thread gets one buffer of
+// about sqrt(n) elements, so for large n the extra memory is negligible.
+//
+// Merges whose shorter run fits in the buffer go through it as usual.
+// Larger merges are block merges, as in WikiSort and GrailSort but with
+// the buffer outside the array: cut both runs into buffer-sized blocks,
+// put the blocks in order of their first elements (A before B on ties),
+// and sweep left to right. Whenever the blocks switch run, the part of the
+// earlier run not yet in place (at most one block) goes to the buffer and
+// is merged with the next block. Blocks are moved once to reorder them
+// and each element goes through the buffer about once, so a merge costs
+// O(n) moves and the sort O(n log n). A part-block at the front of A and
+// at the end of B is merged in afterwards through the buffer.
+//
+// The top merges of the parallel recursion are instead split into two
+// independent merges: cut the longer run at its middle, binary search the
+// matching cut in the other run, and rotate the middle pieces into place.
+// The halves go to different threads.
+//
+// Ties always keep the left run first, so the sort is stable.
+
+#include "psort_impl.h"
+#include "sorttrace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Subarrays smaller than this are sorted, and merges not split, on one
+// thread.
+#define INPLACE_MIN_PARALLEL 65536
+// Smallest per-thread buffer, in elements.
+#define INPLACE_MIN_BUFFER 256
+
+#define AT(p, i) ((p) + (i) * size)
+
+struct ipCtx
+{
+    const struct sortCtx *sc;
+    char *bufs;     // one buffer of bufLen elements per thread
+    size_t bufLen;
+    size_t *order;  // per thread: bufLen block numbers for block merges
+};
+
+// ---------------------------------------------------------------------------
+// Searches and rotation.
+
+// Elements of a[0..n) that sort before x: those <= x if orEqual, else < x.
+static size_t bound(const struct sortCtx *sc, const char *a, size_t n,
+                    const char *x, int orEqual)
+{
+    size_t size = sc->size, lo = 0, hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (orEqual ? !psort_less(sc, x, AT(a, mid)) : psort_less(sc, AT(a, mid), x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Exchange the non-overlapping ranges x and y of `bytes` bytes, a buffer
+// load at a time.
+static void swap_ranges(const struct ipCtx *ip, char *buf, char *x, char *y,
+                        size_t bytes)
+{
+    size_t cap = ip->bufLen * ip->sc->size;
+    while (bytes > 0)
+    {
+        size_t c = bytes < cap ? bytes : cap;
+        memcpy(buf, x, c);
+        memcpy(x, y, c);
+        memcpy(y, buf, c);
+        x += c, y += c, bytes -= c;
+    }
+}
+
+// Turn a[0..na) a[na..na+nb) into a[na..na+nb) a[0..na). Once the shorter
+// side fits in the buffer it is parked there while the other side slides
+// over. Until then, Gries-Mills block swaps put one side's worth of
+// elements in their final place per step.
+static void rotate(const struct ipCtx *ip, char *buf, char *a, size_t na, size_t nb)
+{
+    size_t size = ip->sc->size;
+    while (na > 0 && nb > 0)
+    {
+        if (na <= ip->bufLen && na <= nb)
+        {
+            memcpy(buf, a, na * size);
+            memmove(a, AT(a, na), nb * size);
+            memcpy(AT(a, nb), buf, na * size);
+            return;
+        }
+        if (nb <= ip->bufLen)
+        {
+            memcpy(buf, AT(a, na), nb * size);
+            memmove(AT(a, nb), a, na * size);
+            memcpy(a, buf, nb * size);
+            return;
+        }
+        if (na <= nb)
+        {
+            // A B1 B2 -> B1 A B2, with B1 final.
+            swap_ranges(ip, buf, a, AT(a, na), na * size);
+            a = AT(a, na);
+            nb -= na;
+        }
+        else
+        {
+            // A1 A2 B -> A1 B A2, with A2 final.
+            swap_ranges(ip, buf, AT(a, na - nb), AT(a, na), nb * size);
+            na -= nb;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Merging a[0..na) with a[na..na+nb).
+
+// Merge buf[0..nx), taken from the front of out, with y[0..ny), which
+// follows it, into out until one side runs out. Ties go to buf if bufFirst,
+// else to y. Returns the elements taken from buf; *taken gets those from y.
+static size_t merge_front(const struct sortCtx *sc, char *out, const char *buf,
+                          size_t nx, const char *y, size_t ny, int bufFirst, size_t *taken)
+{
+    size_t size = sc->size, i = 0, j = 0;
+    if (sc->intKeys)
+    {
+        // Branchless, as in psort.c's int kernel. y wins when v < u, or
+        // v <= u if it takes ties: v < u + tie, in 64 bits so u + 1 can't
+        // overflow, keeps both cases one comparison.
+        const int *x = (const int *)buf, *b = (const int *)y;
+        int *o = (int *)out;
+        int64_t tie = !bufFirst;
+        while (i < nx && j < ny)
+        {
+            int u = x[i], v = b[j];
+            int takeY = v < u + tie;
+            o[i + j] = takeY ? v : u;
+            i += !takeY;
+            j += takeY;
+        }
+    }
+    else
+    {
+        while (i < nx && j < ny)
+        {
+            int takeY = bufFirst ? psort_less(sc, AT(y, j), AT(buf, i))
+                                 : !psort_less(sc, AT(buf, i), AT(y, j));
+            psort_move(AT(out, i + j), takeY ? AT(y, j) : AT(buf, i), size);
+            i += !takeY;
+            j += takeY;
+        }
+    }
+    *taken = j;
+    return i;
+}
+
+// The left run is in the buffer; fill a from the front.
+static void merge_forward(const struct sortCtx *sc, char *a, const char *buf,
+                          size_t na, size_t nb)
+{
+    size_t size = sc->size, j;
+    size_t i = merge_front(sc, a, buf, na, AT(a, na), nb, 1, &j);
+    memcpy(AT(a, i + j), AT(buf, i), (na - i) * size); // what is left of b is in place
+}
+
+// The right run is in the buffer; fill a from the back.
+static void merge_backward(const struct sortCtx *sc, char *a, const char *buf,
+                           size_t na, size_t nb)
+{
+    size_t size = sc->size, i = na, j = nb;
+    if (sc->intKeys)
+    {
+        const int *x = (const int *)a, *b = (const int *)buf;
+        int *o = (int *)a;
+        while (i > 0 && j > 0)
+        {
+            int u = x[i - 1], v = b[j - 1];
+            int takeA = v < u;
+            o[i + j - 1] = takeA ? u : v;
+            i -= takeA;
+            j -= !takeA;
+        }
+    }
+    else
+    {
+        while (i > 0 && j > 0)
+        {
+            int takeA = psort_less(sc, AT(buf, j - 1), AT(a, i - 1));
+            psort_move(AT(a, i + j - 1), takeA ? AT(a, i - 1) : AT(buf, j - 1), size);
+            i -= takeA;
+            j -= !takeA;
+        }
+    }
+    memcpy(a, buf, j * size); // what is left of a is in place
+}
+
+// Merge a[0..ma*k) with a[ma*k..(ma+mb)*k), both whole blocks of k =
+// bufLen elements and (ma + mb) <= bufLen.
+static void block_merge(const struct ipCtx *ip, char *buf, size_t *order, char *a,
+                        size_t ma, size_t mb)
+{
+    const struct sortCtx *sc = ip->sc;
+    size_t size = sc->size, k = ip->bufLen, kb = k * size, m = ma + mb;
+#define BLOCK(d) ((a) + (d) * kb)
+
+    // Block order: merge the two runs' blocks by first element. Blocks of
+    // A are numbered [0, ma), those of B [ma, m).
+    for (size_t i = 0, j = ma, d = 0; d < m; d++)
+        order[d] = i < ma && (j == m || !psort_less(sc, BLOCK(j), BLOCK(i))) ? i++ : j++;
+    // The sweep needs each block's run, so mark B's blocks in the top bit
+    // before the moves below overwrite the block numbers.
+    size_t fromB = ~(SIZE_MAX >> 1);
+    for (size_t d = 0; d < m; d++)
+        order[d] |= order[d] >= ma ? fromB : 0;
+
+    // Move the blocks, one cycle of the permutation at a time; a moved
+    // block's entry becomes its own position.
+    for (size_t d0 = 0; d0 < m; d0++)
+    {
+        if ((order[d0] & ~fromB) == d0)
+            continue;
+        memcpy(buf, BLOCK(d0), kb);
+        size_t d = d0;
+        while ((order[d] & ~fromB) != d0)
+        {
+            size_t src = order[d] & ~fromB;
+            memcpy(BLOCK(d), BLOCK(src), kb);
+            order[d] = (order[d] & fromB) | d;
+            d = src;
+        }
+        memcpy(BLOCK(d), buf, kb);
+        order[d] = (order[d] & fromB) | d;
+    }
+
+    // Sweep: a[ps..) up to the current block is the part of run `pendB`
+    // not yet known to be in place.
+    size_t ps = 0;
+    int pendB = (order[0] & fromB) != 0;
+    for (size_t d = 1; d < m; d++)
+    {
+        int isB = (order[d] & fromB) != 0;
+        size_t bs = d * k;
+        if (isB == pendB)
+        {
+            ps = bs; // everything before this block is in place
+            continue;
+        }
+        size_t np = bs - ps, j;
+        memcpy(buf, AT(a, ps), np * size);
+        size_t i = merge_front(sc, AT(a, ps), buf, np, AT(a, bs), k, !pendB, &j);
+        if (i == np)
+        {
+            // The pending part is placed; the rest of this block pends.
+            ps = bs + j;
+            pendB = isB;
+        }
+        else
+        {
+            // This block ran out first: the pending rest goes at its end.
+            memcpy(AT(a, bs + k - (np - i)), AT(buf, i), (np - i) * size);
+            ps = bs + k - (np - i);
+        }
+    }
+#undef BLOCK
+}
+
+// Cut a merge into two independent ones: on return a[0..*i+*j) holds the
+// first *i elements of A and *j of B, which all order before the rest.
+static void split_merge(const struct ipCtx *ip, char *buf, char *a, size_t na,
+                        size_t nb, size_t *i, size_t *j)
+{
+    const struct sortCtx *sc = ip->sc;
+    size_t size = sc->size;
+    if (na >= nb)
+    {
+        *i = na / 2;
+        *j = bound(sc, AT(a, na), nb, AT(a, *i), 0);
+    }
+    else
+    {
+        *j = nb / 2;
+        *i = bound(sc, a, na, AT(a, na + *j), 1);
+    }
+    rotate(ip, buf, AT(a, *i), na - *i, *j);
+}
+
+static void merge_serial(const struct ipCtx *ip, char *buf, size_t *order, char *a,
+                         size_t na, size_t nb)
+{
+    const struct sortCtx *sc = ip->sc;
+    size_t size = sc->size;
+    if (na == 0 || nb == 0)
+        return;
+    // Trim the ends that are already in place.
+    size_t skip = bound(sc, a, na, AT(a, na), 1);
+    a = AT(a, skip);
+    na -= skip;
+    if (na == 0)
+        return;
+    nb = bound(sc, AT(a, na), nb, AT(a, na - 1), 0);
+    if (nb == 0)
+        return;
+
+    if (na <= ip->bufLen && na <= nb)
+    {
+        memcpy(buf, a, na * size);
+        merge_forward(sc, a, buf, na, nb);
+        return;
+    }
+    if (nb <= ip->bufLen)
+    {
+        memcpy(buf, AT(a, na), nb * size);
+        merge_backward(sc, a, buf, na, nb);
+        return;
+    }
+    // Both runs are longer than a block: block merge all of A but a
+    // part-block at its front and all of B but one at its end, then
+    // merge those two in.
+    size_t k = ip->bufLen, headA = na % k, tailB = nb % k;
+    block_merge(ip, buf, order, AT(a, headA), na / k, nb / k);
+    merge_serial(ip, buf, order, AT(a, headA), na - headA + nb - tailB, tailB);
+    merge_serial(ip, buf, order, a, headA, na - headA + nb);
+}
+
+// ---------------------------------------------------------------------------
+// Recursion. Like psort.c, but buffers are handed out by thread: a task
+// with `threads` threads owns buffers [buf, buf + threads).
+
+struct ipTask
+{
+    const struct ipCtx *ip;
+    char *a;
+    size_t na, nb; // merge tasks: a[0..na) with a[na..na+nb); sort: n = na
+    int buf;       // first buffer owned
+    int threads;
+    int level;     // depth in the recursion, for tracing
+};
+
+static void merge_par(struct ipTask *t);
+static void sort_par(struct ipTask *t);
+
+static void *merge_thread(void *arg)
+{
+    merge_par(arg);
+    return NULL;
+}
+
+static void *sort_thread(void *arg)
+{
+    sort_par(arg);
+    return NULL;
+}
+
+static char *task_buf(const struct ipTask *t)
+{
+    return t->ip->bufs + (size_t)t->buf * t->ip->bufLen * t->ip->sc->size;
+}
+
+static size_t *task_order(const struct ipTask *t)
+{
+    return t->ip->order + (size_t)t->buf * t->ip->bufLen;
+}
+
+static void merge_par(struct ipTask *t)
+{
+    const struct ipCtx *ip = t->ip;
+    size_t size = ip->sc->size;
+    if (t->threads < 2 || t->na + t->nb < INPLACE_MIN_PARALLEL || t->na == 0 || t->nb == 0)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_MERGE, t->level, t->na + t->nb);
+        merge_serial(ip, task_buf(t), task_order(t), t->a, t->na, t->nb);
+        TRACE_END(span);
+        return;
+    }
+    size_t i, j;
+    split_merge(ip, task_buf(t), t->a, t->na, t->nb, &i, &j);
+    int lt = t->threads / 2;
+    struct ipTask left = {ip, t->a, i, j, t->buf, lt, t->level};
+    struct ipTask right = {ip, AT(t->a, i + j), t->na - i, t->nb - j, t->buf + lt,
+                           t->threads - lt, t->level};
+    pthread_t tid;
+    int spawned = pthread_create(&tid, NULL, merge_thread, &left) == 0;
+    if (!spawned)
+        merge_par(&left);
+    merge_par(&right);
+    if (spawned)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_WAIT, t->level, 0);
+        pthread_join(tid, NULL);
+        TRACE_END(span);
+    }
+}
+
+static void sort_par(struct ipTask *t)
+{
+    const struct ipCtx *ip = t->ip;
+    const struct sortCtx *sc = ip->sc;
+    size_t size = sc->size, n = t->na;
+    TRACE_SPAN(sub);
+    TRACE_BEGIN(sub, TRACE_SUBTREE, t->level, n);
+    if (n <= sc->cutoff)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_BASE, t->level, n);
+        sc->ops->isort(t->a, n, sc);
+        TRACE_END(span);
+        TRACE_END(sub);
+        return;
+    }
+    size_t mid = n / 2;
+    int lt = t->threads / 2;
+    struct ipTask left = {ip, t->a, mid, 0, t->buf, lt, t->level + 1};
+    struct ipTask right = {ip, AT(t->a, mid), n - mid, 0, t->buf + lt, t->threads - lt,
+                           t->level + 1};
+    pthread_t tid;
+    int spawned = 0;
+    if (t->threads > 1 && n >= INPLACE_MIN_PARALLEL)
+        spawned = pthread_create(&tid, NULL, sort_thread, &left) == 0;
+    if (!spawned)
+    {
+        // Run serially on the whole thread budget's first buffer.
+        left.threads = right.threads = t->threads;
+        right.buf = t->buf;
+        sort_par(&left);
+    }
+    sort_par(&right);
+    if (spawned)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_WAIT, t->level, 0);
+        pthread_join(tid, NULL);
+        TRACE_END(span);
+    }
+
+    struct ipTask merge = {ip, t->a, mid, n - mid, t->buf, t->threads, t->level};
+    merge_par(&merge);
+    TRACE_END(sub);
+}
+
+int inplace_sort(const struct sortCtx *sc, char *base, size_t n,
+                 const struct sortPolicy *policy)
+{
+    int threads = sort_policy_threads(policy);
+    size_t bufLen = INPLACE_MIN_BUFFER;
+    while (bufLen * bufLen < n)
+        bufLen *= 2;
+    if (bufLen > n)
+        bufLen = n;
+    struct ipCtx ip = {sc, malloc((size_t)threads * bufLen * sc->size), bufLen,
+                       malloc((size_t)threads * bufLen * sizeof(size_t))};
+    if (!ip.bufs || !ip.order)
+    {
+        free(ip.bufs);
+        free(ip.order);
+        errno = ENOMEM;
+        return -1;
+    }
+    TRACE_MEM((int64_t)((size_t)threads * bufLen * (sc->size + sizeof(size_t))));
+    struct ipTask top = {&ip, base, n, 0, 0, threads, 0};
+    sort_par(&top);
+    free(ip.bufs);
+    free(ip.order);
+    TRACE_MEM(-(int64_t)((size_t)threads * bufLen * (sc->size + sizeof(size_t))));
+    return 0;
+}
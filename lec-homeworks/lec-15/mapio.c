@@ -0,0 +1,127 @@
+// mapio.c
+// Memory-mapped file helpers. Inputs are mapped with MAP_POPULATE and
+// MADV_SEQUENTIAL | MADV_WILLNEED so the kernel reads ahead in large
+// chunks. Outputs get their blocks reserved with posix_fallocate first:
+// a full disk then fails here with an error, rather than as SIGBUS on a
+// store in the middle of the sort.
+
+#define _GNU_SOURCE
+#include "mapio.h"
+#include "team.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int map_input(const char *path, int writable, struct mappedFile *mf)
+{
+    mf->data = NULL;
+    mf->len = 0;
+    mf->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (mf->fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(mf->fd, &st) != 0)
+        goto fail;
+    mf->len = (size_t)st.st_size;
+    if (mf->len == 0)
+        return 0;
+
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void *p = mmap(NULL, mf->len, prot, MAP_SHARED | MAP_POPULATE, mf->fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    madvise(p, mf->len, MADV_SEQUENTIAL);
+    madvise(p, mf->len, MADV_WILLNEED);
+    mf->data = p;
+    return 0;
+
+fail:
+    close(mf->fd);
+    mf->fd = -1;
+    return -1;
+}
+
+int map_output(const char *path, size_t len, struct mappedFile *mf)
+{
+    mf->data = NULL;
+    mf->len = len;
+    mf->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (mf->fd < 0)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    int rc = posix_fallocate(mf->fd, 0, (off_t)len);
+    if (rc == EOPNOTSUPP || rc == EINVAL) // e.g. tmpfs on old kernels
+        rc = ftruncate(mf->fd, (off_t)len) == 0 ? 0 : errno;
+    if (rc != 0)
+    {
+        close(mf->fd);
+        errno = rc;
+        return -1;
+    }
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   mf->fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close(mf->fd);
+        return -1;
+    }
+    madvise(p, len, MADV_WILLNEED);
+    mf->data = p;
+    return 0;
+}
+
+int same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+        return 0;
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+int unmap_file(struct mappedFile *mf, int sync)
+{
+    int rc = 0;
+    if (mf->data)
+    {
+        if (sync && msync(mf->data, mf->len, MS_SYNC) != 0)
+            rc = -1;
+        if (munmap(mf->data, mf->len) != 0)
+            rc = -1;
+    }
+    if (mf->fd >= 0 && close(mf->fd) != 0)
+        rc = -1;
+    mf->data = NULL;
+    mf->fd = -1;
+    return rc;
+}
+
+struct copyShared
+{
+    char *dst;
+    const char *src;
+    size_t len;
+};
+
+static void copy_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct copyShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->len, &lo, &hi);
+    memcpy(sh->dst + lo, sh->src + lo, hi - lo);
+}
+
+void parallel_copy(void *dst, const void *src, size_t len,
+                   const struct sortPolicy *policy)
+{
+    struct copyShared sh = {dst, src, len};
+    int threads = sort_policy_threads(policy);
+    if (len < ((size_t)1 << 20))
+        threads = 1;
+    team_run(threads, copy_worker, &sh);
+}
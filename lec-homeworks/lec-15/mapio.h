@@ -0,0 +1,48 @@
+// mapio.h
+// Memory-mapped binary files for the sort driver.
+
+#ifndef MAPIO_H
+#define MAPIO_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mappedFile
+{
+    void *data;
+    size_t len;
+    int fd;
+};
+
+// Map an existing file. writable != 0 maps it shared and read-write, so
+// stores go back to the file; otherwise it is mapped read-only. Pages are
+// pre-faulted with MAP_POPULATE and the kernel is told to read ahead.
+// A zero-length file gives data == NULL. Returns 0 or -1 (errno set).
+int map_input(const char *path, int writable, struct mappedFile *mf);
+
+// Create (or truncate) path with len bytes of disk space reserved, and map
+// it shared and read-write, pre-faulted. Returns 0 or -1 (errno set).
+int map_output(const char *path, size_t len, struct mappedFile *mf);
+
+// Nonzero if paths a and b both exist and are the same file (same device
+// and inode), e.g. through a link or a different spelling of the path.
+// map_output on such a path would truncate the input under its mapping.
+int same_file(const char *a, const char *b);
+
+// Flush dirty pages (if sync) and unmap. Returns 0 or -1 (errno set).
+int unmap_file(struct mappedFile *mf, int sync);
+
+// memcpy split across the policy's threads.
+void parallel_copy(void *dst, const void *src, size_t len,
+                   const struct sortPolicy *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MAPIO_H
@@ -1,112 +1,1416 @@
 // Implementation of merge sort in C using pthreads
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include "psort.h"
+#include "radix.h"
+#include "extsort.h"
+#include "argsort.h"
+#include "mapio.h"
+#include "textio.h"
+#include "gen.h"
+#include "numa.h"
+#include "hugemem.h"
+#include "perfctr.h"
+#include "topk.h"
+#include "strsort.h"
+#include "sorttrace.h"
+#include "runstore.h"
+#include "sortreduce.h"
+#include "sortfile.h"
+#include "csvsort.h"
+#include "autotune.h"
+#include "timing.h"
+#include "procsort.h"
+
+// Most percentiles one --percentile list may ask for.
+#define MAX_PERCENTILES 16
+// Range queries timed after each --store batch, and their width as a
+// fraction of the value range.
+#define STORE_QUERIES 16
+#define STORE_QUERY_SPAN 0.001
+
+enum groupMode
+{
+    GROUP_NONE,
+    GROUP_UNIQUE,
+    GROUP_COUNT,
+    GROUP_SUM
+};
+
+// Where --trace and --chrome-trace write; both NULL when not tracing.
+struct traceRequest
+{
+    const char *json, *chrome;
+    struct sortTraceOptions opt;
+};
+
+// Where --index writes the sorted records as a searchable file; path
+// NULL when not asked for.
+struct indexRequest
+{
+    const char *path;
+    struct sortedFileOptions opt;
+};
 
 struct mergesortArgs
 {
     int *array;
-    int n;
+    size_t n;
+    const struct sortPolicy *policy; // NULL for the engine defaults
 };
 
-// Function to perform merge sort on an array provided as input
+// Function to perform merge sort on an array provided as input.
+// Kept as a pthread-style entry point; the work is done by the generic
+// engine in psort.c, which bounds the number of threads it creates.
 void *mergeSort(void *args)
 {
     struct mergesortArgs *msArgs = (struct mergesortArgs *)args;
-    int *array = msArgs->array;
-    int n = msArgs->n;
-    // Check for base case
-    if (n < 2)
-        return;
-    int mid = n / 2;
-    // mergeSort(array, mid);
-    // mergeSort(array + mid, n - mid);
+    if (parallel_merge_sort(msArgs->array, msArgs->n, sizeof(int),
+                            psort_cmp_int, NULL, msArgs->policy) != 0)
+        perror("mergeSort");
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <number_of_elements>   (e.g. 1000000 or 4e9)\n"
+            "       %s --in FILE [--out FILE] [options]\n"
+            "       %s --text --in FILE [--out FILE] [options]\n"
+            "       %s --lines --in FILE [--out FILE] [options]\n"
+            "       %s --csv KEYS --in FILE [--out FILE] [options]\n"
+            "       %s --external --in FILE --out FILE [options]\n"
+            "       %s --autotune [number_of_elements] [options]\n"
+            "Options:\n"
+            "  -a, --algo auto|merge|radix|process\n"
+            "                               sort engine (default auto); process runs\n"
+            "                               the merge sort in one forked process per\n"
+            "                               thread over shared memory\n"
+            "  -t, --threads N              worker threads (default: all CPUs)\n"
+            "  -s, --strategy auto|binary|multiway|natural|sample|inplace\n"
+            "                               merge engine strategy (default auto: sample\n"
+            "                               sort on many cores, else binary); natural\n"
+            "                               suits presorted input; inplace needs only\n"
+            "                               O(sqrt n) extra memory\n"
+            "  -v, --time                   report sort time and throughput\n"
+            "  -A, --autotune               time the engine's settings on this host with\n"
+            "                               the generated input (default 4M elements)\n"
+            "                               and save the fastest to the profile\n"
+            "  -F, --profile FILE|none      tuning profile, loaded at startup for any\n"
+            "                               setting not given on the command line\n"
+            "                               (default $PSORT_PROFILE, else\n"
+            "                               ~/.psort_profile)\n"
+            "  -e, --external               external sort of a binary file\n"
+            "  -i, --in FILE                input file of binary records; mapped and\n"
+            "                               sorted in place unless --out is given\n"
+            "  -o, --out FILE               output file\n"
+            "  -m, --mem SIZE               external sort memory budget (default 256M)\n"
+            "  -T, --tmpdir DIR             directory for external sort runs\n"
+            "  -x, --text                   --in/--out hold decimal ints as text\n"
+            "  -l, --lines                  sort the lines of --in as strings (strcmp\n"
+            "                               order)\n"
+            "  -C, --csv KEYS               sort the rows of a CSV --in by KEYS, e.g.\n"
+            "                               region,ts:i:desc: columns by header name or\n"
+            "                               number, :i int, :f float, :sN string keyed\n"
+            "                               on N bytes (default 16), :desc\n"
+            "  -E, --csv-header             the first CSV line is a header\n"
+            "  -r, --record-size BYTES      record width; records are keyed by a\n"
+            "                               leading native-endian key (default: the\n"
+            "                               key's size)\n"
+            "  -K, --key int|int64|uint64|double\n"
+            "                               key type of generated input and --in\n"
+            "                               records (default int)\n"
+            "  -q, --quiet                  don't print the unsorted and sorted arrays\n"
+            "  -d, --dist NAME              generated input: uniform, sorted, reverse,\n"
+            "                               nearly_sorted, few_unique, zipf, organ_pipe\n"
+            "  -R, --range LO:HI            generated value range (default 0:999)\n"
+            "  -S, --seed N                 generator seed (default 1)\n"
+            "  -N, --numa                   generated input: place and sort one\n"
+            "                               partition per NUMA node (merge engine)\n"
+            "  -H, --huge                   back the array and sort buffers with\n"
+            "                               huge pages where available\n"
+            "  -k, --top K                  generated input: only put the K smallest\n"
+            "                               in order (partial sort) and print those\n"
+            "  -p, --percentile Q[,Q...]    generated input: print these percentiles\n"
+            "                               (0-100) by selection, without sorting\n"
+            "  -g, --group unique|count|sum generated input: sort and combine equal\n"
+            "                               keys in the same pass; sum adds a second\n"
+            "                               generated array (seed + 1) as the values\n"
+            "  -L, --store BATCH            generated input: append it to an incremental\n"
+            "                               sorted store BATCH elements at a time, with\n"
+            "                               range queries in between\n"
+            "  -P, --store-policy tiered|levelled\n"
+            "                               how the store merges runs (default tiered)\n"
+            "  -I, --index FILE             also write the sorted records to FILE in\n"
+            "                               blocks with a sparse index, for sortlookup\n"
+            "  -b, --block BYTES            --index block size (default 4096)\n"
+            "  -B, --bloom BITS             --index Bloom filter bits per record\n"
+            "                               (default 0: no filters)\n"
+            "  -j, --trace FILE             write per-level, per-phase and per-thread\n"
+            "                               timings of the sort to FILE as JSON\n"
+            "  -J, --chrome-trace FILE      write the sort's phases as Chrome trace\n"
+            "                               events (chrome://tracing, Perfetto)\n"
+            "  -c, --trace-counters         add cycles, LLC and branch misses per\n"
+            "                               phase to the traces\n"
+            "                               (tracing needs a make TRACE=1 build and\n"
+            "                               runs the merge engine)\n",
+            prog, prog, prog, prog, prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+// Parse a byte count with an optional K/M/G suffix.
+static size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    switch (*end)
+    {
+    case 'g':
+    case 'G':
+        v <<= 10;
+        // fall through
+    case 'm':
+    case 'M':
+        v <<= 10;
+        // fall through
+    case 'k':
+    case 'K':
+        v <<= 10;
+    }
+    return (size_t)v;
+}
+
+// Comparator for a leading key of the given type (one --key accepts).
+static psort_cmp_fn key_cmp(enum radixKey key)
+{
+    switch (key)
+    {
+    case RADIX_I64:
+        return psort_cmp_int64;
+    case RADIX_U64:
+        return psort_cmp_uint64;
+    case RADIX_F64:
+        return psort_cmp_double;
+    default:
+        return psort_cmp_int;
+    }
+}
+
+// Free the generated array, from wherever main allocated it.
+static void free_array(void *array, size_t n, size_t keySize, int numa, int shared,
+                       struct sortBuf *buf)
+{
+    if (numa)
+        node_free(array, n, sizeof(int));
+    else if (shared)
+        proc_shared_free(array, n * keySize);
+    else
+        sort_buf_free(buf);
+}
+
+// Parse an element count: digits, or a whole number in float notation
+// such as 4e9. Returns 0, or -1 if s is not a positive count.
+static int parse_count(const char *s, size_t *n)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*end == 'e' || *end == 'E' || *end == '.')
+    {
+        double d = strtod(s, &end);
+        if (!(d >= 1 && d < 18446744073709551616.0) || d != (double)(unsigned long long)d)
+            return -1;
+        v = (unsigned long long)d;
+    }
+    if (*end || errno || v == 0 || *s == '-')
+        return -1;
+    *n = (size_t)v;
+    return 0;
+}
+
+// Sort n records of recordSize bytes, keyed by a leading key of the given
+// type. algo "process" runs the process engine, which needs base in shared
+// memory and reports its phases if timed. Otherwise:
+//   - bare keys go to radix sort for "radix", or for "auto" when the policy
+//     prefers it, and to the merge engine (mergeSort for ints) otherwise;
+//   - records of 32 bytes or more are sorted by key index, unless algo is
+//     "merge";
+//   - records wider than the key but under 32 bytes always go to the
+//     merge engine, whatever algo says, as do wide records under "merge".
+static int sort_records(void *base, size_t n, size_t recordSize, enum radixKey key,
+                        const char *algo, const struct sortPolicy *policy, int timed)
+{
+    if (!strcmp(algo, "process"))
+    {
+        struct procSortStats st;
+        if (proc_merge_sort(base, n, recordSize, key_cmp(key), NULL, policy, &st) != 0)
+            return -1;
+        if (timed && st.workers > 0)
+            fprintf(stderr,
+                    "processes: %d workers forked in %.3f ms, all running after %.3f ms\n"
+                    "  partitions sorted in %.3f s, %d merge rounds in %.3f s, "
+                    "reaped in %.3f ms\n",
+                    st.workers, st.forkSeconds * 1e3, st.startSeconds * 1e3, st.sortSeconds,
+                    st.rounds, st.mergeSeconds, st.reapSeconds * 1e3);
+        return 0;
+    }
+    if (recordSize == radix_key_size(key))
+    {
+        int useRadix = !strcmp(algo, "radix") ||
+                       (!strcmp(algo, "auto") && radix_policy_preferred(key, n, policy));
+        if (useRadix)
+            return radix_sort(base, n, key, policy);
+        if (key != RADIX_I32)
+            return parallel_merge_sort(base, n, recordSize, key_cmp(key), NULL, policy);
+        struct mergesortArgs args = {base, n, policy};
+        mergeSort((void *)&args);
+        return 0;
+    }
+    if (recordSize >= 32 && strcmp(algo, "merge"))
+        return key_index_sort(base, n, recordSize, 0, key, policy);
+    return parallel_merge_sort(base, n, recordSize, key_cmp(key), NULL, policy);
+}
+
+static void report_time(double secs, size_t n, size_t recordSize)
+{
+    fprintf(stderr, "sorted %zu elements in %.3f s (%.1f M elements/s, %.2f GB/s of data)\n",
+            n, secs, n / secs / 1e6, n * recordSize / secs / 1e9);
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        fprintf(stderr, "peak memory %.1f MB (%.2fx the data)\n", ru.ru_maxrss / 1024.0,
+                n ? ru.ru_maxrss * 1024.0 / ((double)n * recordSize) : 0.0);
+}
+
+static int trace_start(const struct traceRequest *trace)
+{
+    if (!trace->json && !trace->chrome)
+        return 0;
+    if (sort_trace_begin(&trace->opt) != 0)
+    {
+        perror("trace (build with make TRACE=1)");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_trace(const char *path, int (*writer)(FILE *))
+{
+    FILE *f = fopen(path, "w");
+    int rc = f ? writer(f) : -1;
+    if (f && fclose(f) != 0)
+        rc = -1;
+    if (rc != 0)
+        perror(path);
+    return rc;
+}
+
+static int trace_finish(const struct traceRequest *trace)
+{
+    if (!trace->json && !trace->chrome)
+        return 0;
+    sort_trace_end();
+    int rc = 0;
+    if (trace->json)
+        rc |= write_trace(trace->json, sort_trace_write_json);
+    if (trace->chrome)
+        rc |= write_trace(trace->chrome, sort_trace_write_chrome);
+    return rc;
+}
+
+static int write_index(const struct indexRequest *index, const void *base, size_t n,
+                       size_t recordSize, const struct sortPolicy *policy, int timed)
+{
+    if (!index->path)
+        return 0;
+    double t0 = now();
+    if (sorted_file_write(index->path, base, n, recordSize, &index->opt, policy) != 0)
+    {
+        perror(index->path);
+        return -1;
+    }
+    if (timed)
+        fprintf(stderr, "wrote %s in %.3f s\n", index->path, now() - t0);
+    return 0;
+}
+
+// Hardware counters over the sort, per element so runs of different sizes
+// compare. Run once with and once without --huge to see the TLB effect.
+static void report_counters(const struct perfCounters *pc, size_t n, const char *pages)
+{
+    fprintf(stderr, "array pages: %s\n", pages);
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+    {
+        if (pc->fd[ev] < 0)
+            fprintf(stderr, "%-18s not available\n", perfctr_name((enum perfEvent)ev));
+        else
+            fprintf(stderr, "%-18s %llu (%.3f per element)\n", perfctr_name((enum perfEvent)ev),
+                    (unsigned long long)pc->value[ev], n ? (double)pc->value[ev] / n : 0.0);
+    }
+}
+
+// Per-node throughput of a --numa sort. Bandwidth counts one pass over the
+// node's bytes per phase.
+static void report_nodes(const struct nodeStats *st, size_t recordSize)
+{
+    for (int k = 0; k < st->nodes; k++)
+    {
+        const struct nodeStat *ns = &st->node[k];
+        double bytes = (double)ns->elements * recordSize;
+        fprintf(stderr, "node %d: %d threads, %zu elements, sort %.3f s (%.2f GB/s)",
+                ns->node, ns->threads, ns->elements, ns->sortSeconds,
+                ns->sortSeconds > 0 ? bytes / ns->sortSeconds / 1e9 : 0.0);
+        if (st->nodes > 1)
+            fprintf(stderr, ", merge %.3f s (%.2f GB/s, %.1f MB remote)",
+                    ns->mergeSeconds, ns->mergeSeconds > 0 ? bytes / ns->mergeSeconds / 1e9 : 0.0,
+                    ns->remoteBytes / 1e6);
+        fputc('\n', stderr);
+    }
+}
+
+// Sort a binary file through mmap: in place, or into a mapped output file.
+static int run_mapped(const char *in, const char *out, size_t recordSize,
+                      enum radixKey key, const char *algo, const struct sortPolicy *policy,
+                      int timed, const struct traceRequest *trace,
+                      const struct indexRequest *index)
+{
+    // Writing to the input itself is a sort in place: mapping the output
+    // would truncate the file under the input's mapping.
+    if (out && same_file(in, out))
+        out = NULL;
+    struct mappedFile src, dst;
+    if (map_input(in, out == NULL, &src) != 0)
+    {
+        perror(in);
+        return EXIT_FAILURE;
+    }
+    if (src.len % recordSize)
+    {
+        fprintf(stderr, "%s: size is not a multiple of %zu bytes.\n", in, recordSize);
+        unmap_file(&src, 0);
+        return EXIT_FAILURE;
+    }
+    struct mappedFile *target = &src;
+    if (out)
+    {
+        if (map_output(out, src.len, &dst) != 0)
+        {
+            perror(out);
+            unmap_file(&src, 0);
+            return EXIT_FAILURE;
+        }
+        if (src.len)
+            parallel_copy(dst.data, src.data, src.len, policy);
+        unmap_file(&src, 0);
+        target = &dst;
+    }
+
+    size_t n = target->len / recordSize;
+    if (trace_start(trace) != 0)
+    {
+        unmap_file(target, 0);
+        return EXIT_FAILURE;
+    }
+    double t0 = now();
+    int rc = sort_records(target->data, n, recordSize, key, algo, policy, timed);
+    double secs = now() - t0;
+    if (trace_finish(trace) != 0)
+        rc = -1;
+    else if (rc != 0)
+        perror("sort");
+    else
+    {
+        if (timed)
+            report_time(secs, n, recordSize);
+        rc = write_index(index, target->data, n, recordSize, policy, timed);
+    }
+    if (unmap_file(target, 0) != 0)
+    {
+        perror(out ? out : in);
+        rc = -1;
+    }
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    pthread_t left_thread, right_thread;
-    struct mergesortArgs leftArgs = {array, mid};
-    struct mergesortArgs rightArgs = {array + mid, n - mid};
+// Sort a text file of decimal ints; the result goes to out, or stdout.
+static int run_text(const char *in, const char *out, const char *algo,
+                    const struct sortPolicy *policy, int timed,
+                    const struct traceRequest *trace)
+{
+    struct mappedFile src;
+    if (map_input(in, 0, &src) != 0)
+    {
+        perror(in);
+        return EXIT_FAILURE;
+    }
+    int *array = NULL;
+    size_t n = 0;
+    double t0 = now();
+    int rc = parse_ints_text(src.data, src.len, &array, &n, policy);
+    double parseSecs = now() - t0;
+    unmap_file(&src, 0);
+    if (rc != 0)
+    {
+        perror(in);
+        return EXIT_FAILURE;
+    }
 
-    printf("Creating threads for left half of size %d and right half of size %d\n", mid, n - mid);
-    pthread_create(&left_thread, NULL, mergeSort, (void *)&leftArgs);
-    pthread_create(&right_thread, NULL, mergeSort, (void *)&rightArgs);
+    if (trace_start(trace) != 0)
+    {
+        free(array);
+        return EXIT_FAILURE;
+    }
+    t0 = now();
+    rc = sort_records(array, n, sizeof(int), RADIX_I32, algo, policy, timed);
+    double sortSecs = now() - t0;
+    if (trace_finish(trace) != 0 || rc != 0)
+    {
+        if (rc != 0)
+            perror("sort");
+        free(array);
+        return EXIT_FAILURE;
+    }
 
-    printf("Waiting for threads to finish\n");
-    pthread_join(left_thread, NULL);
-    pthread_join(right_thread, NULL);
+    int fd = out ? open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    struct textioStats st;
+    if (fd < 0 || write_ints_text(fd, array, n, '\n', policy, &st) != 0)
+        rc = -1;
+    if (out && fd >= 0 && close(fd) != 0)
+        rc = -1;
+    if (rc != 0)
+        perror(out ? out : "stdout");
+    else if (timed)
+    {
+        fprintf(stderr, "parse:  %.1f MB in %.3f s (%.1f MB/s)\n",
+                src.len / 1e6, parseSecs, src.len / parseSecs / 1e6);
+        report_time(sortSecs, n, sizeof(int));
+        fprintf(stderr, "format: %.1f MB in %.3f s (%.1f MB/s), write %.3f s\n",
+                st.bytes / 1e6, st.formatSeconds, st.bytes / st.formatSeconds / 1e6,
+                st.ioSeconds);
+    }
+    free(array);
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Merge the sorted halves
-    int *temp = malloc(n * sizeof(int));
-    if (!temp)
+// Sort the lines of a text file as strings; the result goes to out, or
+// stdout.
+static int run_lines(const char *in, const char *out, const struct sortPolicy *policy,
+                     int timed)
+{
+    struct mappedFile src;
+    if (map_input(in, 0, &src) != 0)
+    {
+        perror(in);
+        return EXIT_FAILURE;
+    }
+    struct strArena arena;
+    str_arena_init(&arena);
+    double t0 = now();
+    int rc = str_arena_add_lines(&arena, src.data, src.len);
+    double loadSecs = now() - t0;
+    unmap_file(&src, 0);
+    if (rc != 0)
+    {
+        perror(in);
+        str_arena_free(&arena);
+        return EXIT_FAILURE;
+    }
+
+    t0 = now();
+    if (string_sort(arena.data, arena.offset, arena.n, policy) != 0)
+    {
+        perror("sort");
+        str_arena_free(&arena);
+        return EXIT_FAILURE;
+    }
+    double sortSecs = now() - t0;
+
+    t0 = now();
+    FILE *f = out ? fopen(out, "w") : stdout;
+    if (f)
+    {
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+        for (size_t i = 0; i < arena.n && rc == 0; i++)
+            if (fputs(arena.data + arena.offset[i], f) == EOF || putc('\n', f) == EOF)
+                rc = -1;
+        if ((out ? fclose(f) : fflush(f)) != 0)
+            rc = -1;
+    }
+    if (!f || rc != 0)
+        perror(out ? out : "stdout");
+    else if (timed)
+    {
+        fprintf(stderr, "load:   %zu lines, %.1f MB in %.3f s\n", arena.n, arena.len / 1e6,
+                loadSecs);
+        report_time(sortSecs, arena.n, sizeof(size_t));
+        fprintf(stderr, "write:  %.3f s\n", now() - t0);
+    }
+    rc = f && rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    str_arena_free(&arena);
+    return rc;
+}
+
+// Sort the rows of a CSV file by composite keys; the result goes to out,
+// or stdout.
+static int run_csv(const char *in, const char *out, const char *keySpec, int header,
+                   const struct sortPolicy *policy, int timed)
+{
+    struct mappedFile src;
+    if (map_input(in, 0, &src) != 0)
+    {
+        perror(in);
+        return EXIT_FAILURE;
+    }
+    struct csvTable t;
+    // Rows are reported counting the header, as an editor would show them.
+    size_t rowBase = header ? 2 : 1;
+    double t0 = now();
+    if (csv_parse(src.data, src.len, header, &t, policy) != 0)
+    {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: row %zu: bad quoting or wrong number of fields\n", in,
+                    t.badRow + rowBase);
+        else
+            perror(in);
+        unmap_file(&src, 0);
+        return EXIT_FAILURE;
+    }
+    double parseSecs = now() - t0;
+
+    int rc = EXIT_FAILURE;
+    struct csvKey keys[CSV_MAX_KEYS];
+    struct csvSortStats st;
+    int nKeys = csv_parse_keys(keySpec, &t, keys, CSV_MAX_KEYS);
+    size_t *perm = malloc(t.rows * sizeof(size_t) + 1);
+    int fd = -1;
+    // The fields point into the mapped input, so output to the input file
+    // goes to a temporary file first, renamed over the input at the end.
+    char tmp[4096] = "";
+    if (out && same_file(in, out))
+    {
+        if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", out) >= (int)sizeof(tmp))
+        {
+            errno = ENAMETOOLONG;
+            perror(out);
+            tmp[0] = '\0';
+            goto done;
+        }
+    }
+    if (t.cols == 0)
+    {
+        rc = EXIT_SUCCESS; // empty file
+        goto done;
+    }
+    if (nKeys < 0)
+    {
+        fprintf(stderr, "Bad CSV keys: %s\n", keySpec);
+        goto done;
+    }
+    if (!perm)
     {
         perror("malloc");
+        goto done;
+    }
+    if (csv_sort(&t, keys, nKeys, perm, policy, &st) != 0)
+    {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: row %zu: key is not a number\n", in, st.badRow + rowBase);
+        else
+            perror("sort");
+        goto done;
+    }
+    t0 = now();
+    if (csv_gather(&t, perm, policy) != 0)
+    {
+        perror("gather");
+        goto done;
+    }
+    double gatherSecs = now() - t0;
+
+    t0 = now();
+    if (tmp[0])
+    {
+        fd = mkstemp(tmp);
+        if (fd >= 0)
+            fchmod(fd, 0644);
+        else
+            tmp[0] = '\0';
+    }
+    else
+        fd = out ? open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (fd < 0 || csv_write(fd, &t, policy) != 0 || (out && close(fd) != 0) ||
+        (tmp[0] && rename(tmp, out) != 0))
+    {
+        perror(out ? out : "write");
+        goto done;
+    }
+    tmp[0] = '\0';
+    rc = EXIT_SUCCESS;
+    if (timed)
+    {
+        fprintf(stderr, "parse:  %zu rows, %zu columns, %.1f MB in %.3f s\n", t.rows, t.cols,
+                src.len / 1e6, parseSecs);
+        fprintf(stderr, "keys:   %zu bytes each, encoded in %.3f s\n", st.keyBytes,
+                st.encodeSeconds);
+        report_time(st.sortSeconds, t.rows, st.keyBytes);
+        fprintf(stderr, "engine: %s%s\n", st.radix ? "radix" : "merge",
+                st.tieRuns ? ", with cut string keys re-sorted in full" : "");
+        fprintf(stderr, "gather: %.3f s\nwrite:  %.3f s\n", gatherSecs, now() - t0);
+    }
+
+done:
+    if (tmp[0])
+        unlink(tmp);
+    free(perm);
+    csv_free(&t);
+    unmap_file(&src, 0);
+    return rc;
+}
+
+// Print a labelled array on stdout through the fast formatter.
+static void print_array(const char *label, const int *array, size_t n,
+                        const struct sortPolicy *policy)
+{
+    printf("%s\n", label);
+    fflush(stdout);
+    if (write_ints_text(STDOUT_FILENO, array, n, ' ', policy, NULL) != 0)
+        perror("write");
+    printf("\n");
+}
+
+// print_array for keys of any --key type; only ints have a fast formatter.
+static void print_keys(const char *label, const void *array, size_t n, enum radixKey key,
+                       const struct sortPolicy *policy)
+{
+    if (key == RADIX_I32)
+    {
+        print_array(label, array, n, policy);
         return;
     }
-    int i = 0, j = mid, k = 0;
-    while (i < mid && j < n)
+    printf("%s\n", label);
+    for (size_t i = 0; i < n; i++)
     {
-        if (array[i] < array[j])
-            temp[k++] = array[i++];
+        const char *p = (const char *)array + i * 8;
+        if (key == RADIX_I64)
+        {
+            int64_t v;
+            memcpy(&v, p, sizeof(v));
+            printf("%lld ", (long long)v);
+        }
+        else if (key == RADIX_U64)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            printf("%llu ", (unsigned long long)v);
+        }
         else
-            temp[k++] = array[j++];
+        {
+            double v;
+            memcpy(&v, p, sizeof(v));
+            printf("%.17g ", v);
+        }
+    }
+    printf("\n");
+}
+
+// --top and --percentile on a generated array: selection in O(n) instead
+// of a full sort. Percentiles are read before the partial sort moves
+// anything.
+static int run_select(int *array, size_t n, size_t topK, const double *pct,
+                      int nPct, const struct sortPolicy *policy, int timed)
+{
+    for (int i = 0; i < nPct; i++)
+    {
+        int value;
+        double t0 = now();
+        if (parallel_nth_element(array, n, sizeof(int), psort_cmp_int, NULL,
+                                 percentile_rank(pct[i], n), &value, policy) != 0)
+        {
+            perror("nth_element");
+            return EXIT_FAILURE;
+        }
+        if (timed)
+            fprintf(stderr, "percentile %g of %zu elements in %.3f s\n", pct[i], n, now() - t0);
+        printf("p%g: %d\n", pct[i], value);
+    }
+    if (topK == 0)
+        return EXIT_SUCCESS;
+
+    if (topK > n)
+        topK = n;
+    double t0 = now();
+    if (parallel_partial_sort(array, n, sizeof(int), psort_cmp_int, NULL, topK, policy) != 0)
+    {
+        perror("partial_sort");
+        return EXIT_FAILURE;
     }
-    // Copy any remaining elements from either half
-    while (i < mid)
-        temp[k++] = array[i++];
-    while (j < n)
-        temp[k++] = array[j++];
-    // Copy the merged elements back into the original array
-    for (i = 0; i < n; i++)
-        array[i] = temp[i];
-    free(temp);
+    double secs = now() - t0;
+    if (timed)
+        fprintf(stderr, "smallest %zu of %zu elements in %.3f s (%.1f M elements/s)\n",
+                topK, n, secs, n / secs / 1e6);
+    char label[64];
+    snprintf(label, sizeof(label), "Smallest %zu:", topK);
+    print_array(label, array, topK, policy);
+    return EXIT_SUCCESS;
+}
+
+// --group on a generated array: a fused sort-and-combine, printing the
+// unique keys, or each key with its count or sum.
+static int run_group(int *array, size_t n, enum groupMode mode, const struct genSpec *spec,
+                     const struct sortPolicy *policy, int timed)
+{
+    size_t groups;
+    if (mode == GROUP_UNIQUE)
+    {
+        double t0 = now();
+        if (parallel_sort_reduce(array, n, sizeof(int), psort_cmp_int, NULL, NULL, &groups,
+                                 policy) != 0)
+        {
+            perror("sort");
+            return EXIT_FAILURE;
+        }
+        if (timed)
+            fprintf(stderr, "grouped %zu elements into %zu keys in %.3f s\n", n, groups,
+                    now() - t0);
+        print_array("Unique keys:", array, groups, policy);
+        return EXIT_SUCCESS;
+    }
+
+    struct keyValue *kv = malloc(n * sizeof(*kv));
+    int *values = mode == GROUP_SUM ? malloc(n * sizeof(int)) : NULL;
+    struct genSpec valueSpec = *spec;
+    valueSpec.seed++;
+    if (!kv || (mode == GROUP_SUM && (!values || gen_fill_int(values, n, &valueSpec, policy) != 0)))
+    {
+        perror("group");
+        free(kv);
+        free(values);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < n; i++)
+        kv[i] = (struct keyValue){array[i], values ? values[i] : 1};
+    free(values);
+
+    double t0 = now();
+    if (parallel_sort_reduce(kv, n, sizeof(*kv), psort_cmp_int, psort_combine_add, NULL,
+                             &groups, policy) != 0)
+    {
+        perror("sort");
+        free(kv);
+        return EXIT_FAILURE;
+    }
+    if (timed)
+        fprintf(stderr, "grouped %zu elements into %zu keys in %.3f s\n", n, groups, now() - t0);
+    printf("Groups (key %s):\n", mode == GROUP_SUM ? "sum" : "count");
+    for (size_t i = 0; i < groups; i++)
+        printf("%d %lld\n", kv[i].key, (long long)kv[i].value);
+    free(kv);
+    return EXIT_SUCCESS;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// --store on a generated array: append it batch by batch to a run store,
+// timing a few random range queries after each batch, then print the
+// store's contents from a full scan.
+static int run_store(const int *array, size_t n, size_t batch, enum runMergePolicy mergePolicy,
+                     const struct genSpec *spec, const struct sortPolicy *policy)
+{
+    struct runStoreConfig cfg = {sizeof(int), psort_cmp_int, NULL, mergePolicy, 4, 0, policy};
+    struct runStore *rs = run_store_open(&cfg);
+    size_t batches = (n + batch - 1) / batch;
+    double *lat = malloc(batches * STORE_QUERIES * sizeof(*lat));
+    int *out = malloc(n * sizeof(int));
+    if (!rs || !lat || !out)
+    {
+        perror("store");
+        if (rs)
+            run_store_close(rs);
+        free(lat);
+        free(out);
+        return EXIT_FAILURE;
+    }
+
+    struct genRng rng;
+    gen_rng_seed(&rng, spec->seed, 1);
+    int span = (int)(((double)spec->hi - spec->lo) * STORE_QUERY_SPAN);
+    size_t queries = 0, hits = 0;
+    double appendSecs = 0;
+    int rc = 0;
+    for (size_t at = 0; at < n && rc == 0; at += batch)
+    {
+        size_t len = n - at < batch ? n - at : batch;
+        double t0 = now();
+        rc = run_store_append(rs, array + at, len);
+        appendSecs += now() - t0;
+        for (int q = 0; q < STORE_QUERIES && rc == 0; q++)
+        {
+            // The range can be wider than INT_MAX, so offset it in 64 bits.
+            uint64_t range = (uint64_t)((int64_t)spec->hi - spec->lo) + 1;
+            int lo = (int)((int64_t)spec->lo + (int64_t)(gen_rng_next(&rng) % range));
+            int hi = lo > INT_MAX - span ? INT_MAX : lo + span;
+            t0 = now();
+            size_t got = run_store_scan(rs, &lo, &hi, out, n);
+            lat[queries++] = now() - t0;
+            if (got == (size_t)-1)
+                rc = -1;
+            else
+                hits += got;
+        }
+    }
+    double t0 = now();
+    run_store_wait_idle(rs);
+    double drainSecs = now() - t0;
+    int lo = INT_MIN, hi = INT_MAX;
+    size_t got = rc == 0 ? run_store_scan(rs, &lo, &hi, out, n) : 0;
+    if (rc != 0 || got != n)
+    {
+        perror("store");
+        run_store_close(rs);
+        free(lat);
+        free(out);
+        return EXIT_FAILURE;
+    }
+
+    struct runStoreStats st;
+    run_store_stats(rs, &st);
+    qsort(lat, queries, sizeof(*lat), cmp_double);
+    fprintf(stderr,
+            "store: %zu batches of %zu (%s, fanout %d), append %.3f s (%.1f M elements/s), "
+            "merges drained in %.3f s more\n"
+            "  %zu runs on %d levels; %llu merges, %.3f s merging, %.3f s appends stalled\n"
+            "  write amplification %.2f (%llu elements written for %llu appended)\n"
+            "  range query of width %d: p50 %.1f us, p99 %.1f us, max %.1f us "
+            "(%zu queries, %.0f elements each)\n",
+            batches, batch, mergePolicy == RUNS_TIERED ? "tiered" : "levelled", cfg.fanout,
+            appendSecs, n / appendSecs / 1e6, drainSecs, st.runs, st.levels,
+            (unsigned long long)st.merges, st.mergeSeconds, st.stallSeconds,
+            (double)st.written / st.appended, (unsigned long long)st.written,
+            (unsigned long long)st.appended, span, lat[queries / 2] * 1e6,
+            lat[queries * 99 / 100] * 1e6, lat[queries - 1] * 1e6, queries,
+            (double)hits / queries);
+    run_store_close(rs);
+    print_array("Sorted array:", out, n, policy);
+    free(lat);
+    free(out);
+    return EXIT_SUCCESS;
+}
+
+static int run_external(const char *in, const char *out, size_t recordSize,
+                        size_t mem, const char *tmpDir,
+                        const struct sortPolicy *policy)
+{
+    struct extsortConfig cfg = {recordSize, psort_cmp_int, NULL, mem, tmpDir, policy};
+    struct extsortStats st;
+    if (external_sort(in, out, &cfg, &st) != 0)
+    {
+        perror("external_sort");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr,
+            "external sort: %zu records, %zu runs, %d merge passes\n"
+            "  I/O: %.3f s (read %.1f MB, wrote %.1f MB)\n"
+            "  CPU: %.3f s\n",
+            st.records, st.runs, st.mergePasses, st.ioSeconds,
+            st.bytesRead / 1e6, st.bytesWritten / 1e6, st.cpuSeconds);
+    return EXIT_SUCCESS;
+}
+
+// Tune on this host and save the result as its section of the profile.
+static int run_autotune(const char *path, const char *nArg, const struct genSpec *spec)
+{
+    char buf[4096];
+    if (!path)
+        path = sort_profile_path(buf, sizeof(buf));
+    if (!path || !strcmp(path, "none"))
+    {
+        fprintf(stderr, "--autotune needs a --profile file to write.\n");
+        return EXIT_FAILURE;
+    }
+    struct autotuneOptions opt = {(size_t)4 << 20, *spec, 3, stderr};
+    if (nArg && parse_count(nArg, &opt.n) != 0)
+    {
+        fprintf(stderr, "Number of elements must be positive.\n");
+        return EXIT_FAILURE;
+    }
+    struct sortProfile p;
+    double t0 = now();
+    if (sort_autotune(&opt, &p) != 0)
+    {
+        perror("autotune");
+        return EXIT_FAILURE;
+    }
+    if (sort_profile_save(path, &p) != 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "tuned in %.1f s, saved to %s\n", now() - t0, path);
+    sort_profile_print(stdout, &p);
+    return EXIT_SUCCESS;
+}
+
+// Apply this host's profile, if there is one, to the settings not given
+// on the command line. A profile named with --profile must exist.
+static int load_profile(const char *path, struct sortPolicy *policy, unsigned keep, int timed)
+{
+    char buf[4096];
+    int named = path != NULL;
+    if (!path)
+        path = sort_profile_path(buf, sizeof(buf));
+    if (!path || !strcmp(path, "none"))
+        return 0;
+    struct sortProfile p;
+    if (sort_profile_load(path, &p) != 0)
+    {
+        if ((errno == ENOENT || errno == ENODATA) && !named)
+            return 0;
+        if (errno == ENODATA)
+            fprintf(stderr, "%s: no profile for %s (run --autotune)\n", path, p.cpu);
+        else
+            perror(path);
+        return -1;
+    }
+    sort_profile_apply(&p, policy, keep);
+    if (timed)
+        fprintf(stderr, "using profile %s\n", path);
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    const char *algo = "auto";
+    const char *inPath = NULL, *outPath = NULL, *tmpDir = NULL, *csvKeys = NULL;
+    int csvHeader = 0;
+    int external = 0, timed = 0, text = 0, lines = 0, numa = 0, nPct = 0;
+    size_t topK = 0, storeBatch = 0;
+    enum runMergePolicy storePolicy = RUNS_TIERED;
+    enum groupMode group = GROUP_NONE;
+    struct traceRequest trace = {NULL, NULL, {0, 0, 0}};
+    struct indexRequest index = {NULL, {0, 0}};
+    sorted_file_options_init(&index.opt);
+    double pct[MAX_PERCENTILES];
+    size_t mem = (size_t)256 << 20, recordSize = 0;
+    enum radixKey key = RADIX_I32;
+    int quiet = 0;
+    struct sortPolicy policy;
+    sort_policy_init(&policy);
+    policy.strategy = SORT_AUTO;
+    const char *profilePath = NULL;
+    unsigned profileKeep = 0; // settings given on the command line
+    int autotune = 0;
+    struct genSpec spec;
+    gen_spec_init(&spec);
+
+    static const struct option longopts[] = {
+        {"algo", required_argument, NULL, 'a'},
+        {"threads", required_argument, NULL, 't'},
+        {"strategy", required_argument, NULL, 's'},
+        {"time", no_argument, NULL, 'v'},
+        {"autotune", no_argument, NULL, 'A'},
+        {"profile", required_argument, NULL, 'F'},
+        {"external", no_argument, NULL, 'e'},
+        {"in", required_argument, NULL, 'i'},
+        {"out", required_argument, NULL, 'o'},
+        {"mem", required_argument, NULL, 'm'},
+        {"tmpdir", required_argument, NULL, 'T'},
+        {"csv", required_argument, NULL, 'C'},
+        {"csv-header", no_argument, NULL, 'E'},
+        {"record-size", required_argument, NULL, 'r'},
+        {"key", required_argument, NULL, 'K'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"text", no_argument, NULL, 'x'},
+        {"lines", no_argument, NULL, 'l'},
+        {"dist", required_argument, NULL, 'd'},
+        {"range", required_argument, NULL, 'R'},
+        {"seed", required_argument, NULL, 'S'},
+        {"numa", no_argument, NULL, 'N'},
+        {"huge", no_argument, NULL, 'H'},
+        {"top", required_argument, NULL, 'k'},
+        {"percentile", required_argument, NULL, 'p'},
+        {"group", required_argument, NULL, 'g'},
+        {"store", required_argument, NULL, 'L'},
+        {"store-policy", required_argument, NULL, 'P'},
+        {"index", required_argument, NULL, 'I'},
+        {"block", required_argument, NULL, 'b'},
+        {"bloom", required_argument, NULL, 'B'},
+        {"trace", required_argument, NULL, 'j'},
+        {"chrome-trace", required_argument, NULL, 'J'},
+        {"trace-counters", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:t:s:vAF:ei:o:m:T:C:Er:K:qxld:R:S:NHk:p:g:L:P:I:b:B:j:J:c", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            algo = optarg;
+            break;
+        case 't':
+            policy.threads = atoi(optarg);
+            profileKeep |= SORT_PROFILE_KEEP_THREADS;
+            break;
+        case 's':
+            if (!strcmp(optarg, "binary"))
+                policy.strategy = SORT_BINARY;
+            else if (!strcmp(optarg, "multiway"))
+                policy.strategy = SORT_MULTIWAY;
+            else if (!strcmp(optarg, "natural"))
+                policy.strategy = SORT_NATURAL;
+            else if (!strcmp(optarg, "sample"))
+                policy.strategy = SORT_SAMPLE;
+            else if (!strcmp(optarg, "inplace"))
+                policy.strategy = SORT_INPLACE;
+            else if (!strcmp(optarg, "auto"))
+                policy.strategy = SORT_AUTO;
+            else
+            {
+                fprintf(stderr, "Unknown strategy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            profileKeep |= SORT_PROFILE_KEEP_STRATEGY;
+            break;
+        case 'v':
+            timed = 1;
+            break;
+        case 'A':
+            autotune = 1;
+            break;
+        case 'F':
+            profilePath = optarg;
+            break;
+        case 'e':
+            external = 1;
+            break;
+        case 'i':
+            inPath = optarg;
+            break;
+        case 'o':
+            outPath = optarg;
+            break;
+        case 'm':
+            mem = parse_size(optarg);
+            break;
+        case 'T':
+            tmpDir = optarg;
+            break;
+        case 'C':
+            csvKeys = optarg;
+            break;
+        case 'E':
+            csvHeader = 1;
+            break;
+        case 'r':
+            recordSize = parse_size(optarg);
+            break;
+        case 'K':
+            if (!strcmp(optarg, "int"))
+                key = RADIX_I32;
+            else if (!strcmp(optarg, "int64"))
+                key = RADIX_I64;
+            else if (!strcmp(optarg, "uint64"))
+                key = RADIX_U64;
+            else if (!strcmp(optarg, "double"))
+                key = RADIX_F64;
+            else
+            {
+                fprintf(stderr, "Unknown key type: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'x':
+            text = 1;
+            break;
+        case 'l':
+            lines = 1;
+            break;
+        case 'd':
+            if (gen_dist_parse(optarg, &spec.dist) != 0)
+            {
+                fprintf(stderr, "Unknown distribution: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            if (sscanf(optarg, "%d:%d", &spec.lo, &spec.hi) != 2 || spec.lo > spec.hi)
+            {
+                fprintf(stderr, "Bad range: %s (want LO:HI)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            spec.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'N':
+            numa = 1;
+            break;
+        case 'H':
+            policy.hugePages = 1;
+            break;
+        case 'g':
+            if (!strcmp(optarg, "unique"))
+                group = GROUP_UNIQUE;
+            else if (!strcmp(optarg, "count"))
+                group = GROUP_COUNT;
+            else if (!strcmp(optarg, "sum"))
+                group = GROUP_SUM;
+            else
+            {
+                fprintf(stderr, "Unknown grouping: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            storeBatch = strtoull(optarg, NULL, 10);
+            break;
+        case 'P':
+            if (!strcmp(optarg, "tiered"))
+                storePolicy = RUNS_TIERED;
+            else if (!strcmp(optarg, "levelled"))
+                storePolicy = RUNS_LEVELLED;
+            else
+            {
+                fprintf(stderr, "Unknown store policy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+            index.path = optarg;
+            break;
+        case 'b':
+            index.opt.blockBytes = parse_size(optarg);
+            break;
+        case 'B':
+            index.opt.bloomBits = atoi(optarg);
+            break;
+        case 'j':
+            trace.json = optarg;
+            break;
+        case 'J':
+            trace.chrome = optarg;
+            break;
+        case 'c':
+            trace.opt.counters = 1;
+            break;
+        case 'k':
+            topK = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            for (char *q = strtok(optarg, ","); q; q = strtok(NULL, ","))
+            {
+                char *end;
+                double v = strtod(q, &end);
+                if (*end || v < 0 || v > 100 || nPct == MAX_PERCENTILES)
+                {
+                    fprintf(stderr, "Bad percentile: %s\n", q);
+                    return EXIT_FAILURE;
+                }
+                pct[nPct++] = v;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (autotune)
+        return run_autotune(profilePath, optind < argc ? argv[optind] : NULL, &spec);
+    if (load_profile(profilePath, &policy, profileKeep, timed) != 0)
+        return EXIT_FAILURE;
+    trace.opt.threads = sort_policy_threads(&policy);
+    if (strcmp(algo, "auto") && strcmp(algo, "merge") && strcmp(algo, "radix") &&
+        strcmp(algo, "process"))
+    {
+        fprintf(stderr, "Unknown algorithm: %s\n", algo);
+        return EXIT_FAILURE;
+    }
+
+    if (recordSize == 0)
+        recordSize = radix_key_size(key);
+    if (recordSize < radix_key_size(key))
+    {
+        fprintf(stderr, "Records must be at least %zu bytes.\n", radix_key_size(key));
+        return EXIT_FAILURE;
+    }
+    if (!strcmp(algo, "process") && (text || numa))
+    {
+        fprintf(stderr, "--algo process sorts generated input and binary --in files.\n");
+        return EXIT_FAILURE;
+    }
+    if (key != RADIX_I32 && (external || lines || text || csvKeys || numa || index.path ||
+                             group != GROUP_NONE || storeBatch > 0 || topK > 0 || nPct > 0))
     {
-        fprintf(stderr, "Usage: %s <number_of_elements>\n", argv[0]);
+        fprintf(stderr, "--key covers plain sorts of generated input and --in records.\n");
         return EXIT_FAILURE;
     }
-    int n = atoi(argv[1]);
-    if (n <= 0)
+    if (csvKeys && (!inPath || external || lines || text))
+    {
+        fprintf(stderr, "--csv sorts an --in file on its own.\n");
+        return EXIT_FAILURE;
+    }
+    if ((trace.json || trace.chrome) && (external || lines || csvKeys))
+    {
+        fprintf(stderr, "--trace covers the in-memory int sorts only.\n");
+        return EXIT_FAILURE;
+    }
+    // Only the merge engine is instrumented: auto would pick radix sort
+    // for large arrays and leave the trace empty.
+    if ((trace.json || trace.chrome) && (!strcmp(algo, "radix") || !strcmp(algo, "process")))
+    {
+        fprintf(stderr, "--trace follows the merge engine; --algo %s has no trace points.\n",
+                algo);
+        return EXIT_FAILURE;
+    }
+    if (trace.json || trace.chrome)
+        algo = "merge";
+    if (index.path && (external || lines || text || csvKeys || group != GROUP_NONE || storeBatch > 0 ||
+                       topK > 0 || nPct > 0 || numa))
+    {
+        fprintf(stderr, "--index needs a plain sort of binary records.\n");
+        return EXIT_FAILURE;
+    }
+    if (index.path && (index.opt.blockBytes < recordSize || index.opt.bloomBits < 0))
+    {
+        fprintf(stderr, "--block must hold a record and --bloom be at least 0.\n");
+        return EXIT_FAILURE;
+    }
+    if (external)
+    {
+        if (!inPath || !outPath || optind != argc)
+            usage(argv[0]);
+        return run_external(inPath, outPath, recordSize, mem, tmpDir, &policy);
+    }
+    if (inPath)
+    {
+        if (optind != argc)
+            usage(argv[0]);
+        if (csvKeys)
+            return run_csv(inPath, outPath, csvKeys, csvHeader, &policy, timed);
+        if (lines)
+            return run_lines(inPath, outPath, &policy, timed);
+        if (text)
+            return run_text(inPath, outPath, algo, &policy, timed, &trace);
+        return run_mapped(inPath, outPath, recordSize, key, algo, &policy, timed, &trace, &index);
+    }
+    if (outPath || optind != argc - 1)
+        usage(argv[0]);
+    size_t n, keySize = radix_key_size(key);
+    if (parse_count(argv[optind], &n) != 0)
     {
         fprintf(stderr, "Number of elements must be positive.\n");
         return EXIT_FAILURE;
     }
+    if (n > SIZE_MAX / keySize)
+    {
+        fprintf(stderr, "Too many elements: %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
 
-    int *array = malloc(n * sizeof(int));
+    // With --numa the array is first-touched node by node, so that each
+    // partition lives on the node whose threads will sort it.
+    // The process engine's workers see only shared memory.
+    struct sortBuf buf = {NULL, 0, 0, BUF_HEAP};
+    void *array = NULL;
+    int shared = !strcmp(algo, "process");
+    if (numa)
+        array = node_alloc(n, sizeof(int), &policy);
+    else if (shared)
+        array = proc_shared_alloc(n * keySize);
+    else if (sort_buf_alloc(&buf, n * keySize, &policy) == 0)
+        array = buf.data;
     if (!array)
     {
         perror("malloc");
         return EXIT_FAILURE;
     }
 
-    // Initialize array with random integers
-    for (int i = 0; i < n; i++)
+    // Initialize array with random keys, in parallel. The same seed gives
+    // the same array whatever the thread count.
+    double tg = now();
+    if (gen_fill_key(array, n, key, &spec, &policy) != 0)
     {
-        array[i] = rand() % 1000; // Random integers between 0 and 999
+        perror("generate");
+        free_array(array, n, keySize, numa, shared, &buf);
+        return EXIT_FAILURE;
     }
+    if (timed)
+        fprintf(stderr, "generated %zu elements in %.3f s\n", n, now() - tg);
 
-    // Print unsorted array
-    printf("Unsorted array:\n");
-    for (int i = 0; i < n; i++)
+    if (!quiet)
+        print_keys("Unsorted array:", array, n, key, &policy);
+
+    if (group != GROUP_NONE || storeBatch > 0 || topK > 0 || nPct > 0)
     {
-        printf("%d ", array[i]);
+        int rc;
+        if (group != GROUP_NONE)
+            rc = run_group(array, n, group, &spec, &policy, timed);
+        else if (storeBatch > 0)
+            rc = run_store(array, n, storeBatch, storePolicy, &spec, &policy);
+        else
+            rc = run_select(array, n, topK, pct, nPct, &policy, timed);
+        free_array(array, n, keySize, numa, shared, &buf);
+        return rc;
     }
-    printf("\n");
 
-    // Perform merge sort
-    struct mergesortArgs args = {array, n};
-    mergeSort((void *)&args);
+    // Perform the sort. Radix sort wins on large integer arrays; the merge
+    // engine is used for small ones or when asked for explicitly.
+    if (trace_start(&trace) != 0)
+    {
+        free_array(array, n, keySize, numa, shared, &buf);
+        return EXIT_FAILURE;
+    }
 
-    // Print sorted array
-    printf("Sorted array:\n");
-    for (int i = 0; i < n; i++)
+    // Counters must be open before the sort starts its threads.
+    struct perfCounters pc;
+    if (timed)
     {
-        printf("%d ", array[i]);
+        perfctr_open(&pc, (1u << PERF_EVENTS) - 1);
+        perfctr_start(&pc);
     }
-    printf("\n");
+    double t0 = now();
+    struct nodeStats nodeStats;
+    int rc = numa ? node_merge_sort(array, n, sizeof(int), psort_cmp_int, NULL,
+                                    &policy, &nodeStats)
+                  : sort_records(array, n, keySize, key, algo, &policy, timed);
+    double secs = now() - t0;
+    if (timed)
+        perfctr_stop(&pc);
+    if (trace_finish(&trace) != 0)
+        rc = -1;
+    else if (rc != 0)
+        perror("sort");
+    else if (timed)
+    {
+        report_time(secs, n, keySize);
+        report_counters(&pc, n, numa     ? (policy.hugePages ? "numa+thp" : "numa")
+                                : shared ? "shared"
+                                         : sort_buf_kind(buf.kind));
+        if (numa)
+            report_nodes(&nodeStats, sizeof(int));
+    }
+    if (rc == 0)
+        rc = write_index(&index, array, n, sizeof(int), &policy, timed);
+    if (timed)
+        perfctr_close(&pc);
 
-    free(array);
-    return EXIT_SUCCESS;
+    if (!quiet)
+        print_keys("Sorted array:", array, n, key, &policy);
+
+    free_array(array, n, keySize, numa, shared, &buf);
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
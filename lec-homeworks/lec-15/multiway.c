@@ -0,0 +1,466 @@
+// multiway.c
+// Multiway merge sort strategy. The array is cut into blocks that fit in
+// cache and each block is sorted there. The sorted blocks (runs) are then
+// merged K at a time through a loser tree. With K in the hundreds, a
+// billion elements need two or three passes through DRAM instead of the
+// log2(n / block) passes of a binary merge.
+//
+// A merge pass is split into tasks. Each group of K runs is cut into parts
+// at splitter elements sampled from its runs, and the team takes tasks off
+// a shared counter, so even the last pass (a single group) keeps every
+// thread busy.
+
+#define _GNU_SOURCE
+#include "psort_impl.h"
+#include "team.h"
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Samples drawn per part when choosing splitters.
+#define MW_OVERSAMPLE 8
+
+struct mwTask
+{
+    size_t *lo, *hi; // per-run bounds of this part (k entries each)
+    int k;           // runs in the group
+    char *out;
+};
+
+struct mwShared
+{
+    const struct sortCtx *sc;
+    char *src, *dst;
+    size_t n;
+    size_t blockElems;
+    struct mwTask *tasks;
+    size_t ntasks;
+    size_t next; // next task to claim
+    int failed;  // a merge task ran out of memory
+};
+
+// ---------------------------------------------------------------------------
+// Loser tree over k runs. Leaves past k, and runs that are used up, lose
+// against everything. Ties go to the lower run index, which keeps the merge
+// stable because runs are numbered in input order.
+//
+// For int elements each leaf carries its head as one 64-bit key: the int,
+// offset to unsigned, above the run index. A single unsigned comparison
+// then orders by element and breaks ties by run, an exhausted leaf is
+// UINT64_MAX, and the replay up the tree needs no branches.
+
+struct loserTree
+{
+    const struct sortCtx *sc;
+    const char **head; // NULL once the run is used up
+    const char **end;
+    int *node; // node[0] holds the winner, node[1..cap) the losers
+    int cap;   // leaves, a power of two
+};
+
+static int lt_beats(const struct loserTree *lt, int a, int b)
+{
+    if (!lt->head[a])
+        return 0;
+    if (!lt->head[b])
+        return 1;
+    int c = lt->sc->cmp(lt->head[a], lt->head[b], lt->sc->ctx);
+    return c < 0 || (c == 0 && a < b);
+}
+
+static uint64_t lt_key(const struct loserTree *lt, int i)
+{
+    if (!lt->head[i])
+        return UINT64_MAX;
+    return (uint64_t)((uint32_t)*(const int *)lt->head[i] ^ 0x80000000u) << 32 | (uint32_t)i;
+}
+
+static void lt_build(struct loserTree *lt, int *win)
+{
+    for (int i = 0; i < lt->cap; i++)
+        win[lt->cap + i] = i;
+    for (int v = lt->cap - 1; v >= 1; v--)
+    {
+        int a = win[2 * v], b = win[2 * v + 1];
+        if (lt_beats(lt, a, b))
+        {
+            win[v] = a;
+            lt->node[v] = b;
+        }
+        else
+        {
+            win[v] = b;
+            lt->node[v] = a;
+        }
+    }
+    lt->node[0] = win[1];
+}
+
+// Advance the winner's run past the element just taken.
+static void lt_advance(struct loserTree *lt, int w)
+{
+    lt->head[w] += lt->sc->size;
+    if (lt->head[w] == lt->end[w])
+        lt->head[w] = NULL;
+}
+
+static void merge_ints(struct loserTree *lt, uint64_t *key, size_t total, char *out)
+{
+    int cap = lt->cap, *node = lt->node;
+    for (int i = 0; i < cap; i++)
+        key[i] = lt_key(lt, i);
+    int *o = (int *)out;
+    for (size_t out_i = 0; out_i < total; out_i++)
+    {
+        int w = node[0];
+        o[out_i] = *(const int *)lt->head[w];
+        lt_advance(lt, w);
+        uint64_t kw = key[w] = lt_key(lt, w);
+        for (unsigned v = (unsigned)(w + cap) / 2; v >= 1; v /= 2)
+        {
+            // The loser stays and the winner moves up, by mask rather than
+            // by branch: which one wins is a coin toss on random input.
+            int l = node[v];
+            uint64_t kl = key[l];
+            int diff = (l ^ w) & -(kl < kw);
+            node[v] = l ^ diff;
+            w ^= diff;
+            kw = kl < kw ? kl : kw;
+        }
+        node[0] = w;
+    }
+}
+
+// Merge runs [head[i], end[i]) for i < k into out. Returns 0, or -1 if
+// memory for the tree runs out.
+static int loser_merge(const struct sortCtx *sc, const char **head,
+                       const char **end, int k, char *out)
+{
+    size_t size = sc->size;
+    if (k == 1)
+    {
+        memcpy(out, head[0], (size_t)(end[0] - head[0]));
+        return 0;
+    }
+    if (k == 2)
+    {
+        sc->ops->merge(head[0], (size_t)(end[0] - head[0]) / size, head[1],
+                       (size_t)(end[1] - head[1]) / size, out, sc);
+        return 0;
+    }
+
+    int cap = 1;
+    while (cap < k)
+        cap *= 2;
+    const char **h = malloc((size_t)cap * 2 * sizeof(*h));
+    int *mem = malloc((size_t)cap * 3 * sizeof(*mem));
+    uint64_t *key = sc->intKeys ? malloc((size_t)cap * sizeof(*key)) : NULL;
+    if (!h || !mem || (sc->intKeys && !key))
+    {
+        free(h);
+        free(mem);
+        free(key);
+        return -1;
+    }
+    struct loserTree lt = {sc, h, h + cap, mem, cap};
+    size_t total = 0;
+    for (int i = 0; i < cap; i++)
+    {
+        // Padding leaves and empty runs start out used up.
+        lt.head[i] = i < k && head[i] != end[i] ? head[i] : NULL;
+        lt.end[i] = i < k ? end[i] : NULL;
+        if (i < k)
+            total += (size_t)(end[i] - head[i]) / size;
+    }
+    lt_build(&lt, mem + cap);
+
+    if (key)
+        merge_ints(&lt, key, total, out);
+    else
+    {
+        for (size_t out_i = 0; out_i < total; out_i++)
+        {
+            int w = lt.node[0];
+            psort_move(out, lt.head[w], size);
+            out += size;
+            lt_advance(&lt, w);
+            // Replay the winner's path from its leaf to the root.
+            for (int v = (w + cap) / 2; v >= 1; v /= 2)
+            {
+                if (lt_beats(&lt, lt.node[v], w))
+                {
+                    int t = lt.node[v];
+                    lt.node[v] = w;
+                    w = t;
+                }
+            }
+            lt.node[0] = w;
+        }
+    }
+    free(h);
+    free(mem);
+    free(key);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Splitting a group of runs into parts.
+
+// First position in [lo, hi) whose element is > v (upper) or >= v (!upper).
+static size_t bound(const struct sortCtx *sc, const char *base, size_t lo,
+                    size_t hi, const char *v, int upper)
+{
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *e = base + mid * sc->size;
+        int goRight = upper ? !psort_less(sc, v, e) : psort_less(sc, e, v);
+        if (goRight)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+struct mwSample
+{
+    const struct sortCtx *sc;
+    const char *elem;
+    int run;
+};
+
+// Total order on samples: element, then run index, then position.
+static int sample_cmp(const void *pa, const void *pb, void *ctx)
+{
+    (void)ctx;
+    const struct mwSample *a = pa, *b = pb;
+    if (psort_less(a->sc, a->elem, b->elem))
+        return -1;
+    if (psort_less(a->sc, b->elem, a->elem))
+        return 1;
+    if (a->run != b->run)
+        return a->run < b->run ? -1 : 1;
+    return (a->elem > b->elem) - (a->elem < b->elem);
+}
+
+// Append the tasks for merging runs [r0, r0+k) of src into `parts` parts.
+// bounds holds (parts + 1) * k positions. Returns -1 on allocation failure.
+static int split_group(struct mwShared *sh, const size_t *runStart, size_t r0,
+                       int k, int parts, size_t *bounds)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size;
+    size_t groupLen = runStart[r0 + k] - runStart[r0];
+    if ((size_t)parts > groupLen / 4096 + 1)
+        parts = (int)(groupLen / 4096 + 1);
+
+    // Row p holds the per-run start positions of part p.
+    for (int j = 0; j < k; j++)
+    {
+        bounds[j] = runStart[r0 + j];
+        bounds[(size_t)parts * k + j] = runStart[r0 + j + 1];
+    }
+    if (parts > 1)
+    {
+        size_t per = (size_t)parts * MW_OVERSAMPLE / (size_t)k + 1;
+        size_t ns = 0;
+        struct mwSample *samples = malloc((size_t)k * per * sizeof(*samples));
+        if (!samples)
+            return -1;
+        for (int j = 0; j < k; j++)
+        {
+            size_t lo = runStart[r0 + j], len = runStart[r0 + j + 1] - lo;
+            for (size_t s = 0; s < per && s < len; s++)
+                samples[ns++] = (struct mwSample){sc, sh->src + (lo + (s * len) / per) * size, j};
+        }
+        struct sortPolicy one;
+        sort_policy_init(&one);
+        one.threads = 1;
+        parallel_merge_sort(samples, ns, sizeof(*samples), sample_cmp, NULL, &one);
+
+        for (int p = 1; p < parts; p++)
+        {
+            const struct mwSample *sp = &samples[(size_t)p * ns / (size_t)parts];
+            size_t *row = bounds + (size_t)p * k;
+            size_t *prev = row - k;
+            for (int j = 0; j < k; j++)
+            {
+                size_t lo = runStart[r0 + j], hi = runStart[r0 + j + 1];
+                if (j == sp->run)
+                    row[j] = (size_t)(sp->elem - sh->src) / size;
+                else
+                    row[j] = bound(sc, sh->src, lo, hi, sp->elem, j < sp->run);
+                if (row[j] < prev[j])
+                    row[j] = prev[j];
+            }
+        }
+        free(samples);
+    }
+
+    size_t out = runStart[r0];
+    for (int p = 0; p < parts; p++)
+    {
+        size_t *row = bounds + (size_t)p * k;
+        sh->tasks[sh->ntasks++] = (struct mwTask){row, row + k, k, sh->dst + out * size};
+        for (int j = 0; j < k; j++)
+            out += row[k + j] - row[j];
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Workers.
+
+static void block_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct mwShared *sh = arg;
+    size_t size = sh->sc->size;
+    size_t blocks = (sh->n + sh->blockElems - 1) / sh->blockElems;
+    for (size_t b = (size_t)id; b < blocks; b += (size_t)team->size)
+    {
+        size_t lo = b * sh->blockElems;
+        size_t len = sh->n - lo < sh->blockElems ? sh->n - lo : sh->blockElems;
+        psort_sort_serial(sh->sc, sh->src + lo * size, sh->dst + lo * size, len);
+    }
+}
+
+static void merge_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    (void)id;
+    struct mwShared *sh = arg;
+    size_t size = sh->sc->size;
+    for (;;)
+    {
+        size_t t = __atomic_fetch_add(&sh->next, 1, __ATOMIC_RELAXED);
+        if (t >= sh->ntasks)
+            break;
+        struct mwTask *task = &sh->tasks[t];
+        const char *head[task->k], *end[task->k];
+        for (int j = 0; j < task->k; j++)
+        {
+            head[j] = sh->src + task->lo[j] * size;
+            end[j] = sh->src + task->hi[j] * size;
+        }
+        if (loser_merge(sh->sc, head, end, task->k, task->out) != 0)
+            __atomic_store_n(&sh->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void copy_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct mwShared *sh = arg;
+    size_t size = sh->sc->size, lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+    memcpy(sh->dst + lo * size, sh->src + lo * size, (hi - lo) * size);
+}
+
+// Smallest fanout that still finishes in the fewest passes allowed by
+// maxFanout, so the passes are balanced.
+static int pick_fanout(size_t runs, int maxFanout)
+{
+    int passes = 0;
+    for (size_t r = runs; r > 1; r = (r + (size_t)maxFanout - 1) / (size_t)maxFanout)
+        passes++;
+    for (int k = 2; k < maxFanout; k++)
+    {
+        size_t reach = 1;
+        for (int p = 0; p < passes && reach < runs; p++)
+            reach *= (size_t)k;
+        if (reach >= runs)
+            return k;
+    }
+    return maxFanout;
+}
+
+int multiway_sort(const struct sortCtx *sc, char *base, size_t n,
+                  const struct sortPolicy *policy)
+{
+    size_t size = sc->size;
+    int threads = sort_policy_threads(policy);
+    int maxFanout = policy->fanout >= 2 ? policy->fanout : 2;
+    size_t blockElems = policy->blockBytes / size;
+    if (blockElems < sc->cutoff)
+        blockElems = sc->cutoff;
+
+    struct sortBuf scratchBuf;
+    if (sort_buf_alloc(&scratchBuf, n * size, policy) != 0)
+        return -1;
+    char *scratch = scratchBuf.data;
+    size_t nruns = (n + blockElems - 1) / blockElems;
+    size_t *runStart = malloc((nruns + 1) * sizeof(*runStart));
+    if (!runStart)
+    {
+        sort_buf_free(&scratchBuf);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct mwShared sh = {sc, base, scratch, n, blockElems, NULL, 0, 0, 0};
+    team_run(threads, block_worker, &sh);
+    for (size_t r = 0; r < nruns; r++)
+        runStart[r] = r * blockElems;
+    runStart[nruns] = n;
+
+    int rc = 0;
+    while (nruns > 1)
+    {
+        int k = pick_fanout(nruns, maxFanout);
+        size_t groups = (nruns + (size_t)k - 1) / (size_t)k;
+        int parts = groups >= (size_t)threads ? 1 : (int)(((size_t)threads + groups - 1) / groups);
+
+        sh.tasks = malloc(groups * (size_t)parts * sizeof(*sh.tasks));
+        size_t *bounds = malloc(groups * (size_t)(parts + 1) * (size_t)k * sizeof(*bounds));
+        if (!sh.tasks || !bounds)
+        {
+            free(sh.tasks);
+            free(bounds);
+            errno = ENOMEM;
+            rc = -1;
+            break;
+        }
+        sh.ntasks = 0;
+        sh.next = 0;
+        for (size_t g = 0; g < groups && rc == 0; g++)
+        {
+            size_t r0 = g * (size_t)k;
+            int kg = nruns - r0 < (size_t)k ? (int)(nruns - r0) : k;
+            rc = split_group(&sh, runStart, r0, kg, parts,
+                             bounds + g * (size_t)(parts + 1) * (size_t)k);
+        }
+        if (rc == 0)
+        {
+            team_run(threads, merge_worker, &sh);
+            rc = sh.failed ? -1 : 0;
+        }
+        free(sh.tasks);
+        free(bounds);
+        if (rc != 0)
+        {
+            // src still holds whole sorted runs; hand them back unmerged.
+            errno = ENOMEM;
+            break;
+        }
+
+        for (size_t g = 0; g < groups; g++)
+            runStart[g] = runStart[g * (size_t)k];
+        runStart[groups] = n;
+        nruns = groups;
+        char *t = sh.src;
+        sh.src = sh.dst;
+        sh.dst = t;
+    }
+
+    if (sh.src != base)
+    {
+        sh.dst = base;
+        team_run(threads, copy_worker, &sh);
+    }
+    sort_buf_free(&scratchBuf);
+    free(runStart);
+    return rc;
+}
@@ -0,0 +1,492 @@
+// natural.c
+// Adaptive natural-run merge sort strategy (TimSort-style).
+//
+// Each worker sorts one slice of the array on its own. It scans for
+// maximal runs that are already ascending, or strictly descending (those
+// are reversed in place; strictness keeps the sort stable). Runs shorter
+// than minrun are extended with binary insertion sort. Runs go on a stack
+// that is kept balanced by the usual TimSort invariants, and each merge
+// first gallops to trim the ends that are already in place, then copies
+// only the shorter side to scratch and switches to galloping when one
+// side keeps winning.
+//
+// The sorted slices are then merged pairwise, and those merges gallop too.
+// On input that is already nearly sorted the trims remove almost
+// everything, so the total work stays close to the O(n) run scan.
+//
+// A slice whose natural runs are only a few elements long on average has
+// no order to exploit, and the run bookkeeping only costs time; such a
+// slice goes to the engine's binary merge sort instead.
+
+#include "psort_impl.h"
+#include "team.h"
+#include "hugemem.h"
+#include "sorttrace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_GALLOP 7
+#define MAX_STACK 128
+// Smallest slice worth giving its own worker.
+#define NATURAL_MIN_SLICE 65536
+// Shorter natural runs on average mean a slice is sorted by binary merge.
+#define NATURAL_MIN_AVG_RUN 8
+
+struct tsRun
+{
+    size_t base, len;
+};
+
+struct tsState
+{
+    const struct sortCtx *sc;
+    char *a;   // slice being sorted
+    char *tmp; // scratch, at least half the slice
+    int minGallop;
+    int nruns;
+    struct tsRun runs[MAX_STACK];
+};
+
+#define AT(p, i) ((p) + (i) * size)
+
+// ---------------------------------------------------------------------------
+// Searching.
+
+// Number of leading elements of a[0..n) that sort before key: those <= key
+// when right, those < key otherwise. Probes exponentially from the start
+// (or from the end when fromEnd) and then binary searches the last step.
+static size_t gallop(const struct sortCtx *sc, const char *key, const char *a,
+                     size_t n, int right, int fromEnd)
+{
+    size_t size = sc->size, lo, hi;
+#define BEFORE(i) (right ? !psort_less(sc, key, AT(a, i)) : psort_less(sc, AT(a, i), key))
+    if (!fromEnd)
+    {
+        lo = 0;
+        size_t probe = 1;
+        while (probe <= n && BEFORE(probe - 1))
+        {
+            lo = probe;
+            probe = probe * 2 + 1;
+        }
+        hi = probe - 1 < n ? probe - 1 : n;
+    }
+    else
+    {
+        hi = n;
+        size_t step = 1;
+        while (step <= n && !BEFORE(n - step))
+        {
+            hi = n - step;
+            step *= 2;
+        }
+        lo = step <= n ? n - step + 1 : 0;
+    }
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (BEFORE(mid))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+#undef BEFORE
+    return lo;
+}
+
+static void reverse(char *a, size_t n, size_t size, char *tmp)
+{
+    for (size_t i = 0, j = n - 1; n && i < j; i++, j--)
+    {
+        psort_move(tmp, AT(a, i), size);
+        psort_move(AT(a, i), AT(a, j), size);
+        psort_move(AT(a, j), tmp, size);
+    }
+}
+
+// Binary insertion sort of a[0..n), where a[0..sorted) is already sorted.
+// The run being extended is unordered, so each insertion point is found by
+// plain bisection rather than by galloping.
+static void binary_insertion(const struct sortCtx *sc, char *a, size_t n,
+                             size_t sorted, char *tmp)
+{
+    size_t size = sc->size;
+    for (size_t i = sorted ? sorted : 1; i < n; i++)
+    {
+        size_t lo = 0, hi = i;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (psort_less(sc, AT(a, i), AT(a, mid)))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo == i)
+            continue;
+        psort_move(tmp, AT(a, i), size);
+        memmove(AT(a, lo + 1), AT(a, lo), (i - lo) * size);
+        psort_move(AT(a, lo), tmp, size);
+    }
+}
+
+// Length of the run starting at a[0]; a strictly descending run is
+// reversed so every run comes back ascending.
+static size_t count_run(const struct sortCtx *sc, char *a, size_t n, char *tmp)
+{
+    size_t size = sc->size, i = 1;
+    if (n < 2)
+        return n;
+    if (psort_less(sc, AT(a, 1), AT(a, 0)))
+    {
+        while (i + 1 < n && psort_less(sc, AT(a, i + 1), AT(a, i)))
+            i++;
+        reverse(a, i + 1, size, tmp);
+    }
+    else
+    {
+        while (i + 1 < n && !psort_less(sc, AT(a, i + 1), AT(a, i)))
+            i++;
+    }
+    return i + 1;
+}
+
+// Whether a[0..n) falls into runs of fewer than NATURAL_MIN_AVG_RUN
+// elements on average, counting ascending and descending runs alike.
+static int short_runs(const struct sortCtx *sc, const char *a, size_t n)
+{
+    size_t size = sc->size, runs = 1;
+    for (size_t i = 1; i + 1 < n; i++)
+    {
+        int down = psort_less(sc, AT(a, i), AT(a, i - 1));
+        if (down != psort_less(sc, AT(a, i + 1), AT(a, i)))
+        {
+            runs++;
+            i++; // the next run starts at i + 1
+        }
+    }
+    return n / runs < NATURAL_MIN_AVG_RUN;
+}
+
+static size_t min_run(size_t n)
+{
+    size_t r = 0;
+    while (n >= 64)
+    {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
+}
+
+// ---------------------------------------------------------------------------
+// Merging two adjacent runs a[0..na) and a[na..na+nb), both non-empty,
+// after trimming. merge_lo copies A out and fills from the front; merge_hi
+// copies B out and fills from the back. Ties always put A first.
+
+static void merge_lo(struct tsState *ts, char *a, size_t na, size_t nb)
+{
+    const struct sortCtx *sc = ts->sc;
+    size_t size = sc->size;
+    char *pa = ts->tmp, *pb = AT(a, na), *dst = a;
+    memcpy(pa, a, na * size);
+    int minGallop = ts->minGallop;
+
+    while (na > 0 && nb > 0)
+    {
+        size_t winsA = 0, winsB = 0;
+        // One element at a time until one side wins too often in a row.
+        while (na > 0 && nb > 0)
+        {
+            if (psort_less(sc, pb, pa))
+            {
+                psort_move(dst, pb, size);
+                dst += size, pb += size, nb--;
+                winsA = 0;
+                if (++winsB >= (size_t)minGallop)
+                    break;
+            }
+            else
+            {
+                psort_move(dst, pa, size);
+                dst += size, pa += size, na--;
+                winsB = 0;
+                if (++winsA >= (size_t)minGallop)
+                    break;
+            }
+        }
+        // Galloping: copy whole stretches found by exponential search.
+        while (na > 0 && nb > 0)
+        {
+            winsA = gallop(sc, pb, pa, na, 1, 0);
+            memcpy(dst, pa, winsA * size);
+            dst += winsA * size, pa += winsA * size, na -= winsA;
+            if (na == 0)
+                break;
+            psort_move(dst, pb, size);
+            dst += size, pb += size, nb--;
+            if (nb == 0)
+                break;
+            winsB = gallop(sc, pa, pb, nb, 0, 0);
+            memmove(dst, pb, winsB * size);
+            dst += winsB * size, pb += winsB * size, nb -= winsB;
+            if (nb == 0)
+                break;
+            psort_move(dst, pa, size);
+            dst += size, pa += size, na--;
+            if (minGallop > 1)
+                minGallop--;
+            if (winsA < MIN_GALLOP && winsB < MIN_GALLOP)
+            {
+                minGallop += 2;
+                break;
+            }
+        }
+    }
+    memcpy(dst, pa, na * size); // what is left of B is already in place
+    ts->minGallop = minGallop < 1 ? 1 : minGallop;
+}
+
+static void merge_hi(struct tsState *ts, char *a, size_t na, size_t nb)
+{
+    const struct sortCtx *sc = ts->sc;
+    size_t size = sc->size;
+    memcpy(ts->tmp, AT(a, na), nb * size);
+    // Cursors point one past the last unmerged element.
+    char *ea = AT(a, na), *eb = AT(ts->tmp, nb), *dst = AT(a, na + nb);
+    int minGallop = ts->minGallop;
+
+    while (na > 0 && nb > 0)
+    {
+        size_t winsA = 0, winsB = 0;
+        while (na > 0 && nb > 0)
+        {
+            if (psort_less(sc, eb - size, ea - size))
+            {
+                dst -= size, ea -= size, na--;
+                psort_move(dst, ea, size);
+                winsB = 0;
+                if (++winsA >= (size_t)minGallop)
+                    break;
+            }
+            else
+            {
+                dst -= size, eb -= size, nb--;
+                psort_move(dst, eb, size);
+                winsA = 0;
+                if (++winsB >= (size_t)minGallop)
+                    break;
+            }
+        }
+        while (na > 0 && nb > 0)
+        {
+            // A elements greater than B's last go to the back.
+            winsA = na - gallop(sc, eb - size, a, na, 1, 1);
+            dst -= winsA * size, ea -= winsA * size, na -= winsA;
+            memmove(dst, ea, winsA * size);
+            if (na == 0)
+                break;
+            dst -= size, eb -= size, nb--;
+            psort_move(dst, eb, size);
+            if (nb == 0)
+                break;
+            // B elements not less than A's last follow it.
+            winsB = nb - gallop(sc, ea - size, ts->tmp, nb, 0, 1);
+            dst -= winsB * size, eb -= winsB * size, nb -= winsB;
+            memcpy(dst, eb, winsB * size);
+            if (nb == 0)
+                break;
+            dst -= size, ea -= size, na--;
+            psort_move(dst, ea, size);
+            if (minGallop > 1)
+                minGallop--;
+            if (winsA < MIN_GALLOP && winsB < MIN_GALLOP)
+            {
+                minGallop += 2;
+                break;
+            }
+        }
+    }
+    memcpy(a + na * size, ts->tmp, nb * size); // A's rest is already in place
+    ts->minGallop = minGallop < 1 ? 1 : minGallop;
+}
+
+// Merge adjacent sorted runs a[0..na) and a[na..na+nb) in place.
+static void merge_runs(struct tsState *ts, char *a, size_t na, size_t nb)
+{
+    const struct sortCtx *sc = ts->sc;
+    size_t size = sc->size;
+    // Elements of A that are <= B's first are already in place...
+    size_t skip = gallop(sc, AT(a, na), a, na, 1, 0);
+    a += skip * size;
+    na -= skip;
+    if (na == 0)
+        return;
+    // ...and so are elements of B that are >= A's last.
+    nb = gallop(sc, AT(a, na - 1), AT(a, na), nb, 0, 1);
+    if (nb == 0)
+        return;
+    if (na <= nb)
+        merge_lo(ts, a, na, nb);
+    else
+        merge_hi(ts, a, na, nb);
+}
+
+static void merge_at(struct tsState *ts, int i)
+{
+    struct tsRun *r = ts->runs;
+    merge_runs(ts, ts->a + r[i].base * ts->sc->size, r[i].len, r[i + 1].len);
+    r[i].len += r[i + 1].len;
+    if (i == ts->nruns - 3)
+        r[i + 1] = r[i + 2];
+    ts->nruns--;
+}
+
+static void merge_collapse(struct tsState *ts)
+{
+    struct tsRun *r = ts->runs;
+    while (ts->nruns > 1)
+    {
+        int n = ts->nruns - 2;
+        if ((n > 0 && r[n - 1].len <= r[n].len + r[n + 1].len) ||
+            (n > 1 && r[n - 2].len <= r[n - 1].len + r[n].len))
+        {
+            if (r[n - 1].len < r[n + 1].len)
+                n--;
+        }
+        else if (r[n].len > r[n + 1].len)
+            break;
+        merge_at(ts, n);
+    }
+}
+
+static void timsort(const struct sortCtx *sc, char *a, size_t n, char *tmp)
+{
+    size_t size = sc->size;
+    if (short_runs(sc, a, n))
+    {
+        psort_sort_serial(sc, a, tmp, n);
+        return;
+    }
+    struct tsState ts = {sc, a, tmp, MIN_GALLOP, 0, {{0, 0}}};
+    size_t minrun = min_run(n);
+    for (size_t lo = 0; lo < n;)
+    {
+        size_t len = count_run(sc, AT(a, lo), n - lo, tmp);
+        if (len < minrun)
+        {
+            size_t forced = n - lo < minrun ? n - lo : minrun;
+            binary_insertion(sc, AT(a, lo), forced, len, tmp);
+            len = forced;
+        }
+        ts.runs[ts.nruns++] = (struct tsRun){lo, len};
+        merge_collapse(&ts);
+        lo += len;
+    }
+    while (ts.nruns > 1)
+    {
+        int i = ts.nruns - 2;
+        if (i > 0 && ts.runs[i - 1].len < ts.runs[i + 1].len)
+            i--;
+        merge_at(&ts, i);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Parallel driver.
+
+struct natShared
+{
+    const struct sortCtx *sc;
+    char *base, *scratch;
+    size_t *cut; // slice w is [cut[w], cut[w+1])
+    int slices;
+    int width;   // slices per sorted segment in the current round
+    int threads;
+};
+
+static void slice_worker(struct sortTeam *team, int w, void *arg)
+{
+    (void)team;
+    struct natShared *sh = arg;
+    size_t size = sh->sc->size, lo = sh->cut[w];
+    TRACE_SPAN(span);
+    TRACE_BEGIN(span, TRACE_BASE, TRACE_NO_LEVEL, sh->cut[w + 1] - lo);
+    timsort(sh->sc, sh->base + lo * size, sh->cut[w + 1] - lo, sh->scratch + lo * size);
+    TRACE_END(span);
+}
+
+// Merge segment pair p of the current round: slices [2p*width, (2p+1)*width)
+// and [(2p+1)*width, (2p+2)*width).
+static void pair_worker(struct sortTeam *team, int p, void *arg)
+{
+    (void)team;
+    struct natShared *sh = arg;
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size;
+    int s0 = 2 * p * sh->width, s1 = s0 + sh->width;
+    if (s1 >= sh->slices) // odd segment out; it waits for the next round
+        return;
+    int s2 = s1 + sh->width < sh->slices ? s1 + sh->width : sh->slices;
+    size_t lo = sh->cut[s0], mid = sh->cut[s1], hi = sh->cut[s2];
+    char *a = sh->base + lo * size;
+    size_t na = mid - lo, nb = hi - mid;
+
+    // Only the last round has a single pair; give it every thread.
+    int threads = 2 * sh->width >= sh->slices ? sh->threads : 1;
+    if (threads > 1)
+    {
+        size_t skip = gallop(sc, AT(a, na), a, na, 1, 0);
+        a += skip * size;
+        na -= skip;
+        if (na == 0)
+            return;
+        nb = gallop(sc, AT(a, na - 1), AT(a, na), nb, 0, 1);
+        if (nb == 0)
+            return;
+        char *tmp = sh->scratch + (lo + skip) * size;
+        memcpy(tmp, a, (na + nb) * size);
+        psort_merge_parallel(sc, tmp, na, AT(tmp, na), nb, a, threads);
+        return;
+    }
+    struct tsState ts = {sc, a, sh->scratch + lo * size, MIN_GALLOP, 0, {{0, 0}}};
+    TRACE_SPAN(span);
+    TRACE_BEGIN(span, TRACE_MERGE, TRACE_NO_LEVEL, na + nb);
+    merge_runs(&ts, a, na, nb);
+    TRACE_END(span);
+}
+
+int natural_sort(const struct sortCtx *sc, char *base, size_t n,
+                 const struct sortPolicy *policy)
+{
+    int slices = sort_policy_threads(policy);
+    if ((size_t)slices > n / NATURAL_MIN_SLICE + 1)
+        slices = (int)(n / NATURAL_MIN_SLICE + 1);
+
+    struct sortBuf scratch;
+    if (sort_buf_alloc(&scratch, n * sc->size, policy) != 0)
+        return -1;
+    struct natShared sh = {sc, base, scratch.data,
+                           malloc(((size_t)slices + 1) * sizeof(size_t)),
+                           slices, 1, sort_policy_threads(policy)};
+    if (!sh.cut)
+    {
+        sort_buf_free(&scratch);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int w = 0; w <= slices; w++)
+        sh.cut[w] = n / (size_t)slices * (size_t)w + (w == slices ? n % (size_t)slices : 0);
+
+    team_run_chunks(slices, slice_worker, &sh);
+    for (; sh.width < slices; sh.width *= 2)
+    {
+        int pairs = (slices + 2 * sh.width - 1) / (2 * sh.width);
+        team_run_chunks(pairs, pair_worker, &sh);
+    }
+    sort_buf_free(&scratch);
+    free(sh.cut);
+    return 0;
+}
@@ -0,0 +1,496 @@
+// numa.c
+// NUMA-aware parallel sort with first-touch placement.
+//
+// A plan gives each node a share of the threads in proportion to its
+// CPUs, and the same share of the array. node_alloc first-touches each
+// share from threads bound to that node, so Linux places its pages there.
+// node_merge_sort then sorts every share on its own node, with the scratch
+// buffer also first-touched locally. In the final merge each node writes
+// the part of the output that lies in its own memory. The input for that
+// part comes from every partition, so each node reads about (nodes-1)/nodes
+// of its output remotely and the cross-node traffic is the same in each
+// direction.
+
+#define _GNU_SOURCE
+#include "numa.h"
+#include "psort_impl.h"
+#include "team.h"
+#include "timing.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+struct nodePlan
+{
+    int nodes;
+    int bound; // cpus[] are valid and threads get pinned
+    int id[NODE_MAX];
+    cpu_set_t cpus[NODE_MAX];
+    int threads[NODE_MAX];
+    size_t cut[NODE_MAX + 1]; // node k owns elements [cut[k], cut[k+1])
+};
+
+// ---------------------------------------------------------------------------
+// Topology.
+
+// Parse a sysfs cpulist such as "0-3,8,10-11".
+static void parse_cpulist(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*s)
+    {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s)
+            break;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+            CPU_SET((int)c, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+// Nodes that have CPUs this process may use, in node id order. Falls back
+// to a single unbound node.
+static void detect_nodes(struct nodePlan *plan)
+{
+    cpu_set_t allowed;
+    plan->nodes = 0;
+    plan->bound = 0;
+    DIR *dir = opendir(NODE_DIR);
+    if (dir && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        struct dirent *e;
+        while ((e = readdir(dir)) && plan->nodes < NODE_MAX)
+        {
+            int id;
+            char path[300], list[4096];
+            if (sscanf(e->d_name, "node%d", &id) != 1)
+                continue;
+            snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", e->d_name);
+            FILE *f = fopen(path, "r");
+            if (!f)
+                continue;
+            int ok = fgets(list, sizeof(list), f) != NULL;
+            fclose(f);
+            cpu_set_t set;
+            if (!ok)
+                continue;
+            parse_cpulist(list, &set);
+            CPU_AND(&set, &set, &allowed);
+            if (CPU_COUNT(&set) == 0)
+                continue;
+            // Insert in id order; readdir order is arbitrary.
+            int k = plan->nodes++;
+            for (; k > 0 && plan->id[k - 1] > id; k--)
+            {
+                plan->id[k] = plan->id[k - 1];
+                plan->cpus[k] = plan->cpus[k - 1];
+            }
+            plan->id[k] = id;
+            plan->cpus[k] = set;
+        }
+    }
+    if (dir)
+        closedir(dir);
+    if (plan->nodes > 1)
+        plan->bound = 1;
+    else
+    {
+        plan->nodes = 1;
+        plan->id[0] = 0;
+    }
+}
+
+int node_count(void)
+{
+    struct nodePlan plan;
+    detect_nodes(&plan);
+    return plan.nodes;
+}
+
+static void make_plan(struct nodePlan *plan, size_t n,
+                      const struct sortPolicy *policy)
+{
+    detect_nodes(plan);
+    int threads = sort_policy_threads(policy);
+    if (plan->nodes > threads)
+        plan->nodes = threads;
+    if (plan->nodes == 1)
+        plan->bound = 0;
+
+    // Hand out threads one at a time to the node with the fewest per CPU.
+    for (int k = 0; k < plan->nodes; k++)
+        plan->threads[k] = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        int best = 0;
+        for (int k = 1; k < plan->nodes; k++)
+        {
+            long ck = plan->bound ? CPU_COUNT(&plan->cpus[k]) : 1;
+            long cb = plan->bound ? CPU_COUNT(&plan->cpus[best]) : 1;
+            if ((long)plan->threads[k] * cb < (long)plan->threads[best] * ck)
+                best = k;
+        }
+        plan->threads[best]++;
+    }
+
+    size_t before = 0;
+    for (int k = 0; k <= plan->nodes; k++)
+    {
+        plan->cut[k] = (size_t)((unsigned __int128)n * before / (size_t)threads);
+        if (k < plan->nodes)
+            before += (size_t)plan->threads[k];
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Running one thread per node.
+
+typedef void (*node_fn)(const struct nodePlan *plan, int k, void *arg);
+
+struct nodeThread
+{
+    const struct nodePlan *plan;
+    int k;
+    node_fn fn;
+    void *arg;
+};
+
+static void *node_thread(void *p)
+{
+    struct nodeThread *nt = p;
+    nt->fn(nt->plan, nt->k, nt->arg);
+    return NULL;
+}
+
+// Run fn for every node on a thread pinned to that node's CPUs. Threads
+// the node function creates inherit the pinning. If a thread can't be
+// created, that node's work runs unpinned on the caller instead.
+static void run_on_nodes(const struct nodePlan *plan, node_fn fn, void *arg)
+{
+    pthread_t tid[NODE_MAX];
+    struct nodeThread nt[NODE_MAX];
+    int started[NODE_MAX];
+    for (int k = 0; k < plan->nodes; k++)
+    {
+        nt[k] = (struct nodeThread){plan, k, fn, arg};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (plan->bound)
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &plan->cpus[k]);
+        started[k] = pthread_create(&tid[k], &attr, node_thread, &nt[k]) == 0;
+        pthread_attr_destroy(&attr);
+        if (!started[k])
+            fn(plan, k, arg);
+    }
+    for (int k = 0; k < plan->nodes; k++)
+        if (started[k])
+            pthread_join(tid[k], NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Placement.
+
+struct touchShared
+{
+    const struct nodePlan *plan;
+    char *base;
+    size_t size;
+    int k; // node being touched
+};
+
+static void touch_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    const struct touchShared *sh = arg;
+    const struct nodePlan *plan = sh->plan;
+    size_t lo = plan->cut[sh->k] * sh->size, hi = plan->cut[sh->k + 1] * sh->size;
+    size_t len = hi - lo, page = (size_t)sysconf(_SC_PAGESIZE);
+    int parts = plan->threads[sh->k];
+    char *p = sh->base + lo + len * (size_t)id / (size_t)parts;
+    char *end = sh->base + lo + len * (size_t)(id + 1) / (size_t)parts;
+    for (; p < end; p += page)
+        *(volatile char *)p = 0;
+    if (end > sh->base + lo)
+        *(volatile char *)(end - 1) = 0;
+}
+
+static void touch_node(const struct nodePlan *plan, int k, void *arg)
+{
+    struct touchShared sh = *(const struct touchShared *)arg;
+    sh.k = k;
+    team_run_chunks(plan->threads[k], touch_worker, &sh);
+}
+
+static void *alloc_planned(const struct nodePlan *plan, size_t n, size_t size,
+                           const struct sortPolicy *policy)
+{
+    size_t len = n * size;
+    if (len == 0)
+        len = 1;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    // Advise before the first touch, so the faults can take huge pages.
+    if (policy && policy->hugePages)
+        madvise(p, len, MADV_HUGEPAGE);
+    struct touchShared sh = {plan, p, size, 0};
+    run_on_nodes(plan, touch_node, &sh);
+    return p;
+}
+
+void *node_alloc(size_t n, size_t size, const struct sortPolicy *policy)
+{
+    struct nodePlan plan;
+    make_plan(&plan, n, policy);
+    return alloc_planned(&plan, n, size, policy);
+}
+
+void node_free(void *p, size_t n, size_t size)
+{
+    if (p)
+        munmap(p, n * size > 0 ? n * size : 1);
+}
+
+// ---------------------------------------------------------------------------
+// Sort.
+
+struct sortShared
+{
+    const struct nodePlan *plan;
+    const struct sortCtx *sc;
+    const struct sortPolicy *policy;
+    char *base, *tmp;
+    int err;
+    struct nodeStats *stats;
+};
+
+static void sort_node(const struct nodePlan *plan, int k, void *arg)
+{
+    struct sortShared *sh = arg;
+    struct sortPolicy local = *sh->policy;
+    local.threads = plan->threads[k];
+    size_t lo = plan->cut[k], n = plan->cut[k + 1] - lo;
+    double t0 = now();
+    if (parallel_merge_sort(sh->base + lo * sh->sc->size, n, sh->sc->size,
+                            sh->sc->cmp, sh->sc->ctx, &local) != 0)
+        __atomic_store_n(&sh->err, errno, __ATOMIC_RELAXED);
+    sh->stats->node[k].sortSeconds = now() - t0;
+}
+
+// Number of elements of sorted seq[0..n) that order before x: those < x,
+// or those <= x when orEqual.
+static size_t count_before(const struct sortCtx *sc, const char *seq, size_t n,
+                           const char *x, int orEqual)
+{
+    size_t lo = 0, hi = n, size = sc->size;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *m = seq + mid * size;
+        if (orEqual ? !psort_less(sc, x, m) : psort_less(sc, m, x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// How many elements of partition i are among the first r of the stable
+// merge of all partitions. Equal keys order by partition, matching their
+// order in the input array.
+static size_t split_at(const struct nodePlan *plan, const struct sortCtx *sc,
+                       const char *base, int i, size_t r)
+{
+    size_t size = sc->size;
+    const char *seq = base + plan->cut[i] * size;
+    size_t lo = 0, hi = plan->cut[i + 1] - plan->cut[i];
+    while (lo < hi)
+    {
+        size_t m = lo + (hi - lo) / 2, rank = m;
+        const char *x = seq + m * size;
+        for (int j = 0; j < plan->nodes && rank < r; j++)
+            if (j != i)
+                rank += count_before(sc, base + plan->cut[j] * size,
+                                     plan->cut[j + 1] - plan->cut[j], x, j < i);
+        if (rank < r)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+// Stable merge of k sorted sequences into out; ties go to the lower index.
+static void merge_k(const struct sortCtx *sc, const char **src, size_t *len,
+                    int k, char *out)
+{
+    size_t size = sc->size;
+    int live[NODE_MAX], nlive = 0;
+    for (int i = 0; i < k; i++)
+        if (len[i])
+            live[nlive++] = i;
+    if (nlive == 1)
+        memcpy(out, src[live[0]], len[live[0]] * size);
+    else if (nlive == 2)
+        sc->ops->merge(src[live[0]], len[live[0]], src[live[1]], len[live[1]], out, sc);
+    else if (nlive > 2)
+    {
+        const char *end[NODE_MAX];
+        for (int i = 0; i < k; i++)
+            end[i] = src[i] + len[i] * size;
+        while (nlive > 0)
+        {
+            int best = 0;
+            for (int j = 1; j < nlive; j++)
+                if (psort_less(sc, src[live[j]], src[live[best]]))
+                    best = j;
+            int i = live[best];
+            memcpy(out, src[i], size);
+            out += size;
+            src[i] += size;
+            if (src[i] == end[i])
+            {
+                memmove(&live[best], &live[best + 1], (size_t)(nlive - best - 1) * sizeof(int));
+                nlive--;
+            }
+        }
+    }
+}
+
+struct mergePart
+{
+    struct sortShared *sh;
+    int k;
+};
+
+// Output part `id` of node k's range: [*lo, *hi).
+static void part_range(const struct nodePlan *plan, int k, int id,
+                       size_t *lo, size_t *hi)
+{
+    size_t span = plan->cut[k + 1] - plan->cut[k];
+    int parts = plan->threads[k];
+    *lo = plan->cut[k] + span * (size_t)id / (size_t)parts;
+    *hi = plan->cut[k] + span * (size_t)(id + 1) / (size_t)parts;
+}
+
+// Merge output part `id` of node k's range into the same range of tmp.
+static void merge_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    const struct mergePart *mp = arg;
+    const struct sortShared *sh = mp->sh;
+    const struct nodePlan *plan = sh->plan;
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size, lo, hi;
+    part_range(plan, mp->k, id, &lo, &hi);
+
+    const char *src[NODE_MAX];
+    size_t len[NODE_MAX];
+    for (int i = 0; i < plan->nodes; i++)
+    {
+        size_t a = split_at(plan, sc, sh->base, i, lo);
+        size_t b = split_at(plan, sc, sh->base, i, hi);
+        src[i] = sh->base + (plan->cut[i] + a) * size;
+        len[i] = b - a;
+    }
+    merge_k(sc, src, len, plan->nodes, sh->tmp + lo * size);
+}
+
+// Copy part `id` back once every node has finished merging; both ends of
+// the copy are in node k's memory.
+static void copy_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    const struct mergePart *mp = arg;
+    size_t size = mp->sh->sc->size, lo, hi;
+    part_range(mp->sh->plan, mp->k, id, &lo, &hi);
+    memcpy(mp->sh->base + lo * size, mp->sh->tmp + lo * size, (hi - lo) * size);
+}
+
+static void merge_node(const struct nodePlan *plan, int k, void *arg)
+{
+    struct sortShared *sh = arg;
+    size_t remote = 0;
+    for (int i = 0; i < plan->nodes; i++)
+        if (i != k)
+            remote += split_at(plan, sh->sc, sh->base, i, plan->cut[k + 1]) -
+                      split_at(plan, sh->sc, sh->base, i, plan->cut[k]);
+    struct mergePart mp = {sh, k};
+    double t0 = now();
+    team_run_chunks(plan->threads[k], merge_worker, &mp);
+    sh->stats->node[k].mergeSeconds = now() - t0;
+    sh->stats->node[k].remoteBytes = remote * sh->sc->size;
+}
+
+static void copy_node(const struct nodePlan *plan, int k, void *arg)
+{
+    struct mergePart mp = {arg, k};
+    double t0 = now();
+    team_run_chunks(plan->threads[k], copy_worker, &mp);
+    ((struct sortShared *)arg)->stats->node[k].mergeSeconds += now() - t0;
+}
+
+int node_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                    void *ctx, const struct sortPolicy *policy,
+                    struct nodeStats *stats)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    struct nodeStats local;
+    if (!stats)
+        stats = &local;
+    struct nodePlan plan;
+    make_plan(&plan, n, policy);
+    struct sortCtx sc;
+    psort_ctx_init(&sc, size, cmp, ctx, policy);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->nodes = plan.nodes;
+    for (int k = 0; k < plan.nodes; k++)
+    {
+        stats->node[k].node = plan.id[k];
+        stats->node[k].threads = plan.threads[k];
+        stats->node[k].elements = plan.cut[k + 1] - plan.cut[k];
+    }
+
+    struct sortShared sh = {&plan, &sc, policy, base, NULL, 0, stats};
+    if (plan.nodes == 1)
+    {
+        sort_node(&plan, 0, &sh);
+        errno = sh.err;
+        return sh.err ? -1 : 0;
+    }
+
+    run_on_nodes(&plan, sort_node, &sh);
+    if (sh.err)
+    {
+        errno = sh.err;
+        return -1;
+    }
+    sh.tmp = alloc_planned(&plan, n, size, policy);
+    if (!sh.tmp)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    run_on_nodes(&plan, merge_node, &sh);
+    run_on_nodes(&plan, copy_node, &sh);
+    node_free(sh.tmp, n, size);
+    return 0;
+}
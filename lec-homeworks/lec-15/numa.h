@@ -0,0 +1,61 @@
+// numa.h
+// NUMA-aware sort: the array is split into one partition per memory node,
+// each partition is first-touched and sorted by threads bound to that
+// node, and the final cross-node merge writes every output range from the
+// node that owns it.
+//
+// The topology comes from /sys/devices/system/node, so libnuma is not
+// needed. On a single-node host, or one without that directory, it is a
+// plain parallel_merge_sort.
+
+#ifndef NUMA_SORT_H
+#define NUMA_SORT_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NODE_MAX 64
+
+struct nodeStat
+{
+    int node;              // kernel node id
+    int threads;
+    size_t elements;       // partition size
+    double sortSeconds;    // local sort of the partition
+    double mergeSeconds;   // final merge into this node's output range
+    size_t remoteBytes;    // bytes the final merge read from other nodes
+};
+
+struct nodeStats
+{
+    int nodes; // nodes used; entries [0, nodes) of node[] are valid
+    struct nodeStat node[NODE_MAX];
+};
+
+// Number of memory nodes with CPUs that this process may run on (>= 1).
+int node_count(void);
+
+// Allocate room for n elements of `size` bytes, first-touched by threads
+// bound to each node so that the partition node_merge_sort gives node k
+// sits on node k. Pass the same n, size and policy to node_merge_sort.
+// Returns NULL (errno set) on failure. Free with node_free.
+void *node_alloc(size_t n, size_t size, const struct sortPolicy *policy);
+void node_free(void *p, size_t n, size_t size);
+
+// Stable sort of base[0..n), laid out by node_alloc. Any other buffer
+// works too, just without the placement benefit. stats may be NULL.
+// Returns 0, or -1 (errno set) on allocation failure.
+int node_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                    void *ctx, const struct sortPolicy *policy,
+                    struct nodeStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NUMA_SORT_H
@@ -0,0 +1,126 @@
+// perfctr.c
+// perf_event_open counters. Each event is its own counter with inherit
+// set, so worker threads started inside the measured section add to it.
+// (Inherited counters can't be read as a group, hence one fd per event.)
+// Per-thread counters leave inherit off and are read while running.
+
+#define _GNU_SOURCE
+#include "perfctr.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *eventNames[PERF_EVENTS] = {"dTLB-load-misses", "dTLB-store-misses",
+                                              "page-faults", "cycles", "LLC-misses",
+                                              "branch-misses"};
+
+static void event_attr(enum perfEvent ev, int thread, struct perf_event_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->disabled = !thread;
+    attr->inherit = !thread;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    switch (ev)
+    {
+    case PERF_DTLB_LOAD_MISSES:
+    case PERF_DTLB_STORE_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_DTLB |
+                       (ev == PERF_DTLB_LOAD_MISSES ? PERF_COUNT_HW_CACHE_OP_READ
+                                                    : PERF_COUNT_HW_CACHE_OP_WRITE) << 8 |
+                       PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        break;
+    case PERF_CYCLES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_LLC_MISSES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_BRANCH_MISSES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        attr->type = PERF_TYPE_SOFTWARE;
+        attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+        break;
+    }
+}
+
+static int open_events(struct perfCounters *pc, unsigned mask, int thread)
+{
+    int opened = 0;
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+    {
+        pc->fd[ev] = -1;
+        pc->value[ev] = 0;
+        if (!(mask & (1u << ev)))
+            continue;
+        struct perf_event_attr attr;
+        event_attr((enum perfEvent)ev, thread, &attr);
+        pc->fd[ev] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        opened += pc->fd[ev] >= 0;
+    }
+    return opened;
+}
+
+int perfctr_open(struct perfCounters *pc, unsigned mask)
+{
+    return open_events(pc, mask, 0);
+}
+
+int perfctr_open_thread(struct perfCounters *pc, unsigned mask)
+{
+    return open_events(pc, mask, 1);
+}
+
+void perfctr_start(struct perfCounters *pc)
+{
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+        if (pc->fd[ev] >= 0)
+        {
+            ioctl(pc->fd[ev], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fd[ev], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void perfctr_stop(struct perfCounters *pc)
+{
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+        if (pc->fd[ev] >= 0)
+        {
+            ioctl(pc->fd[ev], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(pc->fd[ev], &pc->value[ev], sizeof(pc->value[ev])) != sizeof(pc->value[ev]))
+                pc->value[ev] = 0;
+        }
+}
+
+void perfctr_read(const struct perfCounters *pc, uint64_t *value)
+{
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+        if (pc->fd[ev] < 0 ||
+            read(pc->fd[ev], &value[ev], sizeof(value[ev])) != sizeof(value[ev]))
+            value[ev] = 0;
+}
+
+void perfctr_close(struct perfCounters *pc)
+{
+    for (int ev = 0; ev < PERF_EVENTS; ev++)
+        if (pc->fd[ev] >= 0)
+        {
+            close(pc->fd[ev]);
+            pc->fd[ev] = -1;
+        }
+}
+
+const char *perfctr_name(enum perfEvent ev)
+{
+    return eventNames[ev];
+}
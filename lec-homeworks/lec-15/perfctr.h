@@ -0,0 +1,56 @@
+// perfctr.h
+// Thin wrapper around perf_event_open for counting hardware events over a
+// section of the program, including in threads it starts, or in one thread
+// only.
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum perfEvent
+{
+    PERF_DTLB_LOAD_MISSES,
+    PERF_DTLB_STORE_MISSES,
+    PERF_PAGE_FAULTS, // software event; available without a hardware PMU
+    PERF_CYCLES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENTS
+};
+
+struct perfCounters
+{
+    int fd[PERF_EVENTS];         // -1 if the event could not be opened
+    uint64_t value[PERF_EVENTS]; // valid after perfctr_stop
+};
+
+// Open the events in `mask` (bit i for event i) for this process's user
+// space, disabled. Threads created after this call are counted too. Events
+// the kernel or the CPU won't give are left at fd -1. Returns the number
+// of events opened.
+int perfctr_open(struct perfCounters *pc, unsigned mask);
+
+// Like perfctr_open, but the events count only the calling thread and are
+// enabled at once. Read them with perfctr_read.
+int perfctr_open_thread(struct perfCounters *pc, unsigned mask);
+
+void perfctr_start(struct perfCounters *pc);
+void perfctr_stop(struct perfCounters *pc);
+void perfctr_close(struct perfCounters *pc);
+
+// Current value of every event into value[0..PERF_EVENTS), without
+// stopping them; 0 for events that are not open.
+void perfctr_read(const struct perfCounters *pc, uint64_t *value);
+
+const char *perfctr_name(enum perfEvent ev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PERFCTR_H
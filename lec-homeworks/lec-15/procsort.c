@@ -0,0 +1,315 @@
+// procsort.c
+// Merge sort across forked worker processes.
+//
+// Worker i owns elements [n*i/P, n*(i+1)/P). It sorts them serially,
+// into the scratch buffer or in place so that the rounds that follow
+// leave the result in base. In the round with runs of w partitions, the
+// workers of each pair of runs split its output evenly by co-rank and
+// merge their shares independently. An odd run at the end is merged with
+// nothing, which copies it to the other buffer.
+//
+// Workers are forked before they know how many siblings they have: they
+// wait at a start gate, a process-shared mutex and condition variable,
+// until the parent has created as many as it could. The parent then sets
+// up the barrier for that count and opens the gate.
+//
+// Each worker gets a pipe back to the parent and writes one byte to it
+// when done. The parent polls the pipes: end of file without the byte
+// means the worker died, and since its siblings would wait at the next
+// barrier forever, the parent kills them all.
+
+#define _GNU_SOURCE
+#include "procsort.h"
+#include "psort_impl.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void *proc_shared_alloc(size_t len)
+{
+    void *p = mmap(NULL, len ? len : 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                   -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void proc_shared_free(void *p, size_t len)
+{
+    if (p)
+        munmap(p, len ? len : 1);
+}
+
+// Shared between the parent and the workers.
+struct procShared
+{
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    int open;     // the start gate; set once every worker has been forked
+    int workers;
+    pthread_barrier_t barrier;
+    double sorted, merged; // when the last partition sort and round ended
+    double started[];      // per worker: when it passed the gate
+};
+
+// What every worker needs; copied into each by fork.
+struct procJob
+{
+    struct sortCtx sc;
+    char *base, *scratch;
+    size_t n;
+    struct procShared *sh;
+};
+
+static size_t part_start(size_t n, int part, int parts)
+{
+    return (size_t)(((unsigned __int128)n * (unsigned)part) / (unsigned)parts);
+}
+
+static int merge_rounds(int workers)
+{
+    int rounds = 0;
+    while ((1 << rounds) < workers)
+        rounds++;
+    return rounds;
+}
+
+static void proc_worker(const struct procJob *job, int id)
+{
+    struct procShared *sh = job->sh;
+    pthread_mutex_lock(&sh->lock);
+    while (!sh->open)
+        pthread_cond_wait(&sh->go, &sh->lock);
+    pthread_mutex_unlock(&sh->lock);
+    sh->started[id] = now();
+
+    const struct sortCtx *sc = &job->sc;
+    size_t size = sc->size, n = job->n;
+    int workers = sh->workers;
+    size_t lo = part_start(n, id, workers), hi = part_start(n, id + 1, workers);
+    char *src = merge_rounds(workers) % 2 ? job->scratch : job->base;
+    char *dst = src == job->base ? job->scratch : job->base;
+    if (src == job->base)
+        psort_sort_serial(sc, job->base + lo * size, job->scratch + lo * size, hi - lo);
+    else
+        psort_sort_into(sc, job->base + lo * size, job->scratch + lo * size, hi - lo);
+    if (pthread_barrier_wait(&sh->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        sh->sorted = now();
+
+    for (int w = 1; w < workers; w *= 2)
+    {
+        int first = id / (2 * w) * (2 * w);
+        int mid = first + w < workers ? first + w : workers;
+        int end = first + 2 * w < workers ? first + 2 * w : workers;
+        size_t a0 = part_start(n, first, workers), b0 = part_start(n, mid, workers);
+        size_t na = b0 - a0, nb = part_start(n, end, workers) - b0;
+        const char *a = src + a0 * size, *b = src + b0 * size;
+        int part = id - first, parts = end - first;
+        size_t k0 = part_start(na + nb, part, parts), k1 = part_start(na + nb, part + 1, parts);
+        size_t i0 = psort_co_rank(sc, k0, a, na, b, nb);
+        size_t i1 = part == parts - 1 ? na : psort_co_rank(sc, k1, a, na, b, nb);
+        sc->ops->merge(a + i0 * size, i1 - i0, b + (k0 - i0) * size, (k1 - i1) - (k0 - i0),
+                       dst + (a0 + k0) * size, sc);
+        if (pthread_barrier_wait(&sh->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            sh->merged = now();
+        char *t = src;
+        src = dst;
+        dst = t;
+    }
+}
+
+static int shared_init(struct procShared *sh)
+{
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    int rc = pthread_mutex_init(&sh->lock, &ma);
+    if (rc == 0 && (rc = pthread_cond_init(&sh->go, &ca)) != 0)
+        pthread_mutex_destroy(&sh->lock);
+    pthread_mutexattr_destroy(&ma);
+    pthread_condattr_destroy(&ca);
+    return rc;
+}
+
+static int barrier_init(pthread_barrier_t *b, int count)
+{
+    pthread_barrierattr_t ba;
+    pthread_barrierattr_init(&ba);
+    pthread_barrierattr_setpshared(&ba, PTHREAD_PROCESS_SHARED);
+    int rc = pthread_barrier_init(b, &ba, (unsigned)count);
+    pthread_barrierattr_destroy(&ba);
+    return rc;
+}
+
+// Wait for every worker to report, killing them all as soon as one dies
+// without reporting. Returns 0, or -1 if a worker died.
+static int supervise(struct pollfd *pfd, int workers, const pid_t *pids)
+{
+    int pending = workers, failed = 0;
+    while (pending > 0)
+    {
+        if (poll(pfd, (nfds_t)workers, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            failed = 1; // can't watch the workers: give up on them
+        }
+        for (int i = 0; i < workers && !failed; i++)
+        {
+            if (pfd[i].fd < 0 || !pfd[i].revents)
+                continue;
+            char done;
+            ssize_t got = read(pfd[i].fd, &done, 1);
+            if (got < 0 && errno == EINTR)
+                continue;
+            failed = got != 1;
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
+            pending--;
+        }
+        if (failed)
+        {
+            for (int i = 0; i < workers; i++)
+                kill(pids[i], SIGKILL);
+            break;
+        }
+    }
+    for (int i = 0; i < workers; i++)
+        if (pfd[i].fd >= 0)
+            close(pfd[i].fd);
+    return failed ? -1 : 0;
+}
+
+int proc_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp, void *ctx,
+                    const struct sortPolicy *policy, struct procSortStats *st)
+{
+    struct procSortStats local;
+    if (!st)
+        st = &local;
+    memset(st, 0, sizeof(*st));
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    if (n < 2 || size == 0)
+        return 0;
+    if (n > SIZE_MAX / size)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct procJob job;
+    psort_ctx_init(&job.sc, size, cmp, ctx, policy);
+    int workers = sort_policy_threads(policy);
+    if ((size_t)workers > n / job.sc.minParallel)
+        workers = n / job.sc.minParallel > 1 ? (int)(n / job.sc.minParallel) : 1;
+    size_t shLen = sizeof(struct procShared) + (size_t)workers * sizeof(double);
+    job.base = base;
+    job.n = n;
+    job.scratch = proc_shared_alloc(n * size);
+    job.sh = proc_shared_alloc(shLen);
+    pid_t *pids = malloc((size_t)workers * sizeof(*pids));
+    struct pollfd *pfd = malloc((size_t)workers * sizeof(*pfd));
+    if (!job.scratch || !job.sh || !pids || !pfd || shared_init(job.sh) != 0)
+    {
+        int e = job.scratch && job.sh && pids && pfd ? EAGAIN : ENOMEM;
+        proc_shared_free(job.scratch, n * size);
+        proc_shared_free(job.sh, shLen);
+        free(pids);
+        free(pfd);
+        errno = e;
+        return -1;
+    }
+
+    double t0 = now();
+    int forked = 0, err = 0;
+    for (; forked < workers; forked++)
+    {
+        int fd[2];
+        if (pipe(fd) != 0)
+        {
+            err = errno;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fd[0]);
+            proc_worker(&job, forked);
+            char done = 1;
+            _exit(write(fd[1], &done, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(fd[1]);
+        if (pid < 0)
+        {
+            err = errno;
+            close(fd[0]);
+            break;
+        }
+        pids[forked] = pid;
+        pfd[forked] = (struct pollfd){fd[0], POLLIN, 0};
+    }
+
+    // Open the gate for the workers there are.
+    int rc = -1;
+    if (forked > 0 && (err = barrier_init(&job.sh->barrier, forked)) == 0)
+    {
+        pthread_mutex_lock(&job.sh->lock);
+        job.sh->workers = forked;
+        job.sh->open = 1;
+        pthread_cond_broadcast(&job.sh->go);
+        pthread_mutex_unlock(&job.sh->lock);
+        st->forkSeconds = now() - t0;
+        rc = supervise(pfd, forked, pids);
+        pthread_barrier_destroy(&job.sh->barrier);
+        err = EIO;
+    }
+    else
+    {
+        // No worker may run: kill the ones waiting at the gate.
+        for (int i = 0; i < forked; i++)
+        {
+            kill(pids[i], SIGKILL);
+            close(pfd[i].fd);
+        }
+    }
+    for (int i = 0; i < forked; i++)
+        while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+
+    if (rc == 0)
+    {
+        double last = t0;
+        for (int i = 0; i < forked; i++)
+            if (job.sh->started[i] > last)
+                last = job.sh->started[i];
+        st->workers = forked;
+        st->rounds = merge_rounds(forked);
+        st->startSeconds = last - t0;
+        st->sortSeconds = job.sh->sorted - last;
+        st->mergeSeconds = st->rounds ? job.sh->merged - job.sh->sorted : 0;
+        st->reapSeconds = now() - (st->rounds ? job.sh->merged : job.sh->sorted);
+    }
+    pthread_cond_destroy(&job.sh->go);
+    pthread_mutex_destroy(&job.sh->lock);
+    proc_shared_free(job.scratch, n * size);
+    proc_shared_free(job.sh, shLen);
+    free(pids);
+    free(pfd);
+    if (rc != 0)
+        errno = err;
+    return rc;
+}
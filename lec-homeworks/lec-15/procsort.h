@@ -0,0 +1,56 @@
+// procsort.h
+// Merge sort in forked worker processes instead of threads, for hosts
+// that cap threads per process and for fault isolation.
+//
+// The data and the scratch buffer live in MAP_SHARED mappings, so what a
+// worker writes is seen by its siblings and by the parent. Each worker
+// sorts one partition; then the workers merge pairs of sorted runs in
+// rounds, each taking an equal share of every merge's output, and meet
+// at a process-shared barrier between rounds. The parent only
+// supervises: a worker that crashes fails the sort instead of taking the
+// caller down with it.
+
+#ifndef PROCSORT_H
+#define PROCSORT_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct procSortStats
+{
+    int workers;         // processes that ran
+    int rounds;          // merge rounds
+    double forkSeconds;  // creating the workers
+    double startSeconds; // from the first fork until the last worker ran
+    double sortSeconds;  // from then until every partition was sorted
+    double mergeSeconds; // the merge rounds
+    double reapSeconds;  // from the last round until every worker was reaped
+};
+
+// len bytes of zeroed memory shared with processes forked later, or NULL
+// (errno set). Free with proc_shared_free.
+void *proc_shared_alloc(size_t len);
+void proc_shared_free(void *p, size_t len);
+
+// Stable sort of n elements of `size` bytes at base, by cmp, in one
+// worker process per policy thread (fewer if the partitions would drop
+// below policy->minParallel elements). base must be shared with child
+// processes: from proc_shared_alloc or a MAP_SHARED file mapping. If
+// some forks fail the sort runs on the workers that were created.
+// Returns 0, or -1 with errno set: from fork or mmap, EOVERFLOW if n * size
+// overflows, or EIO if a worker died, in which case base holds an
+// unspecified mix of its elements.
+// policy may be NULL for the defaults and st NULL if not wanted.
+int proc_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp, void *ctx,
+                    const struct sortPolicy *policy, struct procSortStats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROCSORT_H
@@ -0,0 +1,533 @@
+// psort.c
+// Parallel merge sort engine. The recursion halves the array and hands the
+// left half to a new pthread while threads remain, then runs serially below
+// that. Merges ping-pong between the data and a single scratch buffer, so
+// nothing is copied back after each level, and the merges near the top are
+// split across threads by co-ranking so the last level isn't serial.
+
+#define _GNU_SOURCE
+#include "psort.h"
+#include "psort_impl.h"
+#include "hugemem.h"
+#include "sorttrace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Don't bother spawning threads for subarrays smaller than this, unless
+// the policy says otherwise.
+#define PSORT_MIN_PARALLEL 8192
+
+void sort_policy_init(struct sortPolicy *policy)
+{
+    policy->threads = 0;
+    policy->cutoff = 32;
+    policy->strategy = SORT_BINARY;
+    policy->blockBytes = 256 << 10;
+    policy->fanout = 256;
+    policy->hugePages = 0;
+    policy->minParallel = PSORT_MIN_PARALLEL;
+    policy->radixMinN = 0;
+}
+
+enum sortStrategy sort_policy_strategy(const struct sortPolicy *policy, size_t n)
+{
+    if (policy->strategy != SORT_AUTO)
+        return policy->strategy;
+    if (sort_policy_threads(policy) >= PSORT_SAMPLE_MIN_THREADS && n >= PSORT_SAMPLE_MIN_N)
+        return SORT_SAMPLE;
+    return SORT_BINARY;
+}
+
+int sort_policy_threads(const struct sortPolicy *policy)
+{
+    int t = policy ? policy->threads : 0;
+    if (t <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        t = cpus > 0 ? (int)cpus : 1;
+    }
+    return t;
+}
+
+int psort_cmp_int(const void *a, const void *b, void *ctx)
+{
+    (void)ctx;
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// The 64-bit keys are read with memcpy: records keyed by them need not
+// be 8-byte aligned.
+int psort_cmp_int64(const void *a, const void *b, void *ctx)
+{
+    (void)ctx;
+    int64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return (x > y) - (x < y);
+}
+
+int psort_cmp_uint64(const void *a, const void *b, void *ctx)
+{
+    (void)ctx;
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return (x > y) - (x < y);
+}
+
+// The order radix_sort gives doubles: the bits with the sign flipped, or
+// all of them for negative values, compared as unsigned. It is total, so
+// the sort is well defined with NaNs, and the engines agree on -0 < +0.
+static inline uint64_t double_key(uint64_t bits)
+{
+    return bits ^ ((uint64_t)((int64_t)bits >> 63) | 0x8000000000000000ull);
+}
+
+int psort_cmp_double(const void *a, const void *b, void *ctx)
+{
+    (void)ctx;
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    x = double_key(x);
+    y = double_key(y);
+    return (x > y) - (x < y);
+}
+
+// ---------------------------------------------------------------------------
+// Generic kernels: compare through the function pointer, move with memcpy
+// (psort_move, so small sizes compile to a single load/store).
+
+static void isort_generic(char *a, size_t n, const struct sortCtx *sc)
+{
+    size_t size = sc->size;
+    char tmp[256];
+    for (size_t i = 1; i < n; i++)
+    {
+        char *cur = a + i * size;
+        if (sc->cmp(cur - size, cur, sc->ctx) <= 0)
+        {
+            TRACE_COUNT(1, 0);
+            continue;
+        }
+        // cur stays put while its place is found; a[i - 1] is already known
+        // to be greater.
+        size_t j = i - 1;
+        while (j > 0 && sc->cmp(a + (j - 1) * size, cur, sc->ctx) > 0)
+            j--;
+        if (size <= sizeof(tmp))
+        {
+            psort_move(tmp, cur, size);
+            memmove(a + (j + 1) * size, a + j * size, (i - j) * size);
+            psort_move(a + j * size, tmp, size);
+        }
+        else
+        {
+            // Too wide for tmp: rotate a[j..i] a slice of bytes at a time
+            // rather than allocate, so this can't fail.
+            for (size_t off = 0; off < size; off += sizeof(tmp))
+            {
+                size_t c = size - off < sizeof(tmp) ? size - off : sizeof(tmp);
+                memcpy(tmp, cur + off, c);
+                for (size_t m = i; m > j; m--)
+                    memcpy(a + m * size + off, a + (m - 1) * size + off, c);
+                memcpy(a + j * size + off, tmp, c);
+            }
+        }
+        TRACE_COUNT((i - j) + (j > 0), i - j + 2);
+    }
+}
+
+static void merge_generic(const char *a, size_t na, const char *b, size_t nb,
+                          char *out, const struct sortCtx *sc)
+{
+    size_t size = sc->size;
+    const char *ae = a + na * size, *be = b + nb * size;
+    while (a < ae && b < be)
+    {
+        // Take from b only when strictly smaller, so equal keys stay stable.
+        if (sc->cmp(b, a, sc->ctx) < 0)
+        {
+            psort_move(out, b, size);
+            b += size;
+        }
+        else
+        {
+            psort_move(out, a, size);
+            a += size;
+        }
+        out += size;
+    }
+    TRACE_COUNT(na + nb - (size_t)((ae - a) + (be - b)) / size, na + nb);
+    memcpy(out, a, (size_t)(ae - a));
+    out += ae - a;
+    memcpy(out, b, (size_t)(be - b));
+}
+
+static const struct sortOps genericOps = {isort_generic, merge_generic};
+
+// ---------------------------------------------------------------------------
+// int kernels: inline comparisons and a branchless merge loop.
+
+static void isort_int(char *base, size_t n, const struct sortCtx *sc)
+{
+    (void)sc;
+    int *a = (int *)base;
+    for (size_t i = 1; i < n; i++)
+    {
+        int v = a[i];
+        size_t j = i;
+        while (j > 0 && a[j - 1] > v)
+        {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = v;
+        TRACE_COUNT(i - j + (j > 0), i - j + 1);
+    }
+}
+
+static void merge_int(const char *pa, size_t na, const char *pb, size_t nb,
+                      char *pout, const struct sortCtx *sc)
+{
+    (void)sc;
+    const int *a = (const int *)pa, *b = (const int *)pb;
+    int *out = (int *)pout;
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb)
+    {
+        int x = a[i], y = b[j];
+        int takeB = y < x;
+        out[k++] = takeB ? y : x;
+        i += !takeB;
+        j += takeB;
+    }
+    TRACE_COUNT(k, na + nb);
+    memcpy(out + k, a + i, (na - i) * sizeof(int));
+    k += na - i;
+    memcpy(out + k, b + j, (nb - j) * sizeof(int));
+}
+
+static const struct sortOps intOps = {isort_int, merge_int};
+
+// ---------------------------------------------------------------------------
+// 64-bit key kernels: the int kernels over int64_t, uint64_t and double,
+// with the comparison as a parameter. Each expands to one set of
+// functions, so the comparison is still inlined. Doubles are handled as
+// their bit patterns, which keeps them out of the FP registers.
+
+#define INT64_LESS(x, y) ((x) < (y))
+#define DOUBLE_LESS(x, y) (double_key(x) < double_key(y))
+
+#define KEY64_KERNELS(name, type, LESS)                                         \
+    static void isort_##name(char *base, size_t n, const struct sortCtx *sc)    \
+    {                                                                           \
+        (void)sc;                                                               \
+        type *a = (type *)base;                                                 \
+        for (size_t i = 1; i < n; i++)                                          \
+        {                                                                       \
+            type v = a[i];                                                      \
+            size_t j = i;                                                       \
+            while (j > 0 && LESS(v, a[j - 1]))                                  \
+            {                                                                   \
+                a[j] = a[j - 1];                                                \
+                j--;                                                            \
+            }                                                                   \
+            a[j] = v;                                                           \
+            TRACE_COUNT(i - j + (j > 0), i - j + 1);                            \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    static void merge_##name(const char *pa, size_t na, const char *pb,         \
+                             size_t nb, char *pout, const struct sortCtx *sc)   \
+    {                                                                           \
+        (void)sc;                                                               \
+        const type *a = (const type *)pa, *b = (const type *)pb;                \
+        type *out = (type *)pout;                                               \
+        size_t i = 0, j = 0, k = 0;                                             \
+        while (i < na && j < nb)                                                \
+        {                                                                       \
+            type x = a[i], y = b[j];                                            \
+            int takeB = LESS(y, x);                                             \
+            out[k++] = takeB ? y : x;                                           \
+            i += !takeB;                                                        \
+            j += takeB;                                                         \
+        }                                                                       \
+        TRACE_COUNT(k, na + nb);                                                \
+        memcpy(out + k, a + i, (na - i) * sizeof(type));                        \
+        k += na - i;                                                            \
+        memcpy(out + k, b + j, (nb - j) * sizeof(type));                        \
+    }                                                                           \
+                                                                                \
+    static const struct sortOps name##Ops = {isort_##name, merge_##name};
+
+KEY64_KERNELS(int64, int64_t, INT64_LESS)
+KEY64_KERNELS(uint64, uint64_t, INT64_LESS)
+KEY64_KERNELS(double, uint64_t, DOUBLE_LESS)
+
+static const struct sortOps *pick_ops(size_t size, psort_cmp_fn cmp)
+{
+    if (cmp == psort_cmp_int && size == sizeof(int))
+        return &intOps;
+    // Only whole 8-byte elements: wider records keyed by a 64-bit value
+    // need the generic kernels to move them.
+    if (size == 8 && cmp == psort_cmp_int64)
+        return &int64Ops;
+    if (size == 8 && cmp == psort_cmp_uint64)
+        return &uint64Ops;
+    if (size == 8 && cmp == psort_cmp_double)
+        return &doubleOps;
+    return &genericOps;
+}
+
+// ---------------------------------------------------------------------------
+// Parallel merge. Output position k of merge(a, b) takes the first i
+// elements of a and k - i of b; co_rank finds that i by binary search,
+// with ties going to a so the split agrees with the stable serial merge.
+
+static size_t co_rank(size_t k, const char *a, size_t na, const char *b,
+                      size_t nb, const struct sortCtx *sc)
+{
+    size_t size = sc->size;
+    size_t lo = k > nb ? k - nb : 0;
+    size_t hi = k < na ? k : na;
+    while (lo < hi)
+    {
+        size_t i = lo + (hi - lo) / 2;
+        size_t j = k - i;
+        // a[i] belongs before b[j-1]: we need more of a.
+        if (j > 0 && sc->cmp(a + i * size, b + (j - 1) * size, sc->ctx) <= 0)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+struct mergeTask
+{
+    const struct sortCtx *sc;
+    const char *a, *b;
+    size_t na, nb;
+    char *out;
+    int level; // recursion level of the merge, for tracing
+};
+
+static void *merge_thread(void *arg)
+{
+    struct mergeTask *t = arg;
+    TRACE_SPAN(span);
+    TRACE_BEGIN(span, TRACE_MERGE, t->level, t->na + t->nb);
+    t->sc->ops->merge(t->a, t->na, t->b, t->nb, t->out, t->sc);
+    TRACE_END(span);
+    return NULL;
+}
+
+static void merge_parallel(const struct sortCtx *sc, const char *a, size_t na,
+                           const char *b, size_t nb, char *out, int threads, int level)
+{
+    size_t n = na + nb;
+    if (threads < 2 || n < sc->minParallel)
+    {
+        struct mergeTask task = {sc, a, b, na, nb, out, level};
+        merge_thread(&task);
+        return;
+    }
+
+    size_t size = sc->size;
+    struct mergeTask *tasks = malloc((size_t)threads * sizeof(*tasks));
+    pthread_t *tids = malloc((size_t)threads * sizeof(*tids));
+    int *spawned = calloc((size_t)threads, sizeof(*spawned));
+    if (!tasks || !tids || !spawned)
+    {
+        free(tasks);
+        free(tids);
+        free(spawned);
+        struct mergeTask task = {sc, a, b, na, nb, out, level};
+        merge_thread(&task);
+        return;
+    }
+
+    size_t prevK = 0, prevI = 0;
+    for (int p = 0; p < threads; p++)
+    {
+        size_t k = (size_t)(p + 1) * n / (size_t)threads;
+        size_t i = p == threads - 1 ? na : co_rank(k, a, na, b, nb, sc);
+        size_t j = k - i, prevJ = prevK - prevI;
+        tasks[p] = (struct mergeTask){sc, a + prevI * size, b + prevJ * size,
+                                      i - prevI, j - prevJ, out + prevK * size, level};
+        prevK = k;
+        prevI = i;
+    }
+    for (int p = 1; p < threads; p++)
+        spawned[p] = pthread_create(&tids[p], NULL, merge_thread, &tasks[p]) == 0;
+    merge_thread(&tasks[0]);
+    for (int p = 1; p < threads; p++)
+    {
+        if (spawned[p])
+        {
+            TRACE_SPAN(span);
+            TRACE_BEGIN(span, TRACE_WAIT, level, 0);
+            pthread_join(tids[p], NULL);
+            TRACE_END(span);
+        }
+        else
+            merge_thread(&tasks[p]);
+    }
+    free(tasks);
+    free(tids);
+    free(spawned);
+}
+
+size_t psort_co_rank(const struct sortCtx *sc, size_t k, const char *a, size_t na,
+                     const char *b, size_t nb)
+{
+    return co_rank(k, a, na, b, nb, sc);
+}
+
+void psort_merge_parallel(const struct sortCtx *sc, const char *a, size_t na,
+                          const char *b, size_t nb, char *out, int threads)
+{
+    merge_parallel(sc, a, na, b, nb, out, threads, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Recursion.
+
+struct sortTask
+{
+    const struct sortCtx *sc;
+    char *a;     // data to sort
+    char *b;     // scratch region of the same length
+    size_t n;
+    int intoB;   // leave the sorted result in b instead of a
+    int threads; // threads this subtree may use (including the caller)
+    int level;   // depth in the recursion, for tracing
+};
+
+static void sort_rec(struct sortTask *t);
+
+static void *sort_thread(void *arg)
+{
+    sort_rec(arg);
+    return NULL;
+}
+
+static void sort_rec(struct sortTask *t)
+{
+    const struct sortCtx *sc = t->sc;
+    size_t size = sc->size;
+    TRACE_SPAN(sub);
+    TRACE_BEGIN(sub, TRACE_SUBTREE, t->level, t->n);
+    if (t->n <= sc->cutoff)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_BASE, t->level, t->n);
+        sc->ops->isort(t->a, t->n, sc);
+        TRACE_END(span);
+        if (t->intoB)
+        {
+            TRACE_BEGIN(span, TRACE_COPY, t->level, t->n);
+            memcpy(t->b, t->a, t->n * size);
+            TRACE_COUNT(0, t->n);
+            TRACE_END(span);
+        }
+        TRACE_END(sub);
+        return;
+    }
+
+    // Sort both halves into the other buffer, then merge them back here.
+    size_t mid = t->n / 2;
+    struct sortTask left = {sc, t->a, t->b, mid, !t->intoB, t->threads / 2, t->level + 1};
+    struct sortTask right = {sc, t->a + mid * size, t->b + mid * size,
+                             t->n - mid, !t->intoB, t->threads - t->threads / 2, t->level + 1};
+
+    pthread_t tid;
+    int spawned = 0;
+    if (t->threads > 1 && t->n >= sc->minParallel)
+        spawned = pthread_create(&tid, NULL, sort_thread, &left) == 0;
+    if (!spawned)
+        sort_rec(&left);
+    sort_rec(&right);
+    if (spawned)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_WAIT, t->level, 0);
+        pthread_join(tid, NULL);
+        TRACE_END(span);
+    }
+
+    char *src = t->intoB ? t->a : t->b;
+    char *dst = t->intoB ? t->b : t->a;
+    merge_parallel(sc, src, mid, src + mid * size, t->n - mid, dst, t->threads, t->level);
+    TRACE_END(sub);
+}
+
+void psort_ctx_init(struct sortCtx *sc, size_t size, psort_cmp_fn cmp,
+                    void *ctx, const struct sortPolicy *policy)
+{
+    sc->size = size;
+    sc->cmp = cmp;
+    sc->ctx = ctx;
+    sc->cutoff = policy->cutoff ? policy->cutoff : 1;
+    sc->minParallel = policy->minParallel ? policy->minParallel : 1;
+    sc->ops = pick_ops(size, cmp);
+    sc->intKeys = sc->ops == &intOps;
+}
+
+void psort_sort_serial(const struct sortCtx *sc, char *a, char *scratch,
+                       size_t n)
+{
+    struct sortTask t = {sc, a, scratch, n, 0, 1, 0};
+    sort_rec(&t);
+}
+
+void psort_sort_into(const struct sortCtx *sc, char *a, char *out, size_t n)
+{
+    struct sortTask t = {sc, a, out, n, 1, 1, 0};
+    sort_rec(&t);
+}
+
+int parallel_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                        void *ctx, const struct sortPolicy *policy)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    if (n < 2 || size == 0)
+        return 0;
+    if (n > SIZE_MAX / size)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct sortCtx sc;
+    psort_ctx_init(&sc, size, cmp, ctx, policy);
+    enum sortStrategy strategy = sort_policy_strategy(policy, n);
+    if (strategy == SORT_MULTIWAY)
+        return multiway_sort(&sc, base, n, policy);
+    if (strategy == SORT_NATURAL)
+        return natural_sort(&sc, base, n, policy);
+    if (strategy == SORT_SAMPLE)
+        return sample_sort(&sc, base, n, policy);
+    if (strategy == SORT_INPLACE)
+        return inplace_sort(&sc, base, n, policy);
+
+    struct sortBuf scratch;
+    if (sort_buf_alloc(&scratch, n * size, policy) != 0)
+        return -1;
+    struct sortTask top = {&sc, base, scratch.data, n, 0, sort_policy_threads(policy), 0};
+    sort_rec(&top);
+    sort_buf_free(&scratch);
+    return 0;
+}
@@ -0,0 +1,77 @@
+// psort.h
+// Generic parallel merge sort engine built on pthreads.
+// Sorts any array of fixed-size elements (qsort-style) with a comparator,
+// using a bounded number of worker threads and one scratch buffer.
+
+#ifndef PSORT_H
+#define PSORT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Comparator: <0 if a sorts before b, 0 if equal, >0 otherwise.
+// ctx is passed through unchanged (may be NULL).
+typedef int (*psort_cmp_fn)(const void *a, const void *b, void *ctx);
+
+enum sortStrategy
+{
+    SORT_BINARY,  // recursive two-way merge sort
+    SORT_MULTIWAY, // cache-sized blocks, then K-way loser-tree merges
+    SORT_NATURAL,  // natural runs merged TimSort-style; ~O(n) on presorted input
+    SORT_SAMPLE,   // splitter-tree sample sort; scales past the merge levels
+    SORT_INPLACE,  // buffered block merges; O(sqrt n) memory per thread
+    SORT_AUTO      // SORT_SAMPLE or SORT_BINARY by thread count and n
+};
+
+struct sortPolicy
+{
+    int threads;               // worker threads to use; 0 = all online CPUs
+    size_t cutoff;             // subarrays this small are insertion-sorted
+    enum sortStrategy strategy;
+    size_t blockBytes;         // SORT_MULTIWAY: size of the initial sorted blocks
+    int fanout;                // SORT_MULTIWAY: most runs merged at once
+    int hugePages;             // back large scratch buffers with huge pages
+    size_t minParallel;        // subarrays this small are not split across threads
+    size_t radixMinN;          // for callers choosing between radix_sort and
+                               // this engine: 32-bit keys this many go to radix
+                               // (0: radix_preferred decides)
+};
+
+// Fill in the defaults: all online CPUs, cutoff of 32 elements, binary
+// strategy, 256 KiB blocks and a fanout of 256 for the multiway strategy,
+// ordinary pages, no thread split below 8192 elements, and radix_preferred.
+void sort_policy_init(struct sortPolicy *policy);
+
+// Number of threads a policy resolves to (never less than 1).
+int sort_policy_threads(const struct sortPolicy *policy);
+
+// Strategy a policy resolves to for n elements. SORT_AUTO picks sample
+// sort at PSORT_SAMPLE_MIN_THREADS threads or more and at least
+// PSORT_SAMPLE_MIN_N elements, where the log P merge levels stop scaling;
+// otherwise binary merge sort. Other strategies are returned unchanged.
+#define PSORT_SAMPLE_MIN_THREADS 16
+#define PSORT_SAMPLE_MIN_N ((size_t)1 << 20)
+enum sortStrategy sort_policy_strategy(const struct sortPolicy *policy, size_t n);
+
+// Stable parallel merge sort of n elements of `size` bytes starting at base.
+// policy may be NULL for the defaults.
+// Returns 0 on success, -1 (errno set) if the scratch buffer can't be allocated.
+int parallel_merge_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                        void *ctx, const struct sortPolicy *policy);
+
+// Ready-made comparators for plain keys. Passing one of these (with the
+// matching element size) makes the engine use a type-specialised kernel
+// that compares inline instead of calling through the pointer.
+int psort_cmp_int(const void *a, const void *b, void *ctx);
+int psort_cmp_int64(const void *a, const void *b, void *ctx);  // int64_t
+int psort_cmp_uint64(const void *a, const void *b, void *ctx); // uint64_t
+int psort_cmp_double(const void *a, const void *b, void *ctx); // radix_sort's order
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PSORT_H
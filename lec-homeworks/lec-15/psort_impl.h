@@ -0,0 +1,95 @@
+// psort_impl.h
+// Engine internals shared by the sort strategies in psort.c and its
+// sibling files. Not part of the public API.
+
+#ifndef PSORT_IMPL_H
+#define PSORT_IMPL_H
+
+#include "psort.h"
+
+#include <string.h>
+
+struct sortCtx;
+
+// Element kernels. The strategies only move bytes around; everything that
+// looks at element values goes through one of these tables.
+struct sortOps
+{
+    void (*isort)(char *a, size_t n, const struct sortCtx *sc);
+    void (*merge)(const char *a, size_t na, const char *b, size_t nb,
+                  char *out, const struct sortCtx *sc);
+};
+
+struct sortCtx
+{
+    size_t size;
+    psort_cmp_fn cmp;
+    void *ctx;
+    size_t cutoff;
+    size_t minParallel;
+    const struct sortOps *ops;
+    int intKeys; // elements are plain ints compared with psort_cmp_int
+};
+
+void psort_ctx_init(struct sortCtx *sc, size_t size, psort_cmp_fn cmp,
+                    void *ctx, const struct sortPolicy *policy);
+
+// Single-threaded sort of a[0..n) in place, using scratch[0..n) as the
+// merge buffer.
+void psort_sort_serial(const struct sortCtx *sc, char *a, char *scratch,
+                       size_t n);
+
+// Single-threaded sort of a[0..n) into out[0..n); a is left scrambled.
+void psort_sort_into(const struct sortCtx *sc, char *a, char *out, size_t n);
+
+// Elements of a among the first k outputs of the stable merge of
+// a[0..na) and b[0..nb); the other k - i come from b. Lets several
+// workers each merge one share of the output independently.
+size_t psort_co_rank(const struct sortCtx *sc, size_t k, const char *a, size_t na,
+                     const char *b, size_t nb);
+
+// Stable merge of a[0..na) and b[0..nb) into out, split across up to
+// `threads` threads. out must not overlap the inputs.
+void psort_merge_parallel(const struct sortCtx *sc, const char *a, size_t na,
+                          const char *b, size_t nb, char *out, int threads);
+
+// Copy one element. Small power-of-two sizes get a constant-size memcpy so
+// the compiler turns it into a single load/store instead of a library call.
+static inline void psort_move(char *dst, const char *src, size_t size)
+{
+    switch (size)
+    {
+    case 4:
+        memcpy(dst, src, 4);
+        break;
+    case 8:
+        memcpy(dst, src, 8);
+        break;
+    case 16:
+        memcpy(dst, src, 16);
+        break;
+    default:
+        memcpy(dst, src, size);
+    }
+}
+
+// a sorts strictly before b.
+static inline int psort_less(const struct sortCtx *sc, const char *a,
+                             const char *b)
+{
+    if (sc->intKeys)
+        return *(const int *)a < *(const int *)b;
+    return sc->cmp(a, b, sc->ctx) < 0;
+}
+
+// Strategies. Each sorts base[0..n) and returns 0, or -1 with errno set.
+int multiway_sort(const struct sortCtx *sc, char *base, size_t n,
+                  const struct sortPolicy *policy);
+int natural_sort(const struct sortCtx *sc, char *base, size_t n,
+                 const struct sortPolicy *policy);
+int sample_sort(const struct sortCtx *sc, char *base, size_t n,
+                const struct sortPolicy *policy);
+int inplace_sort(const struct sortCtx *sc, char *base, size_t n,
+                 const struct sortPolicy *policy);
+
+#endif // PSORT_IMPL_H
@@ -0,0 +1,299 @@
+// radix.c
+// Parallel LSD radix sort, 8 bits per pass. Each worker owns a contiguous
+// slice of the input and builds a histogram of it. The histograms of all
+// workers then give every worker its own output offset per digit, so the
+// scatter needs no locking and stays stable. Scatters go through a
+// one-cache-line write-combining buffer per digit, so each store to the
+// destination is a full line instead of a random 4 or 8 byte write.
+//
+// Signed and float keys are flipped to an unsigned order before the first
+// pass and flipped back afterwards. A pass where every key has the same
+// digit is skipped.
+
+#include "radix.h"
+#include "team.h"
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RADIX_BUCKETS 256
+#define WC_BYTES 64
+
+// Below this many keys per worker, extra threads cost more than they save.
+#define RADIX_MIN_PER_THREAD 65536
+
+struct radixShared
+{
+    char *base;
+    char *scratch;
+    size_t n;
+    enum radixKey type;
+    size_t width;
+    size_t firstPass; // low bytes that are not part of the key
+    size_t *hist[2]; // team->size x RADIX_BUCKETS, alternating per pass
+    char *wc;        // per-worker write-combining buffers
+};
+
+size_t radix_key_size(enum radixKey type)
+{
+    switch (type)
+    {
+    case RADIX_I32:
+    case RADIX_U32:
+    case RADIX_F32:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+int radix_preferred(enum radixKey type, size_t n)
+{
+    // Radix does width/8 full passes regardless of n; merge sort does
+    // log2(n) passes. Small arrays fit in cache and favour merge sort.
+    return n >= (radix_key_size(type) == 4 ? 4096 : 16384);
+}
+
+int radix_policy_preferred(enum radixKey type, size_t n, const struct sortPolicy *policy)
+{
+    if (policy && policy->radixMinN && radix_key_size(type) == 4)
+        return n >= policy->radixMinN;
+    return radix_preferred(type, n);
+}
+
+// ---------------------------------------------------------------------------
+// Key flipping, so plain unsigned order matches the key order.
+
+static void flip_keys(char *p, size_t n, enum radixKey type, int undo)
+{
+    if (type == RADIX_I32 || type == RADIX_F32)
+    {
+        uint32_t *k = (uint32_t *)p;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t x = k[i], mask;
+            if (type == RADIX_I32)
+                mask = 0x80000000u;
+            else if (!undo) // negative floats: invert all bits
+                mask = (uint32_t)-(int32_t)(x >> 31) | 0x80000000u;
+            else
+                mask = ((x >> 31) - 1) | 0x80000000u;
+            k[i] = x ^ mask;
+        }
+    }
+    else if (type == RADIX_I64 || type == RADIX_F64)
+    {
+        uint64_t *k = (uint64_t *)p;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t x = k[i], mask;
+            if (type == RADIX_I64)
+                mask = 0x8000000000000000ull;
+            else if (!undo)
+                mask = (uint64_t)-(int64_t)(x >> 63) | 0x8000000000000000ull;
+            else
+                mask = ((x >> 63) - 1) | 0x8000000000000000ull;
+            k[i] = x ^ mask;
+        }
+    }
+}
+
+uint64_t radix_key_bits(const void *key, enum radixKey type)
+{
+    if (radix_key_size(type) == 4)
+    {
+        uint32_t x;
+        memcpy(&x, key, sizeof(x));
+        flip_keys((char *)&x, 1, type, 0);
+        return x;
+    }
+    uint64_t x;
+    memcpy(&x, key, sizeof(x));
+    flip_keys((char *)&x, 1, type, 0);
+    return x;
+}
+
+// ---------------------------------------------------------------------------
+// Per-width kernels.
+
+static void histogram(const char *src, size_t lo, size_t hi, size_t width,
+                      int shift, size_t *hist)
+{
+    memset(hist, 0, RADIX_BUCKETS * sizeof(*hist));
+    if (width == 4)
+    {
+        const uint32_t *k = (const uint32_t *)src;
+        for (size_t i = lo; i < hi; i++)
+            hist[(k[i] >> shift) & 0xff]++;
+    }
+    else
+    {
+        const uint64_t *k = (const uint64_t *)src;
+        for (size_t i = lo; i < hi; i++)
+            hist[(k[i] >> shift) & 0xff]++;
+    }
+}
+
+static void scatter32(const uint32_t *src, size_t lo, size_t hi, int shift,
+                      uint32_t *dst, size_t *pos, char *wcmem)
+{
+    enum { PER_LINE = WC_BYTES / sizeof(uint32_t) };
+    uint32_t(*wc)[PER_LINE] = (uint32_t(*)[PER_LINE])wcmem;
+    unsigned fill[RADIX_BUCKETS] = {0};
+    for (size_t i = lo; i < hi; i++)
+    {
+        uint32_t v = src[i];
+        unsigned d = (v >> shift) & 0xff;
+        wc[d][fill[d]++] = v;
+        if (fill[d] == PER_LINE)
+        {
+            memcpy(dst + pos[d], wc[d], WC_BYTES);
+            pos[d] += PER_LINE;
+            fill[d] = 0;
+        }
+    }
+    for (unsigned d = 0; d < RADIX_BUCKETS; d++)
+        memcpy(dst + pos[d], wc[d], fill[d] * sizeof(uint32_t));
+}
+
+static void scatter64(const uint64_t *src, size_t lo, size_t hi, int shift,
+                      uint64_t *dst, size_t *pos, char *wcmem)
+{
+    enum { PER_LINE = WC_BYTES / sizeof(uint64_t) };
+    uint64_t(*wc)[PER_LINE] = (uint64_t(*)[PER_LINE])wcmem;
+    unsigned fill[RADIX_BUCKETS] = {0};
+    for (size_t i = lo; i < hi; i++)
+    {
+        uint64_t v = src[i];
+        unsigned d = (v >> shift) & 0xff;
+        wc[d][fill[d]++] = v;
+        if (fill[d] == PER_LINE)
+        {
+            memcpy(dst + pos[d], wc[d], WC_BYTES);
+            pos[d] += PER_LINE;
+            fill[d] = 0;
+        }
+    }
+    for (unsigned d = 0; d < RADIX_BUCKETS; d++)
+        memcpy(dst + pos[d], wc[d], fill[d] * sizeof(uint64_t));
+}
+
+// ---------------------------------------------------------------------------
+
+static void radix_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct radixShared *sh = arg;
+    size_t width = sh->width;
+    size_t lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    flip_keys(sh->base + lo * width, hi - lo, sh->type, 0);
+    team_barrier(team);
+
+    char *src = sh->base, *dst = sh->scratch;
+    char *wc = sh->wc + (size_t)id * RADIX_BUCKETS * WC_BYTES;
+    size_t pos[RADIX_BUCKETS];
+    for (int pass = (int)sh->firstPass; pass < (int)width; pass++)
+    {
+        int shift = pass * 8;
+        size_t *hist = sh->hist[pass & 1];
+        histogram(src, lo, hi, width, shift, hist + (size_t)id * RADIX_BUCKETS);
+        team_barrier(team);
+
+        // My offset for digit d: every key with a smaller digit, plus the
+        // keys with digit d in the slices of lower-numbered workers.
+        size_t start = 0;
+        int trivial = 0;
+        for (int d = 0; d < RADIX_BUCKETS; d++)
+        {
+            size_t total = 0;
+            for (int t = 0; t < team->size; t++)
+            {
+                if (t == id)
+                    pos[d] = start + total;
+                total += hist[(size_t)t * RADIX_BUCKETS + d];
+            }
+            if (total == sh->n)
+                trivial = 1;
+            start += total;
+        }
+        // Every worker reaches the same verdict, so skipping is safe. The
+        // histograms alternate buffers, so nobody overwrites this one
+        // before the others have read it.
+        if (trivial)
+            continue;
+
+        if (width == 4)
+            scatter32((const uint32_t *)src, lo, hi, shift, (uint32_t *)dst, pos, wc);
+        else
+            scatter64((const uint64_t *)src, lo, hi, shift, (uint64_t *)dst, pos, wc);
+        team_barrier(team);
+        char *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    flip_keys(src + lo * width, hi - lo, sh->type, 1);
+    if (src != sh->base)
+        memcpy(sh->base + lo * width, src + lo * width, (hi - lo) * width);
+}
+
+static int radix_run(void *base, size_t n, enum radixKey type, size_t firstPass,
+                     const struct sortPolicy *policy)
+{
+    if (n < 2)
+        return 0;
+    size_t width = radix_key_size(type);
+    if (n > SIZE_MAX / width)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    int threads = sort_policy_threads(policy);
+    size_t maxThreads = n / RADIX_MIN_PER_THREAD + 1;
+    if ((size_t)threads > maxThreads)
+        threads = (int)maxThreads;
+
+    struct sortBuf scratch;
+    if (sort_buf_alloc(&scratch, n * width, policy) != 0)
+        return -1;
+    struct radixShared sh = {base, scratch.data, n, type, width, firstPass,
+                             {calloc((size_t)threads * RADIX_BUCKETS, sizeof(size_t)),
+                              calloc((size_t)threads * RADIX_BUCKETS, sizeof(size_t))},
+                             aligned_alloc(WC_BYTES, (size_t)threads * RADIX_BUCKETS * WC_BYTES)};
+    int rc = 0;
+    if (!sh.hist[0] || !sh.hist[1] || !sh.wc)
+        rc = -1;
+    else
+        team_run(threads, radix_worker, &sh);
+
+    sort_buf_free(&scratch);
+    free(sh.hist[0]);
+    free(sh.hist[1]);
+    free(sh.wc);
+    if (rc)
+        errno = ENOMEM;
+    return rc;
+}
+
+int radix_sort(void *base, size_t n, enum radixKey type,
+               const struct sortPolicy *policy)
+{
+    return radix_run(base, n, type, 0, policy);
+}
+
+int radix_sort_prefix(void *base, size_t n, enum radixKey type, size_t keyBytes,
+                      const struct sortPolicy *policy)
+{
+    if ((type != RADIX_U32 && type != RADIX_U64) || keyBytes == 0 ||
+        keyBytes > radix_key_size(type))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return radix_run(base, n, type, radix_key_size(type) - keyBytes, policy);
+}
@@ -0,0 +1,60 @@
+// radix.h
+// Parallel LSD radix sort for plain 32- and 64-bit integer and float keys.
+
+#ifndef RADIX_H
+#define RADIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum radixKey
+{
+    RADIX_I32,
+    RADIX_U32,
+    RADIX_F32,
+    RADIX_I64,
+    RADIX_U64,
+    RADIX_F64
+};
+
+// Size in bytes of one key of the given type.
+size_t radix_key_size(enum radixKey type);
+
+// Sort n keys of the given type in ascending order. The sort is stable and
+// uses one scratch buffer of n keys. Floats order as -inf < ... < -0 < +0
+// < ... < +inf, with NaNs placed by their sign bit at either end.
+// Returns 0 on success, -1 (errno set) on allocation failure.
+int radix_sort(void *base, size_t n, enum radixKey type,
+               const struct sortPolicy *policy);
+
+// Like radix_sort for RADIX_U32 or RADIX_U64, but only the top keyBytes
+// bytes of each value count as key; the bytes below ride along in input
+// order. For (key << 32 | index) pairs made in index order, keyBytes 4
+// gives the stable order by key in half the passes. Returns 0, or -1
+// (errno set: EINVAL for another type or keyBytes out of range).
+int radix_sort_prefix(void *base, size_t n, enum radixKey type, size_t keyBytes,
+                      const struct sortPolicy *policy);
+
+// The key at `key` (any alignment) as an unsigned value whose plain
+// integer order matches the key order.
+uint64_t radix_key_bits(const void *key, enum radixKey type);
+
+// Nonzero if radix_sort is expected to beat the merge engine for n keys
+// of this type. Used by the driver to pick an engine automatically.
+int radix_preferred(enum radixKey type, size_t n);
+
+// radix_preferred, unless policy (which may be NULL) carries a tuned
+// crossover for 32-bit keys in radixMinN.
+int radix_policy_preferred(enum radixKey type, size_t n, const struct sortPolicy *policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RADIX_H
@@ -0,0 +1,508 @@
+// runstore.c
+// LSM-style store of sorted runs.
+//
+// Runs are immutable and kept oldest first. Every merge replaces a
+// contiguous group of runs by one run in their place, so levels never
+// increase from older to newer runs, and equal elements from older runs
+// always sort first. That is what keeps scans in append order on ties.
+//
+// Tiered: once a level holds `fanout` runs they are merged into one run on
+// the next level. Each element is rewritten once per level, so the
+// write amplification is about the number of levels. Scans see up to
+// fanout - 1 runs per level.
+//
+// Levelled: level 0 takes the appended runs. Every other level holds one
+// run, and level i may reach batch * fanout^(i+1) elements. Once fanout
+// runs wait on level 0 they are merged into the level 1 run. A level over
+// its size moves into the next one. Scans see only about one run per
+// level, but each element is rewritten up to fanout times per level.
+//
+// A merge runs outside the lock, since only the merge thread removes
+// runs. A run holds one reference for the list plus one per scan using
+// it, so a merge can retire runs that a scan is still reading.
+
+#include "runstore.h"
+#include "psort_impl.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct srRun
+{
+    char *data;
+    size_t n;
+    int level;
+    int refs;
+};
+
+struct runStore
+{
+    struct runStoreConfig cfg;
+    struct sortPolicy policy;
+    struct sortCtx sc;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // runs appended, or stop
+    pthread_cond_t done; // a merge finished, or the merge thread went idle
+    struct srRun **run;  // live runs, oldest first
+    size_t nRuns, capRuns;
+    size_t batchMax;     // largest batch appended; the levelled size unit
+    int merging, stop;
+    struct runStoreStats st;
+    pthread_t thread;
+};
+
+static void run_unref(struct srRun *r)
+{
+    if (--r->refs == 0)
+    {
+        free(r->data);
+        free(r);
+    }
+}
+
+// Runs on level `level`: they are contiguous, at [*first, *first + count).
+static size_t level_runs(const struct runStore *rs, int level, size_t *first)
+{
+    size_t i = 0;
+    while (i < rs->nRuns && rs->run[i]->level > level)
+        i++;
+    *first = i;
+    while (i < rs->nRuns && rs->run[i]->level == level)
+        i++;
+    return i - *first;
+}
+
+// Next merge to do, as runs [*first, *first + *count) into one run on
+// *level. Returns 0 if there is nothing to merge. Called with the lock.
+static int pick_job(const struct runStore *rs, size_t *first, size_t *count, int *level)
+{
+    size_t fanout = (size_t)rs->cfg.fanout;
+    int top = rs->nRuns ? rs->run[0]->level : 0;
+    if (rs->cfg.mergePolicy == RUNS_TIERED)
+    {
+        for (int l = 0; l <= top; l++)
+            if ((*count = level_runs(rs, l, first)) >= fanout)
+            {
+                *level = l + 1;
+                return 1;
+            }
+        return 0;
+    }
+
+    size_t l1;
+    if (level_runs(rs, 0, first) >= fanout)
+    {
+        // Level 0 into the level 1 run, which sits just before it.
+        *count = rs->nRuns - *first;
+        if (level_runs(rs, 1, &l1) > 0)
+        {
+            *first = l1;
+            *count = rs->nRuns - l1;
+        }
+        *level = 1;
+        return 1;
+    }
+    double cap = (double)rs->batchMax * fanout;
+    for (int l = 1; l <= top; l++)
+    {
+        cap *= fanout;
+        if (level_runs(rs, l, first) == 1 && rs->run[*first]->n > cap)
+        {
+            size_t next;
+            *count = 1;
+            if (level_runs(rs, l + 1, &next) > 0)
+            {
+                *first = next;
+                *count = 2;
+            }
+            *level = l + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Merge runs in[0..k), oldest first, into one buffer by rounds of stable
+// two-way parallel merges, ping-ponging between two buffers.
+static char *merge_group(struct runStore *rs, struct srRun **in, size_t k, size_t *nOut)
+{
+    const struct sortCtx *sc = &rs->sc;
+    size_t size = sc->size, n = 0;
+    for (size_t i = 0; i < k; i++)
+        n += in[i]->n;
+    size_t *cut = malloc((k + 1) * sizeof(*cut));
+    char *buf[2] = {malloc(n * size + 1), malloc(n * size + 1)};
+    if (!cut || !buf[0] || !buf[1])
+    {
+        free(cut);
+        free(buf[0]);
+        free(buf[1]);
+        return NULL;
+    }
+    int threads = sort_policy_threads(&rs->policy);
+
+    // First round straight from the runs; segment j is [cut[j], cut[j+1]).
+    size_t segs = 0, at = 0;
+    for (size_t i = 0; i < k; i += 2)
+    {
+        cut[segs++] = at;
+        if (i + 1 < k)
+            psort_merge_parallel(sc, in[i]->data, in[i]->n, in[i + 1]->data, in[i + 1]->n,
+                                 buf[0] + at * size, threads);
+        else
+            memcpy(buf[0] + at * size, in[i]->data, in[i]->n * size);
+        at += in[i]->n + (i + 1 < k ? in[i + 1]->n : 0);
+    }
+    cut[segs] = n;
+
+    int src = 0;
+    while (segs > 1)
+    {
+        size_t out = 0;
+        for (size_t j = 0; j < segs; j += 2)
+        {
+            size_t lo = cut[j], mid = cut[j + 1], hi = j + 2 <= segs ? cut[j + 2] : mid;
+            if (j + 1 < segs)
+                psort_merge_parallel(sc, buf[src] + lo * size, mid - lo, buf[src] + mid * size,
+                                     hi - mid, buf[!src] + lo * size, threads);
+            else
+                memcpy(buf[!src] + lo * size, buf[src] + lo * size, (mid - lo) * size);
+            cut[out++] = lo;
+        }
+        cut[out] = n;
+        segs = out;
+        src = !src;
+    }
+    free(cut);
+    free(buf[!src]);
+    *nOut = n;
+    return buf[src];
+}
+
+static void *merge_thread(void *arg)
+{
+    struct runStore *rs = arg;
+    pthread_mutex_lock(&rs->lock);
+    for (;;)
+    {
+        size_t first, count;
+        int level;
+        while (!rs->stop && !pick_job(rs, &first, &count, &level))
+        {
+            rs->merging = 0;
+            pthread_cond_broadcast(&rs->done);
+            pthread_cond_wait(&rs->work, &rs->lock);
+        }
+        if (rs->stop)
+            break;
+        if (count == 1)
+        {
+            // Levelled, with nothing on the next level: just move it down.
+            rs->run[first]->level = level;
+            continue;
+        }
+        rs->merging = 1;
+        struct srRun **in = malloc(count * sizeof(*in));
+        struct srRun *out = malloc(sizeof(*out));
+        if (!in || !out)
+        {
+            // Out of memory: leave the runs unmerged and wait for more
+            // appends to try again.
+            free(in);
+            free(out);
+            rs->merging = 0;
+            pthread_cond_broadcast(&rs->done);
+            pthread_cond_wait(&rs->work, &rs->lock);
+            continue;
+        }
+        memcpy(in, rs->run + first, count * sizeof(*in));
+        pthread_mutex_unlock(&rs->lock);
+
+        double t0 = now();
+        out->data = merge_group(rs, in, count, &out->n);
+        out->level = level;
+        out->refs = 1;
+        double secs = now() - t0;
+
+        pthread_mutex_lock(&rs->lock);
+        if (!out->data)
+        {
+            free(in);
+            free(out);
+            rs->merging = 0;
+            pthread_cond_broadcast(&rs->done);
+            pthread_cond_wait(&rs->work, &rs->lock);
+            continue;
+        }
+        // Appends only add runs at the end, so the group is where it was.
+        rs->run[first] = out;
+        memmove(rs->run + first + 1, rs->run + first + count,
+                (rs->nRuns - first - count) * sizeof(*rs->run));
+        rs->nRuns -= count - 1;
+        for (size_t i = 0; i < count; i++)
+            run_unref(in[i]);
+        free(in);
+        rs->st.written += out->n;
+        rs->st.merges++;
+        rs->st.mergeSeconds += secs;
+        pthread_cond_broadcast(&rs->done);
+    }
+    pthread_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+struct runStore *run_store_open(const struct runStoreConfig *cfg)
+{
+    if (cfg->size == 0 || cfg->fanout < 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct runStore *rs = calloc(1, sizeof(*rs));
+    if (!rs)
+        return NULL;
+    rs->cfg = *cfg;
+    if (rs->cfg.stallRuns <= 0)
+        rs->cfg.stallRuns = 4 * cfg->fanout;
+    if (cfg->policy)
+        rs->policy = *cfg->policy;
+    else
+        sort_policy_init(&rs->policy);
+    rs->cfg.policy = &rs->policy;
+    psort_ctx_init(&rs->sc, cfg->size, cfg->cmp, cfg->ctx, &rs->policy);
+    pthread_mutex_init(&rs->lock, NULL);
+    pthread_cond_init(&rs->work, NULL);
+    pthread_cond_init(&rs->done, NULL);
+    rs->merging = 1; // until the merge thread first goes idle
+    int err = pthread_create(&rs->thread, NULL, merge_thread, rs);
+    if (err != 0)
+    {
+        pthread_cond_destroy(&rs->done);
+        pthread_cond_destroy(&rs->work);
+        pthread_mutex_destroy(&rs->lock);
+        free(rs);
+        errno = err;
+        return NULL;
+    }
+    return rs;
+}
+
+void run_store_close(struct runStore *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    rs->stop = 1;
+    pthread_cond_signal(&rs->work);
+    pthread_cond_broadcast(&rs->done);
+    pthread_mutex_unlock(&rs->lock);
+    pthread_join(rs->thread, NULL);
+    for (size_t i = 0; i < rs->nRuns; i++)
+        run_unref(rs->run[i]);
+    free(rs->run);
+    pthread_cond_destroy(&rs->done);
+    pthread_cond_destroy(&rs->work);
+    pthread_mutex_destroy(&rs->lock);
+    free(rs);
+}
+
+int run_store_append(struct runStore *rs, const void *batch, size_t n)
+{
+    if (n == 0)
+        return 0;
+    size_t size = rs->cfg.size;
+    struct srRun *r = malloc(sizeof(*r));
+    char *data = malloc(n * size);
+    if (!r || !data)
+    {
+        free(r);
+        free(data);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(data, batch, n * size);
+    if (parallel_merge_sort(data, n, size, rs->cfg.cmp, rs->cfg.ctx, &rs->policy) != 0)
+    {
+        free(r);
+        free(data);
+        return -1;
+    }
+    *r = (struct srRun){data, n, 0, 1};
+
+    pthread_mutex_lock(&rs->lock);
+    size_t first;
+    double t0 = 0;
+    while (!rs->stop && level_runs(rs, 0, &first) >= (size_t)rs->cfg.stallRuns)
+    {
+        if (t0 == 0)
+            t0 = now();
+        pthread_cond_wait(&rs->done, &rs->lock);
+    }
+    if (t0 != 0)
+        rs->st.stallSeconds += now() - t0;
+    if (rs->nRuns == rs->capRuns)
+    {
+        size_t cap = rs->capRuns ? 2 * rs->capRuns : 16;
+        struct srRun **run = realloc(rs->run, cap * sizeof(*run));
+        if (!run)
+        {
+            pthread_mutex_unlock(&rs->lock);
+            free(data);
+            free(r);
+            errno = ENOMEM;
+            return -1;
+        }
+        rs->run = run;
+        rs->capRuns = cap;
+    }
+    rs->run[rs->nRuns++] = r;
+    if (n > rs->batchMax)
+        rs->batchMax = n;
+    rs->st.appended += n;
+    rs->st.written += n;
+    pthread_cond_signal(&rs->work);
+    pthread_mutex_unlock(&rs->lock);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Scans.
+
+// First element of a[0..n) not before key (upper: first after key).
+static size_t bound(const struct sortCtx *sc, const char *a, size_t n, const char *key,
+                    int upper)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *e = a + mid * sc->size;
+        if (upper ? !psort_less(sc, key, e) : psort_less(sc, e, key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+struct scanCursor
+{
+    const char *at, *end;
+    size_t age; // position in the snapshot; older runs win ties
+};
+
+static int cursor_before(const struct sortCtx *sc, const struct scanCursor *x,
+                         const struct scanCursor *y)
+{
+    if (psort_less(sc, x->at, y->at))
+        return 1;
+    return !psort_less(sc, y->at, x->at) && x->age < y->age;
+}
+
+static void sift_down(const struct sortCtx *sc, struct scanCursor *h, size_t n, size_t i)
+{
+    for (;;)
+    {
+        size_t l = 2 * i + 1, m = i;
+        if (l < n && cursor_before(sc, &h[l], &h[m]))
+            m = l;
+        if (l + 1 < n && cursor_before(sc, &h[l + 1], &h[m]))
+            m = l + 1;
+        if (m == i)
+            return;
+        struct scanCursor t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+size_t run_store_scan(struct runStore *rs, const void *lo, const void *hi,
+                      void *out, size_t max)
+{
+    const struct sortCtx *sc = &rs->sc;
+    size_t size = sc->size;
+
+    pthread_mutex_lock(&rs->lock);
+    size_t k = rs->nRuns;
+    struct srRun **snap = malloc((k ? k : 1) * sizeof(*snap));
+    struct scanCursor *heap = malloc((k ? k : 1) * sizeof(*heap));
+    if (!snap || !heap)
+    {
+        pthread_mutex_unlock(&rs->lock);
+        free(snap);
+        free(heap);
+        errno = ENOMEM;
+        return (size_t)-1;
+    }
+    for (size_t i = 0; i < k; i++)
+    {
+        snap[i] = rs->run[i];
+        snap[i]->refs++;
+    }
+    pthread_mutex_unlock(&rs->lock);
+
+    size_t live = 0;
+    for (size_t i = 0; i < k; i++)
+    {
+        const struct srRun *r = snap[i];
+        size_t a = bound(sc, r->data, r->n, lo, 0), b = bound(sc, r->data, r->n, hi, 1);
+        if (a < b)
+            heap[live++] = (struct scanCursor){r->data + a * size, r->data + b * size, i};
+    }
+    for (size_t i = live; i-- > 0;)
+        sift_down(sc, heap, live, i);
+
+    char *dst = out;
+    size_t got = 0;
+    while (live > 0 && got < max)
+    {
+        // A single cursor left: copy the rest of it in one go.
+        if (live == 1)
+        {
+            size_t take = (size_t)(heap[0].end - heap[0].at) / size;
+            if (take > max - got)
+                take = max - got;
+            memcpy(dst + got * size, heap[0].at, take * size);
+            got += take;
+            break;
+        }
+        psort_move(dst + got * size, heap[0].at, size);
+        got++;
+        heap[0].at += size;
+        if (heap[0].at == heap[0].end)
+            heap[0] = heap[--live];
+        sift_down(sc, heap, live, 0);
+    }
+
+    pthread_mutex_lock(&rs->lock);
+    for (size_t i = 0; i < k; i++)
+        run_unref(snap[i]);
+    pthread_mutex_unlock(&rs->lock);
+    free(snap);
+    free(heap);
+    return got;
+}
+
+void run_store_wait_idle(struct runStore *rs)
+{
+    size_t first, count;
+    int level;
+    pthread_mutex_lock(&rs->lock);
+    while (!rs->stop && (rs->merging || pick_job(rs, &first, &count, &level)))
+        pthread_cond_wait(&rs->done, &rs->lock);
+    pthread_mutex_unlock(&rs->lock);
+}
+
+void run_store_stats(struct runStore *rs, struct runStoreStats *stats)
+{
+    pthread_mutex_lock(&rs->lock);
+    *stats = rs->st;
+    stats->elements = 0;
+    stats->runs = rs->nRuns;
+    stats->levels = rs->nRuns ? rs->run[0]->level + 1 : 0;
+    for (size_t i = 0; i < rs->nRuns; i++)
+        stats->elements += rs->run[i]->n;
+    pthread_mutex_unlock(&rs->lock);
+}
@@ -0,0 +1,79 @@
+// runstore.h
+// Incremental sorted store. Appended batches are sorted into runs, and a
+// background thread merges runs LSM-style, so the data stays queryable in
+// sorted order without re-sorting everything on each append.
+
+#ifndef RUNSTORE_H
+#define RUNSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum runMergePolicy
+{
+    RUNS_TIERED,   // merge a level once it holds `fanout` runs; cheap writes
+    RUNS_LEVELLED  // one run per level, each `fanout` times the last; cheap reads
+};
+
+struct runStoreConfig
+{
+    size_t size;                     // bytes per element
+    psort_cmp_fn cmp;
+    void *ctx;                       // passed to cmp
+    enum runMergePolicy mergePolicy;
+    int fanout;                      // runs per tier, or size ratio of levels
+    int stallRuns;                   // appends wait while this many new runs
+                                     // are unmerged (0: 4 * fanout)
+    const struct sortPolicy *policy; // threads for sorts and merges
+};
+
+struct runStoreStats
+{
+    size_t elements;       // live elements
+    size_t runs;           // live runs
+    int levels;            // deepest level in use, plus one
+    uint64_t appended;     // elements appended
+    uint64_t written;      // elements written into runs, by appends and merges
+    uint64_t merges;
+    double mergeSeconds;   // background merge time
+    double stallSeconds;   // time appends waited for merges to catch up
+};
+
+struct runStore;
+
+// Create a store and start its merge thread. Returns NULL (errno set) on
+// failure.
+struct runStore *run_store_open(const struct runStoreConfig *cfg);
+
+// Stop the merge thread and free everything. Scans must have finished.
+void run_store_close(struct runStore *rs);
+
+// Sort a copy of batch[0..n) into a new run. The batch is queryable when
+// this returns. Returns 0, or -1 (errno set) on allocation failure.
+int run_store_append(struct runStore *rs, const void *batch, size_t n);
+
+// Copy the elements e with lo <= e <= hi, in sorted order, to out, at most
+// max of them; equal elements come out in the order they were appended.
+// Runs may be merged meanwhile: the scan works on the runs live when it
+// started. Returns the number copied, or (size_t)-1 (errno set) on
+// allocation failure.
+size_t run_store_scan(struct runStore *rs, const void *lo, const void *hi,
+                      void *out, size_t max);
+
+// Wait until the merge thread has nothing left to do.
+void run_store_wait_idle(struct runStore *rs);
+
+// Write amplification is stats->written / stats->appended.
+void run_store_stats(struct runStore *rs, struct runStoreStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RUNSTORE_H
@@ -0,0 +1,289 @@
+// samplesort.c
+// Parallel sample sort strategy.
+//
+// Splitters are picked from an oversampled, sorted random sample and laid
+// out as an implicit binary search tree. Every element then descends the
+// tree without branches (i = 2i + (tree[i] < x)) to find its bucket. Keys
+// equal to a splitter go to their own equality bucket, which needs no
+// sorting, so heavy duplicates can't make one bucket huge. Each worker
+// counts its slice per bucket, the counts are prefix-summed bucket-major,
+// and each worker scatters its slice to the scratch buffer. Buckets are
+// then sorted independently, straight back into place.
+//
+// This needs one pass over the data to classify and one to scatter, plus
+// bucket-local sorts that fit in cache. There is no log P chain of merge
+// levels, so it keeps scaling at high thread counts.
+//
+// The sort is stable: a key's bucket depends only on its value, the
+// scatter keeps input order within a bucket, and the bucket sort is the
+// stable merge sort.
+
+#include "psort_impl.h"
+#include "team.h"
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SS_MAX_LOG_BUCKETS 8
+// Buckets per thread aimed for, so the bucket sorts balance.
+#define SS_BUCKETS_PER_THREAD 8
+// Smallest average bucket worth splitting further.
+#define SS_MIN_BUCKET 1024
+#define SS_SEED 0x5eed5a3f1e5ull
+
+struct ssShared
+{
+    const struct sortCtx *sc;
+    char *base, *tmp;
+    size_t n;
+    int logK, k;     // k tree leaves, k - 1 splitters
+    int nb;          // 2k - 1 buckets: even ones are ranges, odd ones equal
+    const char *tree;  // tree[1..k) in breadth-first order
+    const char *split; // split[0..k-1), sorted
+    uint16_t *oracle;  // bucket of each element
+    size_t *hist;      // [worker][bucket] counts, then scatter offsets
+    size_t *start;     // bucket b is tmp[start[b], start[b+1])
+    size_t next;       // next bucket to sort
+};
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// ---------------------------------------------------------------------------
+// Classification.
+
+// Index in [0, 2k-1) of x's bucket, after the descent to leaf b (b
+// splitters are less than x): equal to split[b] goes to 2b+1, else 2b.
+static inline int bucket_of(const struct ssShared *sh, int b, const char *x)
+{
+    size_t size = sh->sc->size;
+    return 2 * b + (b < sh->k - 1 && !psort_less(sh->sc, x, sh->split + (size_t)b * size));
+}
+
+static void classify_generic(const struct ssShared *sh, size_t lo, size_t hi,
+                             size_t *hist)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size;
+    for (size_t j = lo; j < hi; j++)
+    {
+        const char *x = sh->base + j * size;
+        size_t i = 1;
+        for (int l = 0; l < sh->logK; l++)
+            i = 2 * i + (size_t)psort_less(sc, sh->tree + i * size, x);
+        int b = bucket_of(sh, (int)(i - (size_t)sh->k), x);
+        sh->oracle[j] = (uint16_t)b;
+        hist[b]++;
+    }
+}
+
+// Int keys: four elements descend the tree in lockstep so their loads
+// overlap, and every step is a compare and an add.
+static void classify_int(const struct ssShared *sh, size_t lo, size_t hi,
+                         size_t *hist)
+{
+    const int *a = (const int *)sh->base;
+    const int *tree = (const int *)sh->tree;
+    const int *split = (const int *)sh->split;
+    int k = sh->k, logK = sh->logK;
+    size_t j = lo;
+    for (; j + 4 <= hi; j += 4)
+    {
+        int x0 = a[j], x1 = a[j + 1], x2 = a[j + 2], x3 = a[j + 3];
+        size_t i0 = 1, i1 = 1, i2 = 1, i3 = 1;
+        for (int l = 0; l < logK; l++)
+        {
+            i0 = 2 * i0 + (tree[i0] < x0);
+            i1 = 2 * i1 + (tree[i1] < x1);
+            i2 = 2 * i2 + (tree[i2] < x2);
+            i3 = 2 * i3 + (tree[i3] < x3);
+        }
+        int b0 = (int)i0 - k, b1 = (int)i1 - k, b2 = (int)i2 - k, b3 = (int)i3 - k;
+        // split[] has one spare slot, so split[k-1] is readable.
+        b0 = 2 * b0 + ((b0 < k - 1) & (split[b0] == x0));
+        b1 = 2 * b1 + ((b1 < k - 1) & (split[b1] == x1));
+        b2 = 2 * b2 + ((b2 < k - 1) & (split[b2] == x2));
+        b3 = 2 * b3 + ((b3 < k - 1) & (split[b3] == x3));
+        sh->oracle[j] = (uint16_t)b0;
+        sh->oracle[j + 1] = (uint16_t)b1;
+        sh->oracle[j + 2] = (uint16_t)b2;
+        sh->oracle[j + 3] = (uint16_t)b3;
+        hist[b0]++;
+        hist[b1]++;
+        hist[b2]++;
+        hist[b3]++;
+    }
+    classify_generic(sh, j, hi, hist);
+}
+
+// ---------------------------------------------------------------------------
+// Splitters.
+
+static void build_tree(char *tree, const char *split, size_t size, size_t node,
+                       int lo, int hi)
+{
+    if (lo >= hi)
+        return;
+    int mid = lo + (hi - lo) / 2;
+    memcpy(tree + node * size, split + (size_t)mid * size, size);
+    build_tree(tree, split, size, 2 * node, lo, mid);
+    build_tree(tree, split, size, 2 * node + 1, mid + 1, hi);
+}
+
+// Pick up to k - 1 distinct splitters from a sorted sample and set up the
+// tree. Lowers logK when the sample has too few distinct keys.
+static int choose_splitters(struct ssShared *sh, int logK, size_t oversample,
+                            char *treeBuf, char *splitBuf)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size, n = sh->n;
+    size_t m = ((size_t)1 << logK) * oversample;
+    char *sample = malloc(2 * m * size);
+    if (!sample)
+        return -1;
+    uint64_t seed = SS_SEED;
+    for (size_t i = 0; i < m; i++)
+        memcpy(sample + i * size, sh->base + (splitmix64(&seed) % n) * size, size);
+    psort_sort_serial(sc, sample, sample + m * size, m);
+
+    // Distinct sample keys, in place.
+    size_t u = 1;
+    for (size_t i = 1; i < m; i++)
+        if (psort_less(sc, sample + (u - 1) * size, sample + i * size))
+            memcpy(sample + u++ * size, sample + i * size, size);
+
+    while (logK > 1 && ((size_t)1 << logK) - 1 > u)
+        logK--;
+    int k = 1 << logK;
+    for (int i = 0; i < k - 1; i++)
+    {
+        // Evenly spaced through the distinct keys, never repeating one.
+        size_t pick = (size_t)(i + 1) * u / (size_t)k;
+        memcpy(splitBuf + (size_t)i * size, sample + pick * size, size);
+    }
+    memcpy(splitBuf + (size_t)(k - 1) * size, splitBuf + (size_t)(k - 2) * size, size);
+    build_tree(treeBuf, splitBuf, size, 1, 0, k - 1);
+    free(sample);
+
+    sh->logK = logK;
+    sh->k = k;
+    sh->nb = 2 * k - 1;
+    sh->tree = treeBuf;
+    sh->split = splitBuf;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Phases.
+
+static void ss_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct ssShared *sh = arg;
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size, lo, hi, nb = (size_t)sh->nb;
+    size_t *hist = sh->hist + (size_t)id * nb;
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    memset(hist, 0, nb * sizeof(*hist));
+    if (sc->intKeys)
+        classify_int(sh, lo, hi, hist);
+    else
+        classify_generic(sh, lo, hi, hist);
+    team_barrier(team);
+
+    // Bucket-major, then worker order: earlier slices land first in each
+    // bucket, which keeps the scatter stable.
+    if (id == 0)
+    {
+        size_t pos = 0;
+        for (size_t b = 0; b < nb; b++)
+        {
+            sh->start[b] = pos;
+            for (int w = 0; w < team->size; w++)
+            {
+                size_t c = sh->hist[(size_t)w * nb + b];
+                sh->hist[(size_t)w * nb + b] = pos;
+                pos += c;
+            }
+        }
+        sh->start[nb] = pos;
+    }
+    team_barrier(team);
+
+    for (size_t j = lo; j < hi; j++)
+        memcpy(sh->tmp + hist[sh->oracle[j]]++ * size, sh->base + j * size, size);
+    team_barrier(team);
+
+    for (;;)
+    {
+        size_t b = __atomic_fetch_add(&sh->next, 1, __ATOMIC_RELAXED);
+        if (b >= nb)
+            break;
+        size_t s = sh->start[b], len = sh->start[b + 1] - s;
+        char *src = sh->tmp + s * size, *dst = sh->base + s * size;
+        if (b % 2 == 1 || len < 2)
+            memcpy(dst, src, len * size);
+        else
+            psort_sort_into(sc, src, dst, len);
+    }
+}
+
+int sample_sort(const struct sortCtx *sc, char *base, size_t n,
+                const struct sortPolicy *policy)
+{
+    int threads = sort_policy_threads(policy);
+    int logK = 1;
+    while (logK < SS_MAX_LOG_BUCKETS &&
+           ((size_t)1 << logK) < (size_t)threads * SS_BUCKETS_PER_THREAD &&
+           (n >> (logK + 1)) >= SS_MIN_BUCKET)
+        logK++;
+    if (n < 2 * SS_MIN_BUCKET)
+    {
+        // Too small to split; one serial merge sort.
+        struct sortBuf scratch;
+        if (sort_buf_alloc(&scratch, n * sc->size, policy) != 0)
+            return -1;
+        psort_sort_serial(sc, base, scratch.data, n);
+        sort_buf_free(&scratch);
+        return 0;
+    }
+    // Oversampling of about log2(n) / 4 keeps the largest bucket close to
+    // n / k with high probability.
+    size_t oversample = 4;
+    for (size_t m = n; m >= 1024; m >>= 4)
+        oversample++;
+
+    size_t size = sc->size, kmax = (size_t)1 << SS_MAX_LOG_BUCKETS;
+    struct ssShared sh = {sc, base, NULL, n, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0};
+    struct sortBuf scratch;
+    if (sort_buf_alloc(&scratch, n * size, policy) != 0)
+        return -1;
+    sh.tmp = scratch.data;
+    char *treeBuf = malloc(2 * kmax * size);
+    sh.oracle = malloc(n * sizeof(*sh.oracle));
+    sh.hist = malloc((size_t)threads * (2 * kmax) * sizeof(*sh.hist));
+    sh.start = malloc((2 * kmax + 1) * sizeof(*sh.start));
+    int rc = -1;
+    if (treeBuf && sh.oracle && sh.hist && sh.start &&
+        choose_splitters(&sh, logK, oversample, treeBuf, treeBuf + kmax * size) == 0)
+    {
+        team_run(threads, ss_worker, &sh);
+        rc = 0;
+    }
+    sort_buf_free(&scratch);
+    free(treeBuf);
+    free(sh.oracle);
+    free(sh.hist);
+    free(sh.start);
+    if (rc)
+        errno = ENOMEM;
+    return rc;
+}
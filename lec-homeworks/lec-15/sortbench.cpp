@@ -0,0 +1,412 @@
+// sortbench.cpp
+// Benchmark suite for the sort engines. Runs every engine over a set of
+// input distributions, sizes and thread counts, checks each result
+// (sortedness plus an order-independent checksum against the input) and
+// prints one JSON document on stdout.
+//
+// It is C++ only so it can compare against std::sort, std::stable_sort
+// and std::sort(std::execution::par); the engines themselves are C.
+//
+// Usage: ./sortbench [--min N] [--max N] [--threads LIST] [--reps R]
+//                    [--dists LIST] [--engines LIST] [--strings LIST]
+// LIST is comma-separated. Sizes step by powers of ten from --min to --max
+// (default 1e3 to 1e9). Sizes that need more than half of physical memory
+// are skipped. --strings benchmarks the string engines on the named string
+// datasets (urls, logs) instead of the int engines.
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <execution>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define HAVE_TBB_CONTROL 1
+#endif
+
+#include "gen.h"
+#include "psort.h"
+#include "radix.h"
+#include "strsort.h"
+
+static const char *allDists[] = {"uniform", "sorted", "reverse", "nearly_sorted",
+                                 "few_unique", "zipf", "organ_pipe"};
+static const char *allEngines[] = {"merge", "multiway", "natural", "sample", "inplace", "radix",
+                                   "std_sort", "std_stable_sort", "std_sort_par"};
+static const char *allStringEngines[] = {"string", "merge_strcmp", "std_sort_strcmp"};
+
+// ---------------------------------------------------------------------------
+// Input generation, through the same parallel generator the driver uses.
+
+static bool generate(const std::string &dist, std::vector<int> &a, uint64_t seed)
+{
+    struct genSpec spec;
+    gen_spec_init(&spec);
+    if (gen_dist_parse(dist.c_str(), &spec.dist) != 0)
+        return false;
+    spec.seed = seed;
+    spec.lo = spec.dist == GEN_ZIPF ? 0 : INT_MIN;
+    spec.hi = INT_MAX;
+    return gen_fill_int(a.data(), a.size(), &spec, NULL) == 0;
+}
+
+// String datasets. URLs share a scheme and a small set of hosts and path
+// words; log lines share a date prefix and a fixed message layout. Both
+// have the long common prefixes that make plain comparisons re-read bytes.
+static bool generate_strings(const std::string &set, size_t n, uint64_t seed,
+                             struct strArena *a)
+{
+    static const char *words[] = {"news", "sports", "tech", "world", "article",
+                                  "video", "archive", "index", "search", "products"};
+    static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR", "DEBUG"};
+    struct genRng rng;
+    gen_rng_seed(&rng, seed, 0);
+    char buf[256];
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t r = gen_rng_next(&rng), r2 = gen_rng_next(&rng);
+        int len;
+        if (set == "urls")
+            len = snprintf(buf, sizeof(buf), "https://www.site%u.example.com/%s/%s/%u?id=%u",
+                           (unsigned)(r % 200), words[(r >> 8) % 10], words[(r >> 12) % 10],
+                           (unsigned)((r >> 16) % 100000), (unsigned)(r2 % 1000000));
+        else if (set == "logs")
+            len = snprintf(buf, sizeof(buf),
+                           "2024-05-%02u %02u:%02u:%02u.%03u %s [worker-%u] GET "
+                           "/api/v1/users/%u/orders status=200 took=%ums",
+                           (unsigned)(1 + r % 7), (unsigned)((r >> 4) % 24),
+                           (unsigned)((r >> 10) % 60), (unsigned)((r >> 16) % 60),
+                           (unsigned)((r >> 22) % 1000), levels[(r >> 32) % 6],
+                           (unsigned)((r >> 40) % 16), (unsigned)(r2 % 1000000),
+                           (unsigned)((r2 >> 32) % 5000));
+        else
+            return false;
+        if (str_arena_add(a, buf, (size_t)len) != 0)
+            return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Verification.
+
+static uint64_t splitmix(uint64_t &s)
+{
+    uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t checksum(const std::vector<int> &a)
+{
+    uint64_t sum = 0;
+    for (int x : a)
+    {
+        uint64_t s = (uint32_t)x;
+        sum += splitmix(s);
+    }
+    return sum;
+}
+
+static bool is_sorted_asc(const std::vector<int> &a)
+{
+    for (size_t i = 1; i < a.size(); i++)
+        if (a[i - 1] > a[i])
+            return false;
+    return true;
+}
+
+static uint64_t checksum(const std::vector<size_t> &offsets)
+{
+    uint64_t sum = 0;
+    for (size_t o : offsets)
+    {
+        uint64_t s = o;
+        sum += splitmix(s);
+    }
+    return sum;
+}
+
+static bool is_sorted_str(const char *arena, const std::vector<size_t> &offsets)
+{
+    for (size_t i = 1; i < offsets.size(); i++)
+        if (strcmp(arena + offsets[i - 1], arena + offsets[i]) > 0)
+            return false;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+
+static int run_engine(const std::string &engine, std::vector<int> &a, int threads)
+{
+    struct sortPolicy policy;
+    sort_policy_init(&policy);
+    policy.threads = threads;
+    if (engine == "merge")
+        return parallel_merge_sort(a.data(), a.size(), sizeof(int), psort_cmp_int, NULL, &policy);
+    if (engine == "multiway")
+    {
+        policy.strategy = SORT_MULTIWAY;
+        return parallel_merge_sort(a.data(), a.size(), sizeof(int), psort_cmp_int, NULL, &policy);
+    }
+    if (engine == "natural" || engine == "sample" || engine == "inplace")
+    {
+        policy.strategy = engine == "natural"  ? SORT_NATURAL
+                          : engine == "sample" ? SORT_SAMPLE
+                                               : SORT_INPLACE;
+        return parallel_merge_sort(a.data(), a.size(), sizeof(int), psort_cmp_int, NULL, &policy);
+    }
+    if (engine == "radix")
+        return radix_sort(a.data(), a.size(), RADIX_I32, &policy);
+    if (engine == "std_sort")
+        std::sort(a.begin(), a.end());
+    else if (engine == "std_stable_sort")
+        std::stable_sort(a.begin(), a.end());
+    else if (engine == "std_sort_par")
+    {
+#ifdef HAVE_TBB_CONTROL
+        tbb::global_control limit(tbb::global_control::max_allowed_parallelism, (size_t)threads);
+#endif
+        std::sort(std::execution::par, a.begin(), a.end());
+    }
+    else
+        return -1;
+    return 0;
+}
+
+static int run_string_engine(const std::string &engine, const char *arena,
+                             std::vector<size_t> &offsets, int threads)
+{
+    struct sortPolicy policy;
+    sort_policy_init(&policy);
+    policy.threads = threads;
+    if (engine == "string")
+        return string_sort(arena, offsets.data(), offsets.size(), &policy);
+    if (engine == "merge_strcmp")
+        return parallel_merge_sort(offsets.data(), offsets.size(), sizeof(size_t),
+                                   str_cmp_offset, (void *)arena, &policy);
+    if (engine == "std_sort_strcmp")
+        std::sort(offsets.begin(), offsets.end(), [arena](size_t a, size_t b)
+                  { return strcmp(arena + a, arena + b) < 0; });
+    else
+        return -1;
+    return 0;
+}
+
+static bool single_threaded(const std::string &engine)
+{
+    return engine == "std_sort" || engine == "std_stable_sort" || engine == "std_sort_strcmp";
+}
+
+static bool first = true;
+
+static void print_result(const std::string &dist, size_t n, int threads,
+                         const std::string &engine, double best, bool ok)
+{
+    printf("%s\n    {\"dist\": \"%s\", \"n\": %zu, \"threads\": %d, "
+           "\"engine\": \"%s\", \"seconds\": %.6f, \"melems_per_s\": %.2f, "
+           "\"verified\": %s}",
+           first ? "" : ",", dist.c_str(), n, single_threaded(engine) ? 1 : threads,
+           engine.c_str(), best, n / best / 1e6, ok ? "true" : "false");
+    first = false;
+    fflush(stdout);
+}
+
+// Every string engine on one dataset of n strings. Returns the number of
+// unverified results, or -1 if an engine failed.
+static int bench_strings(const std::string &set, size_t n, const std::vector<std::string> &engines,
+                         const std::vector<int> &threadList, int reps)
+{
+    struct strArena arena;
+    str_arena_init(&arena);
+    if (!generate_strings(set, n, 42, &arena))
+    {
+        fprintf(stderr, "unknown string dataset: %s\n", set.c_str());
+        str_arena_free(&arena);
+        return -1;
+    }
+    std::vector<size_t> input(arena.offset, arena.offset + n), work;
+    uint64_t sum = checksum(input);
+    int failures = 0;
+    for (auto &engine : engines)
+        for (int threads : threadList)
+        {
+            if (single_threaded(engine) && threads != threadList.front())
+                continue;
+            double best = 1e300;
+            bool ok = true;
+            for (int r = 0; r < reps && ok; r++)
+            {
+                work = input;
+                auto t0 = std::chrono::steady_clock::now();
+                int rc = run_string_engine(engine, arena.data, work, threads);
+                auto t1 = std::chrono::steady_clock::now();
+                if (rc != 0)
+                {
+                    fprintf(stderr, "engine %s failed\n", engine.c_str());
+                    str_arena_free(&arena);
+                    return -1;
+                }
+                best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+                ok = is_sorted_str(arena.data, work) && checksum(work) == sum;
+            }
+            failures += !ok;
+            print_result(set, n, threads, engine, best, ok);
+        }
+    str_arena_free(&arena);
+    return failures;
+}
+
+static std::vector<std::string> split(const char *list)
+{
+    std::vector<std::string> out;
+    std::string cur;
+    for (const char *p = list;; p++)
+    {
+        if (*p == ',' || *p == '\0')
+        {
+            if (!cur.empty())
+                out.push_back(cur);
+            cur.clear();
+            if (!*p)
+                break;
+        }
+        else
+            cur += *p;
+    }
+    return out;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--min N] [--max N] [--threads LIST] [--reps R]\n"
+            "          [--dists LIST] [--engines LIST] [--strings LIST]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    double minN = 1e3, maxN = 1e9;
+    int reps = 3;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<int> threadList;
+    std::vector<std::string> dists(std::begin(allDists), std::end(allDists));
+    std::vector<std::string> engines, stringSets;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        const char *val = argv[++i];
+        if (opt == "--min")
+            minN = atof(val);
+        else if (opt == "--max")
+            maxN = atof(val);
+        else if (opt == "--reps")
+            reps = std::max(1, atoi(val));
+        else if (opt == "--threads")
+            for (auto &t : split(val))
+                threadList.push_back(atoi(t.c_str()));
+        else if (opt == "--dists")
+            dists = split(val);
+        else if (opt == "--engines")
+            engines = split(val);
+        else if (opt == "--strings")
+            stringSets = split(val);
+        else
+            usage(argv[0]);
+    }
+    if (threadList.empty()) // 1, 2, 4, ... up to all cores
+    {
+        for (int t = 1; t < cpus; t *= 2)
+            threadList.push_back(t);
+        threadList.push_back((int)std::max(1L, cpus));
+    }
+
+    if (engines.empty() && stringSets.empty())
+        engines.assign(std::begin(allEngines), std::end(allEngines));
+    else if (engines.empty())
+        engines.assign(std::begin(allStringEngines), std::end(allStringEngines));
+
+    // Input, working copy and the engines' scratch buffer.
+    double memLimit = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+
+    printf("{\n  \"host\": {\"cpus\": %ld},\n  \"results\": [", cpus);
+    int failures = 0;
+    for (double dn = minN; dn <= maxN * 1.0000001; dn *= 10)
+    {
+        size_t n = (size_t)llround(dn);
+        if (!stringSets.empty())
+        {
+            // About 100 bytes of text, the offsets and 32 bytes of sort
+            // state per string.
+            if (160.0 * n > memLimit)
+            {
+                fprintf(stderr, "skipping n=%zu: not enough memory\n", n);
+                continue;
+            }
+            for (auto &set : stringSets)
+            {
+                int f = bench_strings(set, n, engines, threadList, reps);
+                if (f < 0)
+                    return EXIT_FAILURE;
+                failures += f;
+            }
+            continue;
+        }
+        if (3.0 * n * sizeof(int) > memLimit)
+        {
+            fprintf(stderr, "skipping n=%zu: not enough memory\n", n);
+            continue;
+        }
+        for (auto &dist : dists)
+        {
+            std::vector<int> input(n), work(n);
+            if (!generate(dist, input, 42))
+            {
+                fprintf(stderr, "unknown distribution: %s\n", dist.c_str());
+                return EXIT_FAILURE;
+            }
+            uint64_t sum = checksum(input);
+            for (auto &engine : engines)
+                for (int threads : threadList)
+                {
+                    if (single_threaded(engine) && threads != threadList.front())
+                        continue;
+                    double best = 1e300;
+                    bool ok = true;
+                    for (int r = 0; r < reps && ok; r++)
+                    {
+                        work = input;
+                        auto t0 = std::chrono::steady_clock::now();
+                        int rc = run_engine(engine, work, threads);
+                        auto t1 = std::chrono::steady_clock::now();
+                        if (rc != 0)
+                        {
+                            fprintf(stderr, "engine %s failed\n", engine.c_str());
+                            return EXIT_FAILURE;
+                        }
+                        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+                        ok = is_sorted_asc(work) && checksum(work) == sum;
+                    }
+                    failures += !ok;
+                    print_result(dist, n, threads, engine, best, ok);
+                }
+        }
+    }
+    printf("\n  ],\n  \"failures\": %d\n}\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
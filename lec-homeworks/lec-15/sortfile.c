@@ -0,0 +1,365 @@
+// sortfile.c
+// Searchable sorted files.
+//
+// Layout: the records in blocks of blockBytes, the last one padded like
+// the rest, then the fences (one int per block, padded to 8 bytes), then
+// the Bloom filters (bloomWords 64-bit words per block), then a fixed
+// trailer that says where all that is. The footer is small next to the
+// data (4 bytes per block without filters), so a reader loads it once and
+// binary searches it in memory. That narrows a lookup to one block, and
+// the block's filter can rule the key out before the block is read.
+//
+// A key repeated across a block boundary is a fence of the later block,
+// so a point lookup for it reads that block, and range scans start one
+// block back to find the first copy.
+
+#define _GNU_SOURCE
+#include "sortfile.h"
+#include "mapio.h"
+#include "team.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SORTFILE_MAGIC "PSORTIX1"
+#define SORTFILE_MAX_HASHES 16
+
+struct sortedFileTrailer
+{
+    char magic[8];
+    uint64_t n, recordSize, blockBytes;
+    uint64_t indexOffset; // fences, then the Bloom filters
+    uint64_t bloomWords;  // per block
+    uint64_t bloomHashes;
+};
+
+void sorted_file_options_init(struct sortedFileOptions *opt)
+{
+    opt->blockBytes = 4096;
+    opt->bloomBits = 0;
+}
+
+static inline int key_at(const char *rec)
+{
+    int k;
+    memcpy(&k, rec, sizeof(k));
+    return k;
+}
+
+// splitmix64 finaliser: the two probe sequences of a key come from the
+// halves of one 64-bit hash.
+static inline uint64_t key_hash(int key)
+{
+    uint64_t z = (uint32_t)key + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static void bloom_add(uint64_t *words, size_t nWords, int hashes, int key)
+{
+    uint64_t h = key_hash(key), step = (h >> 32) | 1, bits = (uint64_t)nWords * 64;
+    for (int i = 0; i < hashes; i++, h += step)
+    {
+        uint64_t bit = h % bits;
+        words[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+static int bloom_has(const uint64_t *words, size_t nWords, int hashes, int key)
+{
+    uint64_t h = key_hash(key), step = (h >> 32) | 1, bits = (uint64_t)nWords * 64;
+    for (int i = 0; i < hashes; i++, h += step)
+    {
+        uint64_t bit = h % bits;
+        if (!(words[bit / 64] >> (bit % 64) & 1))
+            return 0;
+    }
+    return 1;
+}
+
+struct writeShared
+{
+    const char *src;
+    char *dst;
+    size_t n, recordSize, blockBytes, perBlock, blocks;
+    int *fence;
+    uint64_t *bloom;
+    size_t bloomWords;
+    int bloomHashes;
+};
+
+static void write_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct writeShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->blocks, &lo, &hi);
+    for (size_t b = lo; b < hi; b++)
+    {
+        size_t first = b * sh->perBlock;
+        size_t count = sh->n - first < sh->perBlock ? sh->n - first : sh->perBlock;
+        const char *src = sh->src + first * sh->recordSize;
+        memcpy(sh->dst + b * sh->blockBytes, src, count * sh->recordSize);
+        sh->fence[b] = key_at(src);
+        if (!sh->bloom)
+            continue;
+        uint64_t *words = sh->bloom + b * sh->bloomWords;
+        for (size_t i = 0; i < count; i++)
+            bloom_add(words, sh->bloomWords, sh->bloomHashes, key_at(src + i * sh->recordSize));
+    }
+}
+
+int sorted_file_write(const char *path, const void *base, size_t n, size_t recordSize,
+                      const struct sortedFileOptions *opt, const struct sortPolicy *policy)
+{
+    struct sortedFileOptions defaults;
+    if (!opt)
+    {
+        sorted_file_options_init(&defaults);
+        opt = &defaults;
+    }
+    if (recordSize < sizeof(int) || opt->blockBytes < recordSize || opt->bloomBits < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t perBlock = opt->blockBytes / recordSize;
+    size_t blocks = (n + perBlock - 1) / perBlock;
+    size_t bloomWords = 0;
+    int bloomHashes = 0;
+    if (opt->bloomBits > 0)
+    {
+        // k = bits per key * ln 2 minimises the false positive rate.
+        bloomWords = (perBlock * (size_t)opt->bloomBits + 63) / 64;
+        bloomHashes = (int)(opt->bloomBits * 0.693 + 0.5);
+        if (bloomHashes < 1)
+            bloomHashes = 1;
+        if (bloomHashes > SORTFILE_MAX_HASHES)
+            bloomHashes = SORTFILE_MAX_HASHES;
+    }
+    size_t dataLen = blocks * opt->blockBytes;
+    size_t fenceLen = (blocks * sizeof(int) + 7) & ~(size_t)7;
+    size_t bloomLen = blocks * bloomWords * sizeof(uint64_t);
+    size_t len = dataLen + fenceLen + bloomLen + sizeof(struct sortedFileTrailer);
+
+    // The file is preallocated, so padding and filters start out zero.
+    struct mappedFile mf;
+    if (map_output(path, len, &mf) != 0)
+        return -1;
+    char *p = mf.data;
+    struct writeShared sh = {base, p, n, recordSize, opt->blockBytes, perBlock, blocks,
+                             (int *)(p + dataLen),
+                             bloomWords ? (uint64_t *)(p + dataLen + fenceLen) : NULL,
+                             bloomWords, bloomHashes};
+    int threads = sort_policy_threads(policy);
+    if ((size_t)threads > blocks / 64 + 1)
+        threads = (int)(blocks / 64 + 1);
+    team_run(threads, write_worker, &sh);
+
+    struct sortedFileTrailer tr = {SORTFILE_MAGIC, n, recordSize, opt->blockBytes, dataLen,
+                                   bloomWords, (uint64_t)bloomHashes};
+    memcpy(p + len - sizeof(tr), &tr, sizeof(tr));
+    return unmap_file(&mf, 0);
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t got = pread(fd, p, len, off);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            if (got == 0)
+                errno = EINVAL; // shorter than the trailer says
+            return -1;
+        }
+        p += got;
+        len -= (size_t)got;
+        off += got;
+    }
+    return 0;
+}
+
+int sorted_file_open(const char *path, struct sortedFile *sf)
+{
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = open(path, O_RDONLY);
+    if (sf->fd < 0)
+        return -1;
+    struct stat st;
+    struct sortedFileTrailer tr;
+    if (fstat(sf->fd, &st) != 0)
+        goto fail;
+    size_t len = (size_t)st.st_size;
+    if (len < sizeof(tr))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (pread_full(sf->fd, &tr, sizeof(tr), (off_t)(len - sizeof(tr))) != 0)
+        goto fail;
+
+    // Everything the trailer says must add up to the file's length.
+    size_t perBlock = tr.recordSize ? tr.blockBytes / tr.recordSize : 0;
+    size_t blocks = perBlock ? (tr.n + perBlock - 1) / perBlock : 0;
+    size_t fenceLen = (blocks * sizeof(int) + 7) & ~(size_t)7;
+    size_t bloomLen = blocks * tr.bloomWords * sizeof(uint64_t);
+    if (memcmp(tr.magic, SORTFILE_MAGIC, sizeof(tr.magic)) || tr.recordSize < sizeof(int) ||
+        perBlock == 0 || tr.indexOffset != blocks * tr.blockBytes ||
+        tr.bloomHashes > SORTFILE_MAX_HASHES || (tr.bloomWords > 0) != (tr.bloomHashes > 0) ||
+        len != tr.indexOffset + fenceLen + bloomLen + sizeof(tr))
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    sf->n = tr.n;
+    sf->recordSize = tr.recordSize;
+    sf->blockBytes = tr.blockBytes;
+    sf->perBlock = perBlock;
+    sf->blocks = blocks;
+    sf->bloomWords = tr.bloomWords;
+    sf->bloomHashes = (int)tr.bloomHashes;
+
+    sf->fence = malloc(fenceLen ? fenceLen : 1);
+    sf->bloom = bloomLen ? malloc(bloomLen) : NULL;
+    if (!sf->fence || (bloomLen && !sf->bloom))
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+    if (pread_full(sf->fd, sf->fence, fenceLen, (off_t)tr.indexOffset) != 0 ||
+        (bloomLen && pread_full(sf->fd, sf->bloom, bloomLen,
+                                (off_t)(tr.indexOffset + fenceLen)) != 0))
+        goto fail;
+
+    // Lookups touch one block each; read-ahead would only evict others.
+    sf->dataLen = tr.indexOffset;
+    if (sf->dataLen)
+    {
+        void *p = mmap(NULL, sf->dataLen, PROT_READ, MAP_SHARED, sf->fd, 0);
+        if (p == MAP_FAILED)
+            goto fail;
+        madvise(p, sf->dataLen, MADV_RANDOM);
+        sf->data = p;
+    }
+    return 0;
+
+fail:
+    sorted_file_close(sf);
+    return -1;
+}
+
+void sorted_file_close(struct sortedFile *sf)
+{
+    int saved = errno;
+    if (sf->data)
+        munmap((void *)sf->data, sf->dataLen);
+    if (sf->fd >= 0)
+        close(sf->fd);
+    free(sf->fence);
+    free(sf->bloom);
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = -1;
+    errno = saved;
+}
+
+// First block whose fence is not below key.
+static size_t fence_lower_bound(const struct sortedFile *sf, int key)
+{
+    size_t lo = 0, hi = sf->blocks;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sf->fence[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static size_t block_count(const struct sortedFile *sf, size_t b)
+{
+    size_t first = b * sf->perBlock;
+    return sf->n - first < sf->perBlock ? sf->n - first : sf->perBlock;
+}
+
+// First record of block b whose key is not below key.
+static size_t record_lower_bound(const struct sortedFile *sf, size_t b, int key)
+{
+    const char *blk = sf->data + b * sf->blockBytes;
+    size_t lo = 0, hi = block_count(sf, b);
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (key_at(blk + mid * sf->recordSize) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int sorted_file_find(const struct sortedFile *sf, int key, void *out,
+                     struct sortedFileStats *stats)
+{
+    size_t j = fence_lower_bound(sf, key);
+    size_t b = j, i = 0;
+    if (j == sf->blocks || sf->fence[j] != key)
+    {
+        // Not a fence: if anywhere, it's inside the block before.
+        if (j == 0)
+            return 0;
+        b = j - 1;
+        if (sf->bloom && !bloom_has(sf->bloom + b * sf->bloomWords, sf->bloomWords,
+                                    sf->bloomHashes, key))
+        {
+            if (stats)
+                stats->bloomSkips++;
+            return 0;
+        }
+        i = record_lower_bound(sf, b, key);
+    }
+    if (stats)
+        stats->blockReads++;
+    const char *rec = sf->data + b * sf->blockBytes + i * sf->recordSize;
+    if (i == block_count(sf, b) || key_at(rec) != key)
+        return 0;
+    memcpy(out, rec, sf->recordSize);
+    return 1;
+}
+
+size_t sorted_file_range(const struct sortedFile *sf, int lo, int hi, void *out, size_t max,
+                         struct sortedFileStats *stats)
+{
+    if (lo > hi || max == 0 || sf->blocks == 0)
+        return 0;
+    size_t j = fence_lower_bound(sf, lo);
+    size_t b = j > 0 ? j - 1 : 0;
+    size_t i = record_lower_bound(sf, b, lo), got = 0;
+    char *dst = out;
+    for (; b < sf->blocks; b++, i = 0)
+    {
+        if (stats)
+            stats->blockReads++;
+        const char *blk = sf->data + b * sf->blockBytes;
+        for (size_t count = block_count(sf, b); i < count; i++)
+        {
+            const char *rec = blk + i * sf->recordSize;
+            if (key_at(rec) > hi)
+                return got;
+            memcpy(dst + got * sf->recordSize, rec, sf->recordSize);
+            if (++got == max)
+                return got;
+        }
+    }
+    return got;
+}
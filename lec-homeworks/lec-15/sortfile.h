@@ -0,0 +1,77 @@
+// sortfile.h
+// Searchable sorted output: records in fixed-size blocks, followed by a
+// footer holding the first key of every block (fence pointers) and,
+// optionally, a Bloom filter per block. A reader keeps the footer in
+// memory and answers a point lookup with at most one block read.
+//
+// Records are keyed by a leading native-endian int, as in the sort driver.
+
+#ifndef SORTFILE_H
+#define SORTFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sortedFileOptions
+{
+    size_t blockBytes; // block size; a multiple of the page size keeps one
+                       // lookup to one page (default 4096)
+    int bloomBits;     // Bloom filter bits per record, 0 for none (default 0)
+};
+
+// Defaults: 4096-byte blocks, no Bloom filters.
+void sorted_file_options_init(struct sortedFileOptions *opt);
+
+// Write base[0..n), sorted by leading int key, to path as a searchable
+// file. opt NULL takes the defaults. Returns 0, or -1 (errno set: EINVAL
+// if a block can't hold one record).
+int sorted_file_write(const char *path, const void *base, size_t n, size_t recordSize,
+                      const struct sortedFileOptions *opt, const struct sortPolicy *policy);
+
+// An open file: the footer in memory, the blocks mapped for random reads.
+struct sortedFile
+{
+    int fd;
+    const char *data;   // mapped blocks
+    size_t dataLen;
+    size_t n, recordSize, blockBytes, perBlock, blocks;
+    int *fence;         // fence[b]: first key of block b
+    uint64_t *bloom;    // bloomWords words per block, or NULL
+    size_t bloomWords;
+    int bloomHashes;
+};
+
+// What lookups cost; callers sum these over many lookups.
+struct sortedFileStats
+{
+    uint64_t blockReads; // blocks searched
+    uint64_t bloomSkips; // lookups the Bloom filter answered alone
+};
+
+// Open path and load its footer. Returns 0, or -1 (errno set: EINVAL if
+// the file isn't one sorted_file_write made).
+int sorted_file_open(const char *path, struct sortedFile *sf);
+
+void sorted_file_close(struct sortedFile *sf);
+
+// Copy a record with this key to out (which one, if there are several, is
+// unspecified). Returns 1 if found, 0 if not. stats may be NULL.
+int sorted_file_find(const struct sortedFile *sf, int key, void *out,
+                     struct sortedFileStats *stats);
+
+// Copy the records with lo <= key <= hi, in order, to out, at most max of
+// them. Returns the number copied. stats may be NULL.
+size_t sorted_file_range(const struct sortedFile *sf, int lo, int hi, void *out, size_t max,
+                         struct sortedFileStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SORTFILE_H
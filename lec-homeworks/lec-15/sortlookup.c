@@ -0,0 +1,208 @@
+// Point and range lookups against a file written by mergesort --index
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "sortfile.h"
+#include "gen.h"
+#include "timing.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] FILE [KEY | LO:HI ...]\n"
+            "Says whether each KEY is in FILE, and lists the keys in each LO:HI.\n"
+            "Options go before FILE; everything after it is a key, so negative\n"
+            "keys need no --.\n"
+            "Options:\n"
+            "  -n, --random N   time N random point lookups and report lookups/s\n"
+            "  -h, --hits       draw the random keys from the file, so all are found\n"
+            "                   (default: uniform over the file's key range)\n"
+            "  -S, --seed N     random key seed (default 1)\n"
+            "  -c, --cold       drop the file from the page cache before the lookups,\n"
+            "                   so they read from disk as on a file larger than memory\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+// Print every key in lo:hi, max records at a time. Each batch after the
+// first restarts at the last key printed and skips the copies of it
+// already printed.
+static void print_range(const struct sortedFile *sf, int lo, int hi, char *buf, size_t max,
+                        struct sortedFileStats *st)
+{
+    size_t total = 0, skip = 0;
+    for (;;)
+    {
+        size_t got = sorted_file_range(sf, lo, hi, buf, max, st);
+        for (size_t i = skip; i < got; i++)
+        {
+            int key;
+            memcpy(&key, buf + i * sf->recordSize, sizeof(key));
+            printf("%d\n", key);
+        }
+        total += got > skip ? got - skip : 0;
+        if (got < max)
+            break;
+        int last;
+        memcpy(&last, buf + (got - 1) * sf->recordSize, sizeof(last));
+        size_t dup = 1;
+        while (dup < got && !memcmp(buf + (got - 1 - dup) * sf->recordSize, &last, sizeof(last)))
+            dup++;
+        if (dup == got)
+        {
+            fprintf(stderr, "more than %zu copies of %d, listing cut short\n", max, last);
+            break;
+        }
+        lo = last;
+        skip = dup;
+    }
+    fprintf(stderr, "%zu records\n", total);
+}
+
+// Time n random point lookups. Keys are drawn before the cache is dropped.
+static int bench(const struct sortedFile *sf, size_t n, int hits, uint64_t seed, int cold)
+{
+    int *keys = malloc(n * sizeof(*keys));
+    char *rec = malloc(sf->recordSize);
+    if (!keys || !rec)
+    {
+        free(keys);
+        free(rec);
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    struct genRng rng;
+    gen_rng_seed(&rng, seed, 0);
+    int lo = sf->fence[0], hi = lo;
+    memcpy(&hi, sf->data + (sf->blocks - 1) * sf->blockBytes +
+                    ((sf->n - 1) % sf->perBlock) * sf->recordSize, sizeof(hi));
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t r = gen_rng_next(&rng);
+        if (hits)
+        {
+            size_t at = r % sf->n;
+            memcpy(&keys[i], sf->data + (at / sf->perBlock) * sf->blockBytes +
+                                 (at % sf->perBlock) * sf->recordSize, sizeof(int));
+        }
+        else
+            keys[i] = (int)(lo + (int64_t)(r % ((uint64_t)((int64_t)hi - lo) + 1)));
+    }
+    if (cold)
+    {
+        // Pages this process has mapped stay cached; unmap them first.
+        madvise((void *)sf->data, sf->dataLen, MADV_DONTNEED);
+        int rc = posix_fadvise(sf->fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (rc != 0)
+            fprintf(stderr, "posix_fadvise: %s; lookups may hit the cache\n", strerror(rc));
+    }
+
+    struct sortedFileStats st = {0, 0};
+    size_t found = 0;
+    double t0 = now();
+    for (size_t i = 0; i < n; i++)
+        found += sorted_file_find(sf, keys[i], rec, &st);
+    double secs = now() - t0;
+
+    size_t indexBytes = sf->blocks * (sizeof(int) + sf->bloomWords * sizeof(uint64_t));
+    fprintf(stderr,
+            "%zu lookups in %.3f s (%.0f lookups/s, %.2f us each), %zu found\n"
+            "  block reads %llu (%.3f per lookup), ruled out by Bloom filter %llu\n"
+            "  index %.1f KB cached for %.1f MB of data (%zu blocks of %zu bytes)\n",
+            n, secs, secs > 0 ? n / secs : 0.0, n ? secs * 1e6 / n : 0.0, found,
+            (unsigned long long)st.blockReads, n ? (double)st.blockReads / n : 0.0,
+            (unsigned long long)st.bloomSkips, indexBytes / 1024.0, sf->dataLen / 1e6,
+            sf->blocks, sf->blockBytes);
+    free(keys);
+    free(rec);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    size_t random = 0;
+    int hits = 0, cold = 0;
+    uint64_t seed = 1;
+    static const struct option longopts[] = {
+        {"random", required_argument, NULL, 'n'},
+        {"hits", no_argument, NULL, 'h'},
+        {"seed", required_argument, NULL, 'S'},
+        {"cold", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    // '+': stop at FILE, so that keys like -5 or -9:-1 aren't taken for options.
+    while ((opt = getopt_long(argc, argv, "+n:hS:c", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            random = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            hits = 1;
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+
+    struct sortedFile sf;
+    if (sorted_file_open(argv[optind], &sf) != 0)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (sf.n == 0)
+    {
+        fprintf(stderr, "%s: no records\n", argv[optind]);
+        sorted_file_close(&sf);
+        return EXIT_FAILURE;
+    }
+
+    int rc = EXIT_SUCCESS;
+    size_t max = sf.perBlock * 64;
+    char *buf = malloc(max * sf.recordSize);
+    if (!buf)
+    {
+        perror("malloc");
+        sorted_file_close(&sf);
+        return EXIT_FAILURE;
+    }
+    struct sortedFileStats st = {0, 0};
+    for (int a = optind + 1; a < argc; a++)
+    {
+        int lo, hi;
+        char tail;
+        if (sscanf(argv[a], "%d:%d%c", &lo, &hi, &tail) == 2)
+            print_range(&sf, lo, hi, buf, max, &st);
+        else if (sscanf(argv[a], "%d%c", &lo, &tail) == 1)
+        {
+            if (sorted_file_find(&sf, lo, buf, &st))
+                printf("%d: found\n", lo);
+            else
+                printf("%d: not found\n", lo);
+        }
+        else
+        {
+            fprintf(stderr, "Bad key: %s (want KEY or LO:HI)\n", argv[a]);
+            rc = EXIT_FAILURE;
+        }
+    }
+    if (random > 0 && bench(&sf, random, hits, seed, cold) != EXIT_SUCCESS)
+        rc = EXIT_FAILURE;
+    free(buf);
+    sorted_file_close(&sf);
+    return rc;
+}
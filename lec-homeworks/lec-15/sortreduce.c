@@ -0,0 +1,363 @@
+// sortreduce.c
+// Merge sort that combines equal keys as it merges.
+//
+// Each worker sorts its slice with a recursive merge sort whose merges
+// emit an element only if it differs from the last one written, and fold
+// it into that one otherwise. Leaves are insertion sorted and folded the
+// same way. A run never holds two equal keys, so when two runs merge the
+// duplicates meet right at the output head. Runs get shorter as they go
+// up, and on low-cardinality data the upper levels have almost nothing
+// to move.
+//
+// The sorted slices are then merged pairwise, one level per barrier. All
+// workers of a pair share its merge. They split it at keys drawn from the
+// left run, so each key falls in exactly one piece. Each piece writes at
+// the offset it would have without any folding, and the pair's first
+// worker then closes the gaps. That moves only the output, and only when
+// something was folded.
+//
+// The slices start in whichever buffer makes the last level end in base,
+// so nothing is copied back.
+
+#include "sortreduce.h"
+#include "psort_impl.h"
+#include "team.h"
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fewest elements worth giving a thread of its own.
+#define REDUCE_MIN_PER_THREAD 65536
+
+struct reduceCtx;
+
+typedef size_t (*merge_fold_fn)(const struct reduceCtx *rc, const char *a, size_t na,
+                                const char *b, size_t nb, char *out);
+
+struct reduceCtx
+{
+    const struct sortCtx *sc;
+    psort_combine_fn combine;
+    int intKey;          // compare leading ints inline (cmp is psort_cmp_int)
+    merge_fold_fn merge; // merge_fold or a specialised kernel
+};
+
+void psort_combine_add(void *into, const void *from, void *ctx)
+{
+    (void)ctx;
+    ((struct keyValue *)into)->value += ((const struct keyValue *)from)->value;
+}
+
+static inline int key_cmp(const struct reduceCtx *rc, const char *a, const char *b)
+{
+    if (rc->intKey)
+    {
+        int x = *(const int *)a, y = *(const int *)b;
+        return (x > y) - (x < y);
+    }
+    return rc->sc->cmp(a, b, rc->sc->ctx);
+}
+
+// Append x after out[0..m), folding it into out[m - 1] if equal. Returns
+// the new m.
+static inline size_t emit(const struct reduceCtx *rc, char *out, size_t m, const char *x)
+{
+    size_t size = rc->sc->size;
+    if (m > 0 && key_cmp(rc, out + (m - 1) * size, x) == 0)
+    {
+        if (rc->combine)
+            rc->combine(out + (m - 1) * size, x, rc->sc->ctx);
+        return m;
+    }
+    psort_move(out + m * size, x, size);
+    return m + 1;
+}
+
+// Fold the equal neighbours of sorted a[0..n) in place. Returns the count
+// left.
+static size_t fold(const struct reduceCtx *rc, char *a, size_t n)
+{
+    size_t size = rc->sc->size, m = n ? 1 : 0;
+    for (size_t i = 1; i < n; i++)
+        m = emit(rc, a, m, a + i * size);
+    return m;
+}
+
+// Merge runs a[0..na) and b[0..nb), neither holding equal keys, into out,
+// folding the keys they share. Ties take a first. Returns the count out.
+static size_t merge_fold(const struct reduceCtx *rc, const char *a, size_t na,
+                         const char *b, size_t nb, char *out)
+{
+    size_t size = rc->sc->size, i = 0, j = 0, m = 0;
+    while (i < na && j < nb)
+    {
+        int c = key_cmp(rc, a + i * size, b + j * size);
+        if (c <= 0)
+        {
+            m = emit(rc, out, m, a + i * size);
+            i++;
+        }
+        else
+        {
+            m = emit(rc, out, m, b + j * size);
+            j++;
+        }
+    }
+    // The rest of one run: only its first element can equal the last
+    // output.
+    const char *rest = i < na ? a + i * size : b + j * size;
+    size_t left = i < na ? na - i : nb - j;
+    if (left > 0)
+    {
+        m = emit(rc, out, m, rest);
+        memcpy(out + m * size, rest + size, (left - 1) * size);
+        m += left - 1;
+    }
+    return m;
+}
+
+// Unique ints: a branchless merge that writes every element and advances
+// the output only past a new key.
+static size_t merge_fold_int(const struct reduceCtx *rc, const char *pa, size_t na,
+                             const char *pb, size_t nb, char *pout)
+{
+    (void)rc;
+    const int *a = (const int *)pa, *b = (const int *)pb;
+    int *out = (int *)pout;
+    size_t i = 0, j = 0, m = 0;
+    int last = 0;
+    while (i < na && j < nb)
+    {
+        int x = a[i], y = b[j];
+        int takeB = y < x, v = takeB ? y : x;
+        out[m] = v;
+        m += m == 0 || v != last;
+        last = v;
+        i += !takeB;
+        j += takeB;
+    }
+    const int *rest = i < na ? a + i : b + j;
+    size_t left = i < na ? na - i : nb - j;
+    if (left > 0)
+    {
+        size_t skip = m > 0 && rest[0] == last;
+        memcpy(out + m, rest + skip, (left - skip) * sizeof(int));
+        m += left - skip;
+    }
+    return m;
+}
+
+// struct keyValue summed by psort_combine_add: the same, folding the
+// value into the slot the key lands in.
+static size_t merge_fold_add(const struct reduceCtx *rc, const char *pa, size_t na,
+                             const char *pb, size_t nb, char *pout)
+{
+    (void)rc;
+    const struct keyValue *a = (const struct keyValue *)pa, *b = (const struct keyValue *)pb;
+    struct keyValue *out = (struct keyValue *)pout;
+    size_t i = 0, j = 0, m = 0;
+    while (i < na && j < nb)
+    {
+        int takeB = b[j].key < a[i].key;
+        struct keyValue v = takeB ? b[j] : a[i];
+        size_t same = m > 0 && out[m - 1].key == v.key;
+        size_t d = m - same;
+        out[d].value = same ? out[d].value + v.value : v.value;
+        out[d].key = v.key;
+        m = d + 1;
+        i += !takeB;
+        j += takeB;
+    }
+    const struct keyValue *rest = i < na ? a + i : b + j;
+    size_t left = i < na ? na - i : nb - j;
+    if (left > 0)
+    {
+        size_t skip = 0;
+        if (m > 0 && rest[0].key == out[m - 1].key)
+        {
+            out[m - 1].value += rest[0].value;
+            skip = 1;
+        }
+        memcpy(out + m, rest + skip, (left - skip) * sizeof(*out));
+        m += left - skip;
+    }
+    return m;
+}
+
+// Sort and fold a[0..n), leaving the result at the start of b if intoB,
+// else of a. The other buffer is scratch. Returns the count left.
+static size_t sort_fold(const struct reduceCtx *rc, char *a, char *b, size_t n, int intoB)
+{
+    const struct sortCtx *sc = rc->sc;
+    size_t size = sc->size;
+    if (n <= sc->cutoff)
+    {
+        sc->ops->isort(a, n, sc);
+        size_t m = fold(rc, a, n);
+        if (intoB)
+            memcpy(b, a, m * size);
+        return m;
+    }
+    size_t mid = n / 2;
+    size_t m1 = sort_fold(rc, a, b, mid, !intoB);
+    size_t m2 = sort_fold(rc, a + mid * size, b + mid * size, n - mid, !intoB);
+    const char *src = intoB ? a : b;
+    return rc->merge(rc, src, m1, src + mid * size, m2, intoB ? b : a);
+}
+
+// First element of a[0..n) not before key.
+static size_t lower_bound(const struct reduceCtx *rc, const char *a, size_t n, const char *key)
+{
+    size_t lo = 0, hi = n, size = rc->sc->size;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (key_cmp(rc, a + mid * size, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+struct reduceShared
+{
+    struct reduceCtx rc;
+    char *buf[2];  // base and scratch
+    size_t n;
+    size_t *count; // count[w]: elements in the run starting at slice w
+    size_t *pieceAt, *pieceN;
+};
+
+static size_t slice_start(const struct sortTeam *team, int w, size_t n)
+{
+    size_t lo, hi;
+    if (w >= team->size)
+        return n;
+    team_slice(team, w, n, &lo, &hi);
+    return lo;
+}
+
+static void reduce_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct reduceShared *sh = arg;
+    const struct reduceCtx *rc = &sh->rc;
+    size_t size = rc->sc->size, lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    // Every merge level flips buffers; start so the last one ends in base.
+    int levels = 0;
+    while ((1 << levels) < team->size)
+        levels++;
+    int cur = levels & 1;
+    sh->count[id] = sort_fold(rc, sh->buf[0] + lo * size, sh->buf[1] + lo * size, hi - lo, cur);
+
+    for (int width = 1; width < team->size; width *= 2)
+    {
+        team_barrier(team);
+        int leader = id - id % (2 * width), partner = leader + width;
+        int group = team->size - leader < 2 * width ? team->size - leader : 2 * width;
+        int piece = id - leader;
+        char *src = sh->buf[cur], *dst = sh->buf[!cur];
+        size_t at = slice_start(team, leader, sh->n);
+        if (partner >= team->size)
+        {
+            // No partner this level: carry the run over to the other buffer.
+            if (piece == 0)
+                memcpy(dst + at * size, src + at * size, sh->count[leader] * size);
+        }
+        else
+        {
+            // Piece `piece` of the pair: keys from the piece-th splitter
+            // of the left run up to the next one.
+            const char *a = src + at * size, *b = src + slice_start(team, partner, sh->n) * size;
+            size_t na = sh->count[leader], nb = sh->count[partner];
+            size_t ia = 0, ib = 0, ja = na, jb = nb;
+            if (na == 0)
+                jb = piece == 0 ? nb : 0;
+            else
+            {
+                if (piece > 0)
+                {
+                    ia = (size_t)piece * na / (size_t)group;
+                    ib = lower_bound(rc, b, nb, a + ia * size);
+                }
+                if (piece + 1 < group)
+                {
+                    ja = (size_t)(piece + 1) * na / (size_t)group;
+                    jb = lower_bound(rc, b, nb, a + ja * size);
+                }
+            }
+            sh->pieceAt[id] = ia + ib;
+            sh->pieceN[id] = rc->merge(rc, a + ia * size, ja - ia, b + ib * size, jb - ib,
+                                        dst + (at + ia + ib) * size);
+        }
+        team_barrier(team);
+        if (partner < team->size && piece == 0)
+        {
+            size_t m = sh->pieceN[id];
+            for (int q = id + 1; q < leader + group; q++)
+            {
+                if (sh->pieceAt[q] != m)
+                    memmove(dst + (at + m) * size, dst + (at + sh->pieceAt[q]) * size,
+                            sh->pieceN[q] * size);
+                m += sh->pieceN[q];
+            }
+            sh->count[leader] = m;
+        }
+        cur = !cur;
+    }
+}
+
+int parallel_sort_reduce(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                         psort_combine_fn combine, void *ctx, size_t *outN,
+                         const struct sortPolicy *policy)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    *outN = n;
+    if (n == 0 || size == 0)
+        return 0;
+    if (n > SIZE_MAX / size)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct sortCtx sc;
+    psort_ctx_init(&sc, size, cmp, ctx, policy);
+    int threads = sort_policy_threads(policy);
+    if ((size_t)threads > n / REDUCE_MIN_PER_THREAD + 1)
+        threads = (int)(n / REDUCE_MIN_PER_THREAD + 1);
+
+    struct sortBuf scratch;
+    if (sort_buf_alloc(&scratch, n * size, policy) != 0)
+        return -1;
+    size_t *counts = malloc(3 * (size_t)threads * sizeof(*counts));
+    if (!counts)
+    {
+        sort_buf_free(&scratch);
+        errno = ENOMEM;
+        return -1;
+    }
+    int intKey = cmp == psort_cmp_int && size >= sizeof(int);
+    merge_fold_fn merge = merge_fold;
+    if (intKey && size == sizeof(int) && !combine)
+        merge = merge_fold_int;
+    else if (intKey && size == sizeof(struct keyValue) && combine == psort_combine_add)
+        merge = merge_fold_add;
+    struct reduceShared sh = {{&sc, combine, intKey, merge}, {base, scratch.data}, n, counts,
+                              counts + threads, counts + 2 * threads};
+    team_run(threads, reduce_worker, &sh);
+    *outN = sh.count[0];
+    free(counts);
+    sort_buf_free(&scratch);
+    return 0;
+}
@@ -0,0 +1,49 @@
+// sortreduce.h
+// Sort with aggregation: equal keys are combined while the runs are being
+// merged, so the output is already grouped (unique, counted, summed) with
+// no separate pass, and on low-cardinality data the runs shrink from the
+// first merge level on.
+
+#ifndef SORTREDUCE_H
+#define SORTREDUCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fold `from` into `into`, two elements that compare equal. `into` is the
+// one that came first in the input. ctx is the sort's ctx.
+typedef void (*psort_combine_fn)(void *into, const void *from, void *ctx);
+
+// Sort base[0..n) and combine every group of equal elements into one,
+// leaving the *outN groups, sorted, in base[0..*outN). The rest of base
+// is left undefined. combine NULL keeps the first element of each group
+// (unique). Groups fold in input order, left to right.
+// Returns 0 on success, -1 (errno set) if the scratch buffer can't be
+// allocated.
+int parallel_sort_reduce(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                         psort_combine_fn combine, void *ctx, size_t *outN,
+                         const struct sortPolicy *policy);
+
+// Ready-made record for counts and sums: sort with psort_cmp_int (which
+// only looks at the leading int key) and combine with psort_combine_add.
+// For counts start every value at 1.
+struct keyValue
+{
+    int key;
+    int64_t value;
+};
+
+// into->value += from->value, for struct keyValue.
+void psort_combine_add(void *into, const void *from, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SORTREDUCE_H
@@ -0,0 +1,415 @@
+// sorttrace.c
+// Trace collection. Every thread that opens a span gets its own record,
+// found through a thread-local pointer, so the hot path takes no lock:
+// per-level and per-phase times and the counts are plain adds into the
+// calling thread's record. Records are linked into a global list when a
+// thread first shows up and stay there until the next trace begins, since
+// the engine's threads have usually exited by the time the trace is
+// written. A generation number tells a thread that its cached pointer
+// belongs to an earlier trace.
+//
+// Spans of at least minSpan elements, subtrees and waits are also kept as
+// events with their start time (and hardware counter deltas when asked
+// for); the rest are only summed, so tracing a large sort stays cheap.
+
+#define _GNU_SOURCE
+#include "sorttrace.h"
+
+#include <errno.h>
+
+#ifndef PSORT_TRACE
+
+int sort_trace_begin(const struct sortTraceOptions *opt)
+{
+    (void)opt;
+    errno = ENOSYS;
+    return -1;
+}
+
+void sort_trace_end(void)
+{
+}
+
+int sort_trace_write_json(FILE *f)
+{
+    (void)f;
+    errno = ENOSYS;
+    return -1;
+}
+
+int sort_trace_write_chrome(FILE *f)
+{
+    (void)f;
+    errno = ENOSYS;
+    return -1;
+}
+
+#else
+
+#include "timing.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Deepest recursion level kept apart; deeper ones are added to the last.
+#define TRACE_LEVELS 64
+#define TRACE_DEFAULT_MIN_SPAN ((size_t)64 << 10)
+#define TRACE_COUNTER_MASK \
+    (1u << PERF_CYCLES | 1u << PERF_LLC_MISSES | 1u << PERF_BRANCH_MISSES)
+
+static const char *phaseNames[TRACE_PHASES] = {"base", "merge", "copy", "wait", "subtree"};
+
+struct traceEvent
+{
+    double start, secs;
+    size_t n;
+    short phase, level;
+    uint64_t counters[PERF_EVENTS];
+};
+
+struct traceThread
+{
+    int id;
+    double first, last; // first span start, last span end
+    int inSubtree;
+    double secs[TRACE_PHASES];
+    double levelSecs[TRACE_LEVELS][TRACE_PHASES];
+    uint64_t levelCalls[TRACE_LEVELS][TRACE_PHASES];
+    uint64_t compares, moves;
+    uint64_t counters[TRACE_PHASES][PERF_EVENTS];
+    struct perfCounters pc;
+    struct traceEvent *events;
+    size_t nEvents, capEvents;
+    struct traceThread *next;
+};
+
+static struct
+{
+    int active;
+    unsigned generation;
+    struct sortTraceOptions opt;
+    double start, end;
+    pthread_mutex_t lock;
+    struct traceThread *threads; // newest first
+    int nThreads;
+    int haveCounters; // some thread got its hardware counters
+    int64_t mem, memPeak;
+} tr = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct traceThread *self;
+static __thread unsigned selfGeneration;
+
+static void free_threads(void)
+{
+    for (struct traceThread *t = tr.threads, *next; t; t = next)
+    {
+        next = t->next;
+        perfctr_close(&t->pc);
+        free(t->events);
+        free(t);
+    }
+    tr.threads = NULL;
+    tr.nThreads = 0;
+}
+
+// The calling thread's record, created on first use. NULL if out of memory.
+static struct traceThread *thread_self(void)
+{
+    unsigned gen = __atomic_load_n(&tr.generation, __ATOMIC_ACQUIRE);
+    if (self && selfGeneration == gen)
+        return self;
+    struct traceThread *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    int counters = perfctr_open_thread(&t->pc, tr.opt.counters ? TRACE_COUNTER_MASK : 0);
+    pthread_mutex_lock(&tr.lock);
+    tr.haveCounters |= counters > 0;
+    t->id = tr.nThreads++;
+    t->next = tr.threads;
+    tr.threads = t;
+    pthread_mutex_unlock(&tr.lock);
+    self = t;
+    selfGeneration = gen;
+    return t;
+}
+
+int sort_trace_begin(const struct sortTraceOptions *opt)
+{
+    pthread_mutex_lock(&tr.lock);
+    free_threads();
+    memset(&tr.opt, 0, sizeof(tr.opt));
+    if (opt)
+        tr.opt = *opt;
+    if (tr.opt.minSpan == 0)
+        tr.opt.minSpan = TRACE_DEFAULT_MIN_SPAN;
+    if (tr.opt.threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        tr.opt.threads = cpus > 0 ? (int)cpus : 1;
+    }
+    tr.haveCounters = 0;
+    tr.mem = tr.memPeak = 0;
+    tr.start = tr.end = now();
+    __atomic_add_fetch(&tr.generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&tr.active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tr.lock);
+    return 0;
+}
+
+void sort_trace_end(void)
+{
+    pthread_mutex_lock(&tr.lock);
+    if (tr.active)
+    {
+        __atomic_store_n(&tr.active, 0, __ATOMIC_RELEASE);
+        tr.end = now();
+        for (struct traceThread *t = tr.threads; t; t = t->next)
+            perfctr_close(&t->pc);
+    }
+    pthread_mutex_unlock(&tr.lock);
+}
+
+// ---------------------------------------------------------------------------
+// Hooks.
+
+void trace_span_begin(struct traceSpan *s, enum tracePhase phase, int level, size_t n)
+{
+    s->live = 0;
+    if (!__atomic_load_n(&tr.active, __ATOMIC_RELAXED))
+        return;
+    struct traceThread *t = thread_self();
+    if (!t)
+        return;
+    if (phase == TRACE_SUBTREE)
+    {
+        if (n >= tr.opt.minSpan || t->inSubtree)
+            return;
+        t->inSubtree = 1;
+    }
+    s->live = 1;
+    s->event = phase == TRACE_SUBTREE || phase == TRACE_WAIT || n >= tr.opt.minSpan;
+    s->phase = (short)phase;
+    s->level = (short)(level < TRACE_LEVELS ? level : TRACE_LEVELS - 1);
+    s->n = n;
+    if (s->event && tr.opt.counters)
+        perfctr_read(&t->pc, s->counters);
+    s->start = now();
+    if (t->first == 0)
+        t->first = s->start;
+}
+
+void trace_span_end(struct traceSpan *s)
+{
+    if (!s->live)
+        return;
+    double end = now(), secs = end - s->start;
+    struct traceThread *t = self;
+    int phase = s->phase;
+    t->last = end;
+    t->secs[phase] += secs;
+    if (phase == TRACE_SUBTREE)
+        t->inSubtree = 0;
+    else if (s->level >= 0)
+    {
+        t->levelSecs[s->level][phase] += secs;
+        t->levelCalls[s->level][phase]++;
+    }
+    if (!s->event)
+        return;
+
+    if (t->nEvents == t->capEvents)
+    {
+        size_t cap = t->capEvents ? 2 * t->capEvents : 256;
+        struct traceEvent *ev = realloc(t->events, cap * sizeof(*ev));
+        if (!ev)
+            return;
+        t->events = ev;
+        t->capEvents = cap;
+    }
+    struct traceEvent *ev = &t->events[t->nEvents++];
+    ev->start = s->start;
+    ev->secs = secs;
+    ev->n = s->n;
+    ev->phase = s->phase;
+    ev->level = s->level;
+    memset(ev->counters, 0, sizeof(ev->counters));
+    if (tr.opt.counters)
+    {
+        uint64_t now[PERF_EVENTS];
+        perfctr_read(&t->pc, now);
+        for (int e = 0; e < PERF_EVENTS; e++)
+        {
+            ev->counters[e] = now[e] - s->counters[e];
+            t->counters[phase][e] += ev->counters[e];
+        }
+    }
+}
+
+void trace_count(uint64_t compares, uint64_t moves)
+{
+    if (!__atomic_load_n(&tr.active, __ATOMIC_RELAXED))
+        return;
+    struct traceThread *t = thread_self();
+    if (!t)
+        return;
+    t->compares += compares;
+    t->moves += moves;
+}
+
+void trace_mem(int64_t bytes)
+{
+    if (!__atomic_load_n(&tr.active, __ATOMIC_RELAXED))
+        return;
+    int64_t cur = __atomic_add_fetch(&tr.mem, bytes, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&tr.memPeak, __ATOMIC_RELAXED);
+    while (cur > peak &&
+           !__atomic_compare_exchange_n(&tr.memPeak, &peak, cur, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+// ---------------------------------------------------------------------------
+// Output.
+
+static void write_counters(FILE *f, const uint64_t *counters)
+{
+    fprintf(f, "{");
+    const char *sep = "";
+    for (int e = 0; e < PERF_EVENTS; e++)
+        if (TRACE_COUNTER_MASK & (1u << e))
+        {
+            fprintf(f, "%s\"%s\": %llu", sep, perfctr_name((enum perfEvent)e),
+                    (unsigned long long)counters[e]);
+            sep = ", ";
+        }
+    fprintf(f, "}");
+}
+
+int sort_trace_write_json(FILE *f)
+{
+    if (!tr.threads)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    double wall = tr.end - tr.start;
+    double phaseSecs[TRACE_PHASES] = {0}, levelSecs[TRACE_LEVELS][TRACE_PHASES] = {{0}};
+    uint64_t levelCalls[TRACE_LEVELS][TRACE_PHASES] = {{0}};
+    uint64_t counters[TRACE_PHASES][PERF_EVENTS] = {{0}};
+    uint64_t compares = 0, moves = 0;
+    double busy = 0;
+    int levels = 0;
+    for (const struct traceThread *t = tr.threads; t; t = t->next)
+    {
+        for (int p = 0; p < TRACE_PHASES; p++)
+        {
+            phaseSecs[p] += t->secs[p];
+            for (int e = 0; e < PERF_EVENTS; e++)
+                counters[p][e] += t->counters[p][e];
+            for (int l = 0; l < TRACE_LEVELS; l++)
+            {
+                levelSecs[l][p] += t->levelSecs[l][p];
+                levelCalls[l][p] += t->levelCalls[l][p];
+                if (t->levelCalls[l][p] && l + 1 > levels)
+                    levels = l + 1;
+            }
+        }
+        busy += t->secs[TRACE_BASE] + t->secs[TRACE_MERGE] + t->secs[TRACE_COPY];
+        compares += t->compares;
+        moves += t->moves;
+    }
+
+    fprintf(f, "{\n  \"wall_seconds\": %.6f,\n  \"threads\": %d,\n", wall, tr.opt.threads);
+    fprintf(f, "  \"utilisation\": %.4f,\n", wall > 0 ? busy / (wall * tr.opt.threads) : 0.0);
+    fprintf(f, "  \"compares\": %llu,\n  \"moves\": %llu,\n", (unsigned long long)compares,
+            (unsigned long long)moves);
+    fprintf(f, "  \"peak_scratch_bytes\": %lld,\n", (long long)tr.memPeak);
+
+    // Subtree time overlaps the base, merge and copy time inside it.
+    fprintf(f, "  \"phases\": {");
+    for (int p = 0; p < TRACE_PHASES; p++)
+    {
+        fprintf(f, "%s\n    \"%s\": {\"seconds\": %.6f", p ? "," : "", phaseNames[p],
+                phaseSecs[p]);
+        if (tr.haveCounters)
+        {
+            fprintf(f, ", \"counters\": ");
+            write_counters(f, counters[p]);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  },\n");
+
+    // Subtree time is already in the levels below it.
+    fprintf(f, "  \"levels\": [");
+    for (int l = 0; l < levels; l++)
+    {
+        fprintf(f, "%s\n    {\"level\": %d", l ? "," : "", l);
+        for (int p = 0; p < TRACE_SUBTREE; p++)
+            fprintf(f, ", \"%s\": {\"seconds\": %.6f, \"calls\": %llu}", phaseNames[p],
+                    levelSecs[l][p], (unsigned long long)levelCalls[l][p]);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ],\n");
+
+    // Idle is the part of a thread's lifetime in no span: thread start-up,
+    // splitting merges, bookkeeping.
+    fprintf(f, "  \"thread_times\": [");
+    int first = 1;
+    for (int id = 0; id < tr.nThreads; id++)
+        for (const struct traceThread *t = tr.threads; t; t = t->next)
+        {
+            if (t->id != id)
+                continue;
+            double b = t->secs[TRACE_BASE] + t->secs[TRACE_MERGE] + t->secs[TRACE_COPY];
+            double life = t->last - t->first;
+            fprintf(f, "%s\n    {\"thread\": %d, \"seconds\": %.6f, \"busy\": %.6f, "
+                       "\"wait\": %.6f, \"idle\": %.6f, \"compares\": %llu, \"moves\": %llu}",
+                    first ? "" : ",", t->id, life, b, t->secs[TRACE_WAIT],
+                    life > b + t->secs[TRACE_WAIT] ? life - b - t->secs[TRACE_WAIT] : 0.0,
+                    (unsigned long long)t->compares, (unsigned long long)t->moves);
+            first = 0;
+        }
+    fprintf(f, "\n  ]\n}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+int sort_trace_write_chrome(FILE *f)
+{
+    if (!tr.threads)
+    {
+        errno = ENODATA;
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char *sep = "\n";
+    for (const struct traceThread *t = tr.threads; t; t = t->next)
+    {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                   "\"args\": {\"name\": \"sort thread %d\"}}",
+                sep, t->id, t->id);
+        sep = ",\n";
+        for (size_t i = 0; i < t->nEvents; i++)
+        {
+            const struct traceEvent *ev = &t->events[i];
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"sort\", \"ph\": \"X\", \"pid\": 1, "
+                       "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"n\": %zu",
+                    phaseNames[ev->phase], t->id, (ev->start - tr.start) * 1e6, ev->secs * 1e6,
+                    ev->n);
+            if (ev->level >= 0)
+                fprintf(f, ", \"level\": %d", ev->level);
+            if (tr.haveCounters)
+            {
+                fprintf(f, ", \"counters\": ");
+                write_counters(f, ev->counters);
+            }
+            fprintf(f, "}}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+#endif // PSORT_TRACE
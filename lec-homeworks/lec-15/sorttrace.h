@@ -0,0 +1,101 @@
+// sorttrace.h
+// Instrumentation of the merge engine: time per recursion level and phase,
+// busy and waiting time per thread, comparison and move counts, peak
+// scratch memory, and optionally hardware counters per phase. The result
+// is written as a JSON summary and as Chrome trace events (load the file
+// in chrome://tracing or Perfetto).
+//
+// Only built with -DPSORT_TRACE (make TRACE=1). Otherwise the hooks in the
+// engine expand to nothing and sort_trace_begin fails with ENOSYS.
+
+#ifndef SORTTRACE_H
+#define SORTTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "perfctr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sortTraceOptions
+{
+    size_t minSpan; // elements a span needs to be its own trace event (0: 64K)
+    int counters;   // read cycles, LLC and branch misses around each event
+    int threads;    // threads the sort may use, for utilisation (0: all CPUs)
+};
+
+// Start collecting, discarding any earlier trace. Returns 0, or -1 with
+// errno set (ENOSYS when built without PSORT_TRACE).
+int sort_trace_begin(const struct sortTraceOptions *opt);
+
+// Stop collecting. The trace stays available to the writers below.
+void sort_trace_end(void);
+
+// Write the summary as JSON, or the events in Chrome trace format.
+// Return 0, or -1 if nothing was traced or the write failed.
+int sort_trace_write_json(FILE *f);
+int sort_trace_write_chrome(FILE *f);
+
+// ---------------------------------------------------------------------------
+// Engine hooks.
+//
+// A span times one phase of one node of the recursion on the calling
+// thread. Base, merge, copy and wait spans never nest on a thread, so their
+// sums are the thread's busy and waiting time. A subtree span wraps the
+// first node below minSpan so that the small, cache-resident work under it
+// shows up as one event, and is not added to the per-level times.
+
+enum tracePhase
+{
+    TRACE_BASE,    // insertion sort of a leaf
+    TRACE_MERGE,
+    TRACE_COPY,    // leaf copied to the other buffer
+    TRACE_WAIT,    // join or barrier
+    TRACE_SUBTREE,
+    TRACE_PHASES
+};
+
+// Level of spans that belong to no recursion level (barriers).
+#define TRACE_NO_LEVEL -1
+
+#ifdef PSORT_TRACE
+
+struct traceSpan
+{
+    double start;
+    uint64_t counters[PERF_EVENTS];
+    size_t n;
+    short phase, level;
+    char live, event;
+};
+
+void trace_span_begin(struct traceSpan *s, enum tracePhase phase, int level, size_t n);
+void trace_span_end(struct traceSpan *s);
+void trace_count(uint64_t compares, uint64_t moves);
+void trace_mem(int64_t bytes);
+
+#define TRACE_SPAN(s) struct traceSpan s
+#define TRACE_BEGIN(s, phase, level, n) trace_span_begin(&(s), phase, level, n)
+#define TRACE_END(s) trace_span_end(&(s))
+#define TRACE_COUNT(compares, moves) trace_count(compares, moves)
+#define TRACE_MEM(bytes) trace_mem(bytes)
+
+#else
+
+#define TRACE_SPAN(s)
+#define TRACE_BEGIN(s, phase, level, n) ((void)0)
+#define TRACE_END(s) ((void)0)
+#define TRACE_COUNT(compares, moves) ((void)0)
+#define TRACE_MEM(bytes) ((void)0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SORTTRACE_H
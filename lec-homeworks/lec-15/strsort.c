@@ -0,0 +1,349 @@
+// strsort.c
+// String sort: multikey quicksort per thread, then LCP-aware merging.
+//
+// A comparison sort over strings re-reads the prefix two strings share
+// every time it compares them, and keys like URLs or log lines share long
+// prefixes. Multikey quicksort (Bentley and Sedgewick) partitions on one
+// character at a time, so each character is looked at O(log n) times
+// instead of once per comparison. Each worker sorts its slice of string
+// pointers that way, then records lcp[i], the length of the prefix string
+// i shares with string i - 1.
+//
+// The sorted slices are merged pairwise, one level per barrier. The LCP
+// merge keeps, for each run's head, its common prefix with the last string
+// output. If the two differ the head with the longer one is smaller and is
+// output without looking at a character; only on a tie are the two heads
+// compared, starting past the shared prefix. Each output gets its lcp
+// entry for free, ready for the next level.
+
+#include "strsort.h"
+#include "team.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Subarrays this small are insertion sorted.
+#define MKQS_CUTOFF 16
+// Fewest strings worth giving a thread of its own.
+#define STR_MIN_PER_THREAD 16384
+
+typedef const unsigned char *str;
+
+// ---------------------------------------------------------------------------
+// Arena.
+
+void str_arena_init(struct strArena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+static int reserve(struct strArena *a, size_t bytes, size_t strings)
+{
+    if (a->len + bytes > a->cap)
+    {
+        size_t cap = a->cap ? a->cap : 4096;
+        while (cap < a->len + bytes)
+            cap *= 2;
+        char *data = realloc(a->data, cap);
+        if (!data)
+            return -1;
+        a->data = data;
+        a->cap = cap;
+    }
+    if (a->n + strings > a->ncap)
+    {
+        size_t ncap = a->ncap ? a->ncap : 256;
+        while (ncap < a->n + strings)
+            ncap *= 2;
+        size_t *offset = realloc(a->offset, ncap * sizeof(*offset));
+        if (!offset)
+            return -1;
+        a->offset = offset;
+        a->ncap = ncap;
+    }
+    return 0;
+}
+
+int str_arena_add(struct strArena *a, const char *s, size_t len)
+{
+    if (reserve(a, len + 1, 1) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    a->offset[a->n++] = a->len;
+    memcpy(a->data + a->len, s, len);
+    a->data[a->len + len] = '\0';
+    a->len += len + 1;
+    return 0;
+}
+
+int str_arena_add_lines(struct strArena *a, const char *buf, size_t len)
+{
+    size_t lines = 1;
+    for (const char *p = buf; (p = memchr(p, '\n', (size_t)(buf + len - p))); p++)
+        lines++;
+    if (reserve(a, len + 1, lines) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    const char *p = buf, *end = buf + len;
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *e = nl ? nl : end;
+        str_arena_add(a, p, (size_t)(e - p));
+        p = e + 1;
+    }
+    return 0;
+}
+
+void str_arena_free(struct strArena *a)
+{
+    free(a->data);
+    free(a->offset);
+    str_arena_init(a);
+}
+
+int str_cmp_offset(const void *a, const void *b, void *ctx)
+{
+    const char *arena = ctx;
+    return strcmp(arena + *(const size_t *)a, arena + *(const size_t *)b);
+}
+
+// ---------------------------------------------------------------------------
+// Multikey quicksort. All strings in s[0..n) share their first `depth`
+// characters.
+
+static void isort_str(str *s, size_t n, size_t depth)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        str cur = s[i];
+        size_t j = i;
+        while (j > 0 && strcmp((const char *)s[j - 1] + depth, (const char *)cur + depth) > 0)
+        {
+            s[j] = s[j - 1];
+            j--;
+        }
+        s[j] = cur;
+    }
+}
+
+static int median3(int a, int b, int c)
+{
+    if (a < b)
+        return b < c ? b : a < c ? c : a;
+    return a < c ? a : b < c ? c : b;
+}
+
+static void mkqs(str *s, size_t n, size_t depth)
+{
+    while (n > MKQS_CUTOFF)
+    {
+        int v = median3(s[0][depth], s[n / 2][depth], s[n - 1][depth]);
+        // Three-way partition on the character at depth: < v, == v, > v.
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt)
+        {
+            int c = s[i][depth];
+            if (c < v)
+            {
+                str t = s[lt];
+                s[lt++] = s[i];
+                s[i++] = t;
+            }
+            else if (c > v)
+            {
+                str t = s[--gt];
+                s[gt] = s[i];
+                s[i] = t;
+            }
+            else
+                i++;
+        }
+        if (v != 0)
+            mkqs(s + lt, gt - lt, depth + 1);
+        // Recurse on the smaller outer part, loop on the larger.
+        if (lt < n - gt)
+        {
+            mkqs(s, lt, depth);
+            s += gt;
+            n -= gt;
+        }
+        else
+        {
+            mkqs(s + gt, n - gt, depth);
+            n = lt;
+        }
+    }
+    isort_str(s, n, depth);
+}
+
+// ---------------------------------------------------------------------------
+// LCP merge.
+
+static size_t lcp_from(str a, str b, size_t h)
+{
+    while (a[h] != 0 && a[h] == b[h])
+        h++;
+    return h;
+}
+
+// Merge the sorted runs a and b, with lcp arrays la and lb (la[0] and
+// lb[0] unused), into out and lo. Ties go to a.
+static void lcp_merge(const str *a, const size_t *la, size_t na, const str *b,
+                      const size_t *lb, size_t nb, str *out, size_t *lo)
+{
+    // ha, hb: common prefix of each head with the last string output
+    // (initially an empty one).
+    size_t i = 0, j = 0, k = 0, ha = 0, hb = 0;
+    while (i < na && j < nb)
+    {
+        if (ha > hb)
+        {
+            // a's head agrees with the last output further than b's, and
+            // b's head sorts after that: a's head is smaller.
+            out[k] = a[i];
+            lo[k++] = ha;
+            if (++i < na)
+                ha = la[i];
+        }
+        else if (ha < hb)
+        {
+            out[k] = b[j];
+            lo[k++] = hb;
+            if (++j < nb)
+                hb = lb[j];
+        }
+        else
+        {
+            size_t h = lcp_from(a[i], b[j], ha);
+            if (a[i][h] <= b[j][h])
+            {
+                out[k] = a[i];
+                lo[k++] = ha;
+                hb = h;
+                if (++i < na)
+                    ha = la[i];
+            }
+            else
+            {
+                out[k] = b[j];
+                lo[k++] = hb;
+                ha = h;
+                if (++j < nb)
+                    hb = lb[j];
+            }
+        }
+    }
+    // The first leftover's lcp with the last output is the head's.
+    if (i < na)
+    {
+        memcpy(out + k, a + i, (na - i) * sizeof(*out));
+        memcpy(lo + k, la + i, (na - i) * sizeof(*lo));
+        lo[k] = ha;
+    }
+    else if (j < nb)
+    {
+        memcpy(out + k, b + j, (nb - j) * sizeof(*out));
+        memcpy(lo + k, lb + j, (nb - j) * sizeof(*lo));
+        lo[k] = hb;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Parallel driver.
+
+struct strShared
+{
+    const char *arena;
+    size_t *offset;
+    size_t n;
+    str *s, *tmp;       // string pointers and the merge buffer
+    size_t *lcp, *tmpLcp;
+};
+
+static size_t slice_start(const struct sortTeam *team, int w, size_t n)
+{
+    size_t lo, hi;
+    if (w >= team->size)
+        return n;
+    team_slice(team, w, n, &lo, &hi);
+    return lo;
+}
+
+static void str_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct strShared *sh = arg;
+    size_t lo, hi;
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    for (size_t i = lo; i < hi; i++)
+        sh->s[i] = (str)sh->arena + sh->offset[i];
+    mkqs(sh->s + lo, hi - lo, 0);
+    sh->lcp[lo] = 0;
+    for (size_t i = lo + 1; i < hi; i++)
+        sh->lcp[i] = lcp_from(sh->s[i - 1], sh->s[i], 0);
+
+    // Level by level, worker id merges its run with the one `width`
+    // slices to its right, ping-ponging between the two buffers.
+    str *src = sh->s, *dst = sh->tmp;
+    size_t *lsrc = sh->lcp, *ldst = sh->tmpLcp;
+    for (int width = 1; width < team->size; width *= 2)
+    {
+        team_barrier(team);
+        if (id % (2 * width) == 0)
+        {
+            size_t mid = slice_start(team, id + width, sh->n);
+            size_t end = slice_start(team, id + 2 * width, sh->n);
+            if (mid < end)
+                lcp_merge(src + lo, lsrc + lo, mid - lo, src + mid, lsrc + mid, end - mid,
+                          dst + lo, ldst + lo);
+            else
+            {
+                memcpy(dst + lo, src + lo, (end - lo) * sizeof(*dst));
+                memcpy(ldst + lo, lsrc + lo, (end - lo) * sizeof(*ldst));
+            }
+        }
+        str *t = src;
+        src = dst;
+        dst = t;
+        size_t *lt = lsrc;
+        lsrc = ldst;
+        ldst = lt;
+    }
+    team_barrier(team);
+
+    for (size_t i = lo; i < hi; i++)
+        sh->offset[i] = (size_t)((const char *)src[i] - sh->arena);
+}
+
+int string_sort(const char *arena, size_t *offset, size_t n,
+                const struct sortPolicy *policy)
+{
+    if (n < 2)
+        return 0;
+    int threads = sort_policy_threads(policy);
+    if ((size_t)threads > n / STR_MIN_PER_THREAD + 1)
+        threads = (int)(n / STR_MIN_PER_THREAD + 1);
+
+    struct strShared sh = {arena, offset, n, NULL, NULL, NULL, NULL};
+    sh.s = malloc(2 * n * sizeof(*sh.s));
+    sh.lcp = malloc(2 * n * sizeof(*sh.lcp));
+    if (!sh.s || !sh.lcp)
+    {
+        free(sh.s);
+        free(sh.lcp);
+        errno = ENOMEM;
+        return -1;
+    }
+    sh.tmp = sh.s + n;
+    sh.tmpLcp = sh.lcp + n;
+    team_run(threads, str_worker, &sh);
+    free(sh.s);
+    free(sh.lcp);
+    return 0;
+}
@@ -0,0 +1,53 @@
+// strsort.h
+// String sort engine. Strings are stored back to back in one arena and
+// named by their offset in it, so growing the arena never invalidates them
+// and sorting only moves offsets.
+
+#ifndef STRSORT_H
+#define STRSORT_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct strArena
+{
+    char *data;     // NUL-terminated strings, back to back
+    size_t len, cap;
+    size_t *offset; // offset[i] is where string i starts in data
+    size_t n, ncap;
+};
+
+void str_arena_init(struct strArena *a);
+
+// Append a copy of s[0..len) as the next string. Returns 0 or -1 (ENOMEM).
+int str_arena_add(struct strArena *a, const char *s, size_t len);
+
+// Append every line of buf[0..len), without its '\n'. A last line with no
+// newline is kept if it is not empty. Returns 0 or -1 (ENOMEM).
+int str_arena_add_lines(struct strArena *a, const char *buf, size_t len);
+
+void str_arena_free(struct strArena *a);
+
+// Sort offset[0..n) so the strings they name in arena are in strcmp order.
+// Each thread multikey-quicksorts a slice, and the sorted slices are
+// merged with an LCP-aware merge that never re-reads a prefix two strings
+// are known to share. Equal strings end up in unspecified order.
+// Extra memory is 32 bytes per string.
+// Returns 0 on success, -1 (errno set) on allocation failure.
+int string_sort(const char *arena, size_t *offset, size_t n,
+                const struct sortPolicy *policy);
+
+// strcmp of the strings at two size_t offsets into the arena passed as
+// ctx, for sorting offsets with the generic engine.
+int str_cmp_offset(const void *a, const void *b, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STRSORT_H
@@ -0,0 +1,101 @@
+// team.c
+// Worker teams. Threads are created while the caller holds the gate mutex,
+// so no worker starts until the final team size is known and the barrier
+// has been initialised for exactly that many workers.
+
+#include "team.h"
+#include "sorttrace.h"
+
+#include <stdlib.h>
+
+struct teamStart
+{
+    struct sortTeam *team;
+    int id;
+    team_fn fn;
+    void *arg;
+};
+
+static void *team_thread(void *p)
+{
+    struct teamStart *s = p;
+    pthread_mutex_lock(&s->team->gate);
+    pthread_mutex_unlock(&s->team->gate);
+    s->fn(s->team, s->id, s->arg);
+    return NULL;
+}
+
+int team_run(int threads, team_fn fn, void *arg)
+{
+    if (threads < 1)
+        threads = 1;
+    struct sortTeam team;
+    pthread_t *tids = malloc((size_t)threads * sizeof(*tids));
+    struct teamStart *starts = malloc((size_t)threads * sizeof(*starts));
+    if (!tids || !starts)
+        threads = 1;
+
+    pthread_mutex_init(&team.gate, NULL);
+    pthread_mutex_lock(&team.gate);
+    int created = 1;
+    for (int i = 1; i < threads; i++)
+    {
+        starts[i] = (struct teamStart){&team, i, fn, arg};
+        if (pthread_create(&tids[i], NULL, team_thread, &starts[i]) != 0)
+            break;
+        created++;
+    }
+    team.size = created;
+    pthread_barrier_init(&team.barrier, NULL, (unsigned)created);
+    pthread_mutex_unlock(&team.gate);
+
+    fn(&team, 0, arg);
+
+    for (int i = 1; i < created; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&team.barrier);
+    pthread_mutex_destroy(&team.gate);
+    free(tids);
+    free(starts);
+    return created;
+}
+
+struct chunkRun
+{
+    int chunks;
+    team_fn fn;
+    void *arg;
+};
+
+static void chunk_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct chunkRun *cr = arg;
+    for (int c = id; c < cr->chunks; c += team->size)
+        cr->fn(team, c, cr->arg);
+}
+
+void team_run_chunks(int chunks, team_fn fn, void *arg)
+{
+    struct chunkRun cr = {chunks, fn, arg};
+    team_run(chunks, chunk_worker, &cr);
+}
+
+void team_barrier(struct sortTeam *team)
+{
+    if (team->size > 1)
+    {
+        TRACE_SPAN(span);
+        TRACE_BEGIN(span, TRACE_WAIT, TRACE_NO_LEVEL, 0);
+        pthread_barrier_wait(&team->barrier);
+        TRACE_END(span);
+    }
+}
+
+void team_slice(const struct sortTeam *team, int id, size_t n,
+                size_t *lo, size_t *hi)
+{
+    size_t workers = (size_t)team->size, w = (size_t)id;
+    size_t q = n / workers, r = n % workers;
+    *lo = w * q + (w < r ? w : r);
+    *hi = *lo + q + (w < r);
+}
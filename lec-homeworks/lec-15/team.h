@@ -0,0 +1,46 @@
+// team.h
+// Fixed-size team of pthreads that run the same function and meet at
+// barriers. Used by the sort modes that work in synchronised phases.
+
+#ifndef TEAM_H
+#define TEAM_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sortTeam
+{
+    int size; // workers actually running, including the caller
+    pthread_barrier_t barrier;
+    pthread_mutex_t gate;
+};
+
+typedef void (*team_fn)(struct sortTeam *team, int id, void *arg);
+
+// Run fn(team, id, arg) on up to `threads` workers; the calling thread is
+// worker 0. If thread creation fails the team just runs smaller, so fn must
+// split its work by team->size, never by the requested count.
+// Returns the number of workers that ran.
+int team_run(int threads, team_fn fn, void *arg);
+
+// Run fn once for every chunk id in [0, chunks) on a team of up to `chunks`
+// workers, passing the chunk id as `id`. Unlike team_run, the number of
+// chunks stays fixed however many threads could be created, so fn must not
+// call team_barrier.
+void team_run_chunks(int chunks, team_fn fn, void *arg);
+
+// Wait until every worker in the team reaches this point.
+void team_barrier(struct sortTeam *team);
+
+// Half-open slice [*lo, *hi) of n items owned by worker id.
+void team_slice(const struct sortTeam *team, int id, size_t n,
+                size_t *lo, size_t *hi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEAM_H
@@ -0,0 +1,400 @@
+// textio.c
+// Text parsing and formatting of ints.
+//
+// Parsing classifies 16 bytes at a time into "token" bytes (digits and
+// '-') with SSE2 when available. Bitmasks then give the token count for a
+// chunk, and the start and length of each token, without a per-byte loop.
+// Digits are converted eight at a time with SWAR multiplies on a 64-bit
+// word. The buffer is cut into one chunk per worker at token boundaries.
+// A first pass counts the numbers in each chunk, so every worker knows
+// where its numbers go in the output array before the second pass
+// converts them.
+//
+// Formatting writes two digits per step from a 200-byte "00".."99" table.
+// Each worker formats a block of ints into its own buffer, and the caller
+// writes the buffers out in order.
+
+#define _GNU_SOURCE
+#include "textio.h"
+#include "team.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Ints formatted per worker per round; bounds the formatting buffers.
+#define FORMAT_BLOCK (1u << 20)
+// Longest formatted int: sign, 10 digits, separator.
+#define FORMAT_MAX 12
+
+static inline int is_token(char c)
+{
+    return (unsigned char)(c - '0') < 10 || c == '-';
+}
+
+// Bit i set if p[i] is a token byte, for i in [0, 16).
+static inline unsigned token_mask16(const char *p)
+{
+#ifdef __SSE2__
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+    __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i minus = _mm_cmpeq_epi8(x, _mm_set1_epi8('-'));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(digit, minus));
+#else
+    unsigned m = 0;
+    for (int i = 0; i < 16; i++)
+        m |= (unsigned)is_token(p[i]) << i;
+    return m;
+#endif
+}
+
+// Eight ASCII digits, most significant in the lowest byte.
+static inline uint32_t swar_8digits(uint64_t v)
+{
+    v -= 0x3030303030303030ull;
+    v = v * 10 + (v >> 8);
+    v = (((v & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) +
+         (((v >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32)))) >> 32;
+    return (uint32_t)v;
+}
+
+// Value of the d <= 8 digits at p; end bounds what may be read.
+static inline uint32_t digits_upto8(const char *p, size_t d, const char *end)
+{
+    uint64_t v;
+    if (p + 8 <= end)
+        memcpy(&v, p, 8);
+    else
+    {
+        char tmp[8] = {0};
+        memcpy(tmp, p, d);
+        memcpy(&v, tmp, 8);
+    }
+    if (d < 8)
+    {
+        // Shift the digits to the top and pad the front with '0'.
+        v = (v << (8 * (8 - d))) | (0x3030303030303030ull >> (8 * d));
+    }
+    return swar_8digits(v);
+}
+
+static int convert_token(const char *p, size_t len, const char *end, int *out)
+{
+    int neg = p[0] == '-';
+    size_t d = len - (size_t)neg;
+    const char *digits = p + neg;
+    if (d == 0 || memchr(digits, '-', d))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (d > 10)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    int64_t v;
+    if (d <= 8)
+        v = digits_upto8(digits, d, end);
+    else
+    {
+        v = 0;
+        for (size_t i = 0; i < d - 8; i++)
+            v = v * 10 + (digits[i] - '0');
+        v = v * 100000000 + digits_upto8(digits + d - 8, 8, end);
+    }
+    if (neg)
+        v = -v;
+    if (v < INT_MIN || v > INT_MAX)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Parallel parse.
+
+struct parseShared
+{
+    const char *buf;
+    size_t *cut;   // worker w parses buf[cut[w]..cut[w+1])
+    size_t *count; // numbers per chunk, then output offsets
+    int *out;
+    int err;
+};
+
+static size_t count_tokens(const char *p, const char *end)
+{
+    size_t count = 0;
+    unsigned carry = 0; // previous byte was a token byte
+    while (p + 16 <= end)
+    {
+        unsigned m = token_mask16(p);
+        count += (size_t)__builtin_popcount(m & ~((m << 1) | carry));
+        carry = m >> 15;
+        p += 16;
+    }
+    for (; p < end; p++)
+    {
+        unsigned t = is_token(*p);
+        count += t && !carry;
+        carry = t;
+    }
+    return count;
+}
+
+static int parse_chunk(const char *p, const char *end, int *out)
+{
+    while (p < end)
+    {
+        // Skip separators.
+        if (p + 16 <= end)
+        {
+            unsigned m = token_mask16(p);
+            if (!m)
+            {
+                p += 16;
+                continue;
+            }
+            p += __builtin_ctz(m);
+        }
+        else
+        {
+            while (p < end && !is_token(*p))
+                p++;
+            if (p == end)
+                break;
+        }
+
+        // Measure the token.
+        size_t len;
+        unsigned stop = p + 16 <= end ? ~token_mask16(p) & 0xffffu : 0;
+        if (stop)
+            len = (size_t)__builtin_ctz(stop);
+        else
+        {
+            len = 0;
+            while (p + len < end && is_token(p[len]))
+                len++;
+        }
+        if (convert_token(p, len, end, out++) != 0)
+            return -1;
+        p += len;
+    }
+    return 0;
+}
+
+static void count_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    struct parseShared *sh = arg;
+    sh->count[id] = count_tokens(sh->buf + sh->cut[id], sh->buf + sh->cut[id + 1]);
+}
+
+static void parse_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    struct parseShared *sh = arg;
+    if (parse_chunk(sh->buf + sh->cut[id], sh->buf + sh->cut[id + 1],
+                    sh->out + sh->count[id]) != 0)
+        __atomic_store_n(&sh->err, errno, __ATOMIC_RELAXED);
+}
+
+int parse_ints_text(const char *buf, size_t len, int **out, size_t *n,
+                    const struct sortPolicy *policy)
+{
+    int threads = sort_policy_threads(policy);
+    if ((size_t)threads > len / (1u << 16) + 1)
+        threads = (int)(len / (1u << 16) + 1);
+
+    struct parseShared sh = {buf, malloc(((size_t)threads + 1) * sizeof(size_t)),
+                             malloc(((size_t)threads + 1) * sizeof(size_t)), NULL, 0};
+    if (!sh.cut || !sh.count)
+    {
+        free(sh.cut);
+        free(sh.count);
+        errno = ENOMEM;
+        return -1;
+    }
+    // Cut at even offsets, moved forward so no cut falls inside a number.
+    // Chunks are fixed before the team starts, so a smaller team than asked
+    // for just runs the extra chunks itself.
+    for (int w = 0; w <= threads; w++)
+    {
+        size_t c = len / (size_t)threads * (size_t)w;
+        if (w == threads)
+            c = len;
+        while (c > 0 && c < len && is_token(buf[c - 1]))
+            c++;
+        if (w > 0 && c < sh.cut[w - 1])
+            c = sh.cut[w - 1];
+        sh.cut[w] = c;
+    }
+
+    team_run_chunks(threads, count_worker, &sh);
+    size_t total = 0;
+    for (int w = 0; w < threads; w++)
+    {
+        size_t c = sh.count[w];
+        sh.count[w] = total;
+        total += c;
+    }
+    sh.out = malloc(total * sizeof(int) + 1);
+    if (!sh.out)
+        sh.err = ENOMEM;
+    else
+        team_run_chunks(threads, parse_worker, &sh);
+
+    free(sh.cut);
+    free(sh.count);
+    if (sh.err)
+    {
+        free(sh.out);
+        errno = sh.err;
+        return -1;
+    }
+    *out = sh.out;
+    *n = total;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Parallel format.
+
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static inline char *format_int(char *p, int value, char sep)
+{
+    uint32_t v = (uint32_t)value;
+    if (value < 0)
+    {
+        *p++ = '-';
+        v = 0u - v;
+    }
+    char tmp[10];
+    char *q = tmp + sizeof(tmp);
+    while (v >= 100)
+    {
+        unsigned pair = v % 100;
+        v /= 100;
+        q -= 2;
+        memcpy(q, digitPairs + 2 * pair, 2);
+    }
+    if (v >= 10)
+    {
+        q -= 2;
+        memcpy(q, digitPairs + 2 * v, 2);
+    }
+    else
+        *--q = (char)('0' + v);
+    size_t len = (size_t)(tmp + sizeof(tmp) - q);
+    memcpy(p, q, len);
+    p[len] = sep;
+    return p + len + 1;
+}
+
+struct formatShared
+{
+    const int *a;
+    size_t n;
+    size_t first; // first int of this round
+    char sep;
+    char **buf;   // one FORMAT_BLOCK * FORMAT_MAX buffer per worker
+    size_t *len;
+};
+
+static void format_worker(struct sortTeam *team, int id, void *arg)
+{
+    (void)team;
+    struct formatShared *sh = arg;
+    size_t lo = sh->first + (size_t)id * FORMAT_BLOCK;
+    size_t hi = lo + FORMAT_BLOCK < sh->n ? lo + FORMAT_BLOCK : sh->n;
+    char *p = sh->buf[id];
+    for (size_t i = lo; i < hi; i++)
+        p = format_int(p, sh->a[i], sh->sep);
+    sh->len[id] = (size_t)(p - sh->buf[id]);
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t m = write(fd, p, len);
+        if (m < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += m;
+        len -= (size_t)m;
+    }
+    return 0;
+}
+
+int write_ints_text(int fd, const int *a, size_t n, char sep,
+                    const struct sortPolicy *policy, struct textioStats *st)
+{
+    struct textioStats local;
+    if (!st)
+        st = &local;
+    memset(st, 0, sizeof(*st));
+
+    int threads = sort_policy_threads(policy);
+    size_t blocks = (n + FORMAT_BLOCK - 1) / FORMAT_BLOCK;
+    if ((size_t)threads > blocks)
+        threads = blocks ? (int)blocks : 1;
+    struct formatShared sh = {a, n, 0, sep, calloc((size_t)threads, sizeof(char *)),
+                              calloc((size_t)threads, sizeof(size_t))};
+    int rc = 0;
+    if (!sh.buf || !sh.len)
+        rc = -1;
+    for (int w = 0; rc == 0 && w < threads; w++)
+        if (!(sh.buf[w] = malloc((size_t)FORMAT_BLOCK * FORMAT_MAX)))
+            rc = -1;
+
+    for (; rc == 0 && sh.first < n; sh.first += (size_t)threads * FORMAT_BLOCK)
+    {
+        double t0 = now();
+        memset(sh.len, 0, (size_t)threads * sizeof(size_t));
+        team_run_chunks(threads, format_worker, &sh);
+        double t1 = now();
+        st->formatSeconds += t1 - t0;
+        for (int w = 0; rc == 0 && w < threads; w++)
+        {
+            rc = write_all(fd, sh.buf[w], sh.len[w]);
+            st->bytes += sh.len[w];
+        }
+        st->ioSeconds += now() - t1;
+    }
+
+    int saved = errno;
+    for (int w = 0; sh.buf && w < threads; w++)
+        free(sh.buf[w]);
+    free(sh.buf);
+    free(sh.len);
+    errno = saved;
+    return rc;
+}
@@ -0,0 +1,39 @@
+// textio.h
+// Fast text I/O for the sort driver: decimal ints separated by whitespace.
+
+#ifndef TEXTIO_H
+#define TEXTIO_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct textioStats
+{
+    size_t bytes;
+    double formatSeconds; // time spent producing text
+    double ioSeconds;     // time spent in write calls
+};
+
+// Parse the decimal ints in buf[0..len) into a malloc'd array. A number is
+// an optional '-' followed by up to 10 digits; any other byte separates
+// numbers. Returns 0 and sets *out and *n, or -1 with errno set to EINVAL
+// (malformed number), ERANGE (doesn't fit an int) or ENOMEM.
+int parse_ints_text(const char *buf, size_t len, int **out, size_t *n,
+                    const struct sortPolicy *policy);
+
+// Write n ints to fd as decimal text, each followed by sep. Formatting runs
+// in parallel over blocks; blocks are written in order. st may be NULL.
+// Returns 0 or -1 (errno set).
+int write_ints_text(int fd, const int *a, size_t n, char sep,
+                    const struct sortPolicy *policy, struct textioStats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEXTIO_H
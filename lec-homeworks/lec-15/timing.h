@@ -0,0 +1,18 @@
+// timing.h
+// Wall-clock time for the phase timings the sorts and the driver report.
+// Internal to this directory; not part of the public API.
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <time.h>
+
+// Seconds on the monotonic clock since an arbitrary start.
+static inline double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif // TIMING_H
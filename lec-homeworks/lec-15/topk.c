@@ -0,0 +1,651 @@
+// topk.c
+// Selection by sampling and filtering.
+//
+// To find the element of rank r, draw a random sample of about sqrt(n)
+// elements, sort it, and take two sample keys lo and hi a few standard
+// deviations either side of where rank r falls in the sample. One
+// parallel pass counts, per worker, the elements below lo, equal to lo,
+// strictly between, equal to hi and above hi. The counts say which class
+// holds rank r. Usually it is the middle one, which holds only
+// O(n / sqrt(n)) elements: a second pass copies those out in input order
+// and the search recurses on the copy. If r lands on a key equal to lo or
+// hi, a single worker finds it by position. If the sample was unlucky and
+// r lies outside the bracket, the pass is repeated with the bracket open
+// on that side. Each round keeps at most n - 1 elements, so it always
+// terminates, and in expectation the whole search is two passes over n.
+//
+// Top-k then selects the pivot of rank k - 1 and gathers everything below
+// it, plus as many pivot-equal elements as needed, taken in input order so
+// that the final stable sort of those k gives exactly the first k of a
+// full stable sort. Partial sort gathers the same way and also moves the
+// elements of base[0..k) that were not taken into the slots the taken
+// ones leave behind.
+
+#include "topk.h"
+#include "psort_impl.h"
+#include "team.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Inputs this small are copied and sorted.
+#define SEL_SMALL 4096
+// Elements sampled per sqrt(n).
+#define SEL_SAMPLE_FACTOR 8
+#define SEL_SEED 0x5e1ec75eedull
+
+// Where an element falls relative to the bracket [lo, hi].
+enum
+{
+    CL_BELOW,
+    CL_LO,
+    CL_INSIDE,
+    CL_HI,
+    CL_ABOVE,
+    CL_COUNT
+};
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// ---------------------------------------------------------------------------
+// Selection.
+
+struct selShared
+{
+    const struct sortCtx *sc;
+    const char *base;
+    size_t n, rank;
+    const char *lo, *hi;       // bracket; NULL leaves that side open
+    size_t (*count)[CL_COUNT]; // per worker
+    int cls;                   // class holding the rank, or -1 on failure
+    size_t skip;               // elements of that class before the rank
+    char *cand;                // CL_INSIDE elements, in input order
+    size_t nCand;
+    size_t *candAt;            // first cand slot of each worker
+    int pickWorker;            // CL_LO/CL_HI: the worker holding the rank
+    char *out;
+};
+
+static int classify(const struct sortCtx *sc, const char *x, const char *lo,
+                    const char *hi)
+{
+    if (lo)
+    {
+        if (psort_less(sc, x, lo))
+            return CL_BELOW;
+        if (!psort_less(sc, lo, x))
+            return CL_LO;
+    }
+    if (!hi || psort_less(sc, x, hi))
+        return CL_INSIDE;
+    return psort_less(sc, hi, x) ? CL_ABOVE : CL_HI;
+}
+
+// Int keys with lo < hi: each class test is a flag sum, so the passes
+// don't mispredict when the rank sits in the middle of the data and no
+// counter is a load-increment-store chain. An open side is taken as the
+// int range's end and its flags fixed up afterwards.
+static void count_int(const struct selShared *sh, size_t lo, size_t hi, size_t *count)
+{
+    const int *a = (const int *)sh->base;
+    int l = sh->lo ? *(const int *)sh->lo : INT_MIN;
+    int h = sh->hi ? *(const int *)sh->hi : INT_MAX;
+    size_t geL = 0, gtL = 0, geH = 0, gtH = 0;
+    for (size_t j = lo; j < hi; j++)
+    {
+        int x = a[j];
+        geL += x >= l;
+        gtL += x > l;
+        geH += x >= h;
+        gtH += x > h;
+    }
+    if (!sh->lo)
+        gtL = geL;
+    if (!sh->hi)
+        geH = gtH;
+    count[CL_BELOW] = hi - lo - geL;
+    count[CL_LO] = geL - gtL;
+    count[CL_INSIDE] = gtL - geH;
+    count[CL_HI] = geH - gtH;
+    count[CL_ABOVE] = gtH;
+}
+
+// Copy the CL_INSIDE ints of [lo, hi). Every element is stored and only
+// kept ones advance the cursor; while kept ones remain the cursor is in
+// bounds, and a stray store is overwritten by the next kept one.
+static void copy_int(const struct selShared *sh, size_t lo, size_t hi, int *dst,
+                     size_t inside)
+{
+    const int *a = (const int *)sh->base;
+    int l = sh->lo ? *(const int *)sh->lo : INT_MIN, openLo = !sh->lo;
+    int h = sh->hi ? *(const int *)sh->hi : INT_MAX, openHi = !sh->hi;
+    size_t pos = 0;
+    for (size_t j = lo; j < hi && pos < inside; j++)
+    {
+        int x = a[j];
+        dst[pos] = x;
+        pos += ((x > l) | openLo) & ((x < h) | openHi);
+    }
+}
+
+// Worker 0, between the passes: find the class holding the rank and set
+// up the second pass.
+static void locate(struct selShared *sh, int workers)
+{
+    size_t before = 0;
+    sh->cls = CL_ABOVE;
+    for (int c = 0; c < CL_COUNT; c++)
+    {
+        size_t total = 0;
+        for (int w = 0; w < workers; w++)
+            total += sh->count[w][c];
+        if (sh->rank < before + total)
+        {
+            sh->cls = c;
+            break;
+        }
+        before += total;
+    }
+    sh->skip = sh->rank - before;
+
+    if (sh->cls == CL_INSIDE)
+    {
+        size_t pos = 0;
+        for (int w = 0; w < workers; w++)
+        {
+            sh->candAt[w] = pos;
+            pos += sh->count[w][CL_INSIDE];
+        }
+        sh->nCand = pos;
+        sh->cand = malloc(pos * sh->sc->size);
+        if (!sh->cand)
+            sh->cls = -1;
+    }
+    else if (sh->cls == CL_LO || sh->cls == CL_HI)
+    {
+        int w = 0;
+        while (sh->skip >= sh->count[w][sh->cls])
+            sh->skip -= sh->count[w++][sh->cls];
+        sh->pickWorker = w;
+    }
+}
+
+static void sel_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct selShared *sh = arg;
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size, lo, hi;
+    size_t *count = sh->count[id];
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    int fast = sc->intKeys && (!sh->lo || !sh->hi || psort_less(sc, sh->lo, sh->hi));
+    if (fast)
+        count_int(sh, lo, hi, count);
+    else
+    {
+        size_t c[CL_COUNT] = {0};
+        for (size_t j = lo; j < hi; j++)
+            c[classify(sc, sh->base + j * size, sh->lo, sh->hi)]++;
+        memcpy(count, c, sizeof(c));
+    }
+    team_barrier(team);
+
+    if (id == 0)
+        locate(sh, team->size);
+    team_barrier(team);
+
+    if (sh->cls == CL_INSIDE && count[CL_INSIDE] > 0)
+    {
+        char *dst = sh->cand + sh->candAt[id] * size;
+        if (fast)
+        {
+            copy_int(sh, lo, hi, (int *)dst, count[CL_INSIDE]);
+            return;
+        }
+        for (size_t j = lo; j < hi; j++)
+        {
+            const char *x = sh->base + j * size;
+            if (classify(sc, x, sh->lo, sh->hi) == CL_INSIDE)
+            {
+                psort_move(dst, x, size);
+                dst += size;
+            }
+        }
+    }
+    else if ((sh->cls == CL_LO || sh->cls == CL_HI) && sh->pickWorker == id)
+    {
+        size_t skip = sh->skip;
+        for (size_t j = lo; j < hi; j++)
+        {
+            const char *x = sh->base + j * size;
+            if (classify(sc, x, sh->lo, sh->hi) == sh->cls && skip-- == 0)
+            {
+                memcpy(sh->out, x, size);
+                break;
+            }
+        }
+    }
+}
+
+static int select_small(const struct sortCtx *sc, const char *a, size_t n,
+                        size_t rank, char *out)
+{
+    size_t size = sc->size;
+    char *tmp = malloc(2 * n * size);
+    if (!tmp)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmp, a, n * size);
+    psort_sort_serial(sc, tmp, tmp + n * size, n);
+    memcpy(out, tmp + rank * size, size);
+    free(tmp);
+    return 0;
+}
+
+// Copy the element of stable rank `rank` in a[0..n) to out.
+static int select_rank(const struct sortCtx *sc, const char *a, size_t n,
+                       size_t rank, char *out, int threads)
+{
+    if (n <= SEL_SMALL)
+        return select_small(sc, a, n, rank, out);
+
+    size_t size = sc->size, s = 1, g = 1;
+    while (s * s < n)
+        s *= 2;
+    size_t m = SEL_SAMPLE_FACTOR * s;
+    // Sample ranks have a standard deviation of at most sqrt(m) / 2, so a
+    // gap of 2 sqrt(m) or more misses with negligible probability.
+    while (g * g < m)
+        g *= 2;
+    g *= 2;
+
+    char *sample = malloc(2 * m * size);
+    size_t (*count)[CL_COUNT] = malloc((size_t)threads * sizeof(*count));
+    size_t *candAt = malloc((size_t)threads * sizeof(*candAt));
+    if (!sample || !count || !candAt)
+    {
+        free(sample);
+        free(count);
+        free(candAt);
+        errno = ENOMEM;
+        return -1;
+    }
+    uint64_t seed = SEL_SEED ^ n;
+    for (size_t i = 0; i < m; i++)
+        memcpy(sample + i * size, a + (splitmix64(&seed) % n) * size, size);
+    psort_sort_serial(sc, sample, sample + m * size, m);
+    size_t at = (size_t)((double)rank / (double)n * (double)m);
+
+    struct selShared sh = {sc, a, n, rank, NULL, NULL, count, 0, 0, NULL, 0, candAt, 0, out};
+    sh.lo = at >= g ? sample + (at - g) * size : NULL;
+    sh.hi = at + g < m ? sample + (at + g) * size : NULL;
+    for (;;)
+    {
+        team_run(threads, sel_worker, &sh);
+        if (sh.cls == CL_BELOW)
+        {
+            sh.hi = sh.lo;
+            sh.lo = NULL;
+        }
+        else if (sh.cls == CL_ABOVE)
+        {
+            sh.lo = sh.hi;
+            sh.hi = NULL;
+        }
+        else
+            break;
+    }
+    free(sample);
+    free(count);
+    free(candAt);
+
+    if (sh.cls < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (sh.cls != CL_INSIDE)
+        return 0;
+    // The candidates kept input order, so stable ranks carry over.
+    int rc = select_rank(sc, sh.cand, sh.nCand, sh.skip, out, threads);
+    free(sh.cand);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Gathering the k smallest.
+
+struct gatherShared
+{
+    const struct sortCtx *sc;
+    char *base;
+    size_t n, k;
+    const char *pivot;         // element of stable rank k - 1
+    size_t (*count)[2][2];     // per worker: [front/back of k][below/equal]
+    size_t *take;              // pivot-equal elements each worker takes
+    size_t *outAt, *holeAt, *srcAt;
+    char *out;                 // taken elements, in input order
+    char *holes;               // in place only: untaken elements of base[0..k)
+};
+
+// Whether x is one of the k smallest. Pivot-equal elements are taken in
+// input order until the worker's share runs out.
+static int taken(const struct gatherShared *sh, const char *x, size_t *equalLeft)
+{
+    if (psort_less(sh->sc, x, sh->pivot))
+        return 1;
+    if (*equalLeft == 0 || psort_less(sh->sc, sh->pivot, x))
+        return 0;
+    (*equalLeft)--;
+    return 1;
+}
+
+// Elements of base[lo..hi) below and equal to the pivot.
+static void count_pivot(const struct gatherShared *sh, size_t lo, size_t hi,
+                        size_t *count)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t below = 0, equal = 0;
+    if (sc->intKeys)
+    {
+        const int *a = (const int *)sh->base;
+        int p = *(const int *)sh->pivot;
+        for (size_t j = lo; j < hi; j++)
+        {
+            below += a[j] < p;
+            equal += a[j] == p;
+        }
+    }
+    else
+        for (size_t j = lo; j < hi; j++)
+        {
+            const char *x = sh->base + j * sc->size;
+            if (psort_less(sc, x, sh->pivot))
+                below++;
+            else if (!psort_less(sc, sh->pivot, x))
+                equal++;
+        }
+    count[0] = below;
+    count[1] = equal;
+}
+
+// Worker 0: share out the pivot-equal elements in worker order and lay
+// out each worker's part of out, holes and the slots the holes fill.
+static void plan_gather(struct gatherShared *sh, const struct sortTeam *team)
+{
+    size_t below = 0;
+    for (int w = 0; w < team->size; w++)
+        below += sh->count[w][0][0] + sh->count[w][1][0];
+    size_t ties = sh->k - below, outPos = 0, holePos = 0, srcPos = 0;
+    for (int w = 0; w < team->size; w++)
+    {
+        size_t (*c)[2] = sh->count[w];
+        size_t equal = c[0][1] + c[1][1], lo, hi;
+        sh->take[w] = equal < ties ? equal : ties;
+        ties -= sh->take[w];
+        size_t takeFront = sh->take[w] < c[0][1] ? sh->take[w] : c[0][1];
+
+        team_slice(team, w, sh->n, &lo, &hi);
+        size_t front = lo >= sh->k ? 0 : (hi < sh->k ? hi : sh->k) - lo;
+        sh->outAt[w] = outPos;
+        sh->holeAt[w] = holePos;
+        sh->srcAt[w] = srcPos;
+        outPos += c[0][0] + c[1][0] + sh->take[w];
+        holePos += front - c[0][0] - takeFront;
+        srcPos += c[1][0] + sh->take[w] - takeFront;
+    }
+}
+
+// Copy the taken elements of base[lo..hi) to *out and, with hole given,
+// the others to *hole, advancing both. Returns the pivot-equal elements
+// still to take.
+static size_t gather_range(const struct gatherShared *sh, size_t lo, size_t hi,
+                           char **out, char **hole, size_t equalLeft)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size;
+    if (sc->intKeys)
+    {
+        // The generic loop reloads the pivot after every store.
+        const int *a = (const int *)sh->base;
+        int p = *(const int *)sh->pivot;
+        int *o = (int *)*out, *h = hole ? (int *)*hole : NULL;
+        for (size_t j = lo; j < hi; j++)
+        {
+            int x = a[j];
+            if (x < p || (x == p && equalLeft > 0))
+            {
+                equalLeft -= x == p;
+                *o++ = x;
+            }
+            else if (h)
+                *h++ = x;
+        }
+        *out = (char *)o;
+        if (hole)
+            *hole = (char *)h;
+        return equalLeft;
+    }
+    for (size_t j = lo; j < hi; j++)
+    {
+        const char *x = sh->base + j * size;
+        if (taken(sh, x, &equalLeft))
+        {
+            psort_move(*out, x, size);
+            *out += size;
+        }
+        else if (hole)
+        {
+            psort_move(*hole, x, size);
+            *hole += size;
+        }
+    }
+    return equalLeft;
+}
+
+// Overwrite the taken elements of base[lo..hi) with src, in order.
+static void refill_range(const struct gatherShared *sh, size_t lo, size_t hi,
+                         const char *src, size_t equalLeft)
+{
+    const struct sortCtx *sc = sh->sc;
+    size_t size = sc->size;
+    if (sc->intKeys)
+    {
+        int *a = (int *)sh->base;
+        int p = *(const int *)sh->pivot;
+        const int *s = (const int *)src;
+        for (size_t j = lo; j < hi; j++)
+        {
+            int x = a[j];
+            if (x < p || (x == p && equalLeft > 0))
+            {
+                equalLeft -= x == p;
+                a[j] = *s++;
+            }
+        }
+        return;
+    }
+    for (size_t j = lo; j < hi; j++)
+    {
+        char *x = sh->base + j * size;
+        if (taken(sh, x, &equalLeft))
+        {
+            psort_move(x, src, size);
+            src += size;
+        }
+    }
+}
+
+static void gather_worker(struct sortTeam *team, int id, void *arg)
+{
+    struct gatherShared *sh = arg;
+    size_t size = sh->sc->size, lo, hi;
+    size_t (*count)[2] = sh->count[id];
+    team_slice(team, id, sh->n, &lo, &hi);
+
+    size_t mid = hi < sh->k ? hi : lo > sh->k ? lo : sh->k; // front is [lo, mid)
+    count_pivot(sh, lo, mid, count[0]);
+    count_pivot(sh, mid, hi, count[1]);
+    team_barrier(team);
+
+    if (id == 0)
+        plan_gather(sh, team);
+    team_barrier(team);
+
+    char *out = sh->out + sh->outAt[id] * size;
+    char *hole = sh->holes ? sh->holes + sh->holeAt[id] * size : NULL;
+    size_t equalLeft = gather_range(sh, lo, mid, &out, hole ? &hole : NULL,
+                                    sh->take[id]);
+    size_t equalBack = equalLeft;
+    gather_range(sh, mid, hi, &out, NULL, equalLeft);
+    if (!sh->holes)
+        return;
+    team_barrier(team);
+
+    // Refill the slots of taken elements past k with the untaken ones from
+    // the front. Only this worker's slice is written, after it is read.
+    refill_range(sh, mid, hi, sh->holes + sh->srcAt[id] * size, equalBack);
+}
+
+// Gather the k smallest of base[0..n) into out, in input order, given the
+// element of rank k - 1. With holes non-NULL, also leave the untaken
+// elements in base[k..n).
+static int gather(const struct sortCtx *sc, char *base, size_t n, size_t k,
+                  const char *pivot, char *out, char *holes, int threads)
+{
+    struct gatherShared sh = {sc, base, n, k, pivot, NULL, NULL, NULL, NULL, NULL, out, holes};
+    sh.count = malloc((size_t)threads * sizeof(*sh.count));
+    sh.take = malloc(4 * (size_t)threads * sizeof(size_t));
+    if (!sh.count || !sh.take)
+    {
+        free(sh.count);
+        free(sh.take);
+        errno = ENOMEM;
+        return -1;
+    }
+    sh.outAt = sh.take + threads;
+    sh.holeAt = sh.outAt + threads;
+    sh.srcAt = sh.holeAt + threads;
+    team_run(threads, gather_worker, &sh);
+    free(sh.count);
+    free(sh.take);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Public entry points.
+
+int parallel_nth_element(const void *base, size_t n, size_t size,
+                         psort_cmp_fn cmp, void *ctx, size_t nth, void *out,
+                         const struct sortPolicy *policy)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    if (nth >= n)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct sortCtx sc;
+    psort_ctx_init(&sc, size, cmp, ctx, policy);
+    return select_rank(&sc, base, n, nth, out, sort_policy_threads(policy));
+}
+
+// Shared by top-k and partial sort; holes as for gather.
+static int smallest_k(char *base, size_t n, size_t size, psort_cmp_fn cmp,
+                      void *ctx, size_t k, char *out, char *holes,
+                      const struct sortPolicy *policy)
+{
+    struct sortCtx sc;
+    psort_ctx_init(&sc, size, cmp, ctx, policy);
+    int threads = sort_policy_threads(policy);
+    char stackbuf[256];
+    char *pivot = size <= sizeof(stackbuf) ? stackbuf : malloc(size);
+    if (!pivot)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = select_rank(&sc, base, n, k - 1, pivot, threads);
+    if (rc == 0)
+        rc = gather(&sc, base, n, k, pivot, out, holes, threads);
+    if (pivot != stackbuf)
+        free(pivot);
+    // Gathered in input order, so the stable sort keeps ties in order.
+    if (rc == 0)
+        rc = parallel_merge_sort(out, k, size, cmp, ctx, policy);
+    return rc;
+}
+
+int parallel_top_k(const void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                   void *ctx, size_t k, void *out,
+                   const struct sortPolicy *policy)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    if (k > n)
+        k = n;
+    if (k == 0 || size == 0)
+        return 0;
+    if (k == n)
+    {
+        memcpy(out, base, n * size);
+        return parallel_merge_sort(out, n, size, cmp, ctx, policy);
+    }
+    // base is only read when holes is NULL.
+    return smallest_k((char *)base, n, size, cmp, ctx, k, out, NULL, policy);
+}
+
+int parallel_partial_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                          void *ctx, size_t k, const struct sortPolicy *policy)
+{
+    struct sortPolicy defaults;
+    if (!policy)
+    {
+        sort_policy_init(&defaults);
+        policy = &defaults;
+    }
+    if (k >= n)
+        return parallel_merge_sort(base, n, size, cmp, ctx, policy);
+    if (k == 0 || size == 0)
+        return 0;
+    char *out = malloc(2 * k * size);
+    if (!out)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = smallest_k(base, n, size, cmp, ctx, k, out, out + k * size, policy);
+    if (rc == 0)
+        memcpy(base, out, k * size);
+    free(out);
+    return rc;
+}
+
+size_t percentile_rank(double q, size_t n)
+{
+    if (q <= 0 || n < 2)
+        return 0;
+    if (q >= 100)
+        return n - 1;
+    return (size_t)(q / 100 * (double)(n - 1) + 0.5);
+}
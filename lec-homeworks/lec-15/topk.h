@@ -0,0 +1,50 @@
+// topk.h
+// Selection without a full sort: the k smallest elements in order, the
+// element of a given rank (nth element, percentiles), and partial sort.
+// All run in expected O(n + k log k) instead of O(n log n).
+//
+// Ranks are stable ranks: equal elements order by position, so the
+// results are exactly what parallel_merge_sort would put at those places.
+
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stddef.h>
+
+#include "psort.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copy the element that sorts at position nth (0-based) of base[0..n)
+// to out. base is not modified.
+// Returns 0 on success, -1 (errno set) on allocation failure or if
+// nth >= n (EINVAL).
+int parallel_nth_element(const void *base, size_t n, size_t size,
+                         psort_cmp_fn cmp, void *ctx, size_t nth, void *out,
+                         const struct sortPolicy *policy);
+
+// Copy the k smallest elements of base[0..n), sorted, to out[0..k).
+// base is not modified; k larger than n is taken as n.
+// Returns 0 on success, -1 (errno set) on allocation failure.
+int parallel_top_k(const void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                   void *ctx, size_t k, void *out,
+                   const struct sortPolicy *policy);
+
+// Rearrange base[0..n) so that base[0..k) holds its k smallest elements,
+// sorted. The other n - k follow in unspecified order. Extra memory is
+// about two copies of k elements.
+// Returns 0 on success, -1 (errno set) on allocation failure.
+int parallel_partial_sort(void *base, size_t n, size_t size, psort_cmp_fn cmp,
+                          void *ctx, size_t k, const struct sortPolicy *policy);
+
+// Rank of the q-th percentile (0 <= q <= 100) of n > 0 elements:
+// q / 100 * (n - 1), rounded to the nearest rank.
+size_t percentile_rank(double q, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TOPK_H